@@ -0,0 +1,381 @@
+/*
+ * bench.h
+ *
+ * This file contains a minimal benchmark registration and reporting harness
+ * for gpu.cpp kernels. Benchmarks register a function that sets up a problem
+ * of a given size and returns a Measurement, the harness sweeps the registered
+ * sizes, reports GFLOPS and GB/s (and the fraction of a configured peak),
+ * writes machine-readable JSON and compares against a stored baseline.
+ *
+ * Configuration is read from the environment:
+ *
+ * BENCH_FILTER      Only run benchmarks whose name contains this substring
+ * BENCH_ITERS       Timed iterations per measurement (default 20)
+ * BENCH_WARMUP      Untimed warm-up iterations per measurement (default 3)
+ * BENCH_OUTPUT      Path of the JSON results file (default bench_results.json)
+ * BENCH_BASELINE    Path of a previous results file to compare against
+ * BENCH_TOLERANCE   Allowed relative slowdown vs the baseline (default 0.10)
+ * BENCH_PEAK_GFLOPS Theoretical compute peak of the adapter, if known
+ * BENCH_PEAK_GBPS   Theoretical memory bandwidth of the adapter, if known
+ *
+ * WebGPU does not expose clock rates or memory bus widths, so the theoretical
+ * peak has to be supplied by the user from the adapter's specification sheet.
+ *
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "gpu.h"
+#include "utils/logging.h"
+
+namespace gpu {
+
+/**
+ * @brief Timing and work counts of one benchmark run at one problem size.
+ * flops and bytes are the work done per iteration and are used to derive the
+ * throughput, bytes counts the minimal global memory traffic of the operation
+ * rather than what a particular kernel implementation happens to issue.
+ */
+struct Measurement {
+  double ms = 0.0;
+  double flops = 0.0;
+  double bytes = 0.0;
+};
+
+/**
+ * @brief Iteration counts forwarded to each benchmark function.
+ */
+struct BenchConfig {
+  size_t warmup = 3;
+  size_t iters = 20;
+};
+
+using BenchFunction =
+    std::function<Measurement(Context &, size_t, const BenchConfig &)>;
+
+/**
+ * @brief A registered benchmark, run once for each of its problem sizes.
+ */
+struct Benchmark {
+  std::string name;
+  std::vector<size_t> sizes;
+  BenchFunction run;
+};
+
+/**
+ * @brief Result row of the report, as written to and read from JSON.
+ */
+struct BenchResult {
+  std::string name;
+  size_t size = 0;
+  double ms = 0.0;
+  double gflops = 0.0;
+  double gbps = 0.0;
+};
+
+/**
+ * @brief Global registry of benchmarks in registration order.
+ */
+inline std::vector<Benchmark> &benchmarks() {
+  static std::vector<Benchmark> registry;
+  return registry;
+}
+
+/**
+ * @brief Registers a benchmark at static initialization time.
+ *
+ * @code
+ * static BenchRegistration reg("gelu", {1 << 16, 1 << 20}, benchGelu);
+ * @endcode
+ */
+struct BenchRegistration {
+  BenchRegistration(const std::string &name, const std::vector<size_t> &sizes,
+                    BenchFunction run) {
+    benchmarks().push_back({name, sizes, std::move(run)});
+  }
+};
+
+/**
+ * @brief Times a blocking CPU-side operation (eg. a transfer) with the wall
+ * clock, after warm-up iterations.
+ * @param[in] config Warm-up and timed iteration counts
+ * @param[in] op Operation to time, must block until the work is complete
+ * @return Mean time per iteration in milliseconds
+ */
+inline double timeWall(const BenchConfig &config,
+                       const std::function<void()> &op) {
+  for (size_t i = 0; i < config.warmup; ++i) {
+    op();
+  }
+  auto start = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < config.iters; ++i) {
+    op();
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() /
+         static_cast<double>(config.iters);
+}
+
+/**
+ * @brief Times a kernel with timeKernel() after warm-up dispatches.
+ * @param[in] ctx Context instance to manage the kernel
+ * @param[in] kernel Kernel instance to time
+ * @param[in] config Warm-up and timed iteration counts
+ * @return Mean time per dispatch in milliseconds
+ */
+inline double timeKernelWarm(Context &ctx, Kernel &kernel,
+                             const BenchConfig &config) {
+  if (config.warmup > 0) {
+    timeKernel(ctx, kernel, config.warmup);
+  }
+  return timeKernel(ctx, kernel, config.iters);
+}
+
+/**
+ * @brief Frees the tensors and kernels created on a Context while the scope is
+ * alive, including those created internally by primitives and stream
+ * pipelines, so that every benchmark point starts from the same device memory
+ * footprint. Kernels are returned by value, so their bind groups and params
+ * buffers are released through the KernelPool as in FreeKernel(). Compiled
+ * pipelines stay cached, they are shared between the sizes of a benchmark.
+ *
+ * The benchmark functions wait for their work, so nothing freed here is in
+ * flight.
+ */
+struct ResourceScope {
+  inline explicit ResourceScope(Context &ctx) : ctx(ctx) {
+    for (auto &pair : ctx.pool.data) {
+      tensors.insert(pair.first);
+    }
+    bindGroups = ctx.kernelPool.data;
+    for (auto &pair : ctx.kernelPool.params) {
+      params.insert(pair.first);
+    }
+  }
+  inline ~ResourceScope() {
+    std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+    std::vector<Tensor> created;
+    for (auto &pair : ctx.pool.data) {
+      if (tensors.count(pair.first) == 0) {
+        created.push_back(pair.second);
+      }
+    }
+    for (const Tensor &tensor : created) {
+      FreeTensor(ctx.pool, tensor);
+    }
+    KernelPool &pool = ctx.kernelPool;
+    for (auto it = pool.data.begin(); it != pool.data.end();) {
+      if (bindGroups.count(*it) == 0) {
+        wgpuBindGroupRelease(*it);
+        it = pool.data.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    for (auto it = pool.params.begin(); it != pool.params.end();) {
+      if (params.count(it->first) == 0) {
+        wgpuBufferRelease(it->first);
+        untrackBuffer(ctx.telemetry, kUniformBuffer, it->second);
+        it = pool.params.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  Context &ctx;
+  std::set<WGPUBuffer> tensors;
+  std::set<WGPUBindGroup> bindGroups;
+  std::set<WGPUBuffer> params;
+};
+
+/**
+ * @brief Blocks until all work submitted to the queue has completed.
+ */
+inline void waitQueue(Context &ctx) {
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  wgpuQueueOnSubmittedWorkDone(
+      ctx.queue,
+      [](WGPUQueueWorkDoneStatus status, void *data) {
+        check(status == WGPUQueueWorkDoneStatus_Success, "Queue work done",
+              __FILE__, __LINE__);
+        static_cast<std::promise<void> *>(data)->set_value();
+      },
+      &promise);
+  wait(ctx, future);
+}
+
+inline double envDouble(const char *name, double fallback) {
+  const char *value = std::getenv(name);
+  return value ? std::atof(value) : fallback;
+}
+
+/**
+ * @brief Writes results as JSON with one result object per line, so the file
+ * stays diffable and can be read back by readBenchResults().
+ */
+inline bool writeBenchResults(const std::string &path,
+                              const std::string &adapter,
+                              const std::vector<BenchResult> &results) {
+  FILE *file = std::fopen(path.c_str(), "w");
+  if (!file) {
+    return false;
+  }
+  std::string escaped;
+  for (char c : adapter) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+    }
+    escaped += c;
+  }
+  std::fprintf(file, "{\n  \"adapter\": \"%s\",\n  \"results\": [\n",
+               escaped.c_str());
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchResult &r = results[i];
+    std::fprintf(file,
+                 "    {\"name\": \"%s\", \"size\": %zu, \"ms\": %.6f, "
+                 "\"gflops\": %.3f, \"gbps\": %.3f}%s\n",
+                 r.name.c_str(), r.size, r.ms, r.gflops, r.gbps,
+                 i + 1 < results.size() ? "," : "");
+  }
+  std::fprintf(file, "  ]\n}\n");
+  std::fclose(file);
+  return true;
+}
+
+/**
+ * @brief Reads a results file written by writeBenchResults(), keyed by
+ * "name/size". Returns an empty map if the file cannot be read.
+ */
+inline std::map<std::string, BenchResult>
+readBenchResults(const std::string &path) {
+  std::map<std::string, BenchResult> results;
+  FILE *file = std::fopen(path.c_str(), "r");
+  if (!file) {
+    return results;
+  }
+  char line[512];
+  while (std::fgets(line, sizeof(line), file)) {
+    char name[256];
+    BenchResult r;
+    const char *start = std::strstr(line, "{\"name\"");
+    if (start &&
+        std::sscanf(start,
+                    "{\"name\": \"%255[^\"]\", \"size\": %zu, \"ms\": %lf, "
+                    "\"gflops\": %lf, \"gbps\": %lf",
+                    name, &r.size, &r.ms, &r.gflops, &r.gbps) == 5) {
+      r.name = name;
+      results[r.name + "/" + std::to_string(r.size)] = r;
+    }
+  }
+  std::fclose(file);
+  return results;
+}
+
+/**
+ * @brief Runs all registered benchmarks, prints a report, writes the JSON
+ * results and compares against the baseline if one is configured. The report
+ * is printed directly rather than through LOG, which NDEBUG builds such as the
+ * bench target compile out. The resources of each size point are freed by a
+ * ResourceScope before the next one is measured.
+ * @param[in] ctx Context instance to run the benchmarks on
+ * @return 0 on success, 1 if any result regressed beyond the tolerance
+ */
+inline int runBenchmarks(Context &ctx) {
+  BenchConfig config;
+  config.iters = static_cast<size_t>(envDouble("BENCH_ITERS", 20));
+  config.warmup = static_cast<size_t>(envDouble("BENCH_WARMUP", 3));
+  check(config.iters > 0, "BENCH_ITERS must be positive", __FILE__, __LINE__);
+  const char *filter = std::getenv("BENCH_FILTER");
+  const char *output = std::getenv("BENCH_OUTPUT");
+  const char *baselinePath = std::getenv("BENCH_BASELINE");
+  double tolerance = envDouble("BENCH_TOLERANCE", 0.10);
+  double peakGflops = envDouble("BENCH_PEAK_GFLOPS", 0.0);
+  double peakGbps = envDouble("BENCH_PEAK_GBPS", 0.0);
+
+  std::string adapter = adapterIdentity(ctx.adapter);
+  std::fprintf(stdout, "Adapter: %s\n", adapter.c_str());
+  std::map<std::string, BenchResult> baseline;
+  if (baselinePath) {
+    baseline = readBenchResults(baselinePath);
+    if (baseline.empty()) {
+      std::fprintf(stderr, "warning: no baseline results read from %s\n",
+                   baselinePath);
+    }
+  }
+
+  std::fprintf(stdout, "%-12s %10s %12s %10s %10s %8s %8s %9s\n",
+               "benchmark", "size", "ms", "GFLOPS", "GB/s", "%peakC", "%peakBW",
+               "vs base");
+  std::vector<BenchResult> results;
+  int regressions = 0;
+  for (const Benchmark &bench : benchmarks()) {
+    if (filter && bench.name.find(filter) == std::string::npos) {
+      continue;
+    }
+    for (size_t size : bench.sizes) {
+      Measurement m;
+      {
+        ResourceScope scope(ctx);
+        m = bench.run(ctx, size, config);
+      }
+      BenchResult r = {bench.name, size, m.ms, 0.0, 0.0};
+      if (m.ms > 0.0) {
+        r.gflops = m.flops / (m.ms * 1e6);
+        r.gbps = m.bytes / (m.ms * 1e6);
+      }
+      char peakC[16] = "-", peakBW[16] = "-", delta[16] = "-";
+      if (peakGflops > 0.0 && m.flops > 0.0) {
+        std::snprintf(peakC, sizeof(peakC), "%.1f", 100.0 * r.gflops / peakGflops);
+      }
+      if (peakGbps > 0.0 && m.bytes > 0.0) {
+        std::snprintf(peakBW, sizeof(peakBW), "%.1f", 100.0 * r.gbps / peakGbps);
+      }
+      auto base = baseline.find(r.name + "/" + std::to_string(r.size));
+      if (base != baseline.end() && base->second.ms > 0.0) {
+        double change = r.ms / base->second.ms - 1.0;
+        std::snprintf(delta, sizeof(delta), "%+.1f%%", 100.0 * change);
+        if (change > tolerance) {
+          ++regressions;
+          std::fprintf(stderr,
+                       "warning: regression: %s size %zu %.4f ms vs %.4f ms\n",
+                       r.name.c_str(), r.size, r.ms, base->second.ms);
+        }
+      }
+      std::fprintf(stdout, "%-12s %10zu %12.4f %10.2f %10.2f %8s %8s %9s\n",
+                   r.name.c_str(), r.size, r.ms, r.gflops, r.gbps, peakC,
+                   peakBW, delta);
+      results.push_back(r);
+    }
+  }
+
+  std::string path = output ? output : "bench_results.json";
+  if (writeBenchResults(path, adapter, results)) {
+    std::fprintf(stdout, "Wrote %zu results to %s\n", results.size(),
+                 path.c_str());
+  } else {
+    std::fprintf(stderr, "error: could not write results to %s\n",
+                 path.c_str());
+  }
+  if (regressions > 0) {
+    std::fprintf(stderr, "error: %d result(s) regressed by more than %.0f%%\n",
+                 regressions, 100.0 * tolerance);
+    return 1;
+  }
+  return 0;
+}
+
+} // namespace gpu
+
+#endif // BENCH_H
@@ -0,0 +1,233 @@
+#include <array>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "gpu.h"
+#include "utils/array_utils.h" // randn
+#include "utils/logging.h"     // LOG
+#include "experimental/primitives.h"
+#include "experimental/stream.h"
+#include "experimental/transformer/shaders.h" // kShaderGelu, kShaderResidual, ...
+
+#include "bench.h"
+
+using namespace gpu;
+
+static constexpr size_t kWorkgroupSize = 256;
+
+// Row width for row-wise kernels (layernorm, softmax), sizes are row counts.
+static constexpr size_t kRowSize = 768;
+
+std::unique_ptr<float[]> randomData(size_t n) {
+  std::unique_ptr<float[]> data(new float[n]);
+  std::mt19937 gen(314159);
+  randn(data.get(), n, gen);
+  return data;
+}
+
+Measurement benchToGPU(Context &ctx, size_t n, const BenchConfig &config) {
+  std::unique_ptr<float[]> data = randomData(n);
+  Tensor tensor = createTensor(ctx, Shape{n}, kf32);
+  double ms = timeWall(config, [&]() {
+    toGPU(ctx, data.get(), tensor);
+    waitQueue(ctx);
+  });
+  return {ms, 0.0, static_cast<double>(n * sizeof(float))};
+}
+
+Measurement benchToCPU(Context &ctx, size_t n, const BenchConfig &config) {
+  std::unique_ptr<float[]> data = randomData(n);
+  Tensor tensor = createTensor(ctx, Shape{n}, kf32, data.get());
+  double ms = timeWall(config, [&]() {
+    toCPU(ctx, tensor, data.get(), n * sizeof(float));
+  });
+  return {ms, 0.0, static_cast<double>(n * sizeof(float))};
+}
+
+Measurement benchGelu(Context &ctx, size_t n, const BenchConfig &config) {
+  std::unique_ptr<float[]> data = randomData(n);
+  Tensor input = createTensor(ctx, Shape{n}, kf32, data.get());
+  Tensor output = createTensor(ctx, Shape{n}, kf32);
+  Kernel op = createKernel(ctx, KernelCode(kShaderGelu, kWorkgroupSize, kf32),
+                           Bindings{input, output},
+                           /* nWorkgroups */ {cdiv(n, kWorkgroupSize), 1, 1});
+  double ms = timeKernelWarm(ctx, op, config);
+  // ~ 3 mul + 1 fma for the cubic, 2 mul + 1 add around tanh, tanh itself
+  return {ms, 10.0 * n, 2.0 * n * sizeof(float)};
+}
+
+Measurement benchResidual(Context &ctx, size_t n, const BenchConfig &config) {
+  std::unique_ptr<float[]> data = randomData(n);
+  Tensor a = createTensor(ctx, Shape{n}, kf32, data.get());
+  Tensor b = createTensor(ctx, Shape{n}, kf32, data.get());
+  Tensor c = createTensor(ctx, Shape{n}, kf32);
+  Kernel op =
+      createKernel(ctx, KernelCode(kShaderResidual, kWorkgroupSize, kf32),
+                   Bindings{a, b, c},
+                   /* nWorkgroups */ {cdiv(n, kWorkgroupSize), 1, 1});
+  double ms = timeKernelWarm(ctx, op, config);
+  return {ms, 1.0 * n, 3.0 * n * sizeof(float)};
+}
+
+Measurement benchLayerNorm(Context &ctx, size_t rows,
+                           const BenchConfig &config) {
+  struct LNParam {
+    uint32_t N;
+    uint32_t C;
+  };
+  size_t n = rows * kRowSize;
+  std::unique_ptr<float[]> data = randomData(n);
+  Tensor input = createTensor(ctx, Shape{rows, kRowSize}, kf32, data.get());
+  Tensor weight = createTensor(ctx, Shape{kRowSize}, kf32, data.get());
+  Tensor bias = createTensor(ctx, Shape{kRowSize}, kf32, data.get());
+  Tensor output = createTensor(ctx, Shape{rows, kRowSize}, kf32);
+  Kernel op = createKernel(
+      ctx, KernelCode(kShaderLayerNorm1, kWorkgroupSize, kf32),
+      Bindings{input, weight, bias, output},
+      /* nWorkgroups */ {cdiv(rows, kWorkgroupSize), 1, 1},
+      LNParam{static_cast<uint32_t>(rows), static_cast<uint32_t>(kRowSize)});
+  double ms = timeKernelWarm(ctx, op, config);
+  // mean (1 add), variance (sub + fma), normalize (sub, mul, fma) per element
+  return {ms, 8.0 * n, (2.0 * n + 2.0 * kRowSize) * sizeof(float)};
+}
+
+Measurement benchSoftmax(Context &ctx, size_t rows, const BenchConfig &config) {
+  struct SoftmaxParam {
+    uint32_t N;
+    uint32_t C;
+  };
+  size_t n = rows * kRowSize;
+  std::unique_ptr<float[]> data = randomData(n);
+  Tensor input = createTensor(ctx, Shape{rows, kRowSize}, kf32, data.get());
+  Tensor output = createTensor(ctx, Shape{rows, kRowSize}, kf32);
+  Kernel op = createKernel(
+      ctx, KernelCode(kShaderSoftmax1, kWorkgroupSize, kf32),
+      Bindings{input, output},
+      /* nWorkgroups */ {cdiv(rows, kWorkgroupSize), 1, 1},
+      SoftmaxParam{static_cast<uint32_t>(rows),
+                   static_cast<uint32_t>(kRowSize)});
+  double ms = timeKernelWarm(ctx, op, config);
+  // max, sub + exp + add, divide per element
+  return {ms, 5.0 * n, 2.0 * n * sizeof(float)};
+}
+
+Measurement benchMatmul(Context &ctx, size_t n, const BenchConfig &config) {
+  std::unique_ptr<float[]> data = randomData(n * n);
+  Tensor a = createTensor(ctx, Shape{n, n}, kf32, data.get());
+  Tensor b = createTensor(ctx, Shape{n, n}, kf32, data.get());
+  Tensor c = createTensor(ctx, Shape{n, n}, kf32);
+  Kernel op = createKernel(
+      ctx, MatmulShader(kWorkgroupSize, kShaderMatMul1, kf32, n, n, n),
+      Bindings{a, b, c},
+      /* nWorkgroups */ {cdiv(n * n, kWorkgroupSize), 1, 1});
+  double ms = timeKernelWarm(ctx, op, config);
+  return {ms, 2.0 * n * n * n, 3.0 * n * n * sizeof(float)};
+}
+
+// Streams n floats through gelu in 8 chunks, so that uploads, dispatches and
+// readbacks of consecutive chunks overlap.
+Measurement benchStreamGelu(Context &ctx, size_t n, const BenchConfig &config) {
+  std::unique_ptr<float[]> input = randomData(n);
+  std::unique_ptr<float[]> output(new float[n]);
+  StreamConfig streamConfig;
+  streamConfig.chunkSize = n / 8 * sizeof(float);
+  StreamPipeline pipeline = createStreamPipeline(
+      ctx, streamConfig,
+      [](Context &ctx, const Tensor &input, const Tensor &output) {
+        size_t chunk = input.data.size / sizeof(float);
+        return createKernel(
+            ctx, KernelCode(kShaderGelu, kWorkgroupSize, kf32),
+            Bindings{input, output},
+            /* nWorkgroups */ {cdiv(chunk, kWorkgroupSize), 1, 1});
+      });
+  double ms = timeWall(config, [&]() {
+    bool ok = runStream(pipeline, streamFromMemory(input.get(),
+                                                   n * sizeof(float)),
+                        streamToMemory(output.get()));
+    check(ok, "Stream gelu", __FILE__, __LINE__);
+  });
+  return {ms, 10.0 * n, 2.0 * n * sizeof(float)};
+}
+
+Measurement benchReduceSum(Context &ctx, size_t n, const BenchConfig &config) {
+  std::unique_ptr<float[]> data = randomData(n);
+  Tensor input = createTensor(ctx, Shape{n}, kf32, data.get());
+  Reduction sum = createReduction(ctx, input, kReduceSum);
+  double ms = timeWall(config, [&]() { runReduction(ctx, sum); });
+  return {ms, 1.0 * n, 1.0 * n * sizeof(float)};
+}
+
+Measurement benchScan(Context &ctx, size_t n, const BenchConfig &config) {
+  std::unique_ptr<float[]> data = randomData(n);
+  Tensor input = createTensor(ctx, Shape{n}, kf32, data.get());
+  Tensor output = createTensor(ctx, Shape{n}, kf32);
+  PrefixScan scan = createPrefixScan(ctx, input, output);
+  double ms = timeWall(config, [&]() { runPrefixScan(ctx, scan); });
+  // Read input, write output, read and write output again to add offsets
+  return {ms, 2.0 * n, 4.0 * n * sizeof(float)};
+}
+
+// Keys are sorted in place, so every iteration after the first sorts sorted
+// keys, which costs the same for a radix sort.
+Measurement benchRadixSort(Context &ctx, size_t n, const BenchConfig &config) {
+  std::vector<uint32_t> keysArr(n), valuesArr(n);
+  std::mt19937 gen(314159);
+  for (size_t i = 0; i < n; ++i) {
+    keysArr[i] = gen();
+    valuesArr[i] = static_cast<uint32_t>(i);
+  }
+  Tensor keys = createTensor(ctx, Shape{n}, ku32, keysArr.data());
+  Tensor values = createTensor(ctx, Shape{n}, ku32, valuesArr.data());
+  RadixSort sort = createRadixSort(ctx, keys, values);
+  double ms = timeWall(config, [&]() { runRadixSort(ctx, sort); });
+  // Per pass: read keys for the histogram, read and write keys and values
+  double passes = 32.0 / kSortBits;
+  return {ms, 0.0, passes * 5.0 * n * sizeof(uint32_t)};
+}
+
+// Top-40 of a vocabulary sized row of logits, as in top-k sampling
+Measurement benchTopK(Context &ctx, size_t n, const BenchConfig &config) {
+  std::unique_ptr<float[]> data = randomData(n);
+  Tensor logits = createTensor(ctx, Shape{n}, kf32, data.get());
+  TopK top = createTopK(ctx, logits, 40);
+  double ms = timeWall(config, [&]() { runTopK(ctx, top); });
+  return {ms, 0.0, 1.0 * n * sizeof(float)};
+}
+
+// Elementwise sizes stay below 65535 * kWorkgroupSize, the maximum 1D
+// dispatch of the default limits.
+static BenchRegistration kBenchToGPU("toGPU", {1 << 16, 1 << 20, 1 << 24},
+                                     benchToGPU);
+static BenchRegistration kBenchToCPU("toCPU", {1 << 16, 1 << 20, 1 << 24},
+                                     benchToCPU);
+static BenchRegistration kBenchGelu("gelu", {1 << 16, 1 << 20, 1 << 23},
+                                    benchGelu);
+static BenchRegistration kBenchResidual("residual",
+                                        {1 << 16, 1 << 20, 1 << 23},
+                                        benchResidual);
+static BenchRegistration kBenchLayerNorm("layernorm", {256, 1024, 4096},
+                                         benchLayerNorm);
+static BenchRegistration kBenchSoftmax("softmax", {256, 1024, 4096},
+                                       benchSoftmax);
+static BenchRegistration kBenchStreamGelu("stream_gelu",
+                                          {1 << 20, 1 << 23, 1 << 26},
+                                          benchStreamGelu);
+static BenchRegistration kBenchReduceSum("reduce_sum",
+                                         {1 << 16, 1 << 20, 1 << 24},
+                                         benchReduceSum);
+static BenchRegistration kBenchScan("scan", {1 << 16, 1 << 20, 1 << 24},
+                                    benchScan);
+static BenchRegistration kBenchRadixSort("radix_sort",
+                                         {1 << 16, 1 << 20, 1 << 23},
+                                         benchRadixSort);
+static BenchRegistration kBenchTopK("topk", {32000, 50257, 128256},
+                                    benchTopK);
+static BenchRegistration kBenchMatmul("matmul", {256, 512, 1024},
+                                      benchMatmul);
+
+int main() {
+  Context ctx = createContext();
+  return runBenchmarks(ctx);
+}
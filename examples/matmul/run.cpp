@@ -1,8 +1,12 @@
 #include <array>
 #include <chrono>
+#include <fstream>
 #include <future>
+#include <limits>
 #include <random>
 #include <cstdlib>
+#include <sstream>
+#include <vector>
 
 #include "gpu.h" // createContext, createTensor, createKernel, dispatchKernel,
                  // wait, resetCommandBuffer, toCPU
@@ -10,7 +14,7 @@
 #include "llmc/reference_impls.h" // for CPU reference implementation
 #include "utils/array_utils.h"    // show, isclose, randn, randint
 #include "utils/logging.h"        // LOG
-#include "experimental/wgsl.h"    // loopUnrolling
+#include "experimental/wgsl.h"    // createKernelCode
 
 using namespace gpu;
 
@@ -109,6 +113,221 @@ inline KernelCode createMatmul2(const char *shaderTemplate, const size_t M,
   return {codeString, workgroupSize};
 }
 
+/* Shape-polymorphic tiling
+ *
+ * Same algorithm as version 2, but the problem size is read from a uniform
+ * instead of being baked into the code, and the tile size is a pipeline
+ * overridable constant. Loads and stores are masked, so one pipeline serves
+ * any M, K, N and the kernel can be dispatched for several problem sizes
+ * through params slots.
+ */
+static const char *kShaderMatmulDynamic = R"(
+struct Params {
+  M: u32,
+  K: u32,
+  N: u32,
+};
+override TILE: u32 = 16u;
+@group(0) @binding(0) var<storage, read_write> A: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> B: array<{{precision}}>;
+@group(0) @binding(2) var<storage, read_write> C: array<{{precision}}>;
+@group(0) @binding(3) var<uniform> params: Params;
+var<workgroup> As: array<{{precision}}, TILE * TILE>;
+var<workgroup> Bs: array<{{precision}}, TILE * TILE>;
+@compute @workgroup_size(TILE * TILE)
+fn main(
+  @builtin(local_invocation_index) localIdx : u32,
+  @builtin(workgroup_id) groupID: vec3<u32>) {
+    let loadRow = localIdx / TILE;
+    let loadCol = localIdx % TILE;
+    let row = groupID.x * TILE + loadRow;
+    let col = groupID.y * TILE + loadCol;
+    let bRow = groupID.y * TILE + loadRow;
+    var total: {{precision}} = 0.0;
+    for (var tile = 0u; tile < (params.K + TILE - 1u) / TILE; tile++) {
+      let kIdx = tile * TILE + loadCol;
+      var a: {{precision}} = 0.0;
+      if (row < params.M && kIdx < params.K) {
+        a = A[row * params.K + kIdx];
+      }
+      var b: {{precision}} = 0.0;
+      if (bRow < params.N && kIdx < params.K) {
+        b = B[bRow * params.K + kIdx];
+      }
+      As[loadRow * TILE + loadCol] = a;
+      Bs[loadRow * TILE + loadCol] = b;
+      workgroupBarrier();
+      for (var k = 0u; k < TILE; k++) {
+        total += As[loadRow * TILE + k] * Bs[loadCol * TILE + k];
+      }
+      workgroupBarrier();
+    }
+    if (row < params.M && col < params.N) {
+      C[row * params.N + col] = total;
+    }
+}
+)";
+
+struct MatmulParams {
+  uint32_t M;
+  uint32_t K;
+  uint32_t N;
+};
+
+inline KernelCode createMatmulDynamic(const char *shaderTemplate,
+                                      size_t tileSize = 16,
+                                      NumType precision = kf32) {
+  std::string codeString(shaderTemplate);
+  replaceAll(codeString, {{"{{precision}}", toString(precision)}});
+  KernelCode code = {codeString, {tileSize * tileSize, 1, 1}, precision};
+  code.constants = {{"TILE", static_cast<double>(tileSize)}};
+  return code;
+}
+
+/* Subgroup split-K matmul
+ *
+ * - Each workgroup computes a TM x TN tile of C
+ * - The K dimension is split across the threads of the workgroup, each
+ *   thread accumulates the partial dot products of the whole tile for every
+ *   THREADS-th k, so rows of A and B (B is stored as B^T) are read coalesced
+ * - The partial tiles are summed with subgroupAdd within each subgroup and
+ *   through workgroup memory across subgroups. Subgroups are not guaranteed to
+ *   be laid out linearly in the workgroup, so each claims a slot for its
+ *   partial tile.
+ * - The subgroup sum is a subgroupAdd rather than a butterfly of
+ *   subgroupShuffleXor steps: the chromium_experimental_subgroups extension of
+ *   the vendored Dawn does not guarantee the shuffle builtins, and drivers
+ *   lower subgroupAdd to their native reduction, which is no slower than the
+ *   log2(subgroup size) shuffles it replaces.
+ *
+ * With TM = 1 this is a matvec for decoding (M = 1), with larger tiles a
+ * matmul for skinny problems (small M or N, large K). Without subgroups the
+ * partial tiles are summed with a tree reduction in workgroup memory instead.
+ */
+static const char *kShaderMatmulSubgroup = R"(
+{{enable}}
+const M: u32 = {{M}};
+const K: u32 = {{K}};
+const N: u32 = {{N}};
+const TM: u32 = {{TM}};
+const TN: u32 = {{TN}};
+const THREADS: u32 = {{threads}};
+@group(0) @binding(0) var<storage, read_write> A: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> B: array<{{precision}}>;
+@group(0) @binding(2) var<storage, read_write> C: array<{{precision}}>;
+var<workgroup> partials: array<{{precision}}, {{partialsSize}}>;
+var<workgroup> numPartials: atomic<u32>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_index) t: u32,
+    {{builtins}}
+    @builtin(workgroup_id) groupID: vec3<u32>) {
+  let row0 = groupID.x * TM;
+  let col0 = groupID.y * TN;
+  var acc: array<{{precision}}, TM * TN>;
+  var a: array<{{precision}}, TM>;
+  var b: array<{{precision}}, TN>;
+  for (var k = t; k < K; k += THREADS) {
+    for (var i = 0u; i < TM; i++) {
+      a[i] = 0.0;
+      if (row0 + i < M) {
+        a[i] = A[(row0 + i) * K + k];
+      }
+    }
+    for (var j = 0u; j < TN; j++) {
+      b[j] = 0.0;
+      if (col0 + j < N) {
+        b[j] = B[(col0 + j) * K + k];
+      }
+    }
+    for (var i = 0u; i < TM; i++) {
+      for (var j = 0u; j < TN; j++) {
+        acc[i * TN + j] += a[i] * b[j];
+      }
+    }
+  }
+  {{reduce}}
+}
+)";
+
+static const char *kMatmulSubgroupReduce = R"(
+  var slot = 0u;
+  if (sgid == 0u) {
+    slot = atomicAdd(&numPartials, 1u);
+  }
+  for (var e = 0u; e < TM * TN; e++) {
+    let total = subgroupAdd(acc[e]);
+    if (sgid == 0u) {
+      partials[slot * TM * TN + e] = total;
+    }
+  }
+  workgroupBarrier();
+  if (t < TM * TN) {
+    let count = atomicLoad(&numPartials);
+    var total: {{precision}} = 0.0;
+    for (var s = 0u; s < count; s++) {
+      total += partials[s * TM * TN + t];
+    }
+    let row = row0 + t / TN;
+    let col = col0 + t % TN;
+    if (row < M && col < N) {
+      C[row * N + col] = total;
+    }
+  }
+)";
+
+static const char *kMatmulWorkgroupReduce = R"(
+  for (var e = 0u; e < TM * TN; e++) {
+    partials[t] = acc[e];
+    workgroupBarrier();
+    for (var s = THREADS / 2u; s > 0u; s >>= 1u) {
+      if (t < s) {
+        partials[t] += partials[t + s];
+      }
+      workgroupBarrier();
+    }
+    let row = row0 + e / TN;
+    let col = col0 + e % TN;
+    if (t == 0u && row < M && col < N) {
+      C[row * N + col] = partials[0];
+    }
+    workgroupBarrier();
+  }
+)";
+
+inline KernelCode createMatmulSubgroup(const char *shaderTemplate,
+                                       const size_t M, const size_t K,
+                                       const size_t N, const size_t TM,
+                                       const size_t TN, bool subgroups,
+                                       size_t minSubgroupSize,
+                                       const Shape &workgroupSize = {256, 1, 1},
+                                       NumType precision = kf32) {
+  assert(TM * TN <= workgroupSize[0]);
+  std::string codeString(shaderTemplate);
+  // One partial tile per subgroup, or one value per thread for the tree
+  size_t partialsSize =
+      subgroups ? workgroupSize[0] / std::max<size_t>(minSubgroupSize, 1) *
+                      TM * TN
+                : workgroupSize[0];
+  replaceAll(codeString,
+             {{"{{reduce}}",
+               subgroups ? kMatmulSubgroupReduce : kMatmulWorkgroupReduce},
+              {"{{enable}}",
+               subgroups ? "enable chromium_experimental_subgroups;" : ""},
+              {"{{builtins}}",
+               subgroups ? "@builtin(subgroup_invocation_id) sgid: u32," : ""},
+              {"{{partialsSize}}", toString(partialsSize)},
+              {"{{workgroupSize}}", toString(workgroupSize)},
+              {"{{precision}}", toString(precision)},
+              {"{{M}}", toString(M)},
+              {"{{K}}", toString(K)},
+              {"{{N}}", toString(N)},
+              {"{{TM}}", toString(TM)},
+              {"{{TN}}", toString(TN)},
+              {"{{threads}}", toString(workgroupSize[0])}});
+  return {codeString, workgroupSize, precision};
+}
+
 /* 1D block-tiling
  *
  * - A block tile in C is of size BM x BN
@@ -209,23 +428,16 @@ inline KernelCode createMatmul3(const char *shaderTemplate, const size_t M,
   // # threads = tile A size == tile B size == # threads for computing C
   assert(/* tile A size */ BM * BK == /* tile B size */ BK * BN);
   assert(/* tile A size */ BM * BK == /* # of threads for C */ BM * BN / TM);
-  std::string codeString(shaderTemplate);
-  replaceAll(codeString, {{"{{workgroupSize}}", toString(workgroupSize)},
-                          {"{{precision}}", toString(precision)},
-                          {"{{M}}", toString(M)},
-                          {"{{K}}", toString(K)},
-                          {"{{N}}", toString(N)},
-                          {"{{BM}}", toString(BM)},
-                          {"{{BK}}", toString(BK)},
-                          {"{{BN}}", toString(BN)},
-                          {"{{TM}}", toString(TM)}});
-  if (unrolling) {
-    std::string unrolledCode = loopUnrolling(codeString);
-    LOG(kDefLog, kInfo, "Unrolled code:\n%s", unrolledCode.c_str());
-    return {unrolledCode, workgroupSize};
-  } else {
-    return {codeString, workgroupSize};
-  }
+  return createKernelCode(shaderTemplate,
+                          {{"M", M},
+                           {"K", K},
+                           {"N", N},
+                           {"BM", BM},
+                           {"BK", BK},
+                           {"BN", BN},
+                           {"TM", TM}},
+                          workgroupSize, precision,
+                          WgslOptions{unrolling ? 32 : 0});
 }
 
 /* 2D block-tiling
@@ -321,27 +533,19 @@ inline KernelCode createMatmul4(const char *shaderTemplate, const size_t M,
   assert(N % BN == 0);
   // # threads = tile A size == tile B size == # threads for computing C
   int num_threads = BM * BN / (TM * TN);
-  std::string codeString(shaderTemplate);
-  replaceAll(codeString, {{"{{workgroupSize}}", toString(workgroupSize)},
-                          {"{{precision}}", toString(precision)},
-                          {"{{M}}", toString(M)},
-                          {"{{K}}", toString(K)},
-                          {"{{N}}", toString(N)},
-                          {"{{BM}}", toString(BM)},
-                          {"{{BK}}", toString(BK)},
-                          {"{{BN}}", toString(BN)},
-                          {"{{TM}}", toString(TM)},
-                          {"{{TN}}", toString(TN)},
-                          {"{{NUM_TILEA}}", toString(BM * BK / num_threads)},
-                          {"{{NUM_TILEB}}", toString(BN * BK / num_threads)}
-                          });
-  if (unrolling) {
-    std::string unrolledCode = loopUnrolling(codeString);
-    LOG(kDefLog, kInfo, "Unrolled code:\n%s", unrolledCode.c_str());
-    return {unrolledCode, workgroupSize};
-  } else {
-    return {codeString, workgroupSize};
-  }
+  return createKernelCode(shaderTemplate,
+                          {{"M", M},
+                           {"K", K},
+                           {"N", N},
+                           {"BM", BM},
+                           {"BK", BK},
+                           {"BN", BN},
+                           {"TM", TM},
+                           {"TN", TN},
+                           {"NUM_TILEA", BM * BK / num_threads},
+                           {"NUM_TILEB", BN * BK / num_threads}},
+                          workgroupSize, precision,
+                          WgslOptions{unrolling ? 32 : 0});
 }
 
 /* 2D block-tiling with vectorization
@@ -440,30 +644,22 @@ inline KernelCode createMatmulWithVectorization(const char *shaderTemplate, cons
   assert(N % BN == 0);
   // # threads = tile A size == tile B size == # threads for computing C
   int num_threads = BM * BN / (TM * TN);
-  std::string codeString(shaderTemplate);
-  replaceAll(codeString, {{"{{workgroupSize}}", toString(workgroupSize)},
-                          {"{{precision}}", toString(precision)},
-                          {"{{M}}", toString(M)},
-                          {"{{K}}", toString(K)},
-                          {"{{N}}", toString(N)},
-                          {"{{BM}}", toString(BM)},
-                          {"{{BK}}", toString(BK)},
-                          {"{{BN}}", toString(BN)},
-                          {"{{TM}}", toString(TM)},
-                          {"{{TN}}", toString(TN)},
-                          {"{{NUM_TILEA}}", toString(BM * BK / num_threads)},
-                          {"{{NUM_TILEB}}", toString(BN * BK / num_threads)},
-                          {"{{TN4}}", toString(TN / 4)},
-                          {"{{N4}}", toString(N / 4)},
-                          {"{{BN4}}", toString(BN / 4)},
-                          });
-  if (unrolling) {
-    std::string unrolledCode = loopUnrolling(codeString);
-    LOG(kDefLog, kInfo, "Unrolled code:\n%s", unrolledCode.c_str());
-    return {unrolledCode, workgroupSize};
-  } else {
-    return {codeString, workgroupSize};
-  }
+  return createKernelCode(shaderTemplate,
+                          {{"M", M},
+                           {"K", K},
+                           {"N", N},
+                           {"BM", BM},
+                           {"BK", BK},
+                           {"BN", BN},
+                           {"TM", TM},
+                           {"TN", TN},
+                           {"NUM_TILEA", BM * BK / num_threads},
+                           {"NUM_TILEB", BN * BK / num_threads},
+                           {"TN4", TN / 4},
+                           {"N4", N / 4},
+                           {"BN4", BN / 4}},
+                          workgroupSize, precision,
+                          WgslOptions{unrolling ? 32 : 0});
 }
 
 /**
@@ -514,6 +710,230 @@ void checkCPU(size_t M, size_t K, size_t N, std::unique_ptr<float[]> &inputPtr,
                                                           : "CPU Check: FAIL");
 }
 
+/**
+ * @brief Tile configuration for the 2D block-tiling kernels (versions 4, 6
+ * and 7) and the subgroup kernels (versions 10 and 11, which only use the
+ * TM x TN tile).
+ */
+struct MatmulConfig {
+  int version; // 4 == 2D blocktiling, 6 == with loop unrolling,
+               // 7 == with loop unrolling and vectorization,
+               // 10 == subgroupAdd matvec, 11 == subgroupAdd split-K
+               // matmul
+  size_t BM, BK, BN, TM, TN;
+};
+
+// Threads per workgroup of the subgroup kernels (versions 10 and 11)
+static constexpr size_t kSubgroupMatmulThreads = 256;
+
+/**
+ * @brief Creates a subgroup split-K matmul kernel computing TM x TN tiles,
+ * falling back to workgroup memory reductions without subgroup support.
+ */
+Kernel createSubgroupMatmul(Context &ctx, size_t TM, size_t TN,
+                            const Bindings</* input, weights, output */ 3> &bindings,
+                            size_t M, size_t K, size_t N) {
+  uint32_t minSubgroupSize, maxSubgroupSize;
+  bool subgroups = subgroupSizeRange(ctx, minSubgroupSize, maxSubgroupSize);
+  if (!subgroups) {
+    LOG(kDefLog, kWarn,
+        "Subgroups are not supported, using workgroup reductions");
+  }
+  // Assume the smallest subgroup size of common hardware if unknown
+  minSubgroupSize = minSubgroupSize > 0 ? minSubgroupSize : 4;
+  Shape wgSize = {kSubgroupMatmulThreads, 1, 1};
+  Shape nWorkgroups = {cdiv(M, TM), cdiv(N, TN), 1};
+  LOG(kDefLog, kInfo, "TM: %zu, TN: %zu, %s reduction (subgroup sizes %u - %u)",
+      TM, TN, subgroups ? "subgroupAdd" : "workgroup memory", minSubgroupSize,
+      maxSubgroupSize);
+  KernelCode matmul =
+      createMatmulSubgroup(kShaderMatmulSubgroup, M, K, N, TM, TN, subgroups,
+                           minSubgroupSize, /*wgSize*/ wgSize);
+  return createKernel(ctx, matmul, bindings, /*nWorkgroups*/ nWorkgroups);
+}
+
+/**
+ * @brief Creates a tiled matmul kernel for the given configuration.
+ */
+Kernel createTiledMatmul(Context &ctx, const MatmulConfig &config,
+                         const Bindings</* input, weights, output */ 3> &bindings,
+                         size_t M, size_t K, size_t N) {
+  const auto &[version, BM, BK, BN, TM, TN] = config;
+  if (version == 10 || version == 11) {
+    return createSubgroupMatmul(ctx, TM, TN, bindings, M, K, N);
+  }
+  Shape wgSize = {(BM / TM) * (BN / TN), 1, 1};
+  Shape nWorkgroups = {cdiv(M, BM), cdiv(N, BN), 1};
+  LOG(kDefLog, kInfo, "M: %d, K: %d, N: %d", M, K, N);
+  LOG(kDefLog, kInfo, "BM: %d, BK: %d, BN: %d, TM: %d, TN: %d", BM, BK, BN, TM, TN);
+  LOG(kDefLog, kInfo, "wgSize: ( %s )", toString(wgSize).c_str());
+  LOG(kDefLog, kInfo, "nWorkgroups: ( %s )", toString(nWorkgroups).c_str());
+  KernelCode matmul =
+      version == 7
+          ? createMatmulWithVectorization(kShaderMatmulWithVectorization, M, K,
+                                          N, BM, BK, BN, TM, TN,
+                                          /*wgSize*/ wgSize, kf32,
+                                          /*Loop unrolling*/ true)
+          : createMatmul4(kShaderMatmul4, M, K, N, BM, BK, BN, TM, TN,
+                          /*wgSize*/ wgSize, kf32,
+                          /*Loop unrolling*/ version == 6);
+  return createKernel(ctx, matmul, bindings, /*nWorkgroups*/ nWorkgroups);
+}
+
+/**
+ * @brief Enumerates the tile configurations which are valid for the problem
+ * size and the device limits: tiles divide the matrices, the workgroup loads
+ * its A and B tiles in whole iterations, and the workgroup size and memory fit
+ * the limits.
+ */
+std::vector<MatmulConfig> matmulCandidates(Context &ctx, size_t M, size_t K,
+                                           size_t N) {
+  WGPUSupportedLimits limits = {};
+  wgpuDeviceGetLimits(ctx.device, &limits);
+  std::vector<MatmulConfig> candidates;
+  for (int version : {4, 6, 7}) {
+    for (size_t BM : {32, 64, 128}) {
+      for (size_t BN : {32, 64, 128}) {
+        for (size_t BK : {8, 16, 32}) {
+          for (size_t TM : {4, 8}) {
+            for (size_t TN : {4, 8}) {
+              size_t numThreads = (BM / TM) * (BN / TN);
+              if (M % BM || N % BN || K % BK || BM % TM || BN % TN ||
+                  (BM * BK) % numThreads || (BN * BK) % numThreads ||
+                  (version == 7 && (TN % 4 || N % 4)) ||
+                  numThreads >
+                      limits.limits.maxComputeInvocationsPerWorkgroup ||
+                  numThreads > limits.limits.maxComputeWorkgroupSizeX ||
+                  (BM + BN) * BK * sizeof(float) >
+                      limits.limits.maxComputeWorkgroupStorageSize) {
+                continue;
+              }
+              candidates.push_back({version, BM, BK, BN, TM, TN});
+            }
+          }
+        }
+      }
+    }
+  }
+  // The subgroup kernels are only worth trying with subgroups, without them
+  // they are a slow fallback
+  if (supportsSubgroups(ctx)) {
+    for (size_t TN : {4, 8, 16}) {
+      candidates.push_back({10, 1, 0, TN, 1, TN});
+    }
+    for (size_t TM : {2, 4}) {
+      for (size_t TN : {4, 8}) {
+        candidates.push_back({11, TM, 0, TN, TM, TN});
+      }
+    }
+  }
+  return candidates;
+}
+
+/**
+ * @brief Times every candidate configuration with timeKernel() and returns
+ * the fastest one. The candidate kernels are freed after timing and only the
+ * pipeline of the fastest one is kept in the pipeline cache, so that the
+ * caller's createTiledMatmul() of the winner does not compile it again.
+ */
+MatmulConfig autotuneMatmul(Context &ctx,
+                            const Bindings</* input, weights, output */ 3> &bindings,
+                            size_t M, size_t K, size_t N, double &bestMs) {
+  std::vector<MatmulConfig> candidates = matmulCandidates(ctx, M, K, N);
+  LOG(kDefLog, kInfo, "Autotuning %zu matmul configurations",
+      candidates.size());
+  MatmulConfig best = {6, 64, 16, 64, 4, 4};
+  WGPUComputePipeline bestPipeline = nullptr;
+  bestMs = std::numeric_limits<double>::infinity();
+  for (const MatmulConfig &config : candidates) {
+    Kernel kernel = createTiledMatmul(ctx, config, bindings, M, K, N);
+    timeKernel(ctx, kernel, 1); // warm up
+    double ms = timeKernel(ctx, kernel, 10);
+    LOG(kDefLog, kInfo,
+        "version %d BM %zu BK %zu BN %zu TM %zu TN %zu: %.3f ms ~ %.2f GFLOPS",
+        config.version, config.BM, config.BK, config.BN, config.TM, config.TN,
+        ms, 2.0 * M * N * K / (ms / 1000.0) / 1e9);
+    // timeKernel() has waited for the dispatches, nothing is in flight
+    WGPUComputePipeline pipeline = kernel.computePipeline;
+    FreeKernel(ctx.kernelPool, kernel);
+    if (ms < bestMs) {
+      if (bestPipeline && bestPipeline != pipeline) {
+        evictPipeline(ctx, bestPipeline);
+      }
+      bestPipeline = pipeline;
+      bestMs = ms;
+      best = config;
+    } else if (pipeline != bestPipeline) {
+      evictPipeline(ctx, pipeline);
+    }
+  }
+  return best;
+}
+
+/**
+ * @brief Looks up the tuned configuration for the adapter and problem size in
+ * a tuning results file written by saveTunedMatmul(). Each line of the file
+ * is of the form:
+ * <adapter identity> <M> <K> <N> <version> <BM> <BK> <BN> <TM> <TN> <ms>
+ */
+bool lookupTunedMatmul(const std::string &path, const std::string &adapter,
+                       size_t M, size_t K, size_t N, MatmulConfig &config) {
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string id;
+    size_t m, k, n;
+    MatmulConfig entry;
+    if (fields >> id >> m >> k >> n >> entry.version >> entry.BM >>
+            entry.BK >> entry.BN >> entry.TM >> entry.TN &&
+        id == adapter && m == M && k == K && n == N) {
+      config = entry;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Saves the tuned configuration for the adapter and problem size,
+ * replacing a previous entry for the same key.
+ */
+void saveTunedMatmul(const std::string &path, const std::string &adapter,
+                     size_t M, size_t K, size_t N, const MatmulConfig &config,
+                     double ms) {
+  std::ostringstream key;
+  key << adapter << " " << M << " " << K << " " << N << " ";
+  std::vector<std::string> lines;
+  {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      if (line.rfind(key.str(), 0) != 0) {
+        lines.push_back(line);
+      }
+    }
+  }
+  std::ostringstream entry;
+  entry << key.str() << config.version << " " << config.BM << " " << config.BK
+        << " " << config.BN << " " << config.TM << " " << config.TN << " "
+        << ms;
+  lines.push_back(entry.str());
+  std::ofstream file(path, std::ios::trunc);
+  for (const std::string &line : lines) {
+    file << line << "\n";
+  }
+  LOG(kDefLog, kInfo, "Saved tuned configuration to %s", path.c_str());
+}
+
+/**
+ * @brief Version used for MATMUL_VERSION 0 without a tuned configuration.
+ * Decoding (M == 1) is a matvec, which the 2D tiled default serves poorly.
+ */
+int defaultMatmulVersion(Context &ctx, size_t M) {
+  return M == 1 && supportsSubgroups(ctx) ? 10 : 6;
+}
+
 Kernel selectMatmul(Context &ctx, int version,
                     const Bindings</* input, weights, output */ 3> &bindings,
                     size_t M, size_t K, size_t N) {
@@ -551,48 +971,32 @@ Kernel selectMatmul(Context &ctx, int version,
 				      /*Loop unrolling*/ version == 5 ? true: false);
     kernel = createKernel(ctx, matmul, bindings,
                           /*nWorkgroups*/ nWorkgroups);
-  } else if (version == 4 || version == 6) {
+  } else if (version == 4 || version == 6 || version == 7) {
     static constexpr size_t BM = 64;
     static constexpr size_t BK = 16;
     static constexpr size_t BN = 64;
     static constexpr size_t TM = BM / BK;
     static constexpr size_t TN = BN / BK;
-    Shape wgSize = {(BM / TM) * (BN / TN), 1, 1}; // This is the same as BK * BK.
-    Shape nWorkgroups = {cdiv(M, BM), cdiv(N, BN), 1};
-    LOG(kDefLog, kInfo, "M: %d, K: %d, N: %d", M, K, N);
-    LOG(kDefLog, kInfo, "BM: %d, BK: %d, BN: %d, TM: %d, TN: %d", BM, BK, BN, TM, TN);
-    LOG(kDefLog, kInfo, "wgSize: ( %s )", toString(wgSize).c_str());
-    LOG(kDefLog, kInfo, "nWorkgroups: ( %s )", toString(nWorkgroups).c_str());
-    KernelCode matmul = createMatmul4(kShaderMatmul4, M, K, N, BM, BK, BN, TM, TN,
-                                      /*wgSize*/ wgSize,
-				      kf32,
-				      /*Loop unrolling*/ version == 6 ? true: false);
-    kernel = createKernel(ctx, matmul, bindings,
-                          /*nWorkgroups*/ nWorkgroups);
-  } else if (version == 7) {
-    static constexpr size_t BM = 64;
-    static constexpr size_t BK = 16;
-    static constexpr size_t BN = 64;
-    static constexpr size_t TM = BM / BK;
-    static constexpr size_t TN = BN / BK;
-    Shape wgSize = {(BM / TM) * (BN / TN), 1, 1}; // This is the same as BK * BK.
-    Shape nWorkgroups = {cdiv(M, BM), cdiv(N, BN), 1};
-    LOG(kDefLog, kInfo, "M: %d, K: %d, N: %d", M, K, N);
-    LOG(kDefLog, kInfo, "BM: %d, BK: %d, BN: %d, TM: %d, TN: %d", BM, BK, BN, TM, TN);
-    LOG(kDefLog, kInfo, "wgSize: ( %s )", toString(wgSize).c_str());
-    LOG(kDefLog, kInfo, "nWorkgroups: ( %s )", toString(nWorkgroups).c_str());
-    KernelCode matmul = createMatmulWithVectorization(kShaderMatmulWithVectorization, M, K, N, BM, BK, BN, TM, TN,
-                                                      /*wgSize*/ wgSize,
-						      kf32,
-						      /*Loop unrolling*/ true);
-    kernel = createKernel(ctx, matmul, bindings,
-                          /*nWorkgroups*/ nWorkgroups);
+    kernel = createTiledMatmul(ctx, {version, BM, BK, BN, TM, TN}, bindings, M,
+                               K, N);
   } else if (version == 8) {
     Shape wgSize = {256, 1, 1};
     Shape nWorkgroups = cdiv({M, N, 1}, {16, 16, 1});
     KernelCode matmul = createNoOp(kShaderNoOp, /*wgsize*/ wgSize);
     kernel = createKernel(ctx, matmul, bindings,
                           /*nWorkgroups*/ nWorkgroups);
+  } else if (version == 9) {
+    static constexpr size_t tileSize = 16;
+    KernelCode matmul = createMatmulDynamic(kShaderMatmulDynamic, tileSize);
+    kernel = createKernel(
+        ctx, matmul, bindings,
+        /* nWorkgroups */ cdiv({M, N, 1}, {tileSize, tileSize, 1}),
+        MatmulParams{static_cast<uint32_t>(M), static_cast<uint32_t>(K),
+                     static_cast<uint32_t>(N)});
+  } else if (version == 10) {
+    kernel = createSubgroupMatmul(ctx, /*TM*/ 1, /*TN*/ 8, bindings, M, K, N);
+  } else if (version == 11) {
+    kernel = createSubgroupMatmul(ctx, /*TM*/ 4, /*TN*/ 4, bindings, M, K, N);
   }
   return kernel;
 }
@@ -603,7 +1007,11 @@ void runTest(int version, size_t M, size_t K, size_t N,
              std::unique_ptr<float[]> &outputPtr) {
 
   // Allocate GPU buffers and copy data
-  Context ctx = createContext();
+  // MATMUL_CACHE_DIR optionally persists compiled pipelines between runs
+  const char *cacheDir = getenv("MATMUL_CACHE_DIR");
+  Context ctx = createContext({}, {}, {}, cacheDir == NULL ? "" : cacheDir);
+  // MATMUL_PROFILE reports GPU timestamps of each dispatch
+  bool profiling = getenv("MATMUL_PROFILE") != NULL && enableProfiling(ctx);
   Tensor input = createTensor(ctx, Shape{M, K}, kf32, inputPtr.get());
   Tensor weights =
       createTensor(ctx, Shape{N, K}, kf32, weightsPtr.get()); // column-major
@@ -612,8 +1020,29 @@ void runTest(int version, size_t M, size_t K, size_t N,
   constexpr size_t nIter = 5;
 
   // Initialize Kernel and bind GPU buffers
+  // MATMUL_AUTOTUNE searches tile configurations and saves the fastest one
+  // for this adapter to MATMUL_TUNE_FILE, version 0 uses the saved one
   LOG(kDefLog, kInfo, "Creating Kernel");
-  Kernel kernel = selectMatmul(ctx, version, {input, weights, output}, M, K, N);
+  const char *tuneFile = getenv("MATMUL_TUNE_FILE");
+  std::string tunePath = tuneFile == NULL ? "matmul_tuning.txt" : tuneFile;
+  std::string adapter = adapterIdentity(ctx.adapter);
+  MatmulConfig tuned;
+  Kernel kernel;
+  if (getenv("MATMUL_AUTOTUNE") != NULL) {
+    double ms;
+    tuned = autotuneMatmul(ctx, {input, weights, output}, M, K, N, ms);
+    saveTunedMatmul(tunePath, adapter, M, K, N, tuned, ms);
+    kernel = createTiledMatmul(ctx, tuned, {input, weights, output}, M, K, N);
+  } else if (version == 0 &&
+             lookupTunedMatmul(tunePath, adapter, M, K, N, tuned)) {
+    LOG(kDefLog, kInfo, "Using tuned configuration (version %d) from %s",
+        tuned.version, tunePath.c_str());
+    kernel = createTiledMatmul(ctx, tuned, {input, weights, output}, M, K, N);
+  } else {
+    kernel = selectMatmul(ctx, version == 0 ? defaultMatmulVersion(ctx, M)
+                                            : version,
+                          {input, weights, output}, M, K, N);
+  }
 
   // Dispatch kernel execution
   LOG(kDefLog, kInfo, "Dispatching Kernel version %d, %d iterations ...",
@@ -627,14 +1056,25 @@ void runTest(int version, size_t M, size_t K, size_t N,
     futures[i] = promises[i].get_future();
   }
 
+  // Capture the dispatch once, replay() re-records while the GPU executes
+  KernelGraph graph;
+  addNode(graph, kernel);
+  compileGraph(ctx, graph);
+
   // Dispatch kernel nIter times
+  std::chrono::duration<double, std::micro> replayTime(0);
   auto start = std::chrono::high_resolution_clock::now();
   for (int i = 0; i < nIter; i++) {
-    dispatchKernel(ctx, kernel, promises[i]);
+    auto replayStart = std::chrono::high_resolution_clock::now();
+    replay(ctx, graph, promises[i]);
+    replayTime += std::chrono::high_resolution_clock::now() - replayStart;
     wait(ctx, futures[i]);
-    resetCommandBuffer(ctx.device, kernel);
   }
   auto end = std::chrono::high_resolution_clock::now();
+  releaseGraph(ctx, graph);
+  // Submission plus re-encoding of the graph, the CPU cost of one iteration
+  LOG(kDefLog, kInfo, "CPU time per replay: %.1f us",
+      replayTime.count() / nIter);
 
   // Report performance.
   // Use microsecond for more accurate time measurement
@@ -645,6 +1085,22 @@ void runTest(int version, size_t M, size_t K, size_t N,
                  (static_cast<double>(duration.count()) / 1000000.0) /
                  1000000000.0 * static_cast<float>(nIter);
 
+  if (profiling) {
+    for (const ProfileStats &stats : profileStats(ctx)) {
+      LOG(kDefLog, kInfo,
+          "GPU time %s: %d dispatches, mean %.3f ms, p50 %.3f ms, p99 %.3f ms",
+          stats.label.c_str(), stats.count, stats.meanMs, stats.p50Ms,
+          stats.p99Ms);
+    }
+    writeChromeTrace(ctx, "matmul_trace.json");
+  }
+
+  if (ctx.diskCache) {
+    LOG(kDefLog, kInfo, "Persistent cache: %zu hits, %zu misses, %zu stores",
+        ctx.diskCache->hits.load(), ctx.diskCache->misses.load(),
+        ctx.diskCache->stores.load());
+  }
+
   LOG(kDefLog, kInfo, "Copying result to CPU");
   toCPU(ctx, output, outputPtr.get(), M * N * sizeof(float));
   LOG(kDefLog, kInfo, "%s",
@@ -659,9 +1115,88 @@ void runTest(int version, size_t M, size_t K, size_t N,
       M, K, N, nIter, duration.count() / static_cast<double>(nIter) / 1000.0 /* us -> ms */, gflops);
 }
 
+void runShardedTest(int version, size_t M, size_t K, size_t N,
+                    std::unique_ptr<float[]> &inputPtr,
+                    std::unique_ptr<float[]> &weightsPtr,
+                    std::unique_ptr<float[]> &outputPtr) {
+  // One context per adapter, rows of the output are split across them in
+  // multiples of the 64 row tiles of the blocktiled kernels
+  std::vector<Context> contexts = createContexts();
+  std::vector<ShardRange> shards = shardRange(M, contexts.size(), 64);
+  LOG(kDefLog, kInfo, "Sharding M = %d across %d adapters", M,
+      contexts.size());
+
+  constexpr size_t nIter = 5;
+  std::vector<Tensor> outputs(contexts.size());
+  std::vector<Kernel> kernels(contexts.size());
+  for (size_t i = 0; i < contexts.size(); ++i) {
+    if (shards[i].size == 0) {
+      continue;
+    }
+    Context &ctx = contexts[i];
+    size_t shardM = shards[i].size;
+    Tensor input = createTensor(ctx, Shape{shardM, K}, kf32,
+                                inputPtr.get() + shards[i].offset * K);
+    Tensor weights = createTensor(ctx, Shape{N, K}, kf32, weightsPtr.get());
+    outputs[i] = createTensor(ctx, Shape{shardM, N}, kf32);
+    LOG(kDefLog, kInfo, "Shard %d: rows [%d, %d) on %s", i, shards[i].offset,
+        shards[i].offset + shardM, adapterIdentity(ctx.adapter).c_str());
+    kernels[i] = selectMatmul(ctx,
+                              version == 0 ? defaultMatmulVersion(ctx, shardM)
+                                           : version,
+                              {input, weights, outputs[i]}, shardM, K, N);
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  for (size_t iter = 0; iter < nIter; ++iter) {
+    // Submit to all adapters before waiting on any of them
+    std::vector<std::promise<void>> promises(contexts.size());
+    std::vector<std::future<void>> futures(contexts.size());
+    for (size_t i = 0; i < contexts.size(); ++i) {
+      if (shards[i].size == 0) {
+        continue;
+      }
+      futures[i] = promises[i].get_future();
+      dispatchKernel(contexts[i], kernels[i], promises[i]);
+    }
+    for (size_t i = 0; i < contexts.size(); ++i) {
+      if (shards[i].size == 0) {
+        continue;
+      }
+      wait(contexts[i], futures[i]);
+      resetCommandBuffer(contexts[i].device, kernels[i]);
+    }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  // Gather the output rows of each shard
+  for (size_t i = 0; i < contexts.size(); ++i) {
+    if (shards[i].size == 0) {
+      continue;
+    }
+    toCPU(contexts[i], outputs[i], outputPtr.get() + shards[i].offset * N,
+          shards[i].size * N * sizeof(float));
+  }
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(outputPtr.get(), M, N, "Output").c_str());
+
+  auto duration =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+  float gflops = 2 * M * N * K /
+                 (static_cast<double>(duration.count()) / 1000000.0) /
+                 1000000000.0 * static_cast<float>(nIter);
+  LOG(kDefLog, kInfo,
+      "Sharded execution time (M = %d, K = %d, N = %d, %d adapters) x %d "
+      "iterations: %.1f milliseconds / dispatch ~ %.2f GFLOPS",
+      M, K, N, contexts.size(), nIter,
+      duration.count() / static_cast<double>(nIter) / 1000.0, gflops);
+}
+
 int main() {
   char* version_str = getenv("MATMUL_VERSION");
-  int version = version_str == NULL ? 6 : atoi(version_str);
+  int version = version_str == NULL ? 0 : atoi(version_str);
+    // 0 == tuned configuration from MATMUL_TUNE_FILE if available, else 6
+    //      (10 for M == 1 with subgroups)
     // 1 == naive matmul
     // 2 == tiling
     // 3 == 1D blocktiling
@@ -670,6 +1205,9 @@ int main() {
     // 6 == 2D blocktiling with loop unrolling
     // 7 == 2D blocktiling with loop unrolling and vectorization
     // 8 == No-Op
+    // 9 == tiling with runtime problem size (override constants, uniforms)
+    // 10 == subgroupAdd reduction matvec (1 x 8 tiles)
+    // 11 == subgroupAdd reduction split-K matmul (4 x 4 tiles)
 
   size_t M, K, N;  // Matrix dimensions
   static constexpr int kTestSize = 2;
@@ -695,7 +1233,12 @@ int main() {
   std::unique_ptr<float[]> outputPtr = std::make_unique<float[]>(M * N);
 
   initData(M, K, N, inputPtr, weightsPtr);
-  runTest(version, M, K, N, inputPtr, weightsPtr, outputPtr);
+  // MATMUL_SHARDED splits the rows of the matmul across all adapters
+  if (getenv("MATMUL_SHARDED") != NULL) {
+    runShardedTest(version, M, K, N, inputPtr, weightsPtr, outputPtr);
+  } else {
+    runTest(version, M, K, N, inputPtr, weightsPtr, outputPtr);
+  }
 
   if constexpr (kTestSize <= 1) {
     // Check result with CPU reference implementation for tiny/small tests
@@ -1,10 +1,11 @@
 #include <array>
 #include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <future>
 #include <thread>
 
-#include "experimental/tui.h" // rasterize
+#include "experimental/tui.h" // createScatterRaster, updateRaster
 #include "gpu.h"
 
 using namespace gpu;
@@ -19,10 +20,11 @@ const dt: f32 = 0.03;
 @group(0) @binding(4) var<storage, read_write> length: array<f32>;
 @group(0) @binding(5) var<storage, read_write> pos: array<f32>;  // x1, y1 for each pendulum
 //@group(0) @binding(6) var<storage, read_write> pos2: array<f32>;  // x2, y2 for each pendulum
+@group(0) @binding(6) var<storage, read_write> numActive: array<u32>;
 @compute @workgroup_size({{workgroupSize}})
 fn main(@builtin(global_invocation_id) global_id : vec3<u32>) {
     let idx = global_id.x;
-    if (idx >= arrayLength(&theta1)) {
+    if (idx >= numActive[0]) {
         return;
     }
     let l = length[idx];
@@ -48,6 +50,23 @@ fn main(@builtin(global_invocation_id) global_id : vec3<u32>) {
 }
 )";
 
+// Releases kRelease more pendulums each frame, and writes the workgroup count
+// of the update kernel for the active pendulums. The count stays on the GPU,
+// the update kernel is dispatched indirectly from args.
+const char *kScheduleSim = R"(
+const kRelease: u32 = 4;
+@group(0) @binding(0) var<storage, read_write> numActive: array<u32>;
+@group(0) @binding(1) var<storage, read_write> args: array<u32>;
+@compute @workgroup_size(1)
+fn main() {
+    let n = min(numActive[0] + kRelease, {{N}});
+    numActive[0] = n;
+    args[0] = (n + {{updateWorkgroupSize}} - 1) / {{updateWorkgroupSize}};
+    args[1] = 1;
+    args[2] = 1;
+}
+)";
+
 int main() {
   // N can be quite a bit larger than this on most GPUs (~ 1M on MBP M1)
   static constexpr size_t N = 1000;
@@ -70,15 +89,36 @@ int main() {
   Tensor vel2 = createTensor(ctx, Shape{N}, kf32, v2Arr.data());
   Tensor length = createTensor(ctx, Shape{N}, kf32, lengthArr.data());
   std::array<float, 2 * 2 * N> posArr; // x, y outputs for each pendulum
-  std::string screen(80 * 40, ' ');
-  Tensor pos = createTensor(ctx, Shape{N * 4}, kf32);
+  // Pendulums which are not released yet rest at their initial position
+  for (size_t i = 0; i < N; ++i) {
+    posArr[4 * i] = lengthArr[i] * sin(theta1Arr[i]);
+    posArr[4 * i + 1] = -lengthArr[i] * cos(theta1Arr[i]);
+    posArr[4 * i + 2] = posArr[4 * i] + lengthArr[i] * sin(theta2Arr[i]);
+    posArr[4 * i + 3] = posArr[4 * i + 1] - lengthArr[i] * cos(theta2Arr[i]);
+  }
+  Tensor pos = createTensor(ctx, Shape{N * 4}, kf32, posArr.data());
+  Tensor numActive = createTensor(ctx, Shape{1}, ku32);
+  Tensor args = createIndirectArgs(ctx);
 
   // Prepare computation
   KernelCode kernel{kUpdateSim, 256, kf32};
   printf("WGSL code: %s\n", kernel.data.c_str());
   Kernel update = createKernel(
-      ctx, kernel, Bindings{theta1, theta2, vel1, vel2, length, pos},
+      ctx, kernel,
+      Bindings{theta1, theta2, vel1, vel2, length, pos, numActive},
       /* nWorkgroups */ cdiv({N, 1, 1}, kernel.workgroupSize));
+  setIndirectDispatch(ctx, update, args);
+  std::string scheduleCode(kScheduleSim);
+  replaceAll(scheduleCode, {{"{{N}}", std::to_string(N)},
+                            {"{{updateWorkgroupSize}}",
+                             std::to_string(kernel.workgroupSize[0])}});
+  Kernel schedule = createKernel(ctx, KernelCode{scheduleCode, 1, kf32},
+                                 Bindings{numActive, args},
+                                 /* nWorkgroups */ {1, 1, 1});
+  CommandBatch step = createCommandBatch(ctx, {schedule, update});
+  // Positions are drawn on the GPU, only the changed screen cells are read
+  // back. N * 2 because there's two objects per pendulum.
+  Raster raster = createScatterRaster(ctx, pos, N * 2, 40, 79, 2.0, 2.0);
 
   // Main simulation update loop
   printf("\033[2J\033[H");
@@ -86,18 +126,18 @@ int main() {
     auto start = std::chrono::high_resolution_clock::now();
     std::promise<void> promise;
     std::future<void> future = promise.get_future();
-    dispatchKernel(ctx, update, promise);
+    dispatchBatch(ctx, step, promise);
+    // The raster is queued right behind the update kernel instead of
+    // draining the queue in between
+    updateRaster(ctx, raster);
     wait(ctx, future);
-    toCPU(ctx, pos, posArr.data(), sizeof(posArr));
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = end - start;
-    // N * 2 because there's two objects per pendulum
-    rasterize(posArr.data(), N * 2, 2.0, 2.0, screen, 80, 40);
     printf("\033[1;1H" // reset cursor
-           "# simulations: %lu\n%s",
-           N, screen.c_str());
-    resetCommandBuffer(ctx.device, update); // Prepare kernel command
-                                            // buffer for nxt iteration
+           "# simulations: %lu, bytes read: %-8zu\n%s",
+           N, raster.bytesRead, raster.screen.c_str());
+    resetCommandBuffer(ctx.device, step); // Prepare batch command
+                                          // buffer for nxt iteration
     std::this_thread::sleep_for(std::chrono::milliseconds(8) - elapsed);
   }
 }
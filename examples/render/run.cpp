@@ -3,6 +3,7 @@
 #include <cstdio>
 #include <future>
 
+#include "experimental/tui.h" // createRaster, updateRaster
 #include "gpu.h"
 #include "utils/array_utils.h"
 #include "utils/logging.h"
@@ -122,40 +123,29 @@ int main(int argc, char **argv) {
   KernelCode code = {kSDF, wgSize};
   Kernel renderKernel = createKernel(ctx, code, Bindings{devScreen},
                                      cdiv({NCOLS, NROWS, 1}, wgSize), params);
+
+  static const char intensity[] =
+      "@B%8&WM#$Z0OQLCJUYX/"
+      "\\|()1{}I[]?lzcvunxrjft-+~<>i!_;:*\"^`',. ";
+  // static const char intensity[] = "@%#8$X71x*+=-:^~'.` ";
+
+  // Intensity = depth map, focus on depth of the objects. The depth is mapped
+  // to characters on the GPU and only the changed characters are read back.
+  Raster raster = createRaster(ctx, devScreen, NROWS, NCOLS, /* min */ 0.0,
+                               /* max */ params.sphereRadius * 3, intensity);
+
   printf("\033[2J\033[H");
   while (true) {
     std::promise<void> promise;
     std::future<void> future = promise.get_future();
     dispatchKernel(ctx, renderKernel, promise);
+    updateRaster(ctx, raster);
     wait(ctx, future);
-    toCPU(ctx, devScreen, screen.data(), sizeof(screen));
     params.time = getCurrentTimeInMilliseconds() - zeroTime;
 
     toGPU(ctx, params, renderKernel);
     resetCommandBuffer(ctx.device, renderKernel);
 
-    static const char intensity[] =
-        "@B%8&WM#$Z0OQLCJUYX/"
-        "\\|()1{}I[]?lzcvunxrjft-+~<>i!_;:*\"^`',. ";
-    // static const char intensity[] = "@%#8$X71x*+=-:^~'.` ";
-
-    // Intensity = depth map, focus on depth of the objects
-    float min = 0.0;
-    float max = params.sphereRadius * 3;
-
-    for (size_t i = 0; i < screen.size(); ++i) {
-      screen[i] = (screen[i] - min) / (max - min);
-    }
-
-    std::array<char, screen.size()> raster;
-    for (size_t i = 0; i < screen.size(); ++i) {
-      size_t index =
-          std::min(sizeof(intensity) - 2,
-                   std::max(0ul, static_cast<size_t>(screen[i] *
-                                                     (sizeof(intensity) - 2))));
-      raster[i] = intensity[index];
-    }
-
     char buffer[(NROWS + 2) * (NCOLS + 2)];
     char *offset = buffer;
     sprintf(offset, "+");
@@ -167,7 +157,7 @@ int main(int argc, char **argv) {
     for (size_t row = 0; row < NROWS; ++row) {
       sprintf(offset, "|");
       for (size_t col = 0; col < NCOLS; ++col) {
-        sprintf(offset + col + 1, "%c", raster[row * NCOLS + col]);
+        sprintf(offset + col + 1, "%c", raster.screen[row * (NCOLS + 1) + col]);
       }
       sprintf(offset + NCOLS + 1, "|\n");
       offset += NCOLS + 3;
@@ -7,32 +7,12 @@
 #include <string>
 #include <thread>
 
+#include "experimental/tui.h" // createRaster, updateRaster
 #include "utils/array_utils.h"
 #include "utils/logging.h"
 
 using namespace gpu;
 
-template <size_t rows, size_t cols>
-void rasterize(const std::array<float, rows * cols> &values,
-               std::array<char, rows *(cols + 1)> &raster) {
-  // Note: We can experiment with the rasterization characters here but fewer
-  // characters looks better by imposing temporal coherence whereas more
-  // characters can start to look like noise.
-  // static const char intensity[] = " `.-':_,^=;><+!ngrc*/z?sLTv)J7(|Fi{C}fI31tlu[neoZ5Yxjya]2ESwqkP6h9d4VpOGbUAKXHm8RD#$Bg0MNWQ%&@";
-  static const char intensity[] = " .`'^-+=*x17X$8#%@";
-  for (size_t i = 0; i < rows; ++i) {
-    for (size_t j = 0; j < cols; ++j) {
-      // values ranges b/w 0 and 1
-      size_t index =
-          std::min(sizeof(intensity) - 2,
-                   std::max(0ul, static_cast<size_t>(values[i * cols + j] *
-                                                     (sizeof(intensity) - 2))));
-      raster[i * (cols + 1) + j] = intensity[index];
-    }
-    raster[i * (cols + 1) + cols] = '\n';
-  }
-}
-
 float getCurrentTimeInMilliseconds(
     std::chrono::time_point<std::chrono::high_resolution_clock> &zeroTime) {
   std::chrono::duration<float> duration =
@@ -93,7 +73,13 @@ int main() {
 
   LOG(kDefLog, kInfo, "Starting render loop");
 
-  std::array<char, kRows *(kCols + 1)> raster;
+  // Screen values range between 0 and 1. Note: We can experiment with the
+  // rasterization characters here but fewer characters looks better by
+  // imposing temporal coherence whereas more characters can start to look like
+  // noise.
+  // " `.-':_,^=;><+!ngrc*/z?sLTv)J7(|Fi{C}fI31tlu[neoZ5Yxjya]2ESwqkP6h9d4VpOGbUAKXHm8RD#$Bg0MNWQ%&@"
+  Raster raster = createRaster(ctx, screen, kRows, kCols, 0.0, 1.0,
+                               " .`'^-+=*x17X$8#%@");
 
   auto start = std::chrono::high_resolution_clock::now();
   std::chrono::duration<float> elapsed;
@@ -101,8 +87,11 @@ int main() {
   printf("\033[2J\033[H");
   size_t framesPerLoad = 20;
   size_t frame = 0;
+  // Reloaded kernels compile in the background, the current kernel keeps
+  // rendering until the new one is ready
+  std::future<Kernel> nextKernel;
   while (true) {
-    if (frame % framesPerLoad == 0) { 
+    if (frame % framesPerLoad == 0 && !nextKernel.valid()) {
       loadKernelCode("shader.wgsl", codeString);
       if (codeString != shader.data) {
         // TODO(avh): Use a better way to avoid write/read race conditions
@@ -110,13 +99,21 @@ int main() {
         std::this_thread::sleep_for(std::chrono::milliseconds(20));
         loadKernelCode("shader.wgsl", codeString);
         shader = {codeString.c_str(), Shape{16, 16, 1}};
-        renderKernel =
-            createKernel(ctx, shader, Bindings{screen},
-                         cdiv({kCols, kRows, 1}, shader.workgroupSize), params);
+        nextKernel = createKernelAsync(
+            ctx, shader, Bindings{screen},
+            cdiv({kCols, kRows, 1}, shader.workgroupSize), params);
+      }
+      frame = 0;
+    }
+    if (nextKernel.valid() &&
+        waitFor(ctx, nextKernel, std::chrono::nanoseconds(0))) {
+      Kernel kernel = nextKernel.get();
+      // Keep the current kernel if the new shader failed to compile
+      if (kernel.computePipeline) {
+        renderKernel = std::move(kernel);
         ticks++;
         start = std::chrono::high_resolution_clock::now();
       }
-      frame = 0;
     }
     params.time = getCurrentTimeInMilliseconds(start);
     toGPU(ctx, params, renderKernel);
@@ -124,15 +121,16 @@ int main() {
     std::promise<void> promise;
     std::future<void> future = promise.get_future();
     dispatchKernel(ctx, renderKernel, promise);
-    wait(ctx, future);
+    // Record the next frame's command buffer while the GPU is busy
     resetCommandBuffer(ctx.device, renderKernel);
-    toCPU(ctx, screen, screenArr);
-    rasterize<kRows, kCols>(screenArr, raster);
+    // Only the characters which changed since the last frame are read back
+    updateRaster(ctx, raster);
+    wait(ctx, future);
     auto frameEnd = std::chrono::high_resolution_clock::now();
     std::chrono::duration<float> frameElapsed = frameEnd - frameStart;
     elapsed = frameEnd - start;
     std::this_thread::sleep_for(std::chrono::milliseconds(10) - frameElapsed);
-    printf("\033[H%s\nRender loop running (full screen recommended) ...\nEdit and save shader.wgsl to see changes here.\nReloaded shader.wgsl %zu times\n", raster.data(), ticks);
+    printf("\033[H%s\nRender loop running (full screen recommended) ...\nEdit and save shader.wgsl to see changes here.\nReloaded shader.wgsl %zu times\n", raster.screen.c_str(), ticks);
     fflush(stdout);
   }
 
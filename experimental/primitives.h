@@ -0,0 +1,746 @@
+/*
+ * primitives.h
+ *
+ * This file contains reusable parallel primitives built on createKernel and
+ * CommandBatch: multi-pass reductions (sum, max, argmax), prefix scans, LSD
+ * radix sort of u32 key / value pairs and top-k selection.
+ *
+ * Each primitive is created once for an input, which compiles its kernels and
+ * records them into a CommandBatch, and can then be run repeatedly on new
+ * contents of the input. The kernels of a primitive are also exposed as a list
+ * of BatchOps, so primitives can be recorded into larger batches.
+ *
+ * Sizes are limited by the maximum 1D dispatch of the default limits (65535
+ * workgroups), i.e. 65535 * kScanBlock elements for reductions and scans and
+ * 65535 * kSortBlock elements for sorts and top-k.
+ *
+ */
+
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+#include <future>
+#include <string>
+#include <vector>
+
+#include "gpu.h"
+#include "utils/logging.h" // LOG
+
+namespace gpu {
+
+// Threads per workgroup and elements per thread of the reduce and scan kernels
+static constexpr size_t kScanThreads = 256;
+static constexpr size_t kScanItems = 4;
+static constexpr size_t kScanBlock = kScanThreads * kScanItems;
+
+// Elements per workgroup of the radix sort kernels, one per thread
+static constexpr size_t kSortBlock = 256;
+static constexpr size_t kSortBits = 4; // bits sorted per pass
+
+/* Reduction of blocks of THREADS * ITEMS elements to one (value, index) item
+ * each. The first pass reads the input values and their positions, later
+ * passes the items of the previous pass. {{combine}} is the body of the
+ * reduction operator, {{workgroupReduce}} the reduction of the items of the
+ * threads of a workgroup, either through workgroup memory or subgroups.
+ */
+static const char *kShaderReduce = R"(
+{{enable}}
+struct Item {
+  v: f32,
+  i: u32,
+};
+const N: u32 = {{N}};
+const THREADS: u32 = {{threads}};
+const ITEMS: u32 = {{items}};
+const FIRST: bool = {{first}};
+@group(0) @binding(0) var<storage, read_write> inVals: array<f32>;
+@group(0) @binding(1) var<storage, read_write> inIdx: array<u32>;
+@group(0) @binding(2) var<storage, read_write> outVals: array<f32>;
+@group(0) @binding(3) var<storage, read_write> outIdx: array<u32>;
+var<workgroup> vals: array<f32, THREADS>;
+var<workgroup> idxs: array<u32, THREADS>;
+var<workgroup> numPartials: atomic<u32>;
+fn combine(a: Item, b: Item) -> Item {
+  {{combine}}
+}
+fn load(i: u32) -> Item {
+  if (FIRST) {
+    return Item(inVals[i], i);
+  }
+  return Item(inVals[i], inIdx[i]);
+}
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_index) t: u32,
+    {{builtins}}
+    @builtin(workgroup_id) gid: vec3<u32>) {
+  var acc = Item({{identity}}, 0xffffffffu);
+  let base = gid.x * THREADS * ITEMS;
+  for (var k = 0u; k < ITEMS; k++) {
+    let i = base + k * THREADS + t;
+    if (i < N) {
+      acc = combine(acc, load(i));
+    }
+  }
+  {{workgroupReduce}}
+}
+)";
+
+// Tree reduction of the items of a workgroup through workgroup memory
+static const char *kReduceWorkgroup = R"(
+  vals[t] = acc.v;
+  idxs[t] = acc.i;
+  workgroupBarrier();
+  for (var s = THREADS / 2u; s > 0u; s >>= 1u) {
+    if (t < s) {
+      let r = combine(Item(vals[t], idxs[t]), Item(vals[t + s], idxs[t + s]));
+      vals[t] = r.v;
+      idxs[t] = r.i;
+    }
+    workgroupBarrier();
+  }
+  if (t == 0u) {
+    outVals[gid.x] = vals[0];
+    outIdx[gid.x] = idxs[0];
+  }
+)";
+
+// Reduction within each subgroup, then of the subgroup partials. Subgroups
+// are not guaranteed to be laid out linearly in the workgroup, so each one
+// claims a slot for its partial.
+static const char *kReduceSubgroup = R"(
+  {{subgroupReduce}}
+  if (sgid == 0u) {
+    let slot = atomicAdd(&numPartials, 1u);
+    vals[slot] = r.v;
+    idxs[slot] = r.i;
+  }
+  workgroupBarrier();
+  if (t == 0u) {
+    var res = Item(vals[0], idxs[0]);
+    let count = atomicLoad(&numPartials);
+    for (var k = 1u; k < count; k++) {
+      res = combine(res, Item(vals[k], idxs[k]));
+    }
+    outVals[gid.x] = res.v;
+    outIdx[gid.x] = res.i;
+  }
+)";
+
+/* Scan of blocks of THREADS * ITEMS elements. Each thread scans ITEMS
+ * consecutive elements, the thread totals are scanned in workgroup memory and
+ * the total of each block is written to sums, to be scanned and added back by
+ * the next level.
+ */
+static const char *kShaderScanBlocks = R"(
+const N: u32 = {{N}};
+const THREADS: u32 = {{threads}};
+const ITEMS: u32 = {{items}};
+const INCLUSIVE: bool = {{inclusive}};
+@group(0) @binding(0) var<storage, read_write> input: array<{{T}}>;
+@group(0) @binding(1) var<storage, read_write> output: array<{{T}}>;
+@group(0) @binding(2) var<storage, read_write> sums: array<{{T}}>;
+var<workgroup> totals: array<{{T}}, THREADS>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_index) t: u32,
+    @builtin(workgroup_id) gid: vec3<u32>) {
+  let base = gid.x * THREADS * ITEMS + t * ITEMS;
+  var partial: array<{{T}}, ITEMS>;
+  var total: {{T}} = {{T}}(0);
+  for (var k = 0u; k < ITEMS; k++) {
+    var x: {{T}} = {{T}}(0);
+    if (base + k < N) {
+      x = input[base + k];
+    }
+    if (INCLUSIVE) {
+      total += x;
+      partial[k] = total;
+    } else {
+      partial[k] = total;
+      total += x;
+    }
+  }
+  totals[t] = total;
+  workgroupBarrier();
+  for (var offset = 1u; offset < THREADS; offset <<= 1u) {
+    var v = totals[t];
+    if (t >= offset) {
+      v += totals[t - offset];
+    }
+    workgroupBarrier();
+    totals[t] = v;
+    workgroupBarrier();
+  }
+  var prefix: {{T}} = {{T}}(0);
+  if (t > 0u) {
+    prefix = totals[t - 1u];
+  }
+  for (var k = 0u; k < ITEMS; k++) {
+    if (base + k < N) {
+      output[base + k] = prefix + partial[k];
+    }
+  }
+  if (t == THREADS - 1u) {
+    sums[gid.x] = totals[t];
+  }
+}
+)";
+
+// Adds the scanned block totals of the next level to each block
+static const char *kShaderScanAdd = R"(
+const N: u32 = {{N}};
+const THREADS: u32 = {{threads}};
+const ITEMS: u32 = {{items}};
+@group(0) @binding(0) var<storage, read_write> output: array<{{T}}>;
+@group(0) @binding(1) var<storage, read_write> offsets: array<{{T}}>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_index) t: u32,
+    @builtin(workgroup_id) gid: vec3<u32>) {
+  let offset = offsets[gid.x];
+  for (var k = 0u; k < ITEMS; k++) {
+    let i = gid.x * THREADS * ITEMS + k * THREADS + t;
+    if (i < N) {
+      output[i] += offset;
+    }
+  }
+}
+)";
+
+/* Digit counts of each block of one radix sort pass, stored digit-major
+ * (hist[digit * NUM_BLOCKS + block]) so that an exclusive scan of hist gives
+ * the output offset of each digit of each block.
+ */
+static const char *kShaderRadixHistogram = R"(
+const N: u32 = {{N}};
+const NUM_BLOCKS: u32 = {{numBlocks}};
+const THREADS: u32 = {{threads}};
+const RADIX: u32 = {{radix}};
+override SHIFT: u32 = 0u;
+@group(0) @binding(0) var<storage, read_write> keys: array<u32>;
+@group(0) @binding(1) var<storage, read_write> hist: array<u32>;
+var<workgroup> counts: array<atomic<u32>, RADIX>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_index) t: u32,
+    @builtin(workgroup_id) gid: vec3<u32>) {
+  let i = gid.x * THREADS + t;
+  if (i < N) {
+    atomicAdd(&counts[(keys[i] >> SHIFT) & (RADIX - 1u)], 1u);
+  }
+  workgroupBarrier();
+  if (t < RADIX) {
+    hist[t * NUM_BLOCKS + gid.x] = atomicLoad(&counts[t]);
+  }
+}
+)";
+
+/* Stable scatter of one radix sort pass. The rank of each key among the keys
+ * of its block with the same digit comes from an inclusive scan of one-hot
+ * digit counters, packed as 16 bit lanes into 8 words per thread.
+ */
+static const char *kShaderRadixScatter = R"(
+const N: u32 = {{N}};
+const NUM_BLOCKS: u32 = {{numBlocks}};
+const THREADS: u32 = {{threads}};
+const RADIX: u32 = {{radix}};
+override SHIFT: u32 = 0u;
+@group(0) @binding(0) var<storage, read_write> keysIn: array<u32>;
+@group(0) @binding(1) var<storage, read_write> valuesIn: array<u32>;
+@group(0) @binding(2) var<storage, read_write> offsets: array<u32>;
+@group(0) @binding(3) var<storage, read_write> keysOut: array<u32>;
+@group(0) @binding(4) var<storage, read_write> valuesOut: array<u32>;
+var<workgroup> counts: array<array<u32, RADIX / 2>, THREADS>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_index) t: u32,
+    @builtin(workgroup_id) gid: vec3<u32>) {
+  let i = gid.x * THREADS + t;
+  let valid = i < N;
+  var key = 0u;
+  var value = 0u;
+  if (valid) {
+    key = keysIn[i];
+    value = valuesIn[i];
+  }
+  let digit = (key >> SHIFT) & (RADIX - 1u);
+  let word = digit / 2u;
+  let lane = 16u * (digit % 2u);
+  var c: array<u32, RADIX / 2>;
+  if (valid) {
+    c[word] = 1u << lane;
+  }
+  counts[t] = c;
+  workgroupBarrier();
+  for (var offset = 1u; offset < THREADS; offset <<= 1u) {
+    var v = counts[t];
+    if (t >= offset) {
+      var o = counts[t - offset];
+      for (var w = 0u; w < RADIX / 2u; w++) {
+        v[w] += o[w];
+      }
+    }
+    workgroupBarrier();
+    counts[t] = v;
+    workgroupBarrier();
+  }
+  if (valid) {
+    let rank = ((counts[t][word] >> lane) & 0xffffu) - 1u;
+    let dst = offsets[digit * NUM_BLOCKS + gid.x] + rank;
+    keysOut[dst] = key;
+    valuesOut[dst] = value;
+  }
+}
+)";
+
+/* Maps scores to u32 keys whose ascending order is the descending order of
+ * the scores, paired with their indices.
+ */
+static const char *kShaderTopKPrepare = R"(
+const N: u32 = {{N}};
+@group(0) @binding(0) var<storage, read_write> scores: array<f32>;
+@group(0) @binding(1) var<storage, read_write> keys: array<u32>;
+@group(0) @binding(2) var<storage, read_write> indices: array<u32>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) id: vec3<u32>) {
+  let i = id.x;
+  if (i < N) {
+    let u = bitcast<u32>(scores[i]);
+    var sortable = u | 0x80000000u;
+    if ((u & 0x80000000u) != 0u) {
+      sortable = ~u;
+    }
+    keys[i] = ~sortable;
+    indices[i] = i;
+  }
+}
+)";
+
+/* Decodes the first K sorted keys back to scores.
+ */
+static const char *kShaderTopKGather = R"(
+const K: u32 = {{K}};
+@group(0) @binding(0) var<storage, read_write> keys: array<u32>;
+@group(0) @binding(1) var<storage, read_write> indices: array<u32>;
+@group(0) @binding(2) var<storage, read_write> topValues: array<f32>;
+@group(0) @binding(3) var<storage, read_write> topIndices: array<u32>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) id: vec3<u32>) {
+  let i = id.x;
+  if (i < K) {
+    let sortable = ~keys[i];
+    var u = ~sortable;
+    if ((sortable & 0x80000000u) != 0u) {
+      u = sortable & 0x7fffffffu;
+    }
+    topValues[i] = bitcast<f32>(u);
+    topIndices[i] = indices[i];
+  }
+}
+)";
+
+/**
+ * @brief Dispatches a primitive's CommandBatch, waits for it to finish and
+ * re-records it for the next run.
+ */
+inline void runBatch(Context &ctx, CommandBatch &batch) {
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchBatch(ctx, batch, promise);
+  wait(ctx, future);
+  resetCommandBuffer(ctx.device, batch);
+}
+
+/**
+ * @brief Builds the list of BatchOps dispatching kernels in order. The
+ * kernels must not move while the ops are in use.
+ */
+inline std::vector<BatchOp> batchOps(const std::vector<Kernel> &kernels) {
+  return std::vector<BatchOp>(kernels.begin(), kernels.end());
+}
+
+enum ReduceOp { kReduceSum, kReduceMax, kReduceArgmax };
+
+/**
+ * @brief Multi-pass reduction of a kf32 tensor to a single value, and for
+ * kReduceArgmax the (lowest) index of the maximum.
+ *
+ * Each pass reduces blocks of kScanBlock items to one, until one item is
+ * left in result (and resultIndex).
+ */
+struct Reduction {
+  ReduceOp op;
+  size_t n;
+  Tensor result;                // {1} kf32
+  Tensor resultIndex;           // {1} ku32, only meaningful for kReduceArgmax
+  std::vector<Tensor> values;   // partial values of each pass
+  std::vector<Tensor> indices;  // partial indices of each pass
+  std::vector<Kernel> kernels;  // one per pass
+  std::vector<BatchOp> ops;
+  CommandBatch batch;
+};
+
+/**
+ * @brief Factory function to create a reduction of a kf32 tensor.
+ * @param[in] ctx Context instance to manage the reduction
+ * @param[in] input Tensor to reduce, all size(input.shape) elements are
+ * reduced
+ * @param[in] op Reduction operator
+ * @return Reduction instance, run with runReduction()
+ *
+ * @code
+ * Reduction sum = createReduction(ctx, input, kReduceSum);
+ * runReduction(ctx, sum);
+ * toCPU(ctx, sum.result, &total, sizeof(float));
+ * @endcode
+ */
+inline Reduction createReduction(Context &ctx, const Tensor &input,
+                                 ReduceOp op) {
+  check(input.dtype == kf32, "Reductions take kf32 tensors", __FILE__,
+        __LINE__);
+  Reduction reduction;
+  reduction.op = op;
+  reduction.n = size(input.shape);
+  bool subgroups = supportsSubgroups(ctx);
+  std::string combine, identity, subgroupReduce;
+  if (op == kReduceSum) {
+    combine = "return Item(a.v + b.v, 0u);";
+    identity = "0.0";
+    subgroupReduce = "let r = Item(subgroupAdd(acc.v), 0u);";
+  } else if (op == kReduceMax) {
+    combine = "return Item(max(a.v, b.v), 0u);";
+    identity = "bitcast<f32>(0xff7fffffu)";
+    subgroupReduce = "let r = Item(subgroupMax(acc.v), 0u);";
+  } else {
+    combine = "if (b.v > a.v || (b.v == a.v && b.i < a.i)) { return b; }\n"
+              "  return a;";
+    identity = "bitcast<f32>(0xff7fffffu)";
+    subgroupReduce =
+        "let m = subgroupMax(acc.v);\n"
+        "  let r = Item(m, subgroupMin(select(0xffffffffu, acc.i, "
+        "acc.v == m)));";
+  }
+  std::string workgroupReduce(subgroups ? kReduceSubgroup : kReduceWorkgroup);
+  replaceAll(workgroupReduce, "{{subgroupReduce}}", subgroupReduce);
+  // The first pass has no input indices, bind a placeholder
+  Tensor inVals = input;
+  Tensor inIdx = createTensor(ctx, Shape{1}, ku32);
+  size_t n = reduction.n;
+  do {
+    size_t numBlocks = cdiv(n, kScanBlock);
+    Tensor outVals = createTensor(ctx, Shape{numBlocks}, kf32);
+    Tensor outIdx = createTensor(ctx, Shape{numBlocks}, ku32);
+    std::string code(kShaderReduce);
+    replaceAll(code,
+               {{"{{workgroupReduce}}", workgroupReduce},
+                {"{{enable}}",
+                 subgroups ? "enable chromium_experimental_subgroups;" : ""},
+                {"{{builtins}}",
+                 subgroups ? "@builtin(subgroup_invocation_id) sgid: u32,"
+                           : ""},
+                {"{{combine}}", combine},
+                {"{{identity}}", identity},
+                {"{{N}}", std::to_string(n)},
+                {"{{threads}}", std::to_string(kScanThreads)},
+                {"{{items}}", std::to_string(kScanItems)},
+                {"{{first}}", reduction.kernels.empty() ? "true" : "false"}});
+    KernelCode kernelCode{code, Shape{kScanThreads, 1, 1}, kf32};
+    kernelCode.label = "reduce";
+    reduction.kernels.push_back(
+        createKernel(ctx, kernelCode, Bindings{inVals, inIdx, outVals, outIdx},
+                     /* nWorkgroups */ {numBlocks, 1, 1}));
+    reduction.values.push_back(outVals);
+    reduction.indices.push_back(outIdx);
+    inVals = outVals;
+    inIdx = outIdx;
+    n = numBlocks;
+  } while (n > 1);
+  reduction.result = reduction.values.back();
+  reduction.resultIndex = reduction.indices.back();
+  reduction.ops = batchOps(reduction.kernels);
+  reduction.batch = createCommandBatch(ctx, reduction.ops);
+  return reduction;
+}
+
+/**
+ * @brief Runs a reduction on the current contents of its input and waits for
+ * the result.
+ */
+inline void runReduction(Context &ctx, Reduction &reduction) {
+  runBatch(ctx, reduction.batch);
+}
+
+/**
+ * @brief Prefix sum of a kf32, ki32 or ku32 tensor.
+ *
+ * The input is scanned in blocks of kScanBlock elements, the block totals are
+ * scanned recursively by the next level and added back to the blocks
+ * (reduce-then-scan). total holds the sum of all elements once the scan ran.
+ */
+struct PrefixScan {
+  size_t n;
+  bool inclusive;
+  Tensor output;
+  Tensor total;                 // {1}, sum of all elements
+  std::vector<Tensor> sums;     // block totals of each level
+  std::vector<Tensor> scanned;  // scanned block totals of each level
+  std::vector<Kernel> kernels;  // in dispatch order
+  std::vector<BatchOp> ops;
+  CommandBatch batch;
+};
+
+/**
+ * @brief Appends the kernels scanning n elements of input into output to
+ * scan, recursing over the block totals.
+ */
+inline void addScanKernels(Context &ctx, PrefixScan &scan, const Tensor &input,
+                           const Tensor &output, size_t n, bool inclusive) {
+  NumType dtype = input.dtype;
+  size_t numBlocks = cdiv(n, kScanBlock);
+  Tensor sums = createTensor(ctx, Shape{numBlocks}, dtype);
+  scan.sums.push_back(sums);
+  std::vector<std::pair<std::string, std::string>> reps = {
+      {"{{T}}", toString(dtype)},
+      {"{{N}}", std::to_string(n)},
+      {"{{threads}}", std::to_string(kScanThreads)},
+      {"{{items}}", std::to_string(kScanItems)},
+      {"{{inclusive}}", inclusive ? "true" : "false"}};
+  std::string code(kShaderScanBlocks);
+  replaceAll(code, reps);
+  KernelCode scanCode{code, Shape{kScanThreads, 1, 1}, kf32};
+  scanCode.label = "scan";
+  scan.kernels.push_back(createKernel(ctx, scanCode,
+                                      Bindings{input, output, sums},
+                                      /* nWorkgroups */ {numBlocks, 1, 1}));
+  if (numBlocks == 1) {
+    scan.total = sums;
+    return;
+  }
+  // Block offsets are always exclusive
+  Tensor scanned = createTensor(ctx, Shape{numBlocks}, dtype);
+  scan.scanned.push_back(scanned);
+  addScanKernels(ctx, scan, sums, scanned, numBlocks, false);
+  std::string addCode(kShaderScanAdd);
+  replaceAll(addCode, reps);
+  KernelCode addKernelCode{addCode, Shape{kScanThreads, 1, 1}, kf32};
+  addKernelCode.label = "scan_add";
+  scan.kernels.push_back(createKernel(ctx, addKernelCode,
+                                      Bindings{output, scanned},
+                                      /* nWorkgroups */ {numBlocks, 1, 1}));
+}
+
+/**
+ * @brief Factory function to create a prefix scan of a tensor.
+ * @param[in] ctx Context instance to manage the scan
+ * @param[in] input Tensor to scan (kf32, ki32 or ku32)
+ * @param[in] output Tensor of the same type and size as input, must not be
+ * input
+ * @param[in] inclusive If true, output[i] includes input[i]
+ * @return PrefixScan instance, run with runPrefixScan()
+ *
+ * @code
+ * PrefixScan offsets = createPrefixScan(ctx, counts, offsets);
+ * runPrefixScan(ctx, offsets);
+ * @endcode
+ */
+inline PrefixScan createPrefixScan(Context &ctx, const Tensor &input,
+                                   const Tensor &output,
+                                   bool inclusive = false) {
+  check(input.dtype == kf32 || input.dtype == ki32 || input.dtype == ku32,
+        "Scans take kf32, ki32 or ku32 tensors", __FILE__, __LINE__);
+  assert(input.dtype == output.dtype &&
+         size(input.shape) == size(output.shape));
+  PrefixScan scan;
+  scan.n = size(input.shape);
+  scan.inclusive = inclusive;
+  scan.output = output;
+  addScanKernels(ctx, scan, input, output, scan.n, inclusive);
+  scan.ops = batchOps(scan.kernels);
+  scan.batch = createCommandBatch(ctx, scan.ops);
+  return scan;
+}
+
+/**
+ * @brief Runs a scan on the current contents of its input and waits for the
+ * result.
+ */
+inline void runPrefixScan(Context &ctx, PrefixScan &scan) {
+  runBatch(ctx, scan.batch);
+}
+
+/**
+ * @brief Stable LSD radix sort of u32 keys, with u32 values moved along.
+ *
+ * Each of the 32 / kSortBits passes counts the digits of each block, scans
+ * the counts into output offsets and scatters the keys and values to a
+ * second pair of buffers, the passes alternate between the two pairs. The
+ * number of passes is even, so the sorted keys and values end up in the
+ * input tensors.
+ */
+struct RadixSort {
+  size_t n;
+  Tensor keys;
+  Tensor values;
+  Tensor tempKeys;
+  Tensor tempValues;
+  Tensor hist;       // {kRadix * numBlocks} digit counts
+  Tensor offsets;    // exclusive scan of hist
+  PrefixScan scan;   // hist -> offsets, its kernels run in every pass
+  std::vector<Kernel> histograms; // one per pass
+  std::vector<Kernel> scatters;   // one per pass
+  std::vector<BatchOp> ops;
+  CommandBatch batch;
+};
+
+/**
+ * @brief Factory function to create a radix sort of key / value pairs.
+ * @param[in] ctx Context instance to manage the sort
+ * @param[in] keys ku32 tensor of keys, sorted in place
+ * @param[in] values ku32 tensor of values of the same size, permuted along
+ * with the keys
+ * @return RadixSort instance, run with runRadixSort()
+ *
+ * @code
+ * RadixSort sort = createRadixSort(ctx, keys, values);
+ * runRadixSort(ctx, sort);
+ * @endcode
+ */
+inline RadixSort createRadixSort(Context &ctx, const Tensor &keys,
+                                 const Tensor &values) {
+  static constexpr size_t kRadix = 1 << kSortBits;
+  static_assert(32 % (2 * kSortBits) == 0, "Even number of passes");
+  check(keys.dtype == ku32 && values.dtype == ku32,
+        "Radix sort takes ku32 keys and values", __FILE__, __LINE__);
+  RadixSort sort;
+  sort.n = size(keys.shape);
+  assert(size(values.shape) == sort.n);
+  size_t numBlocks = cdiv(sort.n, kSortBlock);
+  sort.keys = keys;
+  sort.values = values;
+  sort.tempKeys = createTensor(ctx, Shape{sort.n}, ku32);
+  sort.tempValues = createTensor(ctx, Shape{sort.n}, ku32);
+  sort.hist = createTensor(ctx, Shape{kRadix * numBlocks}, ku32);
+  sort.offsets = createTensor(ctx, Shape{kRadix * numBlocks}, ku32);
+  sort.scan = createPrefixScan(ctx, sort.hist, sort.offsets);
+  std::vector<std::pair<std::string, std::string>> reps = {
+      {"{{N}}", std::to_string(sort.n)},
+      {"{{numBlocks}}", std::to_string(numBlocks)},
+      {"{{threads}}", std::to_string(kSortBlock)},
+      {"{{radix}}", std::to_string(kRadix)}};
+  std::string histogramCode(kShaderRadixHistogram);
+  std::string scatterCode(kShaderRadixScatter);
+  replaceAll(histogramCode, reps);
+  replaceAll(scatterCode, reps);
+  const Tensor *src[2] = {&sort.keys, &sort.tempKeys};
+  const Tensor *srcValues[2] = {&sort.values, &sort.tempValues};
+  for (size_t pass = 0; pass < 32 / kSortBits; ++pass) {
+    size_t in = pass % 2, out = 1 - in;
+    // The passes share their source and only differ in the digit shift
+    KernelCode histogram{histogramCode, Shape{kSortBlock, 1, 1}, kf32};
+    histogram.label = "radix_histogram";
+    histogram.constants = {{"SHIFT", static_cast<double>(pass * kSortBits)}};
+    KernelCode scatter{scatterCode, Shape{kSortBlock, 1, 1}, kf32};
+    scatter.label = "radix_scatter";
+    scatter.constants = histogram.constants;
+    sort.histograms.push_back(
+        createKernel(ctx, histogram, Bindings{*src[in], sort.hist},
+                     /* nWorkgroups */ {numBlocks, 1, 1}));
+    sort.scatters.push_back(createKernel(
+        ctx, scatter,
+        Bindings{*src[in], *srcValues[in], sort.offsets, *src[out],
+                 *srcValues[out]},
+        /* nWorkgroups */ {numBlocks, 1, 1}));
+  }
+  for (size_t pass = 0; pass < sort.histograms.size(); ++pass) {
+    sort.ops.push_back(sort.histograms[pass]);
+    sort.ops.insert(sort.ops.end(), sort.scan.ops.begin(),
+                    sort.scan.ops.end());
+    sort.ops.push_back(sort.scatters[pass]);
+  }
+  sort.batch = createCommandBatch(ctx, sort.ops);
+  return sort;
+}
+
+/**
+ * @brief Sorts the current contents of the keys and values of a RadixSort
+ * and waits for the result.
+ */
+inline void runRadixSort(Context &ctx, RadixSort &sort) {
+  runBatch(ctx, sort.batch);
+}
+
+/**
+ * @brief Selection of the k largest scores of a kf32 tensor and their
+ * indices, in descending order of the scores, ties in ascending order of the
+ * indices (e.g. for top-k sampling).
+ *
+ * The scores are mapped to order preserving u32 keys and radix sorted along
+ * with their indices, and the first k are gathered into values and indices.
+ */
+struct TopK {
+  size_t k;
+  size_t n;
+  Tensor values;       // {k} kf32
+  Tensor indices;      // {k} ku32
+  Tensor keys;         // {n} ku32 sort keys of the scores
+  Tensor sortIndices;  // {n} ku32
+  RadixSort sort;
+  std::vector<Kernel> kernels; // prepare and gather, around the sort
+  std::vector<BatchOp> ops;
+  CommandBatch batch;
+};
+
+/**
+ * @brief Factory function to create a top-k selection.
+ * @param[in] ctx Context instance to manage the selection
+ * @param[in] scores kf32 tensor of scores
+ * @param[in] k Number of scores to select, at most size(scores.shape)
+ * @return TopK instance, run with runTopK()
+ *
+ * @code
+ * TopK top = createTopK(ctx, logits, 40);
+ * runTopK(ctx, top);
+ * toCPU(ctx, top.indices, tokens.data(), 40 * sizeof(uint32_t));
+ * @endcode
+ */
+inline TopK createTopK(Context &ctx, const Tensor &scores, size_t k) {
+  static constexpr size_t kThreads = 256;
+  check(scores.dtype == kf32, "Top-k takes kf32 scores", __FILE__, __LINE__);
+  TopK top;
+  top.k = k;
+  top.n = size(scores.shape);
+  assert(k > 0 && k <= top.n);
+  top.values = createTensor(ctx, Shape{k}, kf32);
+  top.indices = createTensor(ctx, Shape{k}, ku32);
+  top.keys = createTensor(ctx, Shape{top.n}, ku32);
+  top.sortIndices = createTensor(ctx, Shape{top.n}, ku32);
+  std::string prepareCode(kShaderTopKPrepare);
+  replaceAll(prepareCode, "{{N}}", std::to_string(top.n));
+  top.kernels.push_back(createKernel(
+      ctx, KernelCode{prepareCode, kThreads, kf32},
+      Bindings{scores, top.keys, top.sortIndices},
+      /* nWorkgroups */ {cdiv(top.n, kThreads), 1, 1}));
+  top.sort = createRadixSort(ctx, top.keys, top.sortIndices);
+  std::string gatherCode(kShaderTopKGather);
+  replaceAll(gatherCode, "{{K}}", std::to_string(k));
+  top.kernels.push_back(createKernel(
+      ctx, KernelCode{gatherCode, kThreads, kf32},
+      Bindings{top.keys, top.sortIndices, top.values, top.indices},
+      /* nWorkgroups */ {cdiv(k, kThreads), 1, 1}));
+  top.ops.push_back(top.kernels[0]);
+  top.ops.insert(top.ops.end(), top.sort.ops.begin(), top.sort.ops.end());
+  top.ops.push_back(top.kernels[1]);
+  top.batch = createCommandBatch(ctx, top.ops);
+  return top;
+}
+
+/**
+ * @brief Selects the top-k of the current contents of the scores and waits
+ * for the result.
+ */
+inline void runTopK(Context &ctx, TopK &top) { runBatch(ctx, top.batch); }
+
+} // namespace gpu
+
+#endif // PRIMITIVES_H
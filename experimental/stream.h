@@ -0,0 +1,411 @@
+/*
+ * stream.h
+ *
+ * This file contains a double-buffered streaming pipeline for processing
+ * data which does not fit into GPU memory (or host memory) at once. The input
+ * is split into chunks which are written into mapped staging buffers, copied
+ * to the GPU, processed by a kernel and copied back through mapped readback
+ * buffers. With several chunks in flight, reading and uploading chunk N + 1
+ * overlaps with the kernel running on chunk N and the readback of chunk N - 1.
+ *
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gpu.h"
+#include "utils/logging.h" // LOG
+
+namespace gpu {
+
+/**
+ * @brief Host side producer of the stream input. read copies size bytes
+ * starting at offset into dst and returns the number of bytes copied, which
+ * is only smaller than size at the end of the input.
+ */
+struct StreamSource {
+  size_t size; // total size in bytes
+  std::function<size_t(void *dst, size_t offset, size_t size)> read;
+};
+
+/**
+ * @brief Host side consumer of the stream output. write stores size bytes of
+ * src at offset and returns false on failure. Chunks are written in order.
+ */
+struct StreamSink {
+  std::function<bool(const void *src, size_t offset, size_t size)> write;
+};
+
+/**
+ * @brief Creates a StreamSource reading from host memory, which must remain
+ * valid while the stream runs.
+ */
+inline StreamSource streamFromMemory(const void *data, size_t size) {
+  const char *bytes = static_cast<const char *>(data);
+  return {size, [bytes, size](void *dst, size_t offset, size_t n) {
+            n = std::min(n, size - offset);
+            std::memcpy(dst, bytes + offset, n);
+            return n;
+          }};
+}
+
+/**
+ * @brief Creates a StreamSink writing to host memory of at least the size of
+ * the stream output.
+ */
+inline StreamSink streamToMemory(void *data) {
+  char *bytes = static_cast<char *>(data);
+  return {[bytes](const void *src, size_t offset, size_t n) {
+    std::memcpy(bytes + offset, src, n);
+    return true;
+  }};
+}
+
+/**
+ * @brief Creates a StreamSource reading a file sequentially, so that the
+ * file never has to be held in host memory as a whole.
+ * @param[in] path Path of the file to read
+ * @param[out] source StreamSource of the file contents
+ * @return true if the file could be opened
+ *
+ * @code
+ * StreamSource source;
+ * if (!streamFromFile("batches.bin", source)) { ... }
+ * @endcode
+ */
+inline bool streamFromFile(const std::string &path, StreamSource &source) {
+  std::shared_ptr<FILE> file(std::fopen(path.c_str(), "rb"),
+                             [](FILE *f) {
+                               if (f) {
+                                 std::fclose(f);
+                               }
+                             });
+  if (!file || std::fseek(file.get(), 0, SEEK_END) != 0) {
+    LOG(kDefLog, kError, "Could not open stream source %s", path.c_str());
+    return false;
+  }
+  long size = std::ftell(file.get());
+  std::rewind(file.get());
+  source.size = size > 0 ? static_cast<size_t>(size) : 0;
+  source.read = [file](void *dst, size_t offset, size_t n) {
+    // Chunks are read in order, seek only if the caller skipped ahead
+    if (static_cast<size_t>(std::ftell(file.get())) != offset) {
+      std::fseek(file.get(), static_cast<long>(offset), SEEK_SET);
+    }
+    return std::fread(dst, 1, n, file.get());
+  };
+  return true;
+}
+
+/**
+ * @brief Creates a StreamSink writing to a file, which is created or
+ * truncated.
+ * @param[in] path Path of the file to write
+ * @param[out] sink StreamSink writing to the file
+ * @return true if the file could be opened
+ */
+inline bool streamToFile(const std::string &path, StreamSink &sink) {
+  std::shared_ptr<FILE> file(std::fopen(path.c_str(), "wb"),
+                             [](FILE *f) {
+                               if (f) {
+                                 std::fclose(f);
+                               }
+                             });
+  if (!file) {
+    LOG(kDefLog, kError, "Could not open stream sink %s", path.c_str());
+    return false;
+  }
+  sink.write = [file](const void *src, size_t offset, size_t n) {
+    if (static_cast<size_t>(std::ftell(file.get())) != offset) {
+      std::fseek(file.get(), static_cast<long>(offset), SEEK_SET);
+    }
+    return std::fwrite(src, 1, n, file.get()) == n;
+  };
+  return true;
+}
+
+/**
+ * @brief Chunking of a stream. outputChunkSize is the size of the kernel
+ * output for one input chunk, eg. chunkSize for elementwise kernels. Both
+ * sizes must be multiples of 4 bytes.
+ */
+struct StreamConfig {
+  size_t chunkSize = 64 << 20;  // input bytes per chunk
+  size_t outputChunkSize = 0;   // output bytes per chunk, 0 for chunkSize
+  size_t buffersInFlight = 2;   // chunks being uploaded, processed, read back
+};
+
+/**
+ * @brief Creates the kernel processing one chunk, binding the input and
+ * output chunk tensors of a StreamSlot. Every slot gets its own kernel.
+ */
+using StreamKernelBuilder =
+    std::function<Kernel(Context &, const Tensor &input, const Tensor &output)>;
+
+/**
+ * @brief Buffers of one chunk in flight. upload (MapWrite) and download
+ * (MapRead) are staging buffers, input and output the storage buffers bound
+ * to the kernel. batch copies upload to input, dispatches the kernel and
+ * copies output to download in one submission.
+ */
+struct StreamSlot {
+  Tensor upload;   // mapped between uses, written by the host
+  Tensor input;
+  Tensor output;
+  Tensor download; // mapped after the batch completes, read by the host
+  Kernel kernel;
+  CommandBatch batch;
+  std::promise<void> done; // fulfilled when the batch completes
+  std::future<void> doneFuture;
+  std::future<void> uploadMapped;
+  std::future<void> downloadMapped;
+  size_t chunk = 0;     // index of the chunk in flight
+  bool busy = false;    // chunk submitted and not yet drained
+};
+
+/**
+ * @brief Streaming pipeline of StreamConfig::buffersInFlight slots, created
+ * with createStreamPipeline() and run with runStream().
+ *
+ * Staging buffers are owned by the pipeline and released in its destructor,
+ * the chunk tensors belong to the Context's TensorPool.
+ */
+struct StreamPipeline {
+  Context *ctx = nullptr; // non-owning
+  StreamConfig config;
+  std::vector<std::unique_ptr<StreamSlot>> slots;
+  StreamPipeline() = default;
+  StreamPipeline(StreamPipeline &&) = default;
+  StreamPipeline(const StreamPipeline &) = delete;
+  StreamPipeline &operator=(const StreamPipeline &) = delete;
+  ~StreamPipeline();
+};
+
+inline StreamPipeline::~StreamPipeline() {
+  for (std::unique_ptr<StreamSlot> &slot : slots) {
+    // runStream() drains all slots, so no maps are outstanding here
+    std::lock_guard<std::recursive_mutex> lock(*ctx->mutex);
+    untrackBuffer(ctx->telemetry, bufferClass(slot->upload.data.usage),
+                  slot->upload.data.size);
+    untrackBuffer(ctx->telemetry, bufferClass(slot->download.data.usage),
+                  slot->download.data.size);
+    wgpuBufferDestroy(slot->upload.data.buffer);
+    wgpuBufferRelease(slot->upload.data.buffer);
+    wgpuBufferDestroy(slot->download.data.buffer);
+    wgpuBufferRelease(slot->download.data.buffer);
+  }
+}
+
+/**
+ * @brief Creates a staging buffer of the given usage wrapped in a Tensor, so
+ * that it can be used as the source or destination of a BatchOp copy.
+ */
+inline Tensor createStagingTensor(Context &ctx, size_t size,
+                                  WGPUBufferUsageFlags usage,
+                                  bool mappedAtCreation) {
+  WGPUBufferDescriptor desc = {
+      .usage = usage,
+      .size = size,
+      .mappedAtCreation = mappedAtCreation,
+  };
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  WGPUBuffer buffer = wgpuDeviceCreateBuffer(ctx.device, &desc);
+  check(buffer, "Create staging buffer", __FILE__, __LINE__);
+  trackBuffer(ctx.telemetry, bufferClass(usage), size);
+  return Tensor{{buffer, usage, size}, Shape{size / sizeof(uint32_t)}, ku32};
+}
+
+/**
+ * @brief Maps a staging buffer asynchronously, the future is ready once the
+ * buffer is mapped. As with all WebGPU callbacks, use wait() to process
+ * events until then.
+ */
+inline std::future<void> mapStaging(Tensor &staging, WGPUMapModeFlags mode) {
+  auto *promise = new std::promise<void>();
+  std::future<void> future = promise->get_future();
+  wgpuBufferMapAsync(
+      staging.data.buffer, mode, 0, staging.data.size,
+      [](WGPUBufferMapAsyncStatus status, void *data) {
+        auto *promise = static_cast<std::promise<void> *>(data);
+        check(status == WGPUBufferMapAsyncStatus_Success, "Map staging buffer",
+              __FILE__, __LINE__);
+        promise->set_value();
+        delete promise;
+      },
+      promise);
+  return future;
+}
+
+/**
+ * @brief Factory function to create a StreamPipeline.
+ * @param[in] ctx Context instance to manage the pipeline
+ * @param[in] config Chunk sizes and number of chunks in flight
+ * @param[in] build Function creating the kernel of a slot
+ * @return StreamPipeline instance
+ *
+ * @code
+ * StreamPipeline pipeline = createStreamPipeline(ctx, {16 << 20},
+ *     [](Context &ctx, const Tensor &input, const Tensor &output) {
+ *       return createKernel(ctx, KernelCode(kGelu, 256, kf32),
+ *                           Bindings{input, output},
+ *                           {cdiv(input.data.size / sizeof(float), 256), 1, 1});
+ *     });
+ * @endcode
+ */
+inline StreamPipeline createStreamPipeline(Context &ctx, StreamConfig config,
+                                           const StreamKernelBuilder &build) {
+  if (config.outputChunkSize == 0) {
+    config.outputChunkSize = config.chunkSize;
+  }
+  check(config.chunkSize > 0 && config.chunkSize % 4 == 0 &&
+            config.outputChunkSize % 4 == 0,
+        "Stream chunk sizes must be positive multiples of 4 bytes", __FILE__,
+        __LINE__);
+  check(config.buffersInFlight > 0, "Stream needs at least one buffer",
+        __FILE__, __LINE__);
+  StreamPipeline pipeline;
+  pipeline.ctx = &ctx;
+  pipeline.config = config;
+  for (size_t i = 0; i < config.buffersInFlight; ++i) {
+    auto slot = std::make_unique<StreamSlot>();
+    slot->upload = createStagingTensor(
+        ctx, config.chunkSize, WGPUBufferUsage_MapWrite | WGPUBufferUsage_CopySrc,
+        /* mappedAtCreation */ true);
+    slot->download = createStagingTensor(
+        ctx, config.outputChunkSize,
+        WGPUBufferUsage_MapRead | WGPUBufferUsage_CopyDst,
+        /* mappedAtCreation */ false);
+    slot->input =
+        createTensor(ctx, Shape{config.chunkSize / sizeof(uint32_t)}, ku32);
+    slot->output = createTensor(
+        ctx, Shape{config.outputChunkSize / sizeof(uint32_t)}, ku32);
+    slot->kernel = build(ctx, slot->input, slot->output);
+    slot->batch = createCommandBatch(
+        ctx, {BatchOp{slot->upload, slot->input}, slot->kernel,
+              BatchOp{slot->output, slot->download}});
+    pipeline.slots.push_back(std::move(slot));
+  }
+  LOG(kDefLog, kInfo, "Created stream pipeline with %zu x %zu byte chunks",
+      config.buffersInFlight, config.chunkSize);
+  return pipeline;
+}
+
+/**
+ * @brief Waits for the chunk in flight on a slot, hands its output to the
+ * sink and maps the upload buffer for the next chunk.
+ */
+inline bool drainSlot(StreamPipeline &pipeline, StreamSlot &slot,
+                      const StreamSource &source, StreamSink &sink) {
+  Context &ctx = *pipeline.ctx;
+  const StreamConfig &config = pipeline.config;
+  wait(ctx, slot.doneFuture);
+  wait(ctx, slot.downloadMapped);
+  // Output of a partial last chunk is truncated in proportion to its input
+  size_t offset = slot.chunk * config.chunkSize;
+  size_t inputSize = std::min(config.chunkSize, source.size - offset);
+  size_t outputSize = inputSize == config.chunkSize
+                          ? config.outputChunkSize
+                          : inputSize * config.outputChunkSize /
+                                config.chunkSize;
+  const void *mapped = wgpuBufferGetConstMappedRange(
+      slot.download.data.buffer, 0, config.outputChunkSize);
+  check(mapped, "Get mapped range", __FILE__, __LINE__);
+  bool written =
+      sink.write(mapped, slot.chunk * config.outputChunkSize, outputSize);
+  wgpuBufferUnmap(slot.download.data.buffer);
+  wait(ctx, slot.uploadMapped);
+  slot.busy = false;
+  return written;
+}
+
+/**
+ * @brief Streams the source through the pipeline's kernel into the sink.
+ *
+ * For each chunk, the host reads the source directly into the mapped upload
+ * buffer of a free slot and submits the slot's batch, then moves on to the
+ * next slot without waiting, so that up to buffersInFlight chunks are being
+ * transferred or processed at the same time. Slots are drained in chunk order,
+ * which keeps the sink writes sequential. The last chunk is zero padded to the
+ * full chunk size and the kernel always processes whole chunks.
+ *
+ * @param[in] pipeline StreamPipeline instance
+ * @param[in] source Input of the stream
+ * @param[in] sink Output of the stream
+ * @return true if all chunks were read and written successfully
+ *
+ * @code
+ * runStream(pipeline, streamFromMemory(input, size),
+ *           streamToMemory(output));
+ * @endcode
+ */
+inline bool runStream(StreamPipeline &pipeline, const StreamSource &source,
+                      StreamSink sink) {
+  Context &ctx = *pipeline.ctx;
+  const StreamConfig &config = pipeline.config;
+  size_t numChunks = cdiv(source.size, config.chunkSize);
+  size_t numSlots = pipeline.slots.size();
+  bool ok = true;
+  for (size_t chunk = 0; chunk < numChunks && ok; ++chunk) {
+    StreamSlot &slot = *pipeline.slots[chunk % numSlots];
+    if (slot.busy) {
+      ok &= drainSlot(pipeline, slot, source, sink);
+    }
+    size_t offset = chunk * config.chunkSize;
+    size_t size = std::min(config.chunkSize, source.size - offset);
+    void *mapped =
+        wgpuBufferGetMappedRange(slot.upload.data.buffer, 0, config.chunkSize);
+    check(mapped, "Get mapped range", __FILE__, __LINE__);
+    size_t read = source.read(mapped, offset, size);
+    if (read != size) {
+      LOG(kDefLog, kError, "Stream source ended at %zu of %zu bytes",
+          offset + read, source.size);
+      ok = false;
+    }
+    std::memset(static_cast<char *>(mapped) + read, 0,
+                config.chunkSize - read);
+    wgpuBufferUnmap(slot.upload.data.buffer);
+
+    {
+      std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+      slot.done = std::promise<void>();
+      slot.doneFuture = slot.done.get_future();
+      dispatchBatch(ctx, slot.batch, slot.done);
+      resetCommandBuffer(ctx.device, slot.batch);
+      // Maps complete after the submitted batch, the host then writes the
+      // next chunk into upload while other slots keep the GPU busy
+      slot.downloadMapped = mapStaging(slot.download, WGPUMapMode_Read);
+      slot.uploadMapped = mapStaging(slot.upload, WGPUMapMode_Write);
+    }
+    slot.chunk = chunk;
+    slot.busy = true;
+  }
+  // Oldest chunk first. The loop may have stopped early on an error, so the
+  // order is taken from the chunks in flight rather than from numChunks
+  std::vector<StreamSlot *> busy;
+  for (std::unique_ptr<StreamSlot> &slot : pipeline.slots) {
+    if (slot->busy) {
+      busy.push_back(slot.get());
+    }
+  }
+  std::sort(busy.begin(), busy.end(),
+            [](const StreamSlot *a, const StreamSlot *b) {
+              return a->chunk < b->chunk;
+            });
+  for (StreamSlot *slot : busy) {
+    ok &= drainSlot(pipeline, *slot, source, sink);
+  }
+  return ok;
+}
+
+} // namespace gpu
+
+#endif // STREAM_H
@@ -0,0 +1,249 @@
+#ifndef KVCACHE_H
+#define KVCACHE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "gpu.h"
+#include "shaders.h" // kShaderPagedKVAppend, kShaderPagedAttention
+
+namespace gpu {
+
+/**
+ * @brief Marks an unused sequence slot, and padding entries in the token
+ * tables passed to the paged KV kernels.
+ */
+static constexpr uint32_t kNoSequence = 0xffffffffu;
+
+/**
+ * @brief Paged KV cache shared by several sequences.
+ *
+ * Keys and values live in two buffers of numBlocks fixed-size blocks of
+ * blockSize tokens each. Each sequence occupies a slot with a block table
+ * mapping its token positions to blocks, so sequences only hold the blocks
+ * they actually use and the blocks of a finished sequence are immediately
+ * available to others.
+ *
+ * Block tables are kept on the CPU and uploaded with syncBlockTables() before
+ * dispatching kernels which read them. New tokens are written by the
+ * kShaderPagedKVAppend kernel (createKVAppendKernel()) and read by
+ * kShaderPagedAttention (createPagedAttentionKernel()), both take a token
+ * table of (slot, position) pairs as built by appendTokens().
+ */
+struct PagedKVCache {
+  size_t nHeads;
+  size_t headSize;
+  size_t blockSize;            // tokens per block
+  size_t numBlocks;
+  size_t maxSequences;
+  size_t maxBlocksPerSequence; // maximum sequence length / blockSize
+  Tensor keys;                 // (numBlocks, blockSize, nHeads * headSize)
+  Tensor values;               // (numBlocks, blockSize, nHeads * headSize)
+  Tensor blockTables;          // (maxSequences, maxBlocksPerSequence) u32
+  std::vector<uint32_t> hostBlockTables;
+  std::vector<size_t> lengths;       // tokens of the sequence in each slot
+  std::vector<bool> active;          // whether a slot holds a sequence
+  std::vector<uint32_t> freeBlocks;  // stack of unused blocks
+  bool dirty = false;                // host block tables changed since sync
+};
+
+/**
+ * @brief Factory function to create a paged KV cache.
+ * @param[in] ctx Context instance to manage the cache buffers
+ * @param[in] nHeads Number of attention heads
+ * @param[in] headSize Channels per head
+ * @param[in] numBlocks Number of blocks shared by all sequences
+ * @param[in] blockSize Tokens per block
+ * @param[in] maxSequences Maximum number of concurrent sequences
+ * @param[in] maxBlocksPerSequence Maximum number of blocks of one sequence
+ * @return PagedKVCache instance
+ *
+ * @code
+ * PagedKVCache cache = createPagedKVCache(ctx, 12, 64, 1024, 16, 32, 64);
+ * @endcode
+ */
+inline PagedKVCache createPagedKVCache(Context &ctx, size_t nHeads,
+                                       size_t headSize, size_t numBlocks,
+                                       size_t blockSize, size_t maxSequences,
+                                       size_t maxBlocksPerSequence) {
+  PagedKVCache cache;
+  cache.nHeads = nHeads;
+  cache.headSize = headSize;
+  cache.blockSize = blockSize;
+  cache.numBlocks = numBlocks;
+  cache.maxSequences = maxSequences;
+  cache.maxBlocksPerSequence = maxBlocksPerSequence;
+  Shape cacheShape = {numBlocks, blockSize, nHeads * headSize};
+  cache.keys = createTensor(ctx, cacheShape, kf32);
+  cache.values = createTensor(ctx, cacheShape, kf32);
+  cache.hostBlockTables.assign(maxSequences * maxBlocksPerSequence, 0);
+  cache.blockTables =
+      createTensor(ctx, Shape{maxSequences, maxBlocksPerSequence}, ku32,
+                   cache.hostBlockTables.data());
+  cache.lengths.assign(maxSequences, 0);
+  cache.active.assign(maxSequences, false);
+  // Stack order hands out low block indices first
+  for (size_t i = numBlocks; i > 0; --i) {
+    cache.freeBlocks.push_back(static_cast<uint32_t>(i - 1));
+  }
+  return cache;
+}
+
+/**
+ * @brief Takes a free sequence slot of the cache, with no tokens.
+ * @param[in] cache PagedKVCache instance
+ * @return Slot of the new sequence, or kNoSequence if all slots are in use
+ *
+ * @code
+ * size_t slot = addSequence(cache);
+ * @endcode
+ */
+inline size_t addSequence(PagedKVCache &cache) {
+  for (size_t slot = 0; slot < cache.maxSequences; ++slot) {
+    if (!cache.active[slot]) {
+      cache.active[slot] = true;
+      cache.lengths[slot] = 0;
+      return slot;
+    }
+  }
+  return kNoSequence;
+}
+
+/**
+ * @brief Number of additional blocks a sequence needs to grow by numTokens.
+ */
+inline size_t blocksNeeded(const PagedKVCache &cache, size_t slot,
+                           size_t numTokens) {
+  size_t held = cdiv(cache.lengths[slot], cache.blockSize);
+  return cdiv(cache.lengths[slot] + numTokens, cache.blockSize) - held;
+}
+
+/**
+ * @brief Reserves space for numTokens new tokens of a sequence, allocating
+ * blocks as needed, and appends their (slot, position) pairs to tokens, the
+ * token table of the next append and attention dispatch.
+ *
+ * Either all tokens are reserved or, if the cache is out of blocks or the
+ * sequence would exceed maxBlocksPerSequence, nothing changes.
+ *
+ * @param[in] cache PagedKVCache instance
+ * @param[in] slot Slot of the sequence, from addSequence()
+ * @param[in] numTokens Number of new tokens
+ * @param[out] tokens Token table to append the (slot, position) pairs to
+ * @return true if the tokens were reserved
+ *
+ * @code
+ * std::vector<uint32_t> tokens;
+ * appendTokens(cache, slot, 1, tokens);
+ * @endcode
+ */
+inline bool appendTokens(PagedKVCache &cache, size_t slot, size_t numTokens,
+                         std::vector<uint32_t> &tokens) {
+  assert(slot < cache.maxSequences && cache.active[slot]);
+  size_t held = cdiv(cache.lengths[slot], cache.blockSize);
+  size_t needed = blocksNeeded(cache, slot, numTokens);
+  if (needed > cache.freeBlocks.size() ||
+      held + needed > cache.maxBlocksPerSequence) {
+    return false;
+  }
+  for (size_t i = 0; i < needed; ++i) {
+    cache.hostBlockTables[slot * cache.maxBlocksPerSequence + held + i] =
+        cache.freeBlocks.back();
+    cache.freeBlocks.pop_back();
+  }
+  cache.dirty |= needed > 0;
+  for (size_t i = 0; i < numTokens; ++i) {
+    tokens.push_back(static_cast<uint32_t>(slot));
+    tokens.push_back(static_cast<uint32_t>(cache.lengths[slot] + i));
+  }
+  cache.lengths[slot] += numTokens;
+  return true;
+}
+
+/**
+ * @brief Releases a sequence slot and returns its blocks to the cache.
+ * @param[in] cache PagedKVCache instance
+ * @param[in] slot Slot of the sequence, from addSequence()
+ *
+ * @code
+ * freeSequence(cache, slot);
+ * @endcode
+ */
+inline void freeSequence(PagedKVCache &cache, size_t slot) {
+  assert(slot < cache.maxSequences && cache.active[slot]);
+  size_t held = cdiv(cache.lengths[slot], cache.blockSize);
+  for (size_t i = 0; i < held; ++i) {
+    cache.freeBlocks.push_back(
+        cache.hostBlockTables[slot * cache.maxBlocksPerSequence + i]);
+  }
+  cache.active[slot] = false;
+  cache.lengths[slot] = 0;
+}
+
+/**
+ * @brief Uploads the block tables to the GPU if they changed since the last
+ * upload. Call after appendTokens() and before dispatching the kernels.
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] cache PagedKVCache instance
+ *
+ * @code
+ * syncBlockTables(ctx, cache);
+ * @endcode
+ */
+inline void syncBlockTables(Context &ctx, PagedKVCache &cache) {
+  if (cache.dirty) {
+    toGPU(ctx, cache.hostBlockTables.data(), cache.blockTables);
+    cache.dirty = false;
+  }
+}
+
+/**
+ * @brief Creates a kernel which writes the K and V of numTokens new tokens
+ * from qkv ((numTokens, 3 * C) in the layout of ref::attention_forward_cpu)
+ * into the cache, at the positions of the token table (numTokens * 2 u32).
+ * Unused entries of the token table are padded with kNoSequence.
+ *
+ * @code
+ * Kernel append = createKVAppendKernel(ctx, cache, qkv, tokens, numTokens);
+ * @endcode
+ */
+inline Kernel createKVAppendKernel(Context &ctx, PagedKVCache &cache,
+                                   const Tensor &qkv, const Tensor &tokens,
+                                   size_t numTokens) {
+  size_t C = cache.nHeads * cache.headSize;
+  return createKernel(
+      ctx,
+      PagedKVShader(kShaderPagedKVAppend, 256, numTokens, C, cache.nHeads,
+                    cache.blockSize, cache.maxBlocksPerSequence),
+      Bindings{qkv, tokens, cache.blockTables, cache.keys, cache.values},
+      /* nWorkgroups */ {cdiv(numTokens * C, 256), 1, 1});
+}
+
+/**
+ * @brief Creates a kernel which computes the causal attention output
+ * ((numTokens, C)) of numTokens tokens of the token table against the cache,
+ * reading their queries from qkv. The tokens must have been appended by the
+ * kernel from createKVAppendKernel() first.
+ *
+ * @code
+ * Kernel attention =
+ *     createPagedAttentionKernel(ctx, cache, qkv, tokens, out, numTokens);
+ * @endcode
+ */
+inline Kernel createPagedAttentionKernel(Context &ctx, PagedKVCache &cache,
+                                         const Tensor &qkv,
+                                         const Tensor &tokens,
+                                         const Tensor &out, size_t numTokens,
+                                         size_t threads = 32) {
+  size_t C = cache.nHeads * cache.headSize;
+  return createKernel(
+      ctx,
+      PagedKVShader(kShaderPagedAttention, threads, numTokens, C, cache.nHeads,
+                    cache.blockSize, cache.maxBlocksPerSequence),
+      Bindings{qkv, tokens, cache.blockTables, cache.keys, cache.values, out},
+      /* nWorkgroups */ {numTokens, cache.nHeads, 1});
+}
+
+} // namespace gpu
+
+#endif // KVCACHE_H
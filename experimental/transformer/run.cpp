@@ -4,6 +4,7 @@
 #include <array>
 
 #include "llmc/reference_impls.h"
+#include "experimental/weights.h"
 
 using namespace gpu;
 
@@ -124,15 +125,28 @@ void createTransformer(Context &ctx, size_t modelDim, size_t qkvDim,
       .mlp2 = createTensor(ctx, Shape{modelDim, 2 * hiddenWidth}, kf32),
   };
 
-  // Initialize values
-  std::unique_ptr<float[]> qkvInit(new float[modelDim * 3 * nHeads * qkvDim]);
-  // randint(qkvInit.get(), size(transformer.qkv.shape), gen, -2, 2);
-  range(qkvInit.get(), size(transformer.qkv.shape), 0.0);
-  LOG(kDefLog, kInfo, "%s",
-      show<float>(qkvInit.get(), transformer.qkv.shape[0],
-                  transformer.qkv.shape[1], "QKV Weights")
-          .c_str());
-  toGPU(ctx, qkvInit.get(), transformer.qkv);
+  // Initialize values, from a safetensors file if one is given, which is
+  // uploaded without a host copy of the weights
+  const char *weightsPath = std::getenv("TRANSFORMER_WEIGHTS");
+  WeightFile weights;
+  if (weightsPath && openWeights(weightsPath, weights)) {
+    Tensor qkv = getWeight(ctx, weights, "qkv");
+    check(qkv.dtype == kf32 &&
+              size(qkv.shape) == size(transformer.qkv.shape),
+          "QKV weights match the model dimensions", __FILE__, __LINE__);
+    FreeTensor(ctx.pool, transformer.qkv);
+    transformer.qkv = qkv;
+  } else {
+    std::unique_ptr<float[]> qkvInit(
+        new float[modelDim * 3 * nHeads * qkvDim]);
+    // randint(qkvInit.get(), size(transformer.qkv.shape), gen, -2, 2);
+    range(qkvInit.get(), size(transformer.qkv.shape), 0.0);
+    LOG(kDefLog, kInfo, "%s",
+        show<float>(qkvInit.get(), transformer.qkv.shape[0],
+                    transformer.qkv.shape[1], "QKV Weights")
+            .c_str());
+    toGPU(ctx, qkvInit.get(), transformer.qkv);
+  }
 
   activations = {
       .qkv = createTensor(ctx, Shape{batchSize * 3 * nHeads * qkvDim}, kf32),
@@ -0,0 +1,342 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "gpu.h"
+#include "kvcache.h"
+
+namespace gpu {
+
+/**
+ * @brief Kernels and buffers of one decode step for a fixed number of tokens
+ * (the bucket). Steps are built once per bucket by the DecodeStepBuilder of
+ * the scheduler and reused for every step of that size.
+ *
+ * The builder allocates the tensors of the model (inputs and outputs of
+ * bucket rows) into tensors and the kernels into kernels, in dispatch order,
+ * reading the token table from tokens, eg. with createKVAppendKernel() and
+ * createPagedAttentionKernel(). The scheduler records the kernels into batch.
+ */
+struct DecodeStep {
+  size_t bucket = 0;           // tokens per dispatch, rows of the tensors
+  Tensor tokens;               // (bucket * 2) u32 token table
+  std::vector<Tensor> tensors; // model inputs and outputs, set by the builder
+  std::vector<Kernel> kernels; // dispatched in order, set by the builder
+  CommandBatch batch;
+};
+
+using DecodeStepBuilder =
+    std::function<void(Context &, PagedKVCache &, DecodeStep &)>;
+
+/**
+ * @brief A sequence submitted to a DecodeScheduler.
+ *
+ * The first promptLength tokens are available upfront and are fed in chunks
+ * as large as the step allows (prefill), every later token depends on the
+ * output of the previous step and is fed one per step (decode). The sequence
+ * completes once maxLength tokens have been fed or finishSequence() is called.
+ */
+struct DecodeSequence {
+  size_t id;
+  size_t promptLength;
+  size_t maxLength;
+  size_t slot = kNoSequence; // PagedKVCache slot while running
+  size_t fed = 0;            // tokens appended to the cache so far
+  size_t reserved = 0;       // blocks reserved but not yet allocated
+  bool finished = false;
+};
+
+/**
+ * @brief Rows [row, row + numTokens) of a step hold the tokens of sequence id
+ * at positions [position, position + numTokens).
+ */
+struct DecodeEntry {
+  size_t id;
+  size_t row;
+  size_t numTokens;
+  size_t position;
+};
+
+/**
+ * @brief Result of scheduleStep(), the batch to upload inputs for, dispatch
+ * with runStep() and read outputs from.
+ */
+struct DecodeBatch {
+  DecodeStep *step = nullptr; // non-owning, nullptr if nothing was scheduled
+  std::vector<DecodeEntry> entries;
+  size_t numTokens = 0; // rows in use, the remaining rows are padding
+};
+
+/**
+ * @brief Continuous batching scheduler for incremental decoding on a
+ * PagedKVCache.
+ *
+ * Sequences are submitted at any time with submitSequence() and join the
+ * running batch at the next scheduleStep(), while completed sequences leave
+ * it and free their cache blocks. Each step packs one token of every decoding
+ * sequence and prefill chunks of newly admitted sequences into a token table
+ * of tokens from different sequences, picks the smallest bucket holding them
+ * and dispatches the kernels built for that bucket.
+ *
+ * A sequence is admitted only when a cache slot is free and enough blocks for
+ * its maxLength can be reserved, so running sequences never run out of cache
+ * space and no preemption is needed.
+ *
+ * The cache is non-owning and must outlive the scheduler.
+ */
+struct DecodeScheduler {
+  PagedKVCache *cache = nullptr; // non-owning
+  std::vector<size_t> buckets;   // ascending step sizes, in tokens
+  DecodeStepBuilder builder;
+  std::map<size_t, std::unique_ptr<DecodeStep>> steps; // built per bucket
+  std::deque<DecodeSequence> pending;
+  std::vector<DecodeSequence> running;
+  size_t reservedBlocks = 0; // sum of running[i].reserved
+};
+
+/**
+ * @brief Factory function to create a DecodeScheduler.
+ * @param[in] cache PagedKVCache instance shared by the scheduled sequences
+ * @param[in] buckets Step sizes in tokens to build kernels for, the largest
+ * bucket bounds the tokens per step
+ * @param[in] builder Function populating the tensors and kernels of a step
+ * @return DecodeScheduler instance
+ *
+ * @code
+ * DecodeScheduler scheduler = createDecodeScheduler(cache, {1, 4, 16, 64},
+ *     [](Context &ctx, PagedKVCache &cache, DecodeStep &step) {
+ *       ...
+ *     });
+ * @endcode
+ */
+inline DecodeScheduler createDecodeScheduler(PagedKVCache &cache,
+                                             std::vector<size_t> buckets,
+                                             DecodeStepBuilder builder) {
+  check(!buckets.empty(), "Decode scheduler needs at least one bucket",
+        __FILE__, __LINE__);
+  std::sort(buckets.begin(), buckets.end());
+  buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+  check(buckets.front() > 0, "Decode buckets must be positive", __FILE__,
+        __LINE__);
+  DecodeScheduler scheduler;
+  scheduler.cache = &cache;
+  scheduler.buckets = std::move(buckets);
+  scheduler.builder = std::move(builder);
+  return scheduler;
+}
+
+/**
+ * @brief Queues a sequence, it joins the running batch at the first
+ * scheduleStep() where there is room for it.
+ * @param[in] scheduler DecodeScheduler instance
+ * @param[in] id Caller defined identifier reported in DecodeEntry::id
+ * @param[in] promptLength Number of tokens available upfront
+ * @param[in] maxLength Maximum number of tokens fed, including the prompt
+ *
+ * @code
+ * submitSequence(scheduler, requestId, promptTokens.size(), 1024);
+ * @endcode
+ */
+inline void submitSequence(DecodeScheduler &scheduler, size_t id,
+                           size_t promptLength, size_t maxLength) {
+  const PagedKVCache &cache = *scheduler.cache;
+  check(maxLength > 0 && promptLength <= maxLength,
+        "Sequence prompt must fit its maximum length", __FILE__, __LINE__);
+  check(cdiv(maxLength, cache.blockSize) <= cache.maxBlocksPerSequence &&
+            cdiv(maxLength, cache.blockSize) <= cache.numBlocks,
+        "Sequence maximum length must fit the cache", __FILE__, __LINE__);
+  scheduler.pending.push_back({id, promptLength, maxLength});
+}
+
+/**
+ * @brief Marks a sequence as completed before it reached its maximum length,
+ * eg. on an end of sequence token. It leaves the batch at the next
+ * scheduleStep().
+ * @param[in] scheduler DecodeScheduler instance
+ * @param[in] id Identifier of the sequence, as passed to submitSequence()
+ */
+inline void finishSequence(DecodeScheduler &scheduler, size_t id) {
+  for (DecodeSequence &seq : scheduler.running) {
+    if (seq.id == id) {
+      seq.finished = true;
+    }
+  }
+  for (DecodeSequence &seq : scheduler.pending) {
+    if (seq.id == id) {
+      seq.finished = true;
+    }
+  }
+}
+
+/**
+ * @brief Whether any sequences are running or waiting to be admitted.
+ */
+inline bool hasWork(const DecodeScheduler &scheduler) {
+  for (const DecodeSequence &seq : scheduler.running) {
+    if (!seq.finished) {
+      return true;
+    }
+  }
+  for (const DecodeSequence &seq : scheduler.pending) {
+    if (!seq.finished) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Returns the step of the smallest bucket holding numTokens, building
+ * and recording it on first use.
+ */
+inline DecodeStep &getDecodeStep(Context &ctx, DecodeScheduler &scheduler,
+                                 size_t numTokens) {
+  auto bucket = std::lower_bound(scheduler.buckets.begin(),
+                                 scheduler.buckets.end(), numTokens);
+  assert(bucket != scheduler.buckets.end());
+  std::unique_ptr<DecodeStep> &step = scheduler.steps[*bucket];
+  if (!step) {
+    step = std::make_unique<DecodeStep>();
+    step->bucket = *bucket;
+    step->tokens = createTensor(ctx, Shape{*bucket * 2}, ku32);
+    scheduler.builder(ctx, *scheduler.cache, *step);
+    std::vector<BatchOp> ops(step->kernels.begin(), step->kernels.end());
+    step->batch = createCommandBatch(ctx, std::move(ops));
+    LOG(kDefLog, kInfo, "Built decode step for %zu tokens", *bucket);
+  }
+  return *step;
+}
+
+/**
+ * @brief Builds the steps of all buckets, to keep kernel compilation out of
+ * the first decode steps.
+ */
+inline void buildDecodeSteps(Context &ctx, DecodeScheduler &scheduler) {
+  for (size_t bucket : scheduler.buckets) {
+    getDecodeStep(ctx, scheduler, bucket);
+  }
+}
+
+/**
+ * @brief Plans the next step: retires completed sequences, admits queued
+ * ones, reserves cache space for the tokens of the step and uploads the token
+ * and block tables.
+ *
+ * The caller then uploads the inputs of each DecodeEntry to its rows of
+ * batch.step->tensors, dispatches with runStep() and reads the outputs.
+ *
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] scheduler DecodeScheduler instance
+ * @return DecodeBatch of the step, with step == nullptr if there is no work
+ *
+ * @code
+ * while (hasWork(scheduler)) {
+ *   DecodeBatch batch = scheduleStep(ctx, scheduler);
+ *   ... upload inputs ...
+ *   runStep(ctx, batch);
+ *   ... read outputs, finishSequence() on end of sequence ...
+ * }
+ * @endcode
+ */
+inline DecodeBatch scheduleStep(Context &ctx, DecodeScheduler &scheduler) {
+  PagedKVCache &cache = *scheduler.cache;
+  size_t maxTokens = scheduler.buckets.back();
+
+  // Completed sequences leave the batch and release their blocks
+  std::vector<DecodeSequence> running;
+  for (DecodeSequence &seq : scheduler.running) {
+    if (seq.finished || seq.fed == seq.maxLength) {
+      freeSequence(cache, seq.slot);
+      scheduler.reservedBlocks -= seq.reserved;
+    } else {
+      running.push_back(seq);
+    }
+  }
+  scheduler.running = std::move(running);
+
+  // Admit in submission order while there is a slot, a row for the first
+  // token and cache space for the whole sequence
+  while (!scheduler.pending.empty() && scheduler.running.size() < maxTokens) {
+    DecodeSequence seq = scheduler.pending.front();
+    if (seq.finished) {
+      scheduler.pending.pop_front();
+      continue;
+    }
+    size_t blocks = cdiv(seq.maxLength, cache.blockSize);
+    if (cache.freeBlocks.size() < scheduler.reservedBlocks + blocks) {
+      break;
+    }
+    seq.slot = addSequence(cache);
+    if (seq.slot == kNoSequence) {
+      break;
+    }
+    seq.reserved = blocks;
+    scheduler.reservedBlocks += blocks;
+    scheduler.running.push_back(seq);
+    scheduler.pending.pop_front();
+  }
+
+  // Decoding sequences get their token first, prefill chunks fill the rest of
+  // the step
+  DecodeBatch batch;
+  std::vector<uint32_t> tokenTable;
+  for (int prefill = 0; prefill < 2; ++prefill) {
+    for (DecodeSequence &seq : scheduler.running) {
+      bool inPrompt = seq.fed < seq.promptLength;
+      if (inPrompt != (prefill == 1)) {
+        continue;
+      }
+      size_t numTokens =
+          prefill ? std::min(seq.promptLength - seq.fed, maxTokens -
+                                                             batch.numTokens)
+                  : 1;
+      if (numTokens == 0) {
+        continue;
+      }
+      size_t blocks = blocksNeeded(cache, seq.slot, numTokens);
+      bool reserved = appendTokens(cache, seq.slot, numTokens, tokenTable);
+      assert(reserved && blocks <= seq.reserved);
+      seq.reserved -= blocks;
+      scheduler.reservedBlocks -= blocks;
+      batch.entries.push_back({seq.id, batch.numTokens, numTokens, seq.fed});
+      batch.numTokens += numTokens;
+      seq.fed += numTokens;
+    }
+  }
+  if (batch.numTokens == 0) {
+    return batch;
+  }
+
+  batch.step = &getDecodeStep(ctx, scheduler, batch.numTokens);
+  tokenTable.resize(batch.step->bucket * 2, kNoSequence);
+  syncBlockTables(ctx, cache);
+  toGPU(ctx, tokenTable.data(), batch.step->tokens);
+  return batch;
+}
+
+/**
+ * @brief Dispatches the kernels of a batch planned by scheduleStep() and
+ * blocks until they complete.
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] batch DecodeBatch returned by scheduleStep()
+ */
+inline void runStep(Context &ctx, DecodeBatch &batch) {
+  if (!batch.step) {
+    return;
+  }
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchBatch(ctx, batch.step->batch, promise);
+  wait(ctx, future);
+  resetCommandBuffer(ctx.device, batch.step->batch);
+}
+
+} // namespace gpu
+
+#endif // SCHEDULER_H
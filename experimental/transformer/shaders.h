@@ -51,6 +51,30 @@ fn main(
 }
 )";
 
+/* Residual over a slice [offset, offset + size) of the inputs, with B scaled
+ * by the SCALE override constant. The slice is read from a uniform so that
+ * one kernel covers several slices, one per params slot.
+ */
+static const char *kShaderResidualSlice = R"(
+struct Params {
+  offset: u32,
+  size: u32,
+};
+override SCALE: f32 = 1.0;
+@group(0) @binding(0) var<storage, read_write> A: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> B: array<{{precision}}>;
+@group(0) @binding(2) var<storage, read_write> C: array<{{precision}}>;
+@group(0) @binding(3) var<uniform> params: Params;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+  @builtin(global_invocation_id) GlobalInvocationID: vec3<u32>) {
+    let idx = params.offset + GlobalInvocationID.x;
+    if (GlobalInvocationID.x < params.size) {
+      C[idx] = A[idx] + {{precision}}(SCALE) * B[idx];
+    }
+}
+)";
+
 /* LayerNorm
  * v1:
  * - No caching mean/std for backwards
@@ -165,13 +189,349 @@ fn matmul(
  * */
 KernelCode MatmulShader(size_t workgroupSize, const char *shaderRaw,
                         NumType precision, size_t M, size_t K, size_t N) {
-  KernelCode shader = createShader(shaderRaw, workgroupSize, precision);
+  KernelCode shader = KernelCode(shaderRaw, workgroupSize, precision);
   replaceAll(shader.data, "{{M}}", std::to_string(M));
   replaceAll(shader.data, "{{K}}", std::to_string(K));
   replaceAll(shader.data, "{{N}}", std::to_string(N));
   return shader;
 }
 
+/* Quantized matmul
+ * C = A * W^T where A is an M x K f32 matrix and W is an N x K matrix of
+ * block-quantized weights, stored as packed signed integers (4 per u32 word
+ * for ki8, 8 per word for kq4, lowest bits first) with one f32 scale per
+ * {{BLOCK}} consecutive values of a row. See quantize() in array_utils.h.
+ *
+ * v1:
+ * - {{TILE}} x {{TILE}} output tile per workgroup
+ * - A tile and dequantized W tile are staged in workgroup memory for each block
+ *   of K, so each packed word is read and unpacked once per workgroup
+ */
+static const char *kShaderMatmulQuantized = R"(
+@group(0) @binding(0) var<storage, read_write> A: array<f32>;
+@group(0) @binding(1) var<storage, read_write> W: array<u32>;
+@group(0) @binding(2) var<storage, read_write> scales: array<f32>;
+@group(0) @binding(3) var<storage, read_write> C: array<f32>;
+const VALUES_PER_WORD: u32 = {{VALUES_PER_WORD}}u;
+const BITS: u32 = 32u / VALUES_PER_WORD;
+var<workgroup> tileA: array<f32, {{TILE}} * {{BLOCK}}>;
+var<workgroup> tileW: array<f32, {{TILE}} * {{BLOCK}}>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID: vec3<u32>,
+    @builtin(workgroup_id) groupID: vec3<u32>) {
+    let localIdx = localID.y * {{TILE}}u + localID.x;
+    let rowStart = groupID.y * {{TILE}}u;
+    let colStart = groupID.x * {{TILE}}u;
+    var acc: f32 = 0.0;
+    for (var kBlock = 0u; kBlock < {{K}}u; kBlock += {{BLOCK}}u) {
+        for (var idx = localIdx; idx < {{TILE}}u * {{BLOCK}}u;
+             idx += {{TILE}}u * {{TILE}}u) {
+            let row = rowStart + idx / {{BLOCK}}u;
+            var value: f32 = 0.0;
+            if (row < {{M}}u) {
+                value = A[row * {{K}}u + kBlock + idx % {{BLOCK}}u];
+            }
+            tileA[idx] = value;
+        }
+        // Each thread unpacks whole words of the W tile
+        for (var idx = localIdx; idx < {{TILE}}u * {{BLOCK}}u / VALUES_PER_WORD;
+             idx += {{TILE}}u * {{TILE}}u) {
+            let col = idx / ({{BLOCK}}u / VALUES_PER_WORD);
+            let word = idx % ({{BLOCK}}u / VALUES_PER_WORD);
+            var packed: i32 = 0;
+            var scale: f32 = 0.0;
+            if (colStart + col < {{N}}u) {
+                let offset = (colStart + col) * {{K}}u + kBlock;
+                packed = bitcast<i32>(W[offset / VALUES_PER_WORD + word]);
+                scale = scales[offset / {{BLOCK}}u];
+            }
+            for (var j = 0u; j < VALUES_PER_WORD; j++) {
+                tileW[col * {{BLOCK}}u + word * VALUES_PER_WORD + j] =
+                    scale * f32(extractBits(packed, j * BITS, BITS));
+            }
+        }
+        workgroupBarrier();
+        for (var k = 0u; k < {{BLOCK}}u; k++) {
+            acc += tileA[localID.y * {{BLOCK}}u + k]
+                 * tileW[localID.x * {{BLOCK}}u + k];
+        }
+        workgroupBarrier();
+    }
+    let row = rowStart + localID.y;
+    let col = colStart + localID.x;
+    if (row < {{M}}u && col < {{N}}u) {
+        C[row * {{N}}u + col] = acc;
+    }
+}
+)";
+
+/* Quantized matvec
+ * y = W * x for decoding a single token (M = 1), with W quantized in the same
+ * format as kShaderMatmulQuantized.
+ *
+ * v1:
+ * - One workgroup per output, threads stride over packed words and the
+ *   partial sums are reduced in workgroup memory
+ * - Without reuse of W, values are dequantized in registers and the block
+ *   scale is applied once per word
+ */
+static const char *kShaderMatvecQuantized = R"(
+@group(0) @binding(0) var<storage, read_write> x: array<f32>;
+@group(0) @binding(1) var<storage, read_write> W: array<u32>;
+@group(0) @binding(2) var<storage, read_write> scales: array<f32>;
+@group(0) @binding(3) var<storage, read_write> y: array<f32>;
+const VALUES_PER_WORD: u32 = {{VALUES_PER_WORD}}u;
+const BITS: u32 = 32u / VALUES_PER_WORD;
+var<workgroup> partial: array<f32, {{THREADS}}>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID: vec3<u32>,
+    @builtin(workgroup_id) groupID: vec3<u32>) {
+    let n = groupID.x;
+    let t = localID.x;
+    var acc: f32 = 0.0;
+    for (var word = t; word < {{K}}u / VALUES_PER_WORD; word += {{THREADS}}u) {
+        let k = word * VALUES_PER_WORD;
+        let packed = bitcast<i32>(W[n * ({{K}}u / VALUES_PER_WORD) + word]);
+        var dot: f32 = 0.0;
+        for (var j = 0u; j < VALUES_PER_WORD; j++) {
+            dot += x[k + j] * f32(extractBits(packed, j * BITS, BITS));
+        }
+        acc += scales[(n * {{K}}u + k) / {{BLOCK}}u] * dot;
+    }
+    partial[t] = acc;
+    workgroupBarrier();
+    for (var stride = {{THREADS}}u / 2u; stride > 0u; stride /= 2u) {
+        if (t < stride) {
+            partial[t] += partial[t + stride];
+        }
+        workgroupBarrier();
+    }
+    if (t == 0u) {
+        y[n] = partial[0];
+    }
+}
+)";
+
+static constexpr size_t kQuantBlockSize = 32;
+
+/* Generates KernelCode instance for the quantized matmul and matvec kernels -
+ * pass in kShaderMatmulQuantized or kShaderMatvecQuantized via `shaderRaw` and
+ * the weight format (ki8 or kq4) via `weightType`. K must be a multiple of
+ * kQuantBlockSize.
+ *
+ * kShaderMatmulQuantized takes a square {TILE, TILE, 1} workgroup size (e.g.
+ * {16, 16, 1}) and is dispatched with {cdiv(N, TILE), cdiv(M, TILE), 1}
+ * workgroups. kShaderMatvecQuantized takes a power of 2 {THREADS, 1, 1}
+ * workgroup size (e.g. {256, 1, 1}) and is dispatched with {N, 1, 1}
+ * workgroups.
+ * */
+KernelCode QuantizedMatmulShader(const Shape &workgroupSize,
+                                 const char *shaderRaw, NumType weightType,
+                                 size_t M, size_t K, size_t N) {
+  assert(weightType == ki8 || weightType == kq4);
+  assert(K % kQuantBlockSize == 0);
+  KernelCode shader(shaderRaw, workgroupSize, kf32);
+  replaceAll(shader.data,
+             {{"{{VALUES_PER_WORD}}", weightType == ki8 ? "4" : "8"},
+              {"{{BLOCK}}", std::to_string(kQuantBlockSize)},
+              {"{{TILE}}", std::to_string(workgroupSize[0])},
+              {"{{THREADS}}", std::to_string(workgroupSize[0])},
+              {"{{M}}", std::to_string(M)},
+              {"{{K}}", std::to_string(K)},
+              {"{{N}}", std::to_string(N)}});
+  return shader;
+}
+
+/* Fused matmul
+ * C = epilogue(A * W^T) where A is an M x K matrix and W is an N x K matrix
+ * (the layout of ref::matmul_forward_cpu). The epilogue is applied to each
+ * output in registers before it is written, so that elementwise passes that
+ * usually follow a matmul (bias, activation) don't round trip the activation
+ * through global memory.
+ *
+ * {{EPILOGUE}} is substituted with a WGSL function
+ *   fn epilogue(x: f32, row: u32, col: u32) -> f32
+ * which may read the bias binding, see kMatmulEpilogue* below. The bias
+ * binding is part of the layout even if an epilogue doesn't use it.
+ *
+ * v1:
+ * - {{TILE}} x {{TILE}} output tile per workgroup, one output per thread
+ * - A and W tiles are staged in workgroup memory for each {{TILE}} of K
+ */
+static const char *kShaderMatmulFused = R"(
+@group(0) @binding(0) var<storage, read_write> A: array<f32>;
+@group(0) @binding(1) var<storage, read_write> W: array<f32>;
+@group(0) @binding(2) var<storage, read_write> bias: array<f32>;
+@group(0) @binding(3) var<storage, read_write> C: array<f32>;
+var<workgroup> tileA: array<f32, {{TILE}} * {{TILE}}>;
+var<workgroup> tileW: array<f32, {{TILE}} * {{TILE}}>;
+{{EPILOGUE}}
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID: vec3<u32>,
+    @builtin(workgroup_id) groupID: vec3<u32>) {
+    let row = groupID.y * {{TILE}}u + localID.y;
+    let col = groupID.x * {{TILE}}u + localID.x;
+    // Row of W loaded by this thread, W tiles are stored transposed
+    let wRow = groupID.x * {{TILE}}u + localID.y;
+    var acc: f32 = 0.0;
+    for (var kTile = 0u; kTile < {{K}}u; kTile += {{TILE}}u) {
+        let k = kTile + localID.x;
+        var a: f32 = 0.0;
+        var w: f32 = 0.0;
+        if (row < {{M}}u && k < {{K}}u) {
+            a = A[row * {{K}}u + k];
+        }
+        if (wRow < {{N}}u && k < {{K}}u) {
+            w = W[wRow * {{K}}u + k];
+        }
+        tileA[localID.y * {{TILE}}u + localID.x] = a;
+        tileW[localID.x * {{TILE}}u + localID.y] = w;
+        workgroupBarrier();
+        for (var kk = 0u; kk < {{TILE}}u; kk++) {
+            acc += tileA[localID.y * {{TILE}}u + kk]
+                 * tileW[kk * {{TILE}}u + localID.x];
+        }
+        workgroupBarrier();
+    }
+    if (row < {{M}}u && col < {{N}}u) {
+        C[row * {{N}}u + col] = epilogue(acc, row, col);
+    }
+}
+)";
+
+static const char *kMatmulEpilogueIdentity = R"(
+fn epilogue(x: f32, row: u32, col: u32) -> f32 {
+    return x;
+}
+)";
+
+static const char *kMatmulEpilogueBias = R"(
+fn epilogue(x: f32, row: u32, col: u32) -> f32 {
+    return x + bias[col];
+}
+)";
+
+// Same GELU approximation as kShaderGelu
+static const char *kMatmulEpilogueBiasGelu = R"(
+const GELU_SCALING_FACTOR: f32 = 0.7978845608028654; // sqrt(2.0 / PI)
+fn epilogue(x: f32, row: u32, col: u32) -> f32 {
+    let y = x + bias[col];
+    return select(0.5 * y * (1.0 + tanh(GELU_SCALING_FACTOR
+                  * (y + .044715 * y * y * y))), y, y > 10.0);
+}
+)";
+
+/* Generates KernelCode instance for the fused matmul kernel - pass in one of
+ * the kMatmulEpilogue* functions (or a custom one with the same signature) via
+ * `epilogue`.
+ *
+ * The kernel takes a square {tile, tile, 1} workgroup size and is dispatched
+ * with {cdiv(N, tile), cdiv(M, tile), 1} workgroups, bindings are
+ * {A, W, bias, C}.
+ * */
+KernelCode FusedMatmulShader(size_t tile, const char *epilogue, size_t M,
+                             size_t K, size_t N) {
+  KernelCode shader(kShaderMatmulFused, Shape{tile, tile, 1}, kf32);
+  replaceAll(shader.data, {{"{{EPILOGUE}}", epilogue},
+                           {"{{TILE}}", std::to_string(tile)},
+                           {"{{M}}", std::to_string(M)},
+                           {"{{K}}", std::to_string(K)},
+                           {"{{N}}", std::to_string(N)}});
+  return shader;
+}
+
+/* Fused residual + LayerNorm
+ * residOut = inp + residual, out = layernorm(residOut) * weight + bias over
+ * rows of {{C}} channels, as in the pre-norm residual stream of GPT-2.
+ *
+ * v1:
+ * - One workgroup per row, threads stride over the channels and keep their
+ *   values in registers, so inp and residual are read once and each output
+ *   is written once (instead of a residual pass followed by a layernorm pass
+ *   reading the sum back three times)
+ * - Mean and variance are reduced in workgroup memory, the variance is
+ *   computed from the registers in a second pass for accuracy
+ */
+static const char *kShaderResidualLayerNorm = R"(
+@group(0) @binding(0) var<storage, read_write> inp: array<f32>;
+@group(0) @binding(1) var<storage, read_write> residual: array<f32>;
+@group(0) @binding(2) var<storage, read_write> weight: array<f32>;
+@group(0) @binding(3) var<storage, read_write> bias: array<f32>;
+@group(0) @binding(4) var<storage, read_write> residOut: array<f32>;
+@group(0) @binding(5) var<storage, read_write> out: array<f32>;
+const C: u32 = {{C}}u;
+const THREADS: u32 = {{THREADS}}u;
+const PER_THREAD: u32 = {{PER_THREAD}}u;
+var<workgroup> partial: array<f32, THREADS>;
+
+fn reduceSum(t: u32, value: f32) -> f32 {
+    partial[t] = value;
+    workgroupBarrier();
+    for (var stride = THREADS / 2u; stride > 0u; stride /= 2u) {
+        if (t < stride) {
+            partial[t] += partial[t + stride];
+        }
+        workgroupBarrier();
+    }
+    let result = partial[0];
+    // Keep the next reduction from overwriting partial[0] before it is read
+    workgroupBarrier();
+    return result;
+}
+
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID: vec3<u32>,
+    @builtin(workgroup_id) groupID: vec3<u32>) {
+    let rowStart = groupID.x * C;
+    let t = localID.x;
+    var xs: array<f32, PER_THREAD>;
+    var sum: f32 = 0.0;
+    for (var j = 0u; j < PER_THREAD; j++) {
+        let i = t + j * THREADS;
+        if (i < C) {
+            let x = inp[rowStart + i] + residual[rowStart + i];
+            xs[j] = x;
+            residOut[rowStart + i] = x;
+            sum += x;
+        }
+    }
+    let mean = reduceSum(t, sum) / f32(C);
+    var sumSq: f32 = 0.0;
+    for (var j = 0u; j < PER_THREAD; j++) {
+        if (t + j * THREADS < C) {
+            let diff = xs[j] - mean;
+            sumSq += diff * diff;
+        }
+    }
+    let rstd = 1.0 / sqrt(reduceSum(t, sumSq) / f32(C) + 1e-5);
+    for (var j = 0u; j < PER_THREAD; j++) {
+        let i = t + j * THREADS;
+        if (i < C) {
+            out[rowStart + i] = rstd * (xs[j] - mean) * weight[i] + bias[i];
+        }
+    }
+}
+)";
+
+/* Generates KernelCode instance for the fused residual + LayerNorm kernel
+ * for rows of C channels. threads must be a power of 2 (e.g. 256).
+ *
+ * The kernel is dispatched with {N, 1, 1} workgroups for N rows, bindings are
+ * {inp, residual, weight, bias, residOut, out}.
+ * */
+KernelCode ResidualLayerNormShader(size_t threads, size_t C) {
+  assert((threads & (threads - 1)) == 0);
+  KernelCode shader(kShaderResidualLayerNorm, threads, kf32);
+  replaceAll(shader.data, {{"{{C}}", std::to_string(C)},
+                           {"{{THREADS}}", std::to_string(threads)},
+                           {"{{PER_THREAD}}", std::to_string(cdiv(C, threads))}});
+  return shader;
+}
+
 /* Softmax
  * v1:
  * - equivalent to naive softmax with one thread per row
@@ -216,6 +576,296 @@ fn main(@builtin(global_invocation_id) global_id : vec3<u32>) {
 }
 )";
 
+/* Flash attention
+ * Causal multi-head self attention out = softmax(Q K^T / sqrt(HS)) V in a
+ * single pass, following the layout of ref::attention_forward_cpu: qkv is
+ * (B, T, 3 * C) with the Q, K and V of head h at offsets h * HS, C + h * HS
+ * and 2 * C + h * HS of each row, out is (B, T, C) with C = NH * HS.
+ *
+ * v1:
+ * - One workgroup per {{BR}} queries of one (batch, head), one query per
+ *   thread with its running max, running sum and output accumulator in
+ *   registers (online softmax)
+ * - K and V are streamed through workgroup memory in tiles of {{BC}} keys,
+ *   tiles past the last query of the workgroup are skipped (causal mask)
+ * - The (T, T) score matrix is never materialized, memory use is linear in T
+ */
+static const char *kShaderFlashAttention = R"(
+@group(0) @binding(0) var<storage, read_write> qkv: array<f32>;
+@group(0) @binding(1) var<storage, read_write> out: array<f32>;
+const T: u32 = {{T}}u;
+const C: u32 = {{C}}u;
+const HS: u32 = {{HEAD_SIZE}}u;
+const BR: u32 = {{BR}}u;
+const BC: u32 = {{BC}}u;
+const SCALE: f32 = {{SCALE}};
+const NEG_INFINITY: f32 = -3.0e38;
+var<workgroup> tileK: array<f32, BC * HS>;
+var<workgroup> tileV: array<f32, BC * HS>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID: vec3<u32>,
+    @builtin(workgroup_id) groupID: vec3<u32>) {
+    let h = groupID.y;
+    let batchStart = groupID.z * T * 3u * C;
+    let firstQuery = groupID.x * BR;
+    let t = firstQuery + localID.x;
+    let valid = t < T;
+    var q: array<f32, HS>;
+    var acc: array<f32, HS>;
+    if (valid) {
+        for (var d = 0u; d < HS; d++) {
+            q[d] = SCALE * qkv[batchStart + t * 3u * C + h * HS + d];
+            acc[d] = 0.0;
+        }
+    }
+    var runningMax: f32 = NEG_INFINITY;
+    var runningSum: f32 = 0.0;
+    let lastQuery = min(firstQuery + BR, T) - 1u;
+    for (var kStart = 0u; kStart <= lastQuery; kStart += BC) {
+        for (var idx = localID.x; idx < BC * HS; idx += BR) {
+            let key = kStart + idx / HS;
+            var k: f32 = 0.0;
+            var v: f32 = 0.0;
+            if (key < T) {
+                let offset = batchStart + key * 3u * C + h * HS + idx % HS;
+                k = qkv[offset + C];
+                v = qkv[offset + 2u * C];
+            }
+            tileK[idx] = k;
+            tileV[idx] = v;
+        }
+        workgroupBarrier();
+        if (valid) {
+            var scores: array<f32, BC>;
+            var tileMax = runningMax;
+            for (var j = 0u; j < BC; j++) {
+                var score = NEG_INFINITY;
+                if (kStart + j <= t) {
+                    score = 0.0;
+                    for (var d = 0u; d < HS; d++) {
+                        score += q[d] * tileK[j * HS + d];
+                    }
+                }
+                scores[j] = score;
+                tileMax = max(tileMax, score);
+            }
+            // Rescale the accumulators once per tile to the new maximum
+            let correction = exp(runningMax - tileMax);
+            runningSum *= correction;
+            for (var d = 0u; d < HS; d++) {
+                acc[d] *= correction;
+            }
+            for (var j = 0u; j < BC; j++) {
+                if (kStart + j <= t) {
+                    let p = exp(scores[j] - tileMax);
+                    runningSum += p;
+                    for (var d = 0u; d < HS; d++) {
+                        acc[d] += p * tileV[j * HS + d];
+                    }
+                }
+            }
+            runningMax = tileMax;
+        }
+        workgroupBarrier();
+    }
+    if (valid) {
+        let outStart = groupID.z * T * C + t * C + h * HS;
+        for (var d = 0u; d < HS; d++) {
+            out[outStart + d] = acc[d] / runningSum;
+        }
+    }
+}
+)";
+
+/* Generates KernelCode instance for the flash attention kernel for sequence
+ * length T and C = NH * headSize channels. br is the number of queries (and
+ * threads) per workgroup and bc the number of keys per tile, the K and V tiles
+ * (2 * bc * headSize floats) must fit the 16KB of workgroup memory guaranteed
+ * by WebGPU.
+ *
+ * The kernel is dispatched with {cdiv(T, br), NH, B} workgroups, bindings are
+ * {qkv, out}.
+ * */
+KernelCode FlashAttentionShader(size_t T, size_t C, size_t NH, size_t br = 32,
+                                size_t bc = 32) {
+  assert(C % NH == 0);
+  size_t headSize = C / NH;
+  assert(2 * bc * headSize * sizeof(float) <= 16384);
+  char scale[32];
+  snprintf(scale, sizeof(scale), "%.9g", 1.0 / std::sqrt(headSize));
+  KernelCode shader(kShaderFlashAttention, br, kf32);
+  replaceAll(shader.data,
+             {{"{{T}}", std::to_string(T)},
+              {"{{C}}", std::to_string(C)},
+              {"{{HEAD_SIZE}}", std::to_string(headSize)},
+              {"{{BR}}", std::to_string(br)},
+              {"{{BC}}", std::to_string(bc)},
+              {"{{SCALE}}", scale}});
+  return shader;
+}
+
+/* Paged KV cache append
+ * Copies the K and V of new tokens from qkv, (NUM_TOKENS, 3 * C) rows in the
+ * layout of ref::attention_forward_cpu, into a paged cache. keys and values
+ * are (numBlocks, BLOCK, C) and a token at position p of the sequence in slot
+ * s is stored in row p % BLOCK of block blockTables[s * MAX_BLOCKS + p / BLOCK].
+ * tokens holds (slot, position) pairs, tokens with slot 0xffffffff are padding
+ * and are skipped. See PagedKVCache in kvcache.h.
+ *
+ * v1:
+ * - One thread per (token, channel)
+ */
+static const char *kShaderPagedKVAppend = R"(
+@group(0) @binding(0) var<storage, read_write> qkv: array<f32>;
+@group(0) @binding(1) var<storage, read_write> tokens: array<u32>;
+@group(0) @binding(2) var<storage, read_write> blockTables: array<u32>;
+@group(0) @binding(3) var<storage, read_write> keys: array<f32>;
+@group(0) @binding(4) var<storage, read_write> values: array<f32>;
+const C: u32 = {{C}}u;
+const BLOCK: u32 = {{BLOCK}}u;
+const MAX_BLOCKS: u32 = {{MAX_BLOCKS}}u;
+const NUM_TOKENS: u32 = {{NUM_TOKENS}}u;
+const NO_SEQUENCE: u32 = 0xffffffffu;
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) globalID: vec3<u32>) {
+    let token = globalID.x / C;
+    let c = globalID.x % C;
+    if (token >= NUM_TOKENS) {
+        return;
+    }
+    let slot = tokens[2u * token];
+    if (slot == NO_SEQUENCE) {
+        return;
+    }
+    let pos = tokens[2u * token + 1u];
+    let block = blockTables[slot * MAX_BLOCKS + pos / BLOCK];
+    let dst = (block * BLOCK + pos % BLOCK) * C + c;
+    keys[dst] = qkv[token * 3u * C + C + c];
+    values[dst] = qkv[token * 3u * C + 2u * C + c];
+}
+)";
+
+/* Paged attention
+ * Causal attention of new tokens against a paged KV cache (see
+ * kShaderPagedKVAppend for the layout). The query of each token is read from
+ * qkv and attends to positions 0 ... position of its sequence, which must
+ * already have been appended. out is (NUM_TOKENS, C).
+ *
+ * v1:
+ * - One workgroup per (token, head), threads stride over the keys with an
+ *   online softmax each, the partial results are merged in workgroup memory
+ */
+static const char *kShaderPagedAttention = R"(
+@group(0) @binding(0) var<storage, read_write> qkv: array<f32>;
+@group(0) @binding(1) var<storage, read_write> tokens: array<u32>;
+@group(0) @binding(2) var<storage, read_write> blockTables: array<u32>;
+@group(0) @binding(3) var<storage, read_write> keys: array<f32>;
+@group(0) @binding(4) var<storage, read_write> values: array<f32>;
+@group(0) @binding(5) var<storage, read_write> out: array<f32>;
+const C: u32 = {{C}}u;
+const HS: u32 = {{HEAD_SIZE}}u;
+const BLOCK: u32 = {{BLOCK}}u;
+const MAX_BLOCKS: u32 = {{MAX_BLOCKS}}u;
+const THREADS: u32 = {{THREADS}}u;
+const SCALE: f32 = {{SCALE}};
+const NO_SEQUENCE: u32 = 0xffffffffu;
+const NEG_INFINITY: f32 = -3.0e38;
+var<workgroup> maxes: array<f32, THREADS>;
+var<workgroup> sums: array<f32, THREADS>;
+var<workgroup> accs: array<f32, THREADS * HS>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(
+    @builtin(local_invocation_id) localID: vec3<u32>,
+    @builtin(workgroup_id) groupID: vec3<u32>) {
+    let token = groupID.x;
+    let h = groupID.y;
+    let t = localID.x;
+    let slot = tokens[2u * token];
+    let valid = slot != NO_SEQUENCE;
+    // Padding tokens attend to no keys, they still take part in the barrier
+    let numKeys = select(0u, tokens[2u * token + 1u] + 1u, valid);
+    var q: array<f32, HS>;
+    var acc: array<f32, HS>;
+    for (var d = 0u; d < HS; d++) {
+        q[d] = SCALE * qkv[token * 3u * C + h * HS + d];
+        acc[d] = 0.0;
+    }
+    var runningMax: f32 = NEG_INFINITY;
+    var runningSum: f32 = 0.0;
+    for (var key = t; key < numKeys; key += THREADS) {
+        let block = blockTables[slot * MAX_BLOCKS + key / BLOCK];
+        let base = (block * BLOCK + key % BLOCK) * C + h * HS;
+        var score: f32 = 0.0;
+        for (var d = 0u; d < HS; d++) {
+            score += q[d] * keys[base + d];
+        }
+        let newMax = max(runningMax, score);
+        let correction = exp(runningMax - newMax);
+        let p = exp(score - newMax);
+        runningSum = runningSum * correction + p;
+        for (var d = 0u; d < HS; d++) {
+            acc[d] = acc[d] * correction + p * values[base + d];
+        }
+        runningMax = newMax;
+    }
+    maxes[t] = runningMax;
+    sums[t] = runningSum;
+    for (var d = 0u; d < HS; d++) {
+        accs[t * HS + d] = acc[d];
+    }
+    workgroupBarrier();
+    var globalMax: f32 = NEG_INFINITY;
+    for (var i = 0u; i < THREADS; i++) {
+        globalMax = max(globalMax, maxes[i]);
+    }
+    var total: f32 = 0.0;
+    for (var i = 0u; i < THREADS; i++) {
+        total += sums[i] * exp(maxes[i] - globalMax);
+    }
+    for (var d = t; d < HS; d += THREADS) {
+        var o: f32 = 0.0;
+        for (var i = 0u; i < THREADS; i++) {
+            o += accs[i * HS + d] * exp(maxes[i] - globalMax);
+        }
+        if (valid) {
+            out[token * C + h * HS + d] = o / total;
+        }
+    }
+}
+)";
+
+/* Generates KernelCode instances for the paged KV cache kernels, for
+ * numTokens new tokens per dispatch, C = NH * headSize channels, blocks of
+ * blockSize tokens and block tables of maxBlocks entries per sequence.
+ *
+ * kShaderPagedKVAppend takes a {256, 1, 1} workgroup size and is dispatched
+ * with {cdiv(numTokens * C, 256), 1, 1} workgroups, bindings are
+ * {qkv, tokens, blockTables, keys, values}.
+ *
+ * kShaderPagedAttention takes a {threads, 1, 1} workgroup size and is
+ * dispatched with {numTokens, NH, 1} workgroups, bindings are
+ * {qkv, tokens, blockTables, keys, values, out}.
+ * */
+KernelCode PagedKVShader(const char *shaderRaw, size_t threads,
+                         size_t numTokens, size_t C, size_t NH,
+                         size_t blockSize, size_t maxBlocks) {
+  assert(C % NH == 0);
+  size_t headSize = C / NH;
+  assert(threads * (headSize + 2) * sizeof(float) <= 16384);
+  char scale[32];
+  snprintf(scale, sizeof(scale), "%.9g", 1.0 / std::sqrt(headSize));
+  KernelCode shader(shaderRaw, threads, kf32);
+  replaceAll(shader.data, {{"{{C}}", std::to_string(C)},
+                           {"{{HEAD_SIZE}}", std::to_string(headSize)},
+                           {"{{BLOCK}}", std::to_string(blockSize)},
+                           {"{{MAX_BLOCKS}}", std::to_string(maxBlocks)},
+                           {"{{NUM_TOKENS}}", std::to_string(numTokens)},
+                           {"{{THREADS}}", std::to_string(threads)},
+                           {"{{SCALE}}", scale}});
+  return shader;
+}
+
 } // namespace gpu
 
 #endif // KERNELS_H
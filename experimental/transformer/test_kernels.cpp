@@ -1,13 +1,21 @@
+#include <algorithm>
 #include <array>
 #include <future>
 #include <memory>
 #include <random>
+#include <vector>
 
 #include "gpu.h"
 #include "utils/array_utils.h"
 #include "utils/logging.h"
 
+#include "experimental/primitives.h"
+#include "experimental/stream.h"
+#include "experimental/weights.h"
+#include "experimental/wgsl.h"
 #include "llmc/reference_impls.h"
+#include "kvcache.h"
+#include "scheduler.h"
 #include "shaders.h"
 
 using namespace gpu;
@@ -25,11 +33,12 @@ void testResidual(Context &ctx) {
   Tensor output = createTensor(ctx, {N}, kf32, outputArr.data());
   std::promise<void> promise;
   std::future<void> future = promise.get_future();
-  ShaderCode shaderCode = createShader(kShaderResidual, workgroupSize, kf32);
+  KernelCode shaderCode = KernelCode(kShaderResidual, workgroupSize, kf32);
   LOG(kDefLog, kInfo, "Shader Code :\n%s", shaderCode.data.c_str());
   Kernel op =
-      createKernel(ctx, createShader(kShaderResidual, workgroupSize, kf32),
-                   Bindings{input1, input2, output}, /* nthreads */ {N, 1, 1});
+      createKernel(ctx, KernelCode(kShaderResidual, workgroupSize, kf32),
+                   Bindings{input1, input2, output},
+                   /* nWorkgroups */ {cdiv(N, workgroupSize), 1, 1});
   dispatchKernel(ctx, op, promise);
   wait(ctx, future);
   toCPU(ctx, output, outputArr.data(), sizeof(outputArr));
@@ -44,6 +53,181 @@ void testResidual(Context &ctx) {
   LOG(kDefLog, kInfo, "Done with Residual Test");
 }
 
+void testResidualSlots(Context &ctx) {
+  struct SliceParams {
+    uint32_t offset;
+    uint32_t size;
+  };
+  constexpr size_t N = 1000;
+  constexpr size_t workgroupSize = 256;
+  std::vector<float> input1Arr(N);
+  std::vector<float> input2Arr(N);
+  range(input1Arr.data(), N);
+  range(input2Arr.data(), N);
+  std::vector<float> outputArr(N, 0.0f);
+  Tensor input1 = createTensor(ctx, {N}, kf32, input1Arr.data());
+  Tensor input2 = createTensor(ctx, {N}, kf32, input2Arr.data());
+  Tensor output = createTensor(ctx, {N}, kf32, outputArr.data());
+  KernelCode code = KernelCode(kShaderResidualSlice, workgroupSize, kf32);
+  code.constants = {{"SCALE", 2.0}};
+  // Two slices of different sizes dispatched with one kernel, the workgroup
+  // count covers the larger one
+  std::vector<SliceParams> slices = {{0, 300}, {300, 700}};
+  Kernel op = createKernel(ctx, code, Bindings{input1, input2, output},
+                           /* nWorkgroups */ {cdiv(700, workgroupSize), 1, 1},
+                           slices);
+  CommandBatch batch =
+      createCommandBatch(ctx, {BatchOp{op, 0}, BatchOp{op, 1}});
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchBatch(ctx, batch, promise);
+  wait(ctx, future);
+  toCPU(ctx, output, outputArr.data(), N * sizeof(float));
+  std::vector<float> refArr(N);
+  for (size_t i = 0; i < N; ++i) {
+    refArr[i] = input1Arr[i] + 2.0f * input2Arr[i];
+  }
+  bool passed = op.numParamSlots == 2 &&
+                isclose(outputArr.data(), refArr.data(), N, 0.0f);
+  assert(passed);
+  LOG(kDefLog, kInfo, "Residual with params slots passed? %d", passed);
+}
+
+void testPipelineReuse(Context &ctx) {
+  struct SliceParams {
+    uint32_t offset;
+    uint32_t size;
+  };
+  constexpr size_t workgroupSize = 256;
+  KernelCode code = KernelCode(kShaderResidualSlice, workgroupSize, kf32);
+  code.constants = {{"SCALE", 2.0}};
+  bool passed = true;
+  size_t pipelines = 0;
+  // Tensors of different sizes, bounded by the params, share one pipeline
+  for (size_t N : {1000, 3000}) {
+    std::vector<float> input1Arr(N);
+    std::vector<float> input2Arr(N);
+    range(input1Arr.data(), N);
+    range(input2Arr.data(), N);
+    std::vector<float> outputArr(N, 0.0f);
+    Tensor input1 = createTensor(ctx, {N}, kf32, input1Arr.data());
+    Tensor input2 = createTensor(ctx, {N}, kf32, input2Arr.data());
+    Tensor output = createTensor(ctx, {N}, kf32, outputArr.data());
+    Kernel op = createKernel(
+        ctx, code, Bindings{input1, input2, output},
+        /* nWorkgroups */ {cdiv(N, workgroupSize), 1, 1},
+        SliceParams{0, static_cast<uint32_t>(N)});
+    if (pipelines == 0) {
+      pipelines = ctx.pipelineCache.data.size();
+    }
+    passed &= ctx.pipelineCache.data.size() == pipelines;
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, op, promise);
+    wait(ctx, future);
+    toCPU(ctx, output, outputArr.data(), N * sizeof(float));
+    std::vector<float> refArr(N);
+    for (size_t i = 0; i < N; ++i) {
+      refArr[i] = input1Arr[i] + 2.0f * input2Arr[i];
+    }
+    passed &= isclose(outputArr.data(), refArr.data(), N, 0.0f);
+  }
+  assert(passed);
+  LOG(kDefLog, kInfo, "Pipeline reuse across sizes passed? %d", passed);
+}
+
+void testIndirectDispatch(Context &ctx) {
+  constexpr size_t N = 1024;
+  constexpr size_t workgroupSize = 256;
+  std::vector<float> input1Arr(N);
+  std::vector<float> input2Arr(N);
+  range(input1Arr.data(), N);
+  range(input2Arr.data(), N);
+  std::vector<float> outputArr(N, 0.0f);
+  Tensor input1 = createTensor(ctx, {N}, kf32, input1Arr.data());
+  Tensor input2 = createTensor(ctx, {N}, kf32, input2Arr.data());
+  Tensor output = createTensor(ctx, {N}, kf32, outputArr.data());
+  Kernel op =
+      createKernel(ctx, KernelCode(kShaderResidual, workgroupSize, kf32),
+                   Bindings{input1, input2, output},
+                   /* nWorkgroups */ {cdiv(N, workgroupSize), 1, 1});
+  // Only the first two workgroups run, regardless of op.nWorkgroups
+  std::array<uint32_t, 3> argsArr = {2, 1, 1};
+  Tensor args = createIndirectArgs(ctx);
+  toGPU(ctx, argsArr.data(), args);
+  setIndirectDispatch(ctx, op, args);
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchKernel(ctx, op, promise);
+  wait(ctx, future);
+  toCPU(ctx, output, outputArr.data(), N * sizeof(float));
+  std::vector<float> refArr(N, 0.0f);
+  for (size_t i = 0; i < 2 * workgroupSize; ++i) {
+    refArr[i] = input1Arr[i] + input2Arr[i];
+  }
+  bool passed = isclose(outputArr.data(), refArr.data(), N, 0.0f);
+  assert(passed);
+  LOG(kDefLog, kInfo, "Indirect dispatch passed? %d", passed);
+}
+
+void testWgslPreprocessor(Context &ctx) {
+  static const char *kShaderWeightedSum = R"(
+@group(0) @binding(0) var<storage, read_write> inp: array<{{precision}}>;
+@group(0) @binding(1) var<storage, read_write> out: array<{{precision}}>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) gid: vec3<u32>) {
+  let i: u32 = gid.x;
+  if (i >= {{N}}) {
+    return;
+  }
+  var sum: {{precision}} = 0.0;
+  // for (var j: u32 = 0; j < {{W}}; j++) is unrolled below
+  for (var j: u32 = 0; j < {{W}}; j++) {
+    sum += inp[i * {{W}} + j] * f32(j + 1);
+  }
+#if scaled
+  out[i] = {{scale}} * sum;
+#else
+  out[i] = sum;
+#endif
+}
+)";
+  constexpr size_t N = 1000;
+  constexpr size_t W = 4;
+  std::vector<float> inputArr(N * W);
+  range(inputArr.data(), N * W);
+  std::vector<float> outputArr(N);
+  std::vector<float> refArr(N);
+  Tensor input = createTensor(ctx, {N * W}, kf32, inputArr.data());
+  Tensor output = createTensor(ctx, {N}, kf32, outputArr.data());
+  bool passed = true;
+  for (bool scaled : {false, true}) {
+    KernelCode code = createKernelCode(
+        kShaderWeightedSum,
+        {{"N", N}, {"W", 4u}, {"scaled", scaled}, {"scale", 0.5f}},
+        {256, 1, 1}, kf32, WgslOptions{32});
+    // The loop is unrolled, the commented out one is left alone
+    passed &= code.data.find("for (") == code.data.rfind("for (");
+    Kernel op = createKernel(ctx, code, Bindings{input, output},
+                             {cdiv(N, 256), 1, 1});
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchKernel(ctx, op, promise);
+    wait(ctx, future);
+    toCPU(ctx, output, outputArr.data(), N * sizeof(float));
+    for (size_t i = 0; i < N; ++i) {
+      float sum = 0.0f;
+      for (size_t j = 0; j < W; ++j) {
+        sum += inputArr[i * W + j] * static_cast<float>(j + 1);
+      }
+      refArr[i] = scaled ? 0.5f * sum : sum;
+    }
+    passed &= isclose(outputArr.data(), refArr.data(), N, 0.0f);
+  }
+  assert(passed);
+  LOG(kDefLog, kInfo, "WGSL preprocessor passed? %d", passed);
+}
+
 void testHadamard(Context &ctx) {
   constexpr size_t N = 200000;
   constexpr size_t workgroupSize = 256;
@@ -55,13 +239,14 @@ void testHadamard(Context &ctx) {
   Tensor input1 = createTensor(ctx, {N}, kf32, input1Arr.data());
   Tensor input2 = createTensor(ctx, {N}, kf32, input2Arr.data());
   Tensor output = createTensor(ctx, {N}, kf32, outputArr.data());
-  ShaderCode shaderCode = createShader(kShaderHadamard, workgroupSize, kf32);
+  KernelCode shaderCode = KernelCode(kShaderHadamard, workgroupSize, kf32);
   LOG(kDefLog, kInfo, "Shader Code :\n%s", shaderCode.data.c_str());
   std::promise<void> promise;
   std::future<void> future = promise.get_future();
   Kernel op =
-      createKernel(ctx, createShader(kShaderHadamard, workgroupSize, kf32),
-                   Bindings{input1, input2, output}, /* nthreads */ {N, 1, 1});
+      createKernel(ctx, KernelCode(kShaderHadamard, workgroupSize, kf32),
+                   Bindings{input1, input2, output},
+                   /* nWorkgroups */ {cdiv(N, workgroupSize), 1, 1});
   dispatchKernel(ctx, op, promise);
   wait(ctx, future);
   LOG(kDefLog, kInfo, "%s",
@@ -83,7 +268,8 @@ void testMatmul(Context &ctx) {
   Tensor output = createTensor(ctx, {M, N}, kf32, outputArr.data());
   Kernel op = createKernel(
       ctx, MatmulShader(256, kShaderMatMul1, kf32, M, K, N),
-      Bindings{input1, input2, output}, /* nthreads */ {M * N, 1, 1});
+      Bindings{input1, input2, output},
+      /* nWorkgroups */ {cdiv(M * N, 256), 1, 1});
   std::promise<void> promise;
   std::future<void> future = promise.get_future();
   dispatchKernel(ctx, op, promise);
@@ -106,10 +292,67 @@ void testMatmul(Context &ctx) {
   assert(passed);
 }
 
+void testQuantizedMatmul(Context &ctx, NumType weightType, size_t M) {
+  static constexpr size_t K = 256;
+  static constexpr size_t N = 70; // not a multiple of the tile size
+  const int bits = weightType == ki8 ? 8 : 4;
+  const bool matvec = M == 1;
+  LOG(kDefLog, kInfo, "Starting Quantized %s Test (%d bit, M = %d)",
+      matvec ? "Matvec" : "Matmul", bits, M);
+  auto gen = std::mt19937(31415);
+  std::vector<float> inputArr(M * K);
+  std::vector<float> weightArr(N * K);
+  randn(inputArr.data(), inputArr.size(), gen);
+  randn(weightArr.data(), weightArr.size(), gen);
+  std::vector<uint32_t> packedArr(N * K * bits / 32);
+  std::vector<float> scalesArr(N * K / kQuantBlockSize);
+  quantize(weightArr.data(), N, K, bits, kQuantBlockSize, packedArr.data(),
+           scalesArr.data());
+  Tensor input = createTensor(ctx, {M, K}, kf32, inputArr.data());
+  Tensor weights = createTensor(ctx, {N, K}, weightType, packedArr.data());
+  Tensor scales = createTensor(ctx, {N * K / kQuantBlockSize}, kf32,
+                               scalesArr.data());
+  Tensor output = createTensor(ctx, {M, N}, kf32);
+  Shape workgroupSize = matvec ? Shape{256, 1, 1} : Shape{16, 16, 1};
+  Shape nWorkgroups = matvec ? Shape{N, 1, 1}
+                             : Shape{cdiv(N, 16), cdiv(M, 16), 1};
+  Kernel op = createKernel(
+      ctx,
+      QuantizedMatmulShader(workgroupSize,
+                            matvec ? kShaderMatvecQuantized
+                                   : kShaderMatmulQuantized,
+                            weightType, M, K, N),
+      Bindings{input, weights, scales, output}, nWorkgroups);
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchKernel(ctx, op, promise);
+  wait(ctx, future);
+  std::vector<float> outputArr(M * N);
+  toCPU(ctx, output, outputArr.data(), outputArr.size() * sizeof(float));
+
+  // Reference on the dequantized weights, which isolates the kernel from the
+  // quantization error
+  std::vector<float> dequantArr(N * K);
+  dequantize(packedArr.data(), scalesArr.data(), N, K, bits, kQuantBlockSize,
+             dequantArr.data());
+  std::vector<float> refOutputArr(M * N);
+  ref::matmul_forward_cpu(refOutputArr.data(), inputArr.data(),
+                          dequantArr.data(), nullptr, 1, M, K, N);
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(outputArr.data(), M, N, "Quantized Output").c_str());
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(refOutputArr.data(), M, N, "Quantized Reference Output")
+          .c_str());
+  bool passed = isclose(outputArr.data(), refOutputArr.data(), M * N);
+  assert(passed);
+  LOG(kDefLog, kInfo, "Quantized %s passed? %d", matvec ? "Matvec" : "Matmul",
+      passed);
+}
+
 void testTensorPool(Context &ctx) {
   LOG(kDefLog, kInfo, "Starting Tensor Pool Test");
   // Test using the tensor pool to prepare tensor buffers for kernel invocation
-  TensorPool pool = ctx.pool;
+  TensorPool &pool = ctx.pool;
   std::array<float, 6> inputArr = {1.0, 2.0, 3.0, 4.0, 5.0, 6.0};
   Tensor input = createTensor(ctx, {2, 3}, kf32, inputArr.data());
   Tensor output = createTensor(ctx, {2, 3}, kf32);
@@ -130,6 +373,59 @@ void testTensorPool(Context &ctx) {
   LOG(kDefLog, kInfo, "Done with Tensor Pool Test");
 }
 
+void testTelemetry(Context &ctx) {
+  static constexpr size_t N = 1024;
+  resetTelemetry(ctx);
+  Telemetry before = snapshotTelemetry(ctx);
+  std::vector<float> inputArr(N, 1.0f);
+  Tensor input = createTensor(ctx, {N}, kf32, inputArr.data());
+  Tensor output = createTensor(ctx, {N}, kf32);
+  KernelCode shader{kShaderGelu, 256, kf32};
+  shader.label = "telemetry_gelu";
+  Kernel op = createKernel(ctx, shader, Bindings{input, output},
+                           /* nWorkgroups */ {cdiv(N, 256), 1, 1});
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchKernel(ctx, op, promise);
+  wait(ctx, future);
+  std::vector<float> outputArr(N);
+  toCPU(ctx, output, outputArr.data(), N * sizeof(float));
+  Telemetry after = snapshotTelemetry(ctx);
+  FreeTensor(ctx.pool, input);
+  Telemetry freed = snapshotTelemetry(ctx);
+  // The params buffer of a kernel is untracked when the kernel is freed
+  struct SoftmaxParam {
+    uint32_t N;
+    uint32_t C;
+  };
+  Kernel paramsOp = createKernel(
+      ctx, KernelCode(kShaderSoftmax1, 256, kf32), Bindings{output, output},
+      /* nWorkgroups */ {1, 1, 1}, SoftmaxParam{32, N / 32});
+  Telemetry withParams = snapshotTelemetry(ctx);
+  FreeKernel(ctx.kernelPool, paramsOp);
+  Telemetry paramsFreed = snapshotTelemetry(ctx);
+  LOG(kDefLog, kInfo, "Telemetry:\n%s", toString(after).c_str());
+  bool passed =
+      after.liveBuffers[kStorageBuffer] ==
+          before.liveBuffers[kStorageBuffer] + 2 &&
+      after.liveBytes[kStorageBuffer] ==
+          before.liveBytes[kStorageBuffer] + 2 * N * sizeof(float) &&
+      after.dispatches == 1 && after.reads == 1 &&
+      after.bytesRead == N * sizeof(float) &&
+      after.bytesWritten >= N * sizeof(float) &&
+      after.kernels[op.telemetrySlot].label == "telemetry_gelu" &&
+      after.kernels[op.telemetrySlot].dispatches == 1 &&
+      freed.liveBuffers[kStorageBuffer] ==
+          after.liveBuffers[kStorageBuffer] - 1 &&
+      withParams.liveBuffers[kUniformBuffer] ==
+          freed.liveBuffers[kUniformBuffer] + 1 &&
+      paramsFreed.liveBuffers[kUniformBuffer] ==
+          freed.liveBuffers[kUniformBuffer] &&
+      paramsFreed.liveBytes[kUniformBuffer] == freed.liveBytes[kUniformBuffer];
+  assert(passed);
+  LOG(kDefLog, kInfo, "Telemetry passed? %d", passed);
+}
+
 void testGelu(Context &ctx) {
   static constexpr size_t N = 3072;
   std::array<float, N> inputArr;
@@ -141,9 +437,9 @@ void testGelu(Context &ctx) {
   Tensor geluIn = createTensor(ctx, {N}, kf32, inputArr.data());
   Tensor geluOut = createTensor(ctx, {N}, kf32, outputArr.data());
   LOG(kDefLog, kInfo, "Creating GELU Shader");
-  ShaderCode shader = createShader(kShaderGelu, 256, kf32);
+  KernelCode shader = KernelCode(kShaderGelu, 256, kf32);
   Kernel op = createKernel(ctx, shader, Bindings{geluIn, geluOut},
-                           /* nthreads */ {N, 1, 1});
+                           /* nWorkgroups */ {cdiv(N, 256), 1, 1});
   LOG(kDefLog, kInfo, "Workgroup size: %s",
       toString(shader.workgroupSize).c_str());
   LOG(kDefLog, kInfo, "dispatching GELU Shader");
@@ -188,9 +484,9 @@ void testLayerNorm(Context &ctx) {
   Tensor output = createTensor(ctx, {N, C}, kf32, outputArr.data());
   std::promise<void> promise;
   std::future<void> future = promise.get_future();
-  Kernel op = createKernel(ctx, createShader(kShaderLayerNorm1, 256, kf32),
+  Kernel op = createKernel(ctx, KernelCode(kShaderLayerNorm1, 256, kf32),
                            Bindings{input, weight, bias, output},
-                           /* n threads */ {N, 1, 1}, params);
+                           /* nWorkgroups */ {cdiv(N, 256), 1, 1}, params);
   dispatchKernel(ctx, op, promise);
   wait(ctx, future);
   toCPU(ctx, output, outputArr.data(), sizeof(outputArr));
@@ -234,8 +530,8 @@ void testSoftmax(Context &ctx) {
   std::promise<void> promise;
   std::future<void> future = promise.get_future();
   Kernel op = createKernel(
-      ctx, createShader(kShaderSoftmax1, 256, kf32), Bindings{input, output},
-      /* nthreads */ Shape{B * T, 1, 1}, SoftmaxParam{B * T, C});
+      ctx, KernelCode(kShaderSoftmax1, 256, kf32), Bindings{input, output},
+      /* nWorkgroups */ Shape{cdiv(B * T, 256), 1, 1}, SoftmaxParam{B * T, C});
   dispatchKernel(ctx, op, promise);
   wait(ctx, future);
   toCPU(ctx, output, outputArr.data(), sizeof(outputArr));
@@ -255,29 +551,535 @@ void testSoftmax(Context &ctx) {
   LOG(kDefLog, kInfo, "Done with Softmax Test");
 }
 
+void testFusedMatmulBiasGelu(Context &ctx) {
+  static constexpr size_t M = 33; // not multiples of the tile size
+  static constexpr size_t K = 72;
+  static constexpr size_t N = 70;
+  static constexpr size_t tile = 16;
+  auto gen = std::mt19937(31415);
+  std::vector<float> inputArr(M * K);
+  std::vector<float> weightArr(N * K);
+  std::vector<float> biasArr(N);
+  randn(inputArr.data(), inputArr.size(), gen);
+  randn(weightArr.data(), weightArr.size(), gen);
+  randn(biasArr.data(), biasArr.size(), gen);
+  Tensor input = createTensor(ctx, {M, K}, kf32, inputArr.data());
+  Tensor weight = createTensor(ctx, {N, K}, kf32, weightArr.data());
+  Tensor bias = createTensor(ctx, {N}, kf32, biasArr.data());
+  Tensor output = createTensor(ctx, {M, N}, kf32);
+  Kernel op = createKernel(
+      ctx, FusedMatmulShader(tile, kMatmulEpilogueBiasGelu, M, K, N),
+      Bindings{input, weight, bias, output},
+      /* nWorkgroups */ {cdiv(N, tile), cdiv(M, tile), 1});
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchKernel(ctx, op, promise);
+  wait(ctx, future);
+  std::vector<float> outputArr(M * N);
+  toCPU(ctx, output, outputArr.data(), outputArr.size() * sizeof(float));
+
+  std::vector<float> matmulArr(M * N);
+  std::vector<float> refOutputArr(M * N);
+  ref::matmul_forward_cpu(matmulArr.data(), inputArr.data(), weightArr.data(),
+                          biasArr.data(), 1, M, K, N);
+  ref::gelu_forward_cpu(refOutputArr.data(), matmulArr.data(), M * N);
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(outputArr.data(), M, N, "Fused Matmul Output").c_str());
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(refOutputArr.data(), M, N, "Fused Matmul Reference Output")
+          .c_str());
+  bool passed = isclose(outputArr.data(), refOutputArr.data(), M * N);
+  assert(passed);
+  LOG(kDefLog, kInfo, "Fused Matmul + Bias + GELU passed? %d", passed);
+}
+
+void testResidualLayerNorm(Context &ctx) {
+  static constexpr size_t N = 6;
+  static constexpr size_t C = 1000; // not a multiple of the workgroup size
+  std::mt19937 gen(31415);
+  std::vector<float> inputArr(N * C);
+  std::vector<float> residualArr(N * C);
+  std::vector<float> weightArr(C);
+  std::vector<float> biasArr(C);
+  randn(inputArr.data(), inputArr.size(), gen);
+  randn(residualArr.data(), residualArr.size(), gen);
+  randn(weightArr.data(), weightArr.size(), gen);
+  randn(biasArr.data(), biasArr.size(), gen);
+  Tensor input = createTensor(ctx, {N, C}, kf32, inputArr.data());
+  Tensor residual = createTensor(ctx, {N, C}, kf32, residualArr.data());
+  Tensor weight = createTensor(ctx, {C}, kf32, weightArr.data());
+  Tensor bias = createTensor(ctx, {C}, kf32, biasArr.data());
+  Tensor residOut = createTensor(ctx, {N, C}, kf32);
+  Tensor output = createTensor(ctx, {N, C}, kf32);
+  Kernel op = createKernel(
+      ctx, ResidualLayerNormShader(256, C),
+      Bindings{input, residual, weight, bias, residOut, output},
+      /* nWorkgroups */ {N, 1, 1});
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchKernel(ctx, op, promise);
+  wait(ctx, future);
+  std::vector<float> residOutArr(N * C);
+  std::vector<float> outputArr(N * C);
+  toCPU(ctx, residOut, residOutArr.data(), residOutArr.size() * sizeof(float));
+  toCPU(ctx, output, outputArr.data(), outputArr.size() * sizeof(float));
+
+  std::vector<float> refResidArr(N * C);
+  std::vector<float> refOutputArr(N * C);
+  ref::residual_forward_cpu(refResidArr.data(), inputArr.data(),
+                            residualArr.data(), N * C);
+  ref::layernorm_forward_cpu(refOutputArr.data(), refResidArr.data(),
+                             weightArr.data(), biasArr.data(), N, 1, C);
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(outputArr.data(), N, C, "Residual LayerNorm Output").c_str());
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(refOutputArr.data(), N, C,
+                  "Residual LayerNorm Reference Output")
+          .c_str());
+  bool passed = isclose(residOutArr.data(), refResidArr.data(), N * C) &&
+                isclose(outputArr.data(), refOutputArr.data(), N * C);
+  assert(passed);
+  LOG(kDefLog, kInfo, "Residual + LayerNorm passed? %d", passed);
+}
+
 void testAttention(Context &ctx) {
-  static constexpr size_t B = 6;
-  static constexpr size_t T = 32;   // token index
-  static constexpr size_t C = 3072; // input channels
-  static constexpr size_t QKV_DIM = 256;
-  static constexpr size_t N_HEADS = 12;
-  static constexpr size_t OC =
-      QKV_DIM * N_HEADS * 3; // output channels, 3 for Q, K, V
-  std::array<float, B * T * C> inputArr;
-  std::array<float, B * OC> outputArr;
-  std::array<float, C * OC> weightArr;
+  static constexpr size_t B = 2;
+  static constexpr size_t T = 70; // spans several query and key tiles
+  static constexpr size_t N_HEADS = 4;
+  static constexpr size_t C = 256; // N_HEADS * head size of 64
+  std::mt19937 gen(31415);
+  std::vector<float> qkvArr(B * T * 3 * C);
+  randn(qkvArr.data(), qkvArr.size(), gen);
+  Tensor qkv = createTensor(ctx, {B * T, 3 * C}, kf32, qkvArr.data());
+  Tensor output = createTensor(ctx, {B * T, C}, kf32);
+  Kernel op = createKernel(ctx, FlashAttentionShader(T, C, N_HEADS),
+                           Bindings{qkv, output},
+                           /* nWorkgroups */ {cdiv(T, 32), N_HEADS, B});
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchKernel(ctx, op, promise);
+  wait(ctx, future);
+  std::vector<float> outputArr(B * T * C);
+  toCPU(ctx, output, outputArr.data(), outputArr.size() * sizeof(float));
+
+  std::vector<float> refOutputArr(B * T * C);
+  std::vector<float> preattArr(B * N_HEADS * T * T);
+  std::vector<float> attArr(B * N_HEADS * T * T);
+  ref::attention_forward_cpu(refOutputArr.data(), preattArr.data(),
+                             attArr.data(), qkvArr.data(), B, T, C, N_HEADS);
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(outputArr.data(), B * T, C, "Attention Output").c_str());
+  LOG(kDefLog, kInfo, "%s",
+      show<float>(refOutputArr.data(), B * T, C, "Attention Reference Output")
+          .c_str());
+  bool passed = isclose(outputArr.data(), refOutputArr.data(), B * T * C);
+  assert(passed);
+  LOG(kDefLog, kInfo, "Flash Attention passed? %d", passed);
+}
+
+void testPagedKVCache(Context &ctx) {
+  static constexpr size_t N_HEADS = 2;
+  static constexpr size_t HEAD_SIZE = 16;
+  static constexpr size_t C = N_HEADS * HEAD_SIZE;
+  static constexpr size_t BLOCK_SIZE = 4;
+  static constexpr size_t MAX_TOKENS = 3; // concurrent decode streams
+  // Sequence 3 starts when sequence 0 finishes and has to reuse its blocks,
+  // at most 5 + 4 + 3 blocks are in use at the same time
+  const std::vector<size_t> lengths = {5, 20, 13, 9};
+  const std::vector<size_t> starts = {0, 0, 0, 5};
+  static constexpr size_t NUM_BLOCKS = 12;
+  std::mt19937 gen(31415);
+  std::vector<std::vector<float>> qkvArrs(lengths.size());
+  std::vector<std::vector<float>> refOutputArrs(lengths.size());
+  for (size_t s = 0; s < lengths.size(); ++s) {
+    size_t T = lengths[s];
+    qkvArrs[s].resize(T * 3 * C);
+    randn(qkvArrs[s].data(), qkvArrs[s].size(), gen);
+    refOutputArrs[s].resize(T * C);
+    std::vector<float> preattArr(N_HEADS * T * T);
+    std::vector<float> attArr(N_HEADS * T * T);
+    ref::attention_forward_cpu(refOutputArrs[s].data(), preattArr.data(),
+                               attArr.data(), qkvArrs[s].data(), 1, T, C,
+                               N_HEADS);
+  }
+
+  PagedKVCache cache =
+      createPagedKVCache(ctx, N_HEADS, HEAD_SIZE, NUM_BLOCKS, BLOCK_SIZE,
+                         MAX_TOKENS, /* maxBlocksPerSequence */ 5);
+  Tensor qkv = createTensor(ctx, {MAX_TOKENS, 3 * C}, kf32);
+  Tensor tokens = createTensor(ctx, {MAX_TOKENS * 2}, ku32);
+  Tensor output = createTensor(ctx, {MAX_TOKENS, C}, kf32);
+  Kernel append = createKVAppendKernel(ctx, cache, qkv, tokens, MAX_TOKENS);
+  Kernel attention =
+      createPagedAttentionKernel(ctx, cache, qkv, tokens, output, MAX_TOKENS);
+  CommandBatch step = createCommandBatch(ctx, {append, attention});
+
+  std::vector<size_t> slots(lengths.size(), kNoSequence);
+  std::vector<size_t> decoded(lengths.size(), 0);
+  bool passed = true;
+  for (size_t iter = 0; passed; ++iter) {
+    // Finished sequences free their blocks before new ones are admitted
+    for (size_t s = 0; s < lengths.size(); ++s) {
+      if (slots[s] != kNoSequence && decoded[s] == lengths[s]) {
+        freeSequence(cache, slots[s]);
+        slots[s] = kNoSequence;
+      }
+    }
+    for (size_t s = 0; s < lengths.size(); ++s) {
+      if (iter == starts[s] && decoded[s] == 0) {
+        slots[s] = addSequence(cache);
+        assert(slots[s] != kNoSequence);
+      }
+    }
+    std::vector<uint32_t> tokenTable;
+    std::vector<float> qkvArr(MAX_TOKENS * 3 * C, 0.0f);
+    std::vector<size_t> stepSequences;
+    for (size_t s = 0; s < lengths.size(); ++s) {
+      if (slots[s] == kNoSequence) {
+        continue;
+      }
+      bool reserved = appendTokens(cache, slots[s], 1, tokenTable);
+      assert(reserved);
+      std::copy_n(&qkvArrs[s][decoded[s] * 3 * C], 3 * C,
+                  &qkvArr[stepSequences.size() * 3 * C]);
+      stepSequences.push_back(s);
+    }
+    if (stepSequences.empty()) {
+      break;
+    }
+    tokenTable.resize(MAX_TOKENS * 2, kNoSequence);
+    syncBlockTables(ctx, cache);
+    toGPU(ctx, qkvArr.data(), qkv);
+    toGPU(ctx, tokenTable.data(), tokens);
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    dispatchBatch(ctx, step, promise);
+    wait(ctx, future);
+    resetCommandBuffer(ctx.device, step);
+    std::vector<float> outputArr(MAX_TOKENS * C);
+    toCPU(ctx, output, outputArr.data(), outputArr.size() * sizeof(float));
+    for (size_t i = 0; i < stepSequences.size(); ++i) {
+      size_t s = stepSequences[i];
+      passed &= isclose(&outputArr[i * C], &refOutputArrs[s][decoded[s] * C],
+                        C);
+      decoded[s]++;
+    }
+  }
+  for (size_t s = 0; s < lengths.size(); ++s) {
+    passed &= decoded[s] == lengths[s];
+  }
+  // All sequences finished and returned their blocks
+  passed &= cache.freeBlocks.size() == NUM_BLOCKS;
+  assert(passed);
+  LOG(kDefLog, kInfo, "Paged KV Cache passed? %d", passed);
+}
+
+void testDecodeScheduler(Context &ctx) {
+  static constexpr size_t N_HEADS = 2;
+  static constexpr size_t HEAD_SIZE = 16;
+  static constexpr size_t C = N_HEADS * HEAD_SIZE;
+  static constexpr size_t BLOCK_SIZE = 4;
+  // Three slots and ten blocks for five sequences, later sequences wait for
+  // earlier ones to finish
+  static constexpr size_t NUM_BLOCKS = 10;
+  const std::vector<size_t> lengths = {6, 17, 9, 12, 4};
+  const std::vector<size_t> prompts = {4, 1, 6, 0, 3};
+  std::mt19937 gen(27182);
+  std::vector<std::vector<float>> qkvArrs(lengths.size());
+  std::vector<std::vector<float>> refOutputArrs(lengths.size());
+  for (size_t s = 0; s < lengths.size(); ++s) {
+    size_t T = lengths[s];
+    qkvArrs[s].resize(T * 3 * C);
+    randn(qkvArrs[s].data(), qkvArrs[s].size(), gen);
+    refOutputArrs[s].resize(T * C);
+    std::vector<float> preattArr(N_HEADS * T * T);
+    std::vector<float> attArr(N_HEADS * T * T);
+    ref::attention_forward_cpu(refOutputArrs[s].data(), preattArr.data(),
+                               attArr.data(), qkvArrs[s].data(), 1, T, C,
+                               N_HEADS);
+  }
+
+  PagedKVCache cache =
+      createPagedKVCache(ctx, N_HEADS, HEAD_SIZE, NUM_BLOCKS, BLOCK_SIZE,
+                         /* maxSequences */ 3, /* maxBlocksPerSequence */ 5);
+  DecodeScheduler scheduler = createDecodeScheduler(
+      cache, {1, 2, 4, 8},
+      [](Context &ctx, PagedKVCache &cache, DecodeStep &step) {
+        Tensor qkv = createTensor(ctx, {step.bucket, 3 * C}, kf32);
+        Tensor output = createTensor(ctx, {step.bucket, C}, kf32);
+        step.tensors = {qkv, output};
+        step.kernels.push_back(
+            createKVAppendKernel(ctx, cache, qkv, step.tokens, step.bucket));
+        step.kernels.push_back(createPagedAttentionKernel(
+            ctx, cache, qkv, step.tokens, output, step.bucket));
+      });
+  for (size_t s = 0; s < lengths.size(); ++s) {
+    submitSequence(scheduler, s, prompts[s], lengths[s]);
+  }
+
+  std::vector<size_t> checked(lengths.size(), 0);
+  bool passed = true;
+  size_t steps = 0;
+  while (hasWork(scheduler) && passed) {
+    DecodeBatch batch = scheduleStep(ctx, scheduler);
+    if (!batch.step) {
+      continue;
+    }
+    size_t bucket = batch.step->bucket;
+    std::vector<float> qkvArr(bucket * 3 * C, 0.0f);
+    for (const DecodeEntry &entry : batch.entries) {
+      std::copy_n(&qkvArrs[entry.id][entry.position * 3 * C],
+                  entry.numTokens * 3 * C, &qkvArr[entry.row * 3 * C]);
+    }
+    toGPU(ctx, qkvArr.data(), batch.step->tensors[0]);
+    runStep(ctx, batch);
+    std::vector<float> outputArr(bucket * C);
+    toCPU(ctx, batch.step->tensors[1], outputArr.data(),
+          outputArr.size() * sizeof(float));
+    for (const DecodeEntry &entry : batch.entries) {
+      passed &= entry.position == checked[entry.id];
+      passed &= isclose(&outputArr[entry.row * C],
+                        &refOutputArrs[entry.id][entry.position * C],
+                        entry.numTokens * C);
+      checked[entry.id] += entry.numTokens;
+    }
+    ++steps;
+  }
+  for (size_t s = 0; s < lengths.size(); ++s) {
+    passed &= checked[s] == lengths[s];
+  }
+  passed &= cache.freeBlocks.size() == NUM_BLOCKS;
+  assert(passed);
+  LOG(kDefLog, kInfo, "Decode scheduler passed? %d in %zu steps", passed,
+      steps);
+}
+
+void testWeightFile(Context &ctx) {
+  static constexpr size_t M = 33;
+  static constexpr size_t N = 7;
+  std::mt19937 gen(16180);
+  std::vector<float> qkvArr(M * N);
+  randn(qkvArr.data(), qkvArr.size(), gen);
+  // An odd number of halves exercises the padding of the buffer size
+  std::vector<half> biasArr(N);
+  for (size_t i = 0; i < N; ++i) {
+    biasArr[i] = static_cast<float>(i) - 3.0f;
+  }
+  const std::string path = "build/test_weights.safetensors";
+  bool passed = saveWeights(path, {"qkv", "bias"}, {{M, N}, {N}},
+                            {kf32, kf16}, {qkvArr.data(), biasArr.data()});
+  WeightFile weights;
+  passed &= openWeights(path, weights);
+  passed &= weights.entries.size() == 2 && !weights.entries["qkv"].loaded;
+  Tensor qkv = getWeight(ctx, weights, "qkv");
+  Tensor bias = getWeight(ctx, weights, "bias");
+  passed &= getWeight(ctx, weights, "qkv").data.buffer == qkv.data.buffer;
+  std::vector<float> qkvOut(M * N);
+  std::vector<float> biasOut(N);
+  toCPU(ctx, qkv, qkvOut.data(), qkvOut.size() * sizeof(float));
+  toCPU(ctx, bias, biasOut.data(), biasOut.size() * sizeof(float));
+  passed &= qkv.shape[0] == M && qkv.shape[1] == N && bias.dtype == kf16;
+  passed &= qkvOut == qkvArr;
+  for (size_t i = 0; i < N; ++i) {
+    passed &= biasOut[i] == static_cast<float>(i) - 3.0f;
+  }
+  // A shape of more than Shape::kMaxRank dims is rejected, not copied
+  const std::string badPath = "build/test_weights_rank.safetensors";
+  std::string header = "{\"w\":{\"dtype\":\"F32\",\"shape\":"
+                       "[1,1,1,1,1,1,1,1,1],\"data_offsets\":[0,4]}}";
+  uint8_t headerSize[8] = {static_cast<uint8_t>(header.size())};
+  FILE *file = fopen(badPath.c_str(), "wb");
+  passed &= file != nullptr;
+  if (file) {
+    fwrite(headerSize, 1, 8, file);
+    fwrite(header.data(), 1, header.size(), file);
+    fwrite(qkvArr.data(), sizeof(float), 1, file);
+    fclose(file);
+  }
+  WeightFile badWeights;
+  passed &= !openWeights(badPath, badWeights);
+  assert(passed);
+  LOG(kDefLog, kInfo, "Weight file passed? %d", passed);
+}
+
+void testStream(Context &ctx) {
+  // Sums pairs of words, so the output chunks are half the input chunks
+  static const char *kShaderPairSum = R"(
+@group(0) @binding(0) var<storage, read_write> inp: array<u32>;
+@group(0) @binding(1) var<storage, read_write> out: array<u32>;
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) gid: vec3<u32>) {
+  let i: u32 = gid.x;
+  if (i < arrayLength(&out)) {
+    out[i] = inp[2 * i] + inp[2 * i + 1];
+  }
+}
+)";
+  // 3 full chunks of 256 words and a partial one, through 2 slots
+  constexpr size_t N = 1000;
+  constexpr size_t chunkWords = 256;
+  std::vector<uint32_t> inputArr(N);
+  for (size_t i = 0; i < N; ++i) {
+    inputArr[i] = static_cast<uint32_t>(3 * i + 1);
+  }
+  std::vector<uint32_t> refArr(N / 2);
+  for (size_t i = 0; i < N / 2; ++i) {
+    refArr[i] = inputArr[2 * i] + inputArr[2 * i + 1];
+  }
+  StreamConfig config;
+  config.chunkSize = chunkWords * sizeof(uint32_t);
+  config.outputChunkSize = config.chunkSize / 2;
+  StreamPipeline pipeline = createStreamPipeline(
+      ctx, config,
+      [](Context &ctx, const Tensor &input, const Tensor &output) {
+        return createKernel(ctx, KernelCode(kShaderPairSum, 64, ku32),
+                            Bindings{input, output},
+                            {cdiv(chunkWords / 2, 64), 1, 1});
+      });
+
+  std::vector<uint32_t> outputArr(N / 2, 0);
+  StreamSource memorySource =
+      streamFromMemory(inputArr.data(), N * sizeof(uint32_t));
+  bool passed =
+      runStream(pipeline, memorySource, streamToMemory(outputArr.data()));
+  passed &= outputArr == refArr;
+
+  // Same stream between files
+  const std::string inputPath = "build/test_stream_input.bin";
+  const std::string outputPath = "build/test_stream_output.bin";
+  FILE *file = fopen(inputPath.c_str(), "wb");
+  passed &= file && fwrite(inputArr.data(), sizeof(uint32_t), N, file) == N;
+  if (file) {
+    fclose(file);
+  }
+  StreamSource source;
+  StreamSink sink;
+  passed &= streamFromFile(inputPath, source) && streamToFile(outputPath, sink);
+  passed &= runStream(pipeline, source, sink);
+  sink = {}; // closes the output file
+  std::vector<uint32_t> fileArr(N / 2, 0);
+  file = fopen(outputPath.c_str(), "rb");
+  passed &= file && fread(fileArr.data(), sizeof(uint32_t), N / 2, file) ==
+                        N / 2;
+  if (file) {
+    fclose(file);
+  }
+  passed &= fileArr == refArr;
+  assert(passed);
+  LOG(kDefLog, kInfo, "Stream passed? %d", passed);
+}
+
+void testPrimitives(Context &ctx) {
+  // Sizes which need several reduce and scan levels and partial blocks
+  static constexpr size_t N = 300000;
+  static constexpr size_t K = 5;
+  std::mt19937 gen(27182);
+  std::vector<float> scoresArr(N);
+  randn(scoresArr.data(), N, gen);
+  std::vector<uint32_t> countsArr(N);
+  std::uniform_int_distribution<uint32_t> dist(0, 7);
+  for (size_t i = 0; i < N; ++i) {
+    countsArr[i] = dist(gen);
+  }
+  std::vector<uint32_t> keysArr(N);
+  std::vector<uint32_t> valuesArr(N);
+  std::uniform_int_distribution<uint32_t> keyDist;
+  for (size_t i = 0; i < N; ++i) {
+    keysArr[i] = keyDist(gen);
+    valuesArr[i] = static_cast<uint32_t>(i);
+  }
+  Tensor scores = createTensor(ctx, Shape{N}, kf32, scoresArr.data());
+  Tensor counts = createTensor(ctx, Shape{N}, ku32, countsArr.data());
+  Tensor offsets = createTensor(ctx, Shape{N}, ku32);
+  Tensor keys = createTensor(ctx, Shape{N}, ku32, keysArr.data());
+  Tensor values = createTensor(ctx, Shape{N}, ku32, valuesArr.data());
+
+  Reduction maxReduction = createReduction(ctx, scores, kReduceMax);
+  Reduction argmax = createReduction(ctx, scores, kReduceArgmax);
+  PrefixScan scan = createPrefixScan(ctx, counts, offsets);
+  RadixSort sort = createRadixSort(ctx, keys, values);
+  TopK top = createTopK(ctx, scores, K);
+  runReduction(ctx, maxReduction);
+  runReduction(ctx, argmax);
+  runPrefixScan(ctx, scan);
+  runRadixSort(ctx, sort);
+  runTopK(ctx, top);
+
+  float maxOut, argmaxValue;
+  uint32_t argmaxIndex, total;
+  toCPU(ctx, maxReduction.result, &maxOut, sizeof(float));
+  toCPU(ctx, argmax.result, &argmaxValue, sizeof(float));
+  toCPU(ctx, argmax.resultIndex, &argmaxIndex, sizeof(uint32_t));
+  toCPU(ctx, scan.total, &total, sizeof(uint32_t));
+  std::vector<uint32_t> offsetsOut(N), keysOut(N), valuesOut(N);
+  toCPU(ctx, offsets, offsetsOut.data(), N * sizeof(uint32_t));
+  toCPU(ctx, keys, keysOut.data(), N * sizeof(uint32_t));
+  toCPU(ctx, values, valuesOut.data(), N * sizeof(uint32_t));
+  std::array<float, K> topValues;
+  std::array<uint32_t, K> topIndices;
+  toCPU(ctx, top.values, topValues.data(), sizeof(topValues));
+  toCPU(ctx, top.indices, topIndices.data(), sizeof(topIndices));
+
+  size_t refArgmax = std::max_element(scoresArr.begin(), scoresArr.end()) -
+                     scoresArr.begin();
+  bool passed = maxOut == scoresArr[refArgmax];
+  passed &= argmaxIndex == refArgmax && argmaxValue == maxOut;
+  uint32_t sum = 0;
+  for (size_t i = 0; i < N; ++i) {
+    passed &= offsetsOut[i] == sum;
+    sum += countsArr[i];
+  }
+  passed &= total == sum;
+  std::vector<size_t> order(N);
+  for (size_t i = 0; i < N; ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return keysArr[a] < keysArr[b];
+  });
+  for (size_t i = 0; i < N; ++i) {
+    passed &= keysOut[i] == keysArr[order[i]] && valuesOut[i] == order[i];
+  }
+  for (size_t i = 0; i < N; ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return scoresArr[a] > scoresArr[b];
+  });
+  for (size_t i = 0; i < K; ++i) {
+    passed &= topIndices[i] == order[i] && topValues[i] == scoresArr[order[i]];
+  }
+  assert(passed);
+  LOG(kDefLog, kInfo, "Primitives passed? %d", passed);
 }
 
 int main(int argc, char **argv) {
   Context ctx = createContext();
 
   testTensorPool(ctx);
+  testTelemetry(ctx);
   testResidual(ctx);
+  testResidualSlots(ctx);
+  testPipelineReuse(ctx);
+  testIndirectDispatch(ctx);
+  testWgslPreprocessor(ctx);
   testHadamard(ctx);
   testMatmul(ctx);
+  testQuantizedMatmul(ctx, ki8, 33);
+  testQuantizedMatmul(ctx, kq4, 33);
+  testQuantizedMatmul(ctx, ki8, 1);
+  testQuantizedMatmul(ctx, kq4, 1);
   testGelu(ctx);
   testLayerNorm(ctx);
   testSoftmax(ctx);
+  testFusedMatmulBiasGelu(ctx);
+  testResidualLayerNorm(ctx);
+  testAttention(ctx);
+  testPagedKVCache(ctx);
+  testDecodeScheduler(ctx);
+  testWeightFile(ctx);
+  testStream(ctx);
+  testPrimitives(ctx);
 
   LOG(kDefLog, kInfo, "Done with all tests");
 }
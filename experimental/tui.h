@@ -4,6 +4,13 @@
 #include <array>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "experimental/wgsl.h" // createKernelCode
+#include "gpu.h"
 
 // Work-in-progress - various terminal UI visualization functions
 
@@ -61,7 +68,316 @@ void rasterize(float *pos, size_t n, float maxX, float maxY, std::string &screen
 }
 
 
+/*
+ * GPU raster stage
+ *
+ * Instead of reading back a float per pixel (or the positions of every
+ * simulated object) and converting to characters on the CPU, a raster maps
+ * values to glyphs on the GPU. Each cell is one byte, the index of its glyph,
+ * packed 4 cells per u32 word. Cells are grouped into tiles of
+ * kRasterTileWords words; the shading kernel compares each tile to the
+ * previous frame and appends the tiles that changed to a delta buffer,
+ *
+ *   [count, (tile index, kRasterTileWords words) * count]
+ *
+ * so a frame reads back only the changed cells.
+ */
+
+static constexpr size_t kRasterTileWords = 64;
+
+// Maps values of a field (or counts of a scatter) to glyph indices and
+// appends the changed tiles to the delta buffer. One workgroup per tile.
+static const char *kShaderRasterShade = R"(
+#if counts
+@group(0) @binding(0) var<storage, read_write> values: array<atomic<u32>>;
+#else
+@group(0) @binding(0) var<storage, read_write> values: array<f32>;
+#endif
+@group(0) @binding(1) var<storage, read_write> cells: array<u32>;
+@group(0) @binding(2) var<storage, read_write> delta: Delta;
+
+struct Delta {
+  count: atomic<u32>,
+  tiles: array<u32>,
+};
+
+const kTileWords: u32 = {{tileWords}};
+const kMaxGlyph: f32 = f32({{numGlyphs}} - 1);
+
+var<workgroup> changed: atomic<u32>;
+var<workgroup> slot: u32;
+
+fn glyph(cell: u32) -> u32 {
+#if counts
+  // Counts are cleared for the next frame's scatter
+  let value = f32(atomicExchange(&values[cell], 0u));
+#else
+  let value = values[cell];
+#endif
+  let t = (value - {{minValue}}) / ({{maxValue}} - {{minValue}});
+  return u32(clamp(t * kMaxGlyph, 0.0, kMaxGlyph));
+}
+
+@compute @workgroup_size({{tileWords}})
+fn main(@builtin(local_invocation_index) lid: u32,
+        @builtin(workgroup_id) wid: vec3<u32>) {
+  let tile = wid.x;
+  let w = tile * kTileWords + lid;
+  var word = 0u;
+  if (w < {{numWords}}) {
+    for (var k = 0u; k < 4u; k++) {
+      let cell = 4u * w + k;
+      if (cell < {{numCells}}) {
+        word |= glyph(cell) << (8u * k);
+      }
+    }
+    if (word != cells[w]) {
+      cells[w] = word;
+      atomicStore(&changed, 1u);
+    }
+  }
+  workgroupBarrier();
+  if (lid == 0u && atomicLoad(&changed) != 0u) {
+    // Slots are 1-based, 0 means the tile is unchanged
+    slot = atomicAdd(&delta.count, 1u) + 1u;
+  }
+  workgroupBarrier();
+  let s = slot;
+  if (s == 0u) {
+    return;
+  }
+  let base = (s - 1u) * (kTileWords + 1u);
+  if (lid == 0u) {
+    delta.tiles[base] = tile;
+  }
+  if (w < {{numWords}}) {
+    delta.tiles[base + 1u + lid] = word;
+  }
+}
+)";
+
+// Counts the points (x, y pairs) within a distance of 1 of each cell, with x in
+// [-maxX, maxX] left to right and y in [-maxY, maxY] bottom to top.
+static const char *kShaderRasterScatter = R"(
+@group(0) @binding(0) var<storage, read_write> points: array<f32>;
+@group(0) @binding(1) var<storage, read_write> counts: array<atomic<u32>>;
+
+@compute @workgroup_size({{workgroupSize}})
+fn main(@builtin(global_invocation_id) gid: vec3<u32>) {
+  let i = gid.x;
+  if (i >= {{numPoints}}) {
+    return;
+  }
+  let nx = (1.0 + points[2u * i] / {{maxX}}) / 2.0 * f32({{cols}});
+  // negate y since it extends from top to bottom
+  let ny = (1.0 - points[2u * i + 1u] / {{maxY}}) / 2.0 * f32({{rows}});
+  // Only the 2 x 2 cells around the point can be closer than 1
+  for (var dy = 0; dy < 2; dy++) {
+    for (var dx = 0; dx < 2; dx++) {
+      let x = floor(nx) + f32(dx);
+      let y = floor(ny) + f32(dy);
+      if (x >= 0.0 && x < f32({{cols}}) && y >= 0.0 && y < f32({{rows}}) &&
+          length(vec2<f32>(nx - x, ny - y)) < 1.0) {
+        atomicAdd(&counts[u32(y) * {{cols}} + u32(x)], 1u);
+      }
+    }
+  }
+}
+)";
+
+/**
+ * @brief Character screen rendered on the GPU, see createRaster() and
+ * createScatterRaster(). screen holds the rows of glyphs separated by
+ * newlines, and is updated in place by updateRaster().
+ */
+struct Raster {
+  size_t rows = 0;
+  size_t cols = 0;
+  std::string glyphs;
+  std::string screen;     // rows * (cols + 1) characters
+  Tensor cells;           // packed glyph indices of the last frame
+  Tensor delta;           // changed tiles of the last frame
+  Tensor counts;          // per cell point counts, scatter rasters only
+  std::vector<Kernel> kernels; // [scatter,] shade, referenced by batch
+  CommandBatch batch;
+  std::vector<uint32_t> deltaArr;
+  size_t numTiles = 0;
+  size_t budget = 1;      // tiles read back along with the count
+  size_t dirtyTiles = 0;  // tiles changed in the last update
+  size_t bytesRead = 0;   // bytes read back in the last update
+};
+
+/**
+ * @brief Creates the shading kernel, cells and delta buffers of a raster
+ * reading values.
+ */
+inline void initRaster(Context &ctx, Raster &raster, Tensor &values,
+                       size_t rows, size_t cols, float minValue,
+                       float maxValue, const std::string &glyphs,
+                       bool counts) {
+  assert(!glyphs.empty() && glyphs.size() <= 256);
+  raster.rows = rows;
+  raster.cols = cols;
+  raster.glyphs = glyphs;
+  size_t numCells = rows * cols;
+  size_t numWords = cdiv(numCells, 4);
+  raster.numTiles = cdiv(numWords, kRasterTileWords);
+  raster.cells = createTensor(ctx, {numWords}, ku32);
+  raster.delta =
+      createTensor(ctx, {1 + raster.numTiles * (kRasterTileWords + 1)}, ku32);
+  raster.deltaArr.resize(raster.delta.data.size / sizeof(uint32_t));
+  // The cells start out zeroed, i.e. as the first glyph
+  raster.screen.assign(rows * (cols + 1), glyphs[0]);
+  for (size_t row = 0; row < rows; ++row) {
+    raster.screen[row * (cols + 1) + cols] = '\n';
+  }
+  KernelCode code = createKernelCode(kShaderRasterShade,
+                                     {{"counts", counts},
+                                      {"tileWords", kRasterTileWords},
+                                      {"numGlyphs", glyphs.size()},
+                                      {"numCells", numCells},
+                                      {"numWords", numWords},
+                                      {"minValue", minValue},
+                                      {"maxValue", maxValue}},
+                                     {kRasterTileWords, 1, 1});
+  code.label = "raster_shade";
+  raster.kernels.push_back(createKernel(
+      ctx, code, Bindings{values, raster.cells, raster.delta},
+      /* nWorkgroups */ {raster.numTiles, 1, 1}));
+  raster.batch = createCommandBatch(
+      ctx, std::vector<BatchOp>(raster.kernels.begin(), raster.kernels.end()));
+}
+
+/**
+ * @brief Creates a raster mapping the values of a rows x cols field to glyphs,
+ * minValue to the first and maxValue to the last glyph.
+ * @param[in] ctx Context instance to manage the raster
+ * @param[in] field Tensor of rows * cols f32 values, row major
+ * @param[in] rows Number of rows of the screen
+ * @param[in] cols Number of columns of the screen
+ * @param[in] minValue Value shown as the first glyph
+ * @param[in] maxValue Value shown as the last glyph
+ * @param[in] glyphs Glyphs from low to high values, at most 256
+ * @return Raster instance
+ *
+ * @code
+ * Raster raster = createRaster(ctx, screen, 64, 96, 0.0, 1.0);
+ * @endcode
+ */
+inline Raster createRaster(Context &ctx, Tensor &field, size_t rows,
+                           size_t cols, float minValue = 0.0,
+                           float maxValue = 1.0,
+                           const std::string &glyphs = " .`'^-+=*x17X$8#%@") {
+  Raster raster;
+  initRaster(ctx, raster, field, rows, cols, minValue, maxValue, glyphs,
+             /* counts */ false);
+  return raster;
+}
+
+/**
+ * @brief Creates a raster drawing point positions, each cell showing the
+ * number of points within a distance of 1 of it. Counts of 0 to maxCount map
+ * to the glyphs from first to last.
+ * @param[in] ctx Context instance to manage the raster
+ * @param[in] points Tensor of numPoints x, y pairs of f32
+ * @param[in] numPoints Number of points
+ * @param[in] rows Number of rows of the screen
+ * @param[in] cols Number of columns of the screen
+ * @param[in] maxX Points with x in [-maxX, maxX] are shown left to right
+ * @param[in] maxY Points with y in [-maxY, maxY] are shown bottom to top
+ * @param[in] maxCount Count shown as the last glyph
+ * @param[in] glyphs Glyphs from low to high counts, at most 256
+ * @return Raster instance
+ *
+ * @code
+ * Raster raster = createScatterRaster(ctx, pos, 2 * N, 40, 80, 2.0, 2.0);
+ * @endcode
+ */
+inline Raster
+createScatterRaster(Context &ctx, Tensor &points, size_t numPoints,
+                    size_t rows, size_t cols, float maxX, float maxY,
+                    float maxCount = 34.0,
+                    const std::string &glyphs = " .`'^-+=*x17X$8#%@") {
+  Raster raster;
+  raster.counts = createTensor(ctx, {rows * cols}, ku32);
+  KernelCode code = createKernelCode(kShaderRasterScatter,
+                                     {{"numPoints", numPoints},
+                                      {"rows", rows},
+                                      {"cols", cols},
+                                      {"maxX", maxX},
+                                      {"maxY", maxY}},
+                                     {256, 1, 1});
+  code.label = "raster_scatter";
+  // Reserved so that the kernels don't move when the shading kernel is added
+  raster.kernels.reserve(2);
+  raster.kernels.push_back(
+      createKernel(ctx, code, Bindings{points, raster.counts},
+                   /* nWorkgroups */ {cdiv(numPoints, 256), 1, 1}));
+  initRaster(ctx, raster, raster.counts, rows, cols, 0.0, maxCount, glyphs,
+             /* counts */ true);
+  return raster;
+}
 
+/**
+ * @brief Renders a frame of the raster from the current contents of its input
+ * tensor, and updates raster.screen with the cells that changed. Work
+ * submitted before, e.g. a simulation step, completes before the raster
+ * reads its input.
+ *
+ * The count of changed tiles is read along with as many tiles as changed in
+ * the previous frame, the rest (if any) with a second readback.
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] raster Raster instance to update
+ * @return Number of tiles that changed
+ *
+ * @code
+ * updateRaster(ctx, raster);
+ * printf("%s", raster.screen.c_str());
+ * @endcode
+ */
+inline size_t updateRaster(Context &ctx, Raster &raster) {
+  const size_t tileSize = (kRasterTileWords + 1) * sizeof(uint32_t);
+  const uint32_t zero = 0;
+  toGPU(ctx, &zero, raster.delta.data.buffer, sizeof(zero));
+  std::promise<void> promise;
+  std::future<void> future = promise.get_future();
+  dispatchBatch(ctx, raster.batch, promise);
+  size_t budget = std::min(raster.budget, raster.numTiles);
+  size_t size = sizeof(uint32_t) + budget * tileSize;
+  std::future<void> readback =
+      toCPUAsync(ctx, raster.delta, raster.deltaArr.data(), size);
+  resetCommandBuffer(ctx.device, raster.batch);
+  wait(ctx, readback);
+  wait(ctx, future);
+  size_t count = raster.deltaArr[0];
+  raster.bytesRead = size;
+  if (count > budget) {
+    readback = toCPUAsync(
+        ctx, raster.delta,
+        reinterpret_cast<char *>(raster.deltaArr.data()) + size,
+        (count - budget) * tileSize, size);
+    wait(ctx, readback);
+    raster.bytesRead += (count - budget) * tileSize;
+  }
+  raster.budget = std::max<size_t>(1, count);
+  raster.dirtyTiles = count;
+  const size_t numCells = raster.rows * raster.cols;
+  for (size_t i = 0; i < count; ++i) {
+    const uint32_t *entry =
+        &raster.deltaArr[1 + i * (kRasterTileWords + 1)];
+    size_t firstCell = entry[0] * kRasterTileWords * 4;
+    for (size_t c = 0; c < kRasterTileWords * 4; ++c) {
+      size_t cell = firstCell + c;
+      if (cell >= numCells) {
+        break;
+      }
+      uint32_t index = (entry[1 + c / 4] >> (8 * (c % 4))) & 0xFF;
+      raster.screen[cell / raster.cols * (raster.cols + 1) +
+                    cell % raster.cols] = raster.glyphs[index];
+    }
+  }
+  return count;
+}
 
 } // namespace gpu
 
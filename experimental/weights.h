@@ -0,0 +1,452 @@
+/*
+ * weights.h
+ *
+ * This file contains a loader for weight files in the safetensors format
+ * (https://github.com/huggingface/safetensors). The file is memory mapped and
+ * each tensor is created on first use with a buffer that is mapped at
+ * creation, so that its data is copied straight from the file mapping into
+ * GPU-visible memory. No host copy of the weights is made, and the pages of a
+ * tensor are released from the mapping once it has been uploaded, which keeps
+ * the peak resident memory during model load close to the largest tensor.
+ *
+ * Supported dtypes are F32, F16, I32 and U32. POSIX only (mmap).
+ *
+ */
+
+#ifndef WEIGHTS_H
+#define WEIGHTS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gpu.h"
+#include "utils/logging.h" // LOG
+
+namespace gpu {
+
+/**
+ * @brief Index entry of a tensor in a WeightFile. offset and size locate the
+ * data in the mapping, tensor is only valid once loaded.
+ */
+struct WeightEntry {
+  NumType dtype;
+  Shape shape;
+  size_t offset; // in bytes from the start of the file
+  size_t size;   // in bytes
+  Tensor tensor;
+  bool loaded = false;
+};
+
+/**
+ * @brief Memory mapped weight file, created with openWeights().
+ *
+ * The mapping is kept until the WeightFile is destroyed, the tensors belong to
+ * the Context's TensorPool and outlive it.
+ */
+struct WeightFile {
+  std::string path;
+  const uint8_t *mapping = nullptr; // read-only file mapping
+  size_t mappingSize = 0;
+  std::map<std::string, WeightEntry> entries;
+  WeightFile() = default;
+  WeightFile(WeightFile &&other) noexcept
+      : path(std::move(other.path)), mapping(other.mapping),
+        mappingSize(other.mappingSize), entries(std::move(other.entries)) {
+    other.mapping = nullptr;
+    other.mappingSize = 0;
+  }
+  WeightFile &operator=(WeightFile &&other) noexcept {
+    std::swap(path, other.path);
+    std::swap(mapping, other.mapping);
+    std::swap(mappingSize, other.mappingSize);
+    std::swap(entries, other.entries);
+    return *this;
+  }
+  WeightFile(const WeightFile &) = delete;
+  WeightFile &operator=(const WeightFile &) = delete;
+  ~WeightFile() {
+    if (mapping) {
+      munmap(const_cast<uint8_t *>(mapping), mappingSize);
+    }
+  }
+};
+
+/**
+ * @brief Minimal cursor over the JSON header of a safetensors file. Only the
+ * subset used by the format is supported: objects, arrays, strings (without
+ * unicode escapes) and non-negative integers.
+ */
+struct JsonCursor {
+  const char *pos;
+  const char *end;
+  bool ok = true;
+};
+
+inline void skipSpace(JsonCursor &json) {
+  while (json.pos < json.end &&
+         (*json.pos == ' ' || *json.pos == '\n' || *json.pos == '\r' ||
+          *json.pos == '\t')) {
+    ++json.pos;
+  }
+}
+
+inline bool consume(JsonCursor &json, char c) {
+  skipSpace(json);
+  if (json.pos < json.end && *json.pos == c) {
+    ++json.pos;
+    return true;
+  }
+  return false;
+}
+
+inline std::string parseString(JsonCursor &json) {
+  std::string result;
+  if (!consume(json, '"')) {
+    json.ok = false;
+    return result;
+  }
+  while (json.pos < json.end && *json.pos != '"') {
+    if (*json.pos == '\\' && json.pos + 1 < json.end) {
+      ++json.pos;
+    }
+    result += *json.pos++;
+  }
+  json.ok &= consume(json, '"');
+  return result;
+}
+
+inline size_t parseInteger(JsonCursor &json) {
+  skipSpace(json);
+  size_t value = 0;
+  const char *start = json.pos;
+  while (json.pos < json.end && *json.pos >= '0' && *json.pos <= '9') {
+    value = value * 10 + static_cast<size_t>(*json.pos++ - '0');
+  }
+  json.ok &= json.pos > start;
+  return value;
+}
+
+inline std::vector<size_t> parseIntegers(JsonCursor &json) {
+  std::vector<size_t> values;
+  json.ok &= consume(json, '[');
+  if (consume(json, ']')) {
+    return values;
+  }
+  do {
+    values.push_back(parseInteger(json));
+  } while (json.ok && consume(json, ','));
+  json.ok &= consume(json, ']');
+  return values;
+}
+
+/**
+ * @brief Skips any JSON value, used for the __metadata__ entry.
+ */
+inline void skipValue(JsonCursor &json) {
+  skipSpace(json);
+  if (json.pos >= json.end) {
+    json.ok = false;
+  } else if (*json.pos == '"') {
+    parseString(json);
+  } else if (*json.pos == '{') {
+    ++json.pos;
+    if (consume(json, '}')) {
+      return;
+    }
+    do {
+      parseString(json);
+      json.ok &= consume(json, ':');
+      skipValue(json);
+    } while (json.ok && consume(json, ','));
+    json.ok &= consume(json, '}');
+  } else if (*json.pos == '[') {
+    ++json.pos;
+    if (consume(json, ']')) {
+      return;
+    }
+    do {
+      skipValue(json);
+    } while (json.ok && consume(json, ','));
+    json.ok &= consume(json, ']');
+  } else {
+    while (json.pos < json.end && *json.pos != ',' && *json.pos != '}' &&
+           *json.pos != ']') {
+      ++json.pos;
+    }
+  }
+}
+
+/**
+ * @brief Converts a safetensors dtype name to NumType.
+ * @return false if the dtype is not supported
+ */
+inline bool weightType(const std::string &name, NumType &dtype) {
+  static const std::map<std::string, NumType> types = {
+      {"F32", kf32}, {"F16", kf16}, {"I32", ki32}, {"U32", ku32}};
+  auto type = types.find(name);
+  if (type == types.end()) {
+    return false;
+  }
+  dtype = type->second;
+  return true;
+}
+
+/**
+ * @brief Memory maps a safetensors file and reads its index. No tensor data
+ * is touched until the tensors are loaded with getWeight().
+ * @param[in] path Path of the safetensors file
+ * @param[out] weights WeightFile instance to populate
+ * @return true if the file was mapped and its header is valid
+ *
+ * @code
+ * WeightFile weights;
+ * if (!openWeights("model.safetensors", weights)) { ... }
+ * @endcode
+ */
+inline bool openWeights(const std::string &path, WeightFile &weights) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(kDefLog, kError, "Could not open weight file %s", path.c_str());
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < 8) {
+    LOG(kDefLog, kError, "Weight file %s is too small", path.c_str());
+    close(fd);
+    return false;
+  }
+  size_t fileSize = static_cast<size_t>(info.st_size);
+  void *mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping keeps its own reference to the file
+  if (mapping == MAP_FAILED) {
+    LOG(kDefLog, kError, "Could not map weight file %s", path.c_str());
+    return false;
+  }
+  weights = WeightFile();
+  weights.path = path;
+  weights.mapping = static_cast<const uint8_t *>(mapping);
+  weights.mappingSize = fileSize;
+
+  // 8 byte little endian header size, JSON header, then the data section
+  uint64_t headerSize = 0;
+  for (int i = 7; i >= 0; --i) {
+    headerSize = (headerSize << 8) | weights.mapping[i];
+  }
+  if (headerSize > fileSize - 8) {
+    LOG(kDefLog, kError, "Invalid header size in %s", path.c_str());
+    return false;
+  }
+  size_t dataStart = 8 + headerSize;
+  const char *header = reinterpret_cast<const char *>(weights.mapping + 8);
+  JsonCursor json{header, header + headerSize};
+  json.ok = consume(json, '{');
+  if (json.ok && !consume(json, '}')) {
+    do {
+      std::string name = parseString(json);
+      json.ok &= consume(json, ':');
+      if (name == "__metadata__") {
+        skipValue(json);
+        continue;
+      }
+      WeightEntry entry;
+      std::string dtype;
+      std::vector<size_t> offsets;
+      json.ok &= consume(json, '{');
+      do {
+        std::string key = parseString(json);
+        json.ok &= consume(json, ':');
+        if (key == "dtype") {
+          dtype = parseString(json);
+        } else if (key == "shape") {
+          std::vector<size_t> dims = parseIntegers(json);
+          if (dims.size() > Shape::kMaxRank) {
+            LOG(kDefLog, kError, "Weight %s has rank %zu, at most %zu",
+                name.c_str(), dims.size(), Shape::kMaxRank);
+            json.ok = false;
+            break;
+          }
+          entry.shape.rank = dims.size();
+          std::copy(dims.begin(), dims.end(), entry.shape.data.begin());
+        } else if (key == "data_offsets") {
+          offsets = parseIntegers(json);
+        } else {
+          skipValue(json);
+        }
+      } while (json.ok && consume(json, ','));
+      json.ok &= consume(json, '}');
+      if (!json.ok || offsets.size() != 2 || offsets[0] > offsets[1] ||
+          offsets[1] > fileSize - dataStart) {
+        json.ok = false;
+        break;
+      }
+      if (!weightType(dtype, entry.dtype)) {
+        LOG(kDefLog, kWarn, "Skipping weight %s of unsupported dtype %s",
+            name.c_str(), dtype.c_str());
+        continue;
+      }
+      entry.offset = dataStart + offsets[0];
+      entry.size = offsets[1] - offsets[0];
+      if (entry.size != size(entry.shape) * sizeBits(entry.dtype) / 8) {
+        LOG(kDefLog, kError, "Size of weight %s does not match its shape",
+            name.c_str());
+        json.ok = false;
+        break;
+      }
+      weights.entries[name] = entry;
+    } while (json.ok && consume(json, ','));
+    json.ok &= consume(json, '}');
+  }
+  if (!json.ok) {
+    LOG(kDefLog, kError, "Invalid header in weight file %s", path.c_str());
+    return false;
+  }
+  LOG(kDefLog, kInfo, "Mapped %zu weights from %s", weights.entries.size(),
+      path.c_str());
+  return true;
+}
+
+/**
+ * @brief Returns a weight tensor, creating it on first use. The buffer is
+ * created mapped, filled directly from the file mapping and unmapped, after
+ * which the file pages of the tensor are released again.
+ * @param[in] ctx Context instance to manage the tensor
+ * @param[in] weights WeightFile instance from openWeights()
+ * @param[in] name Name of the tensor in the file
+ * @return Tensor instance of the weight
+ *
+ * @code
+ * Tensor qkv = getWeight(ctx, weights, "h.0.attn.c_attn.weight");
+ * @endcode
+ */
+inline Tensor getWeight(Context &ctx, WeightFile &weights,
+                        const std::string &name) {
+  auto it = weights.entries.find(name);
+  check(it != weights.entries.end(), ("Weight " + name + " exists").c_str(),
+        __FILE__, __LINE__);
+  WeightEntry &entry = it->second;
+  if (entry.loaded) {
+    return entry.tensor;
+  }
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  WGPUBufferUsageFlags usage = WGPUBufferUsage_Storage |
+                               WGPUBufferUsage_CopyDst |
+                               WGPUBufferUsage_CopySrc;
+  size_t bufferSize = sizeBytes(entry.shape, entry.dtype);
+  WGPUBufferDescriptor desc = {
+      .usage = usage,
+      .size = bufferSize,
+      .mappedAtCreation = true,
+  };
+  WGPUBuffer buffer = wgpuDeviceCreateBuffer(ctx.device, &desc);
+  check(buffer, "Create weight buffer", __FILE__, __LINE__);
+  void *mapped = wgpuBufferGetMappedRange(buffer, 0, bufferSize);
+  check(mapped, "Get mapped range", __FILE__, __LINE__);
+  std::memcpy(mapped, weights.mapping + entry.offset, entry.size);
+  // Buffer sizes are padded to 4 bytes
+  std::memset(static_cast<uint8_t *>(mapped) + entry.size, 0,
+              bufferSize - entry.size);
+  wgpuBufferUnmap(buffer);
+
+  // The upload is done, drop the file pages of the tensor from the resident
+  // set. Partial pages at the ends may be shared with neighbouring tensors,
+  // only whole pages are released.
+  size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t begin = cdiv(entry.offset, pageSize) * pageSize;
+  size_t end = (entry.offset + entry.size) / pageSize * pageSize;
+  if (end > begin) {
+    madvise(const_cast<uint8_t *>(weights.mapping) + begin, end - begin,
+            MADV_DONTNEED);
+  }
+
+  // FreeTensor() and ~TensorPool() remove the buffer from the telemetry
+  trackBuffer(ctx.telemetry, bufferClass(usage), bufferSize);
+  countWrite(ctx.telemetry, bufferSize);
+  ctx.pool.data[buffer] = Tensor{
+      .data = Array{.buffer = buffer, .usage = usage, .size = bufferSize},
+      .shape = entry.shape,
+      .dtype = entry.dtype,
+  };
+  entry.tensor = ctx.pool.data[buffer];
+  entry.loaded = true;
+  return entry.tensor;
+}
+
+/**
+ * @brief Writes tensors from host memory to a safetensors file, eg. to convert
+ * weights for use with openWeights().
+ * @param[in] path Path of the file to write
+ * @param[in] names Names of the tensors
+ * @param[in] shapes Shapes of the tensors
+ * @param[in] dtypes Data types of the tensors, kf32, kf16, ki32 or ku32
+ * @param[in] data Pointers to the tensor data in storage format
+ * @return true if the file was written
+ *
+ * @code
+ * saveWeights("model.safetensors", {"qkv"}, {{768, 2304}}, {kf32},
+ *             {qkv.data()});
+ * @endcode
+ */
+inline bool saveWeights(const std::string &path,
+                        const std::vector<std::string> &names,
+                        const std::vector<Shape> &shapes,
+                        const std::vector<NumType> &dtypes,
+                        const std::vector<const void *> &data) {
+  check(names.size() == shapes.size() && names.size() == dtypes.size() &&
+            names.size() == data.size(),
+        "One shape, dtype and data pointer per weight", __FILE__, __LINE__);
+  static const std::map<NumType, std::string> typeNames = {
+      {kf32, "F32"}, {kf16, "F16"}, {ki32, "I32"}, {ku32, "U32"}};
+  std::string header = "{";
+  size_t offset = 0;
+  std::vector<size_t> sizes;
+  for (size_t i = 0; i < names.size(); ++i) {
+    auto type = typeNames.find(dtypes[i]);
+    check(type != typeNames.end(), "Weight dtype can be saved", __FILE__,
+          __LINE__);
+    sizes.push_back(size(shapes[i]) * sizeBits(dtypes[i]) / 8);
+    std::string dims;
+    for (size_t d = 0; d < shapes[i].rank; ++d) {
+      dims += (d > 0 ? "," : "") + std::to_string(shapes[i][d]);
+    }
+    header += (i > 0 ? ",\"" : "\"") + names[i] + "\":{\"dtype\":\"" +
+              type->second + "\",\"shape\":[" + dims +
+              "],\"data_offsets\":[" + std::to_string(offset) + "," +
+              std::to_string(offset + sizes[i]) + "]}";
+    offset += sizes[i];
+  }
+  header += "}";
+  // Pad the header with spaces so that the data section is 8 byte aligned
+  header.append((8 - header.size() % 8) % 8, ' ');
+
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (!file) {
+    LOG(kDefLog, kError, "Could not write weight file %s", path.c_str());
+    return false;
+  }
+  uint8_t headerSize[8];
+  for (size_t i = 0; i < 8; ++i) {
+    headerSize[i] = static_cast<uint8_t>(
+        static_cast<uint64_t>(header.size()) >> (8 * i));
+  }
+  bool ok = std::fwrite(headerSize, 1, 8, file) == 8 &&
+            std::fwrite(header.data(), 1, header.size(), file) == header.size();
+  for (size_t i = 0; i < names.size() && ok; ++i) {
+    ok = std::fwrite(data[i], 1, sizes[i], file) == sizes[i];
+  }
+  ok &= std::fclose(file) == 0;
+  return ok;
+}
+
+} // namespace gpu
+
+#endif // WEIGHTS_H
@@ -1,82 +1,882 @@
 #ifndef GPU_CPP_WGSL_H
 #define GPU_CPP_WGSL_H
 
+/*
+ * wgsl.h
+ *
+ * This file contains a WGSL template preprocessor. Templates are tokenized
+ * once, comments and nested braces are recognized as such, and expanded in a
+ * single pass over the tokens which
+ *
+ * - substitutes {{name}} placeholders with typed parameters, e.g. a uint32_t
+ *   parameter is written as a u32 literal and a NumType as its type name,
+ * - keeps or drops the lines between #if / #elif / #else / #endif directives
+ *   depending on the parameters,
+ * - unrolls for loops with constant bounds.
+ *
+ * Tokenized templates and expansions are memoized, so expanding the same
+ * template with the same parameters again is a lookup.
+ *
+ * @code
+ * KernelCode code = createKernelCode(kShaderTemplate,
+ *                                    {{"N", N}, {"useBias", true}},
+ *                                    {256, 1, 1}, kf32);
+ * @endcode
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <regex>
-#include "utils/logging.h"        // LOG
+#include <unordered_map>
+#include <vector>
+
+#include "gpu.h"
+#include "utils/logging.h" // LOG
 
 namespace gpu {
 
-// Loop-unrolling optimization with regex
-//
-// Note: Be cautious, as it does not correctly recognize comments or lexical tokens.
-std::string loopUnrolling(const std::string& code, int threshold = 32) {
-  // This regex pattern matches a for loop with the following structure:
-  // for (var <varName>: u32 = <start>; <varName> < <end>; <varName>++) { <loopBody> }
-  std::regex forLoopPattern(R"(for\s*\(\s*var\s+(\w+):\s*u32\s*=\s*(\d+)\s*;\s*\1\s*<\s*(\d+)\s*;\s*\1\+\+\s*\)\s*\{\s*([^{}]*)\})");
-  // Explanation of the regex:
-  // for\s*\(                        : Matches 'for (' with optional whitespace
-  // \s*var\s+                       : Matches 'var ' with optional whitespace
-  // (\w+)                           : Captures the variable name (alphanumeric characters and underscores)
-  // :\s*u32\s*=\s*                  : Matches ': u32 = ' with optional whitespace
-  // (\d+)                           : Captures the start value (one or more digits)
-  // \s*;\s*                         : Matches ';' with optional whitespace
-  // \1\s*<\s*                       : Matches the captured variable name followed by '<' with optional whitespace
-  // (\d+)                           : Captures the end value (one or more digits)
-  // \s*;\s*                         : Matches ';' with optional whitespace
-  // \1\+\+\s*                       : Matches the captured variable name followed by '++' with optional whitespace
-  // \)\s*\{\s*                      : Matches ')' followed by '{' with optional whitespace
-  // ([^{}]*)                        : Captures the loop body (anything except '{' or '}')
-  // \}                              : Matches the closing '}'
-
-  // Example:
-  //
-  // Input code:
-  // for (var i: u32 = 0; i < 3; i++) { std::cout << i << std::endl; }
-  //
-  // Matches:
-  //   varName = "i"
-  //   start = "0"
-  //   end = "3"
-  //   loopBody = "std::cout << i << std::endl;"
-  //
-  // Unrolled:
-  // std::cout << 0 << std::endl;
-  // std::cout << 1 << std::endl;
-  // std::cout << 2 << std::endl;  
-  //
-  std::smatch match;
-  std::string unrolledCode = code;
-  while (std::regex_search(unrolledCode, match, forLoopPattern)) {
-    std::string varName = match[1];
-    int start = std::stoi(match[2]);
-    int end = std::stoi(match[3]);
-    std::string loopBody = match[4];
-
-    if (end - start > threshold ) {
-      std::string skippedLoop =
-	"for (var " +
-	std::string(match[1]) + ": u32 = " + std::string(match[2]) + ";"+
-	std::string(match[1]) + " < " + std::string(match[3]) + ";"+
-	std::string(match[1]) + "++) /* Skipped */ {"+
-	std::string(match[4]) +
-	"}";
-      LOG(kDefLog, kInfo, "Roll loop:%s", skippedLoop.c_str());
-      unrolledCode = unrolledCode.substr(0, match.position()) + skippedLoop + unrolledCode.substr(match.position() + match.length());
+/**
+ * @brief Value of a WGSL template parameter. The type of the C++ value
+ * determines how it is written into the code:
+ *
+ * - bool as true / false
+ * - int, size_t and other integers as integer literals (AbstractInt)
+ * - unsigned int (uint32_t) as a u32 literal, e.g. 4u
+ * - float as an f32 literal, e.g. 0.5f, double as a float literal
+ * - NumType as its WGSL type name, e.g. f32
+ * - Shape as a comma separated list, e.g. for @workgroup_size
+ * - strings verbatim
+ */
+struct WgslValue {
+  enum Kind { kBool, kInt, kU32, kI32, kF32, kFloat, kText };
+  Kind kind = kText;
+  int64_t i = 0;
+  double f = 0.0;
+  std::string text;
+
+  WgslValue() = default;
+  WgslValue(bool v) : kind(kBool), i(v) {}
+  WgslValue(int v) : kind(kInt), i(v) {}
+  WgslValue(long v) : kind(kInt), i(v) {}
+  WgslValue(long long v) : kind(kInt), i(v) {}
+  WgslValue(unsigned long v) : kind(kInt), i(static_cast<int64_t>(v)) {}
+  WgslValue(unsigned long long v) : kind(kInt), i(static_cast<int64_t>(v)) {}
+  WgslValue(unsigned int v) : kind(kU32), i(v) {}
+  WgslValue(float v) : kind(kF32), f(v) {}
+  WgslValue(double v) : kind(kFloat), f(v) {}
+  WgslValue(NumType v) : kind(kText), text(toString(v)) {}
+  WgslValue(const Shape &v) : kind(kText), text(toString(v)) {}
+  WgslValue(const char *v) : kind(kText), text(v) {}
+  WgslValue(const std::string &v) : kind(kText), text(v) {}
+
+  /**
+   * @brief Explicitly typed i32 parameter, written as e.g. -3i.
+   */
+  static WgslValue i32(int32_t v) {
+    WgslValue value(static_cast<int>(v));
+    value.kind = kI32;
+    return value;
+  }
+};
+
+/**
+ * @brief Parameters of a template by name. Placeholders without a parameter
+ * are left as they are, e.g. for the {{precision}} and {{workgroupSize}}
+ * substitution of KernelCode.
+ */
+using WgslParams = std::map<std::string, WgslValue>;
+
+/**
+ * @brief Options of the template expansion.
+ */
+struct WgslOptions {
+  // Loops with constant bounds of at most this many iterations are unrolled,
+  // 0 disables unrolling
+  int unrollThreshold = 0;
+  bool stripComments = false;
+};
+
+/**
+ * @brief Writes a template parameter as WGSL code.
+ */
+inline std::string toString(const WgslValue &value) {
+  char buffer[32];
+  switch (value.kind) {
+  case WgslValue::kBool:
+    return value.i ? "true" : "false";
+  case WgslValue::kInt:
+    return std::to_string(value.i);
+  case WgslValue::kU32:
+    return std::to_string(value.i) + "u";
+  case WgslValue::kI32:
+    return std::to_string(value.i) + "i";
+  case WgslValue::kF32:
+    snprintf(buffer, sizeof(buffer), "%.9g", value.f);
+    return std::string(buffer) + "f";
+  case WgslValue::kFloat: {
+    snprintf(buffer, sizeof(buffer), "%.17g", value.f);
+    std::string text(buffer);
+    // Without a point or exponent this would be an integer literal
+    if (text.find_first_of(".en") == std::string::npos) {
+      text += ".0";
+    }
+    return text;
+  }
+  default:
+    return value.text;
+  }
+}
+
+/**
+ * @brief Lexical token of a WGSL template. Whitespace and comments are kept as
+ * tokens so the expansion preserves the layout of the code.
+ */
+struct WgslToken {
+  enum Kind { kIdent, kNumber, kPunct, kSpace, kComment, kParam, kDirective };
+  Kind kind;
+  std::string text; // for kParam the parameter name, for kDirective the line
+};
+
+namespace wgsl {
+
+inline bool isIdentStart(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+inline bool isIdentChar(char c) { return isIdentStart(c) || isDigit(c); }
+
+inline bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+         c == '\f';
+}
+
+/**
+ * @brief Splits WGSL code (with template placeholders and directives) into
+ * tokens.
+ */
+inline std::vector<WgslToken> tokenize(const std::string &code) {
+  static const char *kOperators[] = {
+      "<<=", ">>=", "++", "--", "+=", "-=", "*=", "/=", "%=", "&=", "|=",
+      "^=",  "<<",  ">>", "<=", ">=", "==", "!=", "&&", "||", "->"};
+  std::vector<WgslToken> tokens;
+  size_t n = code.size();
+  size_t pos = 0;
+  bool lineStart = true; // only whitespace since the last newline
+  while (pos < n) {
+    char c = code[pos];
+    size_t begin = pos;
+    if (isSpace(c)) {
+      while (pos < n && isSpace(code[pos])) {
+        lineStart |= code[pos] == '\n';
+        ++pos;
+      }
+      tokens.push_back({WgslToken::kSpace, code.substr(begin, pos - begin)});
+      continue;
+    }
+    if (c == '#' && lineStart) {
+      while (pos < n && code[pos] != '\n') {
+        ++pos;
+      }
+      tokens.push_back(
+          {WgslToken::kDirective, code.substr(begin + 1, pos - begin - 1)});
+      continue;
+    }
+    lineStart = false;
+    if (code.compare(pos, 2, "//") == 0) {
+      while (pos < n && code[pos] != '\n') {
+        ++pos;
+      }
+      tokens.push_back({WgslToken::kComment, code.substr(begin, pos - begin)});
+    } else if (code.compare(pos, 2, "/*") == 0) {
+      // Block comments nest in WGSL
+      int depth = 0;
+      do {
+        if (code.compare(pos, 2, "/*") == 0) {
+          ++depth;
+          pos += 2;
+        } else if (code.compare(pos, 2, "*/") == 0) {
+          --depth;
+          pos += 2;
+        } else {
+          ++pos;
+        }
+      } while (pos < n && depth > 0);
+      tokens.push_back({WgslToken::kComment, code.substr(begin, pos - begin)});
+    } else if (code.compare(pos, 2, "{{") == 0 &&
+               code.find("}}", pos + 2) != std::string::npos) {
+      size_t close = code.find("}}", pos + 2);
+      std::string name = code.substr(pos + 2, close - pos - 2);
+      bool valid = !name.empty();
+      for (char ch : name) {
+        valid &= isIdentChar(ch);
+      }
+      if (valid) {
+        tokens.push_back({WgslToken::kParam, name});
+        pos = close + 2;
+      } else {
+        tokens.push_back({WgslToken::kPunct, "{"});
+        ++pos;
+      }
+    } else if (isIdentStart(c)) {
+      while (pos < n && isIdentChar(code[pos])) {
+        ++pos;
+      }
+      tokens.push_back({WgslToken::kIdent, code.substr(begin, pos - begin)});
+    } else if (isDigit(c) ||
+               (c == '.' && pos + 1 < n && isDigit(code[pos + 1]))) {
+      // Decimal, hex and float literals with their suffixes
+      while (pos < n && (isIdentChar(code[pos]) || code[pos] == '.' ||
+                         ((code[pos] == '+' || code[pos] == '-') &&
+                          (code[pos - 1] == 'e' || code[pos - 1] == 'E' ||
+                           code[pos - 1] == 'p' || code[pos - 1] == 'P') &&
+                          code.compare(begin, 2, "0x") != 0))) {
+        ++pos;
+      }
+      tokens.push_back({WgslToken::kNumber, code.substr(begin, pos - begin)});
+    } else {
+      size_t length = 1;
+      for (const char *op : kOperators) {
+        size_t opLength = std::char_traits<char>::length(op);
+        if (code.compare(pos, opLength, op) == 0) {
+          length = opLength;
+          break;
+        }
+      }
+      pos += length;
+      tokens.push_back({WgslToken::kPunct, code.substr(begin, length)});
+    }
+  }
+  return tokens;
+}
+
+inline bool isBlank(const WgslToken &token) {
+  return token.kind == WgslToken::kSpace || token.kind == WgslToken::kComment;
+}
+
+/**
+ * @brief Index of the next token at or after pos which is not whitespace or a
+ * comment, or end.
+ */
+inline size_t skipBlank(const std::vector<WgslToken> &tokens, size_t pos,
+                        size_t end) {
+  while (pos < end && isBlank(tokens[pos])) {
+    ++pos;
+  }
+  return pos;
+}
+
+/**
+ * @brief Parses an integer literal (decimal or hex, with an optional u or i
+ * suffix). Returns false for anything else.
+ */
+inline bool parseInt(const std::string &text, int64_t &value,
+                     std::string *suffix = nullptr) {
+  std::string digits = text;
+  std::string s;
+  if (!digits.empty() && (digits.back() == 'u' || digits.back() == 'i')) {
+    s = digits.back();
+    digits.pop_back();
+  }
+  if (digits.empty()) {
+    return false;
+  }
+  int base = digits.size() > 2 && (digits[1] == 'x' || digits[1] == 'X')
+                 ? 16
+                 : 10;
+  char *end = nullptr;
+  long long v = std::strtoll(digits.c_str(), &end, base);
+  if (*end != '\0') {
+    return false;
+  }
+  value = v;
+  if (suffix) {
+    *suffix = s;
+  }
+  return true;
+}
+
+/**
+ * @brief Operand of a directive expression, a number or text.
+ */
+struct ExprValue {
+  bool isText = false;
+  double num = 0.0;
+  std::string text;
+  bool truthy() const { return isText ? !text.empty() : num != 0.0; }
+  std::string str() const {
+    if (!isText) {
+      char buffer[32];
+      snprintf(buffer, sizeof(buffer), "%.17g", num);
+      return buffer;
+    }
+    return text;
+  }
+};
+
+/**
+ * @brief Recursive descent evaluator of #if expressions: parameter names,
+ * integer and bool literals, other identifiers as text, with ! == != < <= >
+ * >= && || and parentheses.
+ */
+struct ExprParser {
+  const std::vector<WgslToken> &tokens;
+  const WgslParams &params;
+  size_t pos = 0;
+  bool ok = true;
+
+  const WgslToken *peek() {
+    pos = skipBlank(tokens, pos, tokens.size());
+    return pos < tokens.size() ? &tokens[pos] : nullptr;
+  }
+  bool accept(const char *op) {
+    const WgslToken *token = peek();
+    if (token && token->kind == WgslToken::kPunct && token->text == op) {
+      ++pos;
+      return true;
+    }
+    return false;
+  }
+  ExprValue primary() {
+    const WgslToken *token = peek();
+    ExprValue value;
+    if (!token) {
+      ok = false;
+      return value;
+    }
+    ++pos;
+    if (token->kind == WgslToken::kPunct && token->text == "(") {
+      value = orExpr();
+      ok &= accept(")");
+    } else if (token->kind == WgslToken::kNumber) {
+      int64_t i;
+      if (parseInt(token->text, i)) {
+        value.num = static_cast<double>(i);
+      } else {
+        value.num = std::strtod(token->text.c_str(), nullptr);
+      }
+    } else if (token->kind == WgslToken::kIdent ||
+               token->kind == WgslToken::kParam) {
+      auto it = params.find(token->text);
+      if (token->text == "true" || token->text == "false") {
+        value.num = token->text == "true";
+      } else if (it == params.end()) {
+        value.isText = true;
+        value.text = token->text;
+      } else if (it->second.kind == WgslValue::kText) {
+        value.isText = true;
+        value.text = it->second.text;
+      } else if (it->second.kind == WgslValue::kF32 ||
+                 it->second.kind == WgslValue::kFloat) {
+        value.num = it->second.f;
+      } else {
+        value.num = static_cast<double>(it->second.i);
+      }
+    } else {
+      ok = false;
+    }
+    return value;
+  }
+  ExprValue unary() {
+    if (accept("!")) {
+      ExprValue value;
+      value.num = !unary().truthy();
+      return value;
+    }
+    return primary();
+  }
+  ExprValue comparison() {
+    ExprValue lhs = unary();
+    for (const char *op : {"==", "!=", "<=", ">=", "<", ">"}) {
+      if (accept(op)) {
+        ExprValue rhs = unary();
+        std::string o(op);
+        ExprValue result;
+        if (lhs.isText || rhs.isText) {
+          int cmp = lhs.str().compare(rhs.str());
+          result.num = o == "==" ? cmp == 0 : o == "!=" ? cmp != 0
+                       : o == "<=" ? cmp <= 0 : o == ">=" ? cmp >= 0
+                       : o == "<"  ? cmp < 0  : cmp > 0;
+        } else {
+          result.num = o == "==" ? lhs.num == rhs.num
+                       : o == "!=" ? lhs.num != rhs.num
+                       : o == "<=" ? lhs.num <= rhs.num
+                       : o == ">=" ? lhs.num >= rhs.num
+                       : o == "<"  ? lhs.num < rhs.num
+                                   : lhs.num > rhs.num;
+        }
+        return result;
+      }
+    }
+    return lhs;
+  }
+  ExprValue andExpr() {
+    ExprValue value = comparison();
+    while (accept("&&")) {
+      bool rhs = comparison().truthy();
+      value = ExprValue{false, static_cast<double>(value.truthy() && rhs), ""};
+    }
+    return value;
+  }
+  ExprValue orExpr() {
+    ExprValue value = andExpr();
+    while (accept("||")) {
+      bool rhs = andExpr().truthy();
+      value = ExprValue{false, static_cast<double>(value.truthy() || rhs), ""};
+    }
+    return value;
+  }
+};
+
+/**
+ * @brief Evaluates the expression of an #if or #elif directive.
+ */
+inline bool evalCondition(const std::string &expr, const WgslParams &params) {
+  std::vector<WgslToken> tokens = tokenize(expr);
+  ExprParser parser{tokens, params};
+  bool result = parser.orExpr().truthy();
+  if (!parser.ok || parser.peek()) {
+    LOG(kDefLog, kError, "Invalid WGSL template condition: %s", expr.c_str());
+    return false;
+  }
+  return result;
+}
+
+/**
+ * @brief Substitutes parameters and evaluates directives, the first stage of
+ * the expansion.
+ */
+inline std::vector<WgslToken> specialize(const std::vector<WgslToken> &tokens,
+                                         const WgslParams &params) {
+  struct Branch {
+    bool parentActive;
+    bool taken;  // a previous branch of this #if was active
+    bool active;
+  };
+  std::vector<Branch> branches;
+  std::vector<WgslToken> out;
+  out.reserve(tokens.size());
+  bool active = true;
+  for (const WgslToken &token : tokens) {
+    if (token.kind == WgslToken::kDirective) {
+      std::vector<WgslToken> words = tokenize(token.text);
+      size_t first = skipBlank(words, 0, words.size());
+      std::string keyword = first < words.size() ? words[first].text : "";
+      std::string rest;
+      for (size_t i = first + 1; i < words.size(); ++i) {
+        // {{name}} in a condition refers to the parameter name
+        rest += words[i].text;
+      }
+      if (keyword == "if") {
+        bool cond = active && evalCondition(rest, params);
+        branches.push_back({active, cond, cond});
+      } else if (keyword == "elif" && !branches.empty()) {
+        Branch &branch = branches.back();
+        branch.active = branch.parentActive && !branch.taken &&
+                        evalCondition(rest, params);
+        branch.taken |= branch.active;
+      } else if (keyword == "else" && !branches.empty()) {
+        Branch &branch = branches.back();
+        branch.active = branch.parentActive && !branch.taken;
+        branch.taken = true;
+      } else if (keyword == "endif" && !branches.empty()) {
+        branches.pop_back();
+      } else {
+        LOG(kDefLog, kError, "Invalid WGSL template directive: #%s",
+            token.text.c_str());
+      }
+      active = branches.empty() || branches.back().active;
+      continue;
+    }
+    if (!active) {
+      continue;
+    }
+    if (token.kind == WgslToken::kParam) {
+      auto it = params.find(token.text);
+      if (it == params.end()) {
+        out.push_back(token);
+      } else {
+        for (WgslToken &value : tokenize(toString(it->second))) {
+          out.push_back(std::move(value));
+        }
+      }
     } else {
-      LOG(kDefLog, kInfo, "Unroll loop(var: %s, start:%d, end:%d, body:%s)", varName.c_str(), start, end, loopBody.c_str());
-      std::string unrolledLoop;
-      for (int i = start; i < end; ++i) {
-        std::string unrolledIteration = loopBody;
-        std::regex varPattern(varName);
-        unrolledIteration = std::regex_replace(unrolledIteration, varPattern, std::to_string(i));
-        unrolledLoop += unrolledIteration;
+      out.push_back(token);
+    }
+  }
+  if (!branches.empty()) {
+    LOG(kDefLog, kError, "Unterminated #if in WGSL template");
+  }
+  return out;
+}
+
+/**
+ * @brief Matches the header of a loop with constant bounds at tokens[pos]
+ * (the for keyword),
+ *
+ *   for (var i[: u32] = START; i < BOUND; i++ | i += STEP | i = i + STEP) {
+ *
+ * and returns the position of the opening brace of its body, or 0.
+ */
+inline size_t matchLoop(const std::vector<WgslToken> &tokens, size_t pos,
+                        size_t end, std::string &var, std::string &type,
+                        int64_t &start, int64_t &bound, int64_t &step,
+                        std::string &suffix) {
+  auto is = [&](size_t i, const char *text) {
+    return i < end && tokens[i].text == text &&
+           tokens[i].kind != WgslToken::kComment;
+  };
+  auto next = [&](size_t i) { return skipBlank(tokens, i + 1, end); };
+  size_t i = next(pos);
+  if (!is(i, "(")) {
+    return 0;
+  }
+  i = next(i);
+  if (!is(i, "var")) {
+    return 0;
+  }
+  i = next(i);
+  if (i >= end || tokens[i].kind != WgslToken::kIdent) {
+    return 0;
+  }
+  var = tokens[i].text;
+  i = next(i);
+  type.clear();
+  if (is(i, ":")) {
+    i = next(i);
+    if (!is(i, "u32") && !is(i, "i32")) {
+      return 0;
+    }
+    type = tokens[i].text;
+    i = next(i);
+  }
+  if (!is(i, "=")) {
+    return 0;
+  }
+  i = next(i);
+  if (i >= end || tokens[i].kind != WgslToken::kNumber ||
+      !parseInt(tokens[i].text, start, &suffix)) {
+    return 0;
+  }
+  i = next(i);
+  if (!is(i, ";")) {
+    return 0;
+  }
+  i = next(i);
+  if (!is(i, var.c_str())) {
+    return 0;
+  }
+  i = next(i);
+  if (!is(i, "<")) {
+    return 0;
+  }
+  i = next(i);
+  if (i >= end || tokens[i].kind != WgslToken::kNumber ||
+      !parseInt(tokens[i].text, bound)) {
+    return 0;
+  }
+  i = next(i);
+  if (!is(i, ";")) {
+    return 0;
+  }
+  i = next(i);
+  if (!is(i, var.c_str())) {
+    return 0;
+  }
+  i = next(i);
+  if (is(i, "++")) {
+    step = 1;
+    i = next(i);
+  } else if (is(i, "+=")) {
+    i = next(i);
+    if (i >= end || !parseInt(tokens[i].text, step)) {
+      return 0;
+    }
+    i = next(i);
+  } else if (is(i, "=")) {
+    i = next(i);
+    if (!is(i, var.c_str())) {
+      return 0;
+    }
+    i = next(i);
+    if (!is(i, "+")) {
+      return 0;
+    }
+    i = next(i);
+    if (i >= end || !parseInt(tokens[i].text, step)) {
+      return 0;
+    }
+    i = next(i);
+  } else {
+    return 0;
+  }
+  if (!is(i, ")")) {
+    return 0;
+  }
+  i = next(i);
+  return is(i, "{") && step > 0 ? i : 0;
+}
+
+/**
+ * @brief Position of the brace closing the one at tokens[open], or end.
+ */
+inline size_t matchBrace(const std::vector<WgslToken> &tokens, size_t open,
+                         size_t end) {
+  int depth = 0;
+  for (size_t i = open; i < end; ++i) {
+    if (tokens[i].kind != WgslToken::kPunct) {
+      continue;
+    }
+    if (tokens[i].text == "{") {
+      ++depth;
+    } else if (tokens[i].text == "}" && --depth == 0) {
+      return i;
+    }
+  }
+  return end;
+}
+
+/**
+ * @brief Whether a loop body can be repeated with the loop variable replaced
+ * by constants: it does not break, continue or modify the loop variable.
+ */
+inline bool canUnroll(const std::vector<WgslToken> &tokens, size_t begin,
+                      size_t end, const std::string &var) {
+  static const char *kAssignments[] = {"=",  "+=", "-=", "*=", "/=", "%=",
+                                       "&=", "|=", "^=", "<<=", ">>=",
+                                       "++", "--"};
+  const WgslToken *prev = nullptr;
+  for (size_t i = begin; i < end; ++i) {
+    const WgslToken &token = tokens[i];
+    if (isBlank(token)) {
+      continue;
+    }
+    if (token.kind == WgslToken::kIdent &&
+        (token.text == "break" || token.text == "continue")) {
+      return false;
+    }
+    if (token.kind == WgslToken::kIdent && token.text == var &&
+        !(prev && prev->text == ".")) {
+      if (prev && (prev->text == "++" || prev->text == "--" ||
+                   prev->text == "&")) {
+        return false;
+      }
+      size_t next = skipBlank(tokens, i + 1, end);
+      if (next < end) {
+        for (const char *op : kAssignments) {
+          if (tokens[next].kind == WgslToken::kPunct &&
+              tokens[next].text == op) {
+            return false;
+          }
+        }
+      }
+    }
+    prev = &token;
+  }
+  return true;
+}
+
+/**
+ * @brief Copies tokens[begin, end) to out, unrolling loops with constant
+ * bounds of at most threshold iterations. Each iteration is emitted as its
+ * own block, so declarations in the body stay local to the iteration. Loops
+ * nested in unrolled (or kept) loops are unrolled in turn.
+ */
+inline void unroll(const std::vector<WgslToken> &tokens, size_t begin,
+                   size_t end, int threshold, std::vector<WgslToken> &out) {
+  for (size_t i = begin; i < end; ++i) {
+    const WgslToken &token = tokens[i];
+    std::string var, type, suffix;
+    int64_t start, bound, step;
+    size_t open = 0;
+    if (token.kind == WgslToken::kIdent && token.text == "for") {
+      open = matchLoop(tokens, i, end, var, type, start, bound, step, suffix);
+    }
+    size_t close = open ? matchBrace(tokens, open, end) : end;
+    int64_t trips = open && bound > start ? (bound - start + step - 1) / step
+                                          : 0;
+    if (!open || close == end || trips > threshold ||
+        !canUnroll(tokens, open + 1, close, var)) {
+      out.push_back(token);
+      continue;
+    }
+    std::string literalSuffix = type == "u32"   ? "u"
+                                : type == "i32" ? "i"
+                                                : suffix;
+    for (int64_t value = start; value < bound; value += step) {
+      std::vector<WgslToken> body;
+      body.reserve(close - open + 1);
+      const WgslToken *prev = nullptr;
+      for (size_t j = open; j <= close; ++j) {
+        const WgslToken &bodyToken = tokens[j];
+        if (bodyToken.kind == WgslToken::kIdent && bodyToken.text == var &&
+            !(prev && prev->text == ".")) {
+          body.push_back({WgslToken::kNumber,
+                          std::to_string(value) + literalSuffix});
+        } else {
+          body.push_back(bodyToken);
+        }
+        if (!isBlank(bodyToken)) {
+          prev = &bodyToken;
+        }
       }
-      unrolledCode = unrolledCode.substr(0, match.position()) + unrolledLoop + unrolledCode.substr(match.position() + match.length());
+      unroll(body, 0, body.size(), threshold, out);
+      out.push_back({WgslToken::kSpace, "\n"});
     }
+    i = close;
   }
+}
+
+/**
+ * @brief Joins tokens back into code.
+ */
+inline std::string join(const std::vector<WgslToken> &tokens,
+                        bool stripComments) {
+  size_t size = 0;
+  for (const WgslToken &token : tokens) {
+    size += token.text.size() + 4;
+  }
+  std::string code;
+  code.reserve(size);
+  for (const WgslToken &token : tokens) {
+    if (token.kind == WgslToken::kComment && stripComments) {
+      continue;
+    }
+    if (token.kind == WgslToken::kParam) {
+      code += "{{" + token.text + "}}";
+    } else if (token.kind == WgslToken::kDirective) {
+      code += "#" + token.text;
+    } else {
+      code += token.text;
+    }
+  }
+  return code;
+}
+
+/**
+ * @brief Memoized tokenized templates and expansions.
+ */
+struct Cache {
+  std::mutex mutex;
+  std::unordered_map<std::string, std::shared_ptr<const std::vector<WgslToken>>>
+      templates;
+  std::unordered_map<std::string, std::string> expansions;
+  size_t hits = 0;
+  size_t misses = 0;
+};
+
+inline Cache &cache() {
+  static Cache instance;
+  return instance;
+}
+
+} // namespace wgsl
+
+/**
+ * @brief Expands a WGSL template: substitutes the parameters, evaluates the
+ * #if directives and, if enabled in the options, unrolls loops with constant
+ * bounds. Results are memoized by template, parameters and options.
+ *
+ * @param[in] code WGSL template
+ * @param[in] params Template parameters
+ * @param[in] options Expansion options
+ * @return Expanded WGSL code
+ *
+ * @code
+ * std::string code = expandWgsl(kShaderTemplate,
+ *                               {{"N", N}, {"precision", kf16}},
+ *                               WgslOptions{32});
+ * @endcode
+ */
+inline std::string expandWgsl(const std::string &code,
+                              const WgslParams &params = {},
+                              const WgslOptions &options = {}) {
+  std::string key;
+  for (const auto &[name, value] : params) {
+    key += name + "=" + std::to_string(value.kind) + ":" + toString(value) +
+           "\n";
+  }
+  key += std::to_string(options.unrollThreshold) +
+         (options.stripComments ? "s" : "") + '\0' + code;
+  wgsl::Cache &cache = wgsl::cache();
+  std::shared_ptr<const std::vector<WgslToken>> tokens;
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto it = cache.expansions.find(key);
+    if (it != cache.expansions.end()) {
+      ++cache.hits;
+      return it->second;
+    }
+    ++cache.misses;
+    std::shared_ptr<const std::vector<WgslToken>> &cached =
+        cache.templates[code];
+    if (!cached) {
+      cached = std::make_shared<const std::vector<WgslToken>>(
+          wgsl::tokenize(code));
+    }
+    tokens = cached;
+  }
+  // Expand outside of the lock, a concurrent expansion of the same key
+  // produces the same result
+  std::vector<WgslToken> specialized = wgsl::specialize(*tokens, params);
+  std::string result;
+  if (options.unrollThreshold > 0) {
+    std::vector<WgslToken> unrolled;
+    unrolled.reserve(specialized.size());
+    wgsl::unroll(specialized, 0, specialized.size(), options.unrollThreshold,
+                 unrolled);
+    result = wgsl::join(unrolled, options.stripComments);
+  } else {
+    result = wgsl::join(specialized, options.stripComments);
+  }
+  LOG(kDefLog, kTrace, "Expanded WGSL template:\n%s", result.c_str());
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  return cache.expansions.emplace(key, std::move(result)).first->second;
+}
+
+/**
+ * @brief Expands a WGSL template into a KernelCode. The workgroupSize and
+ * precision placeholders are set from the arguments unless they are given in
+ * params.
+ *
+ * @param[in] code WGSL template
+ * @param[in] params Template parameters
+ * @param[in] workgroupSize Workgroup size of the kernel
+ * @param[in] precision Precision of the kernel
+ * @param[in] options Expansion options
+ * @return KernelCode instance
+ *
+ * @code
+ * KernelCode code = createKernelCode(kShaderMatmul, {{"M", M}, {"K", K}},
+ *                                    {256, 1, 1}, kf32,
+ *                                    WgslOptions{32});
+ * @endcode
+ */
+inline KernelCode createKernelCode(const std::string &code,
+                                   WgslParams params,
+                                   const Shape &workgroupSize = {256, 1, 1},
+                                   NumType precision = kf32,
+                                   const WgslOptions &options = {}) {
+  params.emplace("workgroupSize", workgroupSize);
+  params.emplace("precision", precision);
+  return KernelCode{expandWgsl(code, params, options), workgroupSize,
+                    precision};
+}
 
-  return unrolledCode;
+/**
+ * @brief Unrolls the loops of WGSL code with constant bounds of at most
+ * threshold iterations, see expandWgsl().
+ *
+ * @code
+ * std::string unrolled = loopUnrolling(code);
+ * @endcode
+ */
+inline std::string loopUnrolling(const std::string &code, int threshold = 32) {
+  return expandWgsl(code, {}, WgslOptions{threshold});
 }
 
 } // namespace gpu
@@ -1,22 +1,49 @@
 #ifndef GPU_H
 #define GPU_H
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <filesystem>
+#include <functional>
 #include <future>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <type_traits>
 #include <unordered_map>
 #include <vector>
 #include <utility> // std::pair
 
+#include "utils/half.h"
 #include "utils/logging.h"
 #include "webgpu/webgpu.h"
 
+// Dawn's webgpu.h declares its extensions such as the cache device
+// descriptor, detect it when the build does not set the backend explicitly
+#if !defined(WEBGPU_BACKEND_DAWN) && defined(WGPU_DAWN_CACHE_DEVICE_DESCRIPTOR_INIT)
+#define WEBGPU_BACKEND_DAWN
+#endif
+
+// Dawn's native API lists every physical adapter, including several GPUs of
+// the same model, which webgpu.h adapter requests can not return (see
+// enumerateAdapters()). It is used when a Dawn build provides its headers.
+#if defined(WEBGPU_BACKEND_DAWN) && defined(__has_include)
+#if __has_include(<dawn/native/DawnNative.h>)
+#include <dawn/native/DawnNative.h>
+#define GPU_DAWN_NATIVE_ADAPTERS
+#endif
+#endif
+
 namespace gpu {
 
 #ifndef NDEBUG
@@ -84,6 +111,78 @@ inline size_t size(const Shape &shape) {
   return numels;
 }
 
+/**
+ * @brief Ceiling division.
+ */
+inline size_t cdiv(size_t n, size_t d) { return (n + d - 1) / d; }
+
+/**
+ * @brief Element types of tensors.
+ *
+ * kf16 requires the shader-f16 feature, which createContext() requests when
+ * the adapter supports it. ki8 and kq4 are packed storage types, 4 signed 8
+ * bit or 8 signed 4 bit values are packed into each u32 word (lowest bits
+ * first) and unpacked in the shader.
+ */
+enum NumType { kf32, kf16, ki32, ku32, ki8, kq4 };
+
+/**
+ * @brief Converts NumType to string. The string is the WGSL storage type that
+ * is substituted for {{precision}}, packed types are stored as u32 words.
+ */
+inline std::string toString(NumType type) {
+  switch (type) {
+  case kf16:
+    return "f16";
+  case kf32:
+    return "f32";
+  case ki32:
+    return "i32";
+  case ku32:
+  case ki8:
+  case kq4:
+    return "u32";
+  default:
+    LOG(kDefLog, kError, "Invalid NumType in string conversion.");
+    return "unknown";
+  }
+}
+
+/**
+ * @brief Returns the size in bits of one element of the given type.
+ */
+inline size_t sizeBits(NumType type) {
+  switch (type) {
+  case kf16:
+    return 16;
+  case kf32:
+  case ki32:
+  case ku32:
+    return 32;
+  case ki8:
+    return 8;
+  case kq4:
+    return 4;
+  default:
+    LOG(kDefLog, kError, "Invalid NumType in size calculation.");
+    return 0;
+  }
+}
+
+/**
+ * @brief Returns the size in bytes of a buffer holding a tensor of the given
+ * shape and type. The size is rounded up to a multiple of 4 bytes as required
+ * for storage buffer bindings and buffer writes, which also accounts for the
+ * u32 words of packed types.
+ *
+ * @code
+ * sizeBytes({256, 256}, kf16) -> 131072
+ * @endcode
+ */
+inline size_t sizeBytes(const Shape &shape, NumType type) {
+  return cdiv(size(shape) * sizeBits(type), 32) * 4;
+}
+
 
 /**
  * @brief Represents a tensor on the GPU, which is a buffer of values with a
@@ -96,6 +195,7 @@ inline size_t size(const Shape &shape) {
 struct Tensor {
   Array data;
   Shape shape;
+  NumType dtype = kf32;
 };
 
 /**
@@ -176,23 +276,22 @@ struct TensorPool {
   inline TensorPool(Context *ctx) : ctx(ctx), data() {};
   Context *ctx;
   std::unordered_map<WGPUBuffer, Tensor> data;
+  std::vector<Array> arenas; // backing buffers for createArenaTensor()
+  std::vector<size_t> arenaUsed; // bump offset in bytes for each arena
+  size_t arenaCurrent = 0;       // arenas after this one are empty
+  size_t arenaBlockSize = 64 * 1024 * 1024; // minimum size of a new arena
+  size_t arenaAlignment = 0; // minStorageBufferOffsetAlignment, queried lazily
   ~TensorPool();
 };
 
-enum NumType { kf32 };
-
 /**
- * @brief Converts NumType to string.
+ * @brief Position of the bump allocator of the TensorPool arenas, used to
+ * release scratch allocations with resetArena().
  */
-inline std::string toString(NumType type) {
-  switch (type) {
-  case kf32:
-    return "f32";
-  default:
-    LOG(kDefLog, kError, "Invalid NumType in string conversion.");
-    return "unknown";
-  }
-}
+struct ArenaMark {
+  size_t arena = 0;
+  size_t offset = 0;
+};
 
 /**
  * @brief Converts Shape to string. The string formatting is meant to be
@@ -271,7 +370,10 @@ struct KernelCode {
 
     replaceAll(data, "{{workgroupSize}}", toString({workgroupSize, 1, 1}));
     replaceAll(data, "{{precision}}", toString(precision));
-    LOG(kDefLog, kInfo, "Shader code:\n%s", data.c_str());
+    if (precision == kf16) {
+      data = "enable f16;\n" + data;
+    }
+    LOG(kDefLog, kTrace, "Shader code:\n%s", data.c_str());
   }
 
   /**
@@ -296,13 +398,20 @@ struct KernelCode {
       : data(pData), workgroupSize(workgroupSize), precision(precision) {
         replaceAll(data, "{{workgroupSize}}", toString(workgroupSize));
         replaceAll(data, "{{precision}}", toString(precision));
-        LOG(kDefLog, kInfo, "Shader code:\n%s", data.c_str());
+        if (precision == kf16) {
+          data = "enable f16;\n" + data;
+        }
+        LOG(kDefLog, kTrace, "Shader code:\n%s", data.c_str());
       }
   std::string data;
   Shape workgroupSize;
   NumType precision = kf32;
   std::string label = "kernel";
   std::string entryPoint = "main";
+  // Values of WGSL override declarations, e.g. {{"TILE", 16}}. Unlike
+  // {{placeholder}} substitution, kernels differing only in these values share
+  // the shader source, and can be specialized without editing the code.
+  std::vector<std::pair<std::string, double>> constants;
 };
 
 /**
@@ -325,6 +434,31 @@ inline void replaceAll(std::string &str,
   }
 }
 
+/**
+ * @brief 64-bit FNV-1a hash of a byte range. Unlike std::hash, the result is
+ * stable across processes and platforms, so it can be used for content
+ * addressing of shader code.
+ *
+ * @param[in] data Pointer to the bytes to hash
+ * @param[in] size Number of bytes to hash
+ * @param[in] seed Hash value to continue from, allows chaining multiple ranges
+ * into one hash
+ *
+ * @code
+ * uint64_t h = hashBytes(code.data.data(), code.data.size());
+ * @endcode
+ */
+inline uint64_t hashBytes(const void *data, size_t size,
+                          uint64_t seed = 14695981039346656037ull) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  uint64_t h = seed;
+  for (size_t i = 0; i < size; ++i) {
+    h ^= bytes[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
 /**
  * @brief Used for on-done callback data for asynchronous operations sduch as
  * kernel launching.
@@ -338,6 +472,119 @@ struct CallbackDataDyn {
   std::future<void> *future;
 };
 
+/**
+ * @brief Opt-in GPU profiler which records the device time of each kernel
+ * dispatch with timestamp queries at the compute pass boundaries, see
+ * enableProfiling().
+ *
+ * Each recorded compute pass takes a slot of two queries in the query set.
+ * Slots are claimed when a command buffer is recorded (resetCommandBuffer()),
+ * marked as submitted on dispatch and turned into ProfileEvents by
+ * collectProfile(). Each claim gets a ticket, so that a kernel or batch only
+ * ever releases or submits the slot it claimed itself, not one that has since
+ * been collected and claimed by another pass.
+ */
+struct ProfileEvent {
+  std::string label;
+  uint64_t begin; // device timestamp in ns
+  uint64_t end;   // device timestamp in ns
+};
+
+struct Profiler {
+  static constexpr size_t kNoSlot = static_cast<size_t>(-1);
+  enum SlotState { kFree, kRecorded, kSubmitted };
+  WGPUQuerySet querySet = nullptr;
+  WGPUBuffer resolveBuffer = nullptr; // 2 timestamps per slot
+  std::vector<SlotState> slots;
+  std::vector<std::string> labels; // label of the pass recorded in each slot
+  std::vector<uint64_t> tickets;   // ticket of the claim holding each slot
+  uint64_t nextTicket = 1;
+  size_t cursor = 0;               // next slot to try to claim
+  std::mutex mutex;                // guards slots, labels and cursor
+  std::vector<ProfileEvent> events;
+  inline ~Profiler() {
+    if (resolveBuffer) {
+      wgpuBufferRelease(resolveBuffer);
+    }
+    if (querySet) {
+      wgpuQuerySetRelease(querySet);
+    }
+  }
+};
+
+/**
+ * @brief A profiler slot held by a recorded command buffer, identified by its
+ * index and the ticket of the claim.
+ */
+struct ProfileSlot {
+  size_t index = Profiler::kNoSlot;
+  uint64_t ticket = 0;
+};
+
+/**
+ * @brief Claims a profiler slot for a compute pass and sets up the timestamp
+ * writes for it. Returns a ProfileSlot with index Profiler::kNoSlot if
+ * profiling is disabled (profiler is nullptr) or all slots are in use.
+ */
+inline ProfileSlot
+claimProfileSlot(Profiler *profiler, const std::string &label,
+                 WGPUComputePassTimestampWrites &timestampWrites) {
+  if (!profiler) {
+    return ProfileSlot{};
+  }
+  std::lock_guard<std::mutex> lock(profiler->mutex);
+  size_t numSlots = profiler->slots.size();
+  for (size_t i = 0; i < numSlots; ++i) {
+    size_t slot = (profiler->cursor + i) % numSlots;
+    if (profiler->slots[slot] == Profiler::kFree) {
+      profiler->slots[slot] = Profiler::kRecorded;
+      profiler->labels[slot] = label;
+      profiler->tickets[slot] = profiler->nextTicket++;
+      profiler->cursor = (slot + 1) % numSlots;
+      timestampWrites = {
+          .querySet = profiler->querySet,
+          .beginningOfPassWriteIndex = static_cast<uint32_t>(2 * slot),
+          .endOfPassWriteIndex = static_cast<uint32_t>(2 * slot + 1),
+      };
+      return ProfileSlot{slot, profiler->tickets[slot]};
+    }
+  }
+  LOG(kDefLog, kWarn, "Profiler slots exhausted, call collectProfile()");
+  return ProfileSlot{};
+}
+
+/**
+ * @brief Frees a profiler slot whose command buffer is re-recorded or released
+ * without having been submitted. Only a slot still recorded under the caller's
+ * claim is freed, and the caller's handle is reset either way.
+ */
+inline void releaseProfileSlot(Profiler *profiler, ProfileSlot &slot) {
+  if (profiler && slot.index != Profiler::kNoSlot) {
+    std::lock_guard<std::mutex> lock(profiler->mutex);
+    if (profiler->slots[slot.index] == Profiler::kRecorded &&
+        profiler->tickets[slot.index] == slot.ticket) {
+      profiler->slots[slot.index] = Profiler::kFree;
+    }
+  }
+  slot = ProfileSlot{};
+}
+
+/**
+ * @brief Marks a profiler slot as submitted, so that collectProfile() reads
+ * its timestamps, and resets the caller's handle. From here on the slot
+ * belongs to collectProfile().
+ */
+inline void submitProfileSlot(Profiler *profiler, ProfileSlot &slot) {
+  if (profiler && slot.index != Profiler::kNoSlot) {
+    std::lock_guard<std::mutex> lock(profiler->mutex);
+    if (profiler->slots[slot.index] == Profiler::kRecorded &&
+        profiler->tickets[slot.index] == slot.ticket) {
+      profiler->slots[slot.index] = Profiler::kSubmitted;
+    }
+  }
+  slot = ProfileSlot{};
+}
+
 /**
  * @brief Represents handles + metadata for a reusable kernel on the GPU.
  * The struct members can be divided into "consumed upon dispatch"
@@ -350,7 +597,16 @@ struct Kernel {
   Shape nWorkgroups;
   WGPUBindGroup bindGroup;             // persists between submission
   WGPUComputePipeline computePipeline; // persists between submission
-  WGPUCommandBuffer commandBuffer;     // destroyed upon submission
+  WGPUCommandBuffer commandBuffer = nullptr; // released upon dispatch
+  std::string label = "kernel";        // KernelCode::label, used by Profiler
+  Profiler *profiler = nullptr;        // non-owning, nullptr unless profiling
+  ProfileSlot profileSlot;       // slot of commandBuffer's pass
+  size_t numParamSlots = 0; // > 0 if params are bound with a dynamic offset
+  size_t paramsStride = 0;  // bytes between param slots
+  size_t paramsSlot = 0;    // slot bound when recording commandBuffer
+  WGPUBuffer indirectBuffer = nullptr; // non-owning, see setIndirectDispatch()
+  size_t indirectOffset = 0;           // bytes into indirectBuffer
+  size_t telemetrySlot = static_cast<size_t>(-1); // Telemetry::kernels index
 };
 
 /**
@@ -367,34 +623,229 @@ inline bool operator<(const Kernel &lhs, const Kernel &rhs) {
  * @brief A pool of kernels to manage GPU resources. For simple use cases this
  * is instantiated as a member in the Context struct although it's possible to
  * have multiple resource pools of kernels in more complex scenarios.
+ *
+ * Kernels are returned by value from createKernel(), so the pool tracks the
+ * bind groups and params buffers they own rather than the Kernel instances
+ * themselves. FreeKernel() releases them for an individual kernel.
  */
 struct KernelPool {
   inline KernelPool(Context *ctx) : ctx(ctx), data() {}
   Context *ctx;
-  std::set<Kernel *> data;
-  inline ~KernelPool() {
-    // Note : Some kernel resources such as commandBuffer are harvested by
-    // queue submission, explicitly destroying readback and callback buffers
-    // produces runtime errors.
+  std::set<WGPUBindGroup> data;
+  std::unordered_map<WGPUBuffer, size_t> params; // params buffer -> bytes
+  ~KernelPool();
+};
+
+/**
+ * @brief Compiled pipeline state which can be shared between kernels that
+ * have the same WGSL code, entry point and binding layout. Only the bind
+ * group (and params buffer) is specific to an individual Kernel.
+ */
+struct CompiledPipeline {
+  WGPUBindGroupLayout bgLayout;
+  WGPUPipelineLayout pipelineLayout;
+  WGPUComputePipeline computePipeline;
+};
+
+/**
+ * @brief Content-addressed cache of compiled pipelines, keyed by a hash of the
+ * WGSL code, entry point and binding layout (see pipelineKey()). Used by
+ * createKernel() to skip shader module and pipeline creation when an
+ * equivalent kernel has already been built.
+ *
+ * As with TensorPool, most users do not need to interact with the
+ * PipelineCache directly, as there is a member instance in the Context.
+ */
+struct PipelineCache {
+  std::unordered_map<uint64_t, CompiledPipeline> data;
+  // Callbacks waiting on pipelines that are being compiled asynchronously
+  std::unordered_map<uint64_t, std::vector<std::function<void(bool)>>> pending;
+  size_t hits = 0;
+  size_t misses = 0;
+  inline ~PipelineCache() {
+    for (auto &pair : data) {
+      wgpuComputePipelineRelease(pair.second.computePipeline);
+      wgpuPipelineLayoutRelease(pair.second.pipelineLayout);
+      wgpuBindGroupLayoutRelease(pair.second.bgLayout);
+    }
+    data.clear();
+  }
+};
+
+/**
+ * @brief Opt-in persistent on-disk cache for backend-compiled pipeline blobs.
+ *
+ * When enabled through createContext(), Dawn's cache hooks
+ * (WGPUDawnCacheDeviceDescriptor) load and store blobs through this struct, so
+ * that a warm restart of the process can skip shader compilation. Blobs are
+ * stored in a subdirectory of `dir` named after the adapter / driver identity
+ * (see adapterIdentity()), one file per blob named by the hash of Dawn's cache
+ * key, which itself covers the WGSL code and pipeline state. Each file starts
+ * with the full key, which is compared on load so that a hash collision is a
+ * miss rather than a wrong blob.
+ *
+ * hits and misses count blob lookups, stores counts blobs written to disk.
+ * Dawn may call the hooks from its worker threads, so they are atomic.
+ */
+struct PersistentCache {
+  std::string dir;         // cache directory for the current adapter
+  std::string isolationKey; // adapter / driver identity
+  std::atomic<size_t> hits{0};
+  std::atomic<size_t> misses{0};
+  std::atomic<size_t> stores{0};
+};
+
+/**
+ * @brief Pool of reusable MapRead staging buffers for copying data from the
+ * GPU to the CPU in toCPU() / toCPUAsync(). Buffers are bucketed by size
+ * (rounded up to the next power of two) so that repeated readbacks, such as
+ * once per frame in a render loop, do not allocate a new buffer each time.
+ *
+ * Buffers are returned to the pool once a readback has completed and are
+ * released when the pool is destroyed.
+ */
+struct ReadbackPool {
+  std::unordered_map<size_t, std::vector<WGPUBuffer>> data; // bucket -> free
+                                                            // buffers
+  inline ~ReadbackPool() {
+    for (auto &pair : data) {
+      for (WGPUBuffer buffer : pair.second) {
+        wgpuBufferRelease(buffer);
+      }
+    }
     data.clear();
   }
 };
 
+/**
+ * @brief Classes of GPU buffers counted separately by Telemetry.
+ */
+enum BufferClass {
+  kStorageBuffer = 0, // tensors, arenas and indirect arguments
+  kUniformBuffer,     // kernel params
+  kReadbackBuffer,    // MapRead staging buffers of the ReadbackPool
+  kNumBufferClasses
+};
+
+static const char *kBufferClassStr[] = {"storage", "uniform", "readback"};
+
+/**
+ * @brief Number of dispatches of the kernels with a given label.
+ */
+struct KernelCounter {
+  std::string label;
+  size_t dispatches = 0;
+};
+
+/**
+ * @brief Runtime counters of a Context: the GPU buffers it holds and the work
+ * and transfers it submitted. The counters are plain integers updated by the
+ * gpu.h functions under the Context's mutex, which they hold anyway, so they
+ * cost an increment or two per call. Read them with snapshotTelemetry().
+ */
+struct Telemetry {
+  std::array<size_t, kNumBufferClasses> liveBuffers = {};
+  std::array<size_t, kNumBufferClasses> liveBytes = {};
+  std::array<size_t, kNumBufferClasses> peakBytes = {};
+  size_t submits = 0;      // wgpuQueueSubmit calls
+  size_t dispatches = 0;   // kernel dispatches, including those of batches
+  size_t writes = 0;       // toGPU calls and createTensor uploads
+  size_t bytesWritten = 0;
+  size_t reads = 0;        // toCPU / toCPUAsync calls
+  size_t bytesRead = 0;
+  std::vector<KernelCounter> kernels; // indexed by Kernel::telemetrySlot
+  std::unordered_map<std::string, size_t> kernelSlots; // label -> slot
+};
+
+/**
+ * @brief How wait() drives WebGPU events while a future is pending.
+ *
+ * - kSpin polls wgpuInstanceProcessEvents() continuously, lowest latency but
+ *   occupies a CPU core for the duration of the GPU work.
+ * - kYield polls but yields the thread between polls, so other runnable
+ *   threads on the same core take precedence.
+ * - kBlock sleeps between polls with an exponential backoff (capped at
+ *   kMaxWaitBackoff), which keeps CPU use near zero for long running work at
+ *   the cost of up to one backoff interval of added latency.
+ */
+enum WaitMode { kSpin, kYield, kBlock };
+
+static constexpr std::chrono::microseconds kMinWaitBackoff{10};
+static constexpr std::chrono::microseconds kMaxWaitBackoff{1000};
+
 /**
  * @brief Represents a GPU context, aggregates WebGPU API handles to interact
  * with the GPU including the instance, adapter, device, and queue.
  *
  * Additionally contains a TensorPool and KernelPool for managing GPU resources
  * to simplify lifetime management of GPU resources.
+ *
+ * The gpu.h functions taking a Context (createTensor, createKernel,
+ * dispatchKernel, toGPU, toCPU, wait, ...) lock the Context's mutex and can
+ * be called from several threads sharing the Context. The lower level
+ * overloads taking a TensorPool or WGPUDevice directly are not synchronized,
+ * and an individual Kernel or CommandBatch should be used by one thread at a
+ * time.
  */
 struct Context {
-  WGPUInstance instance;
-  WGPUAdapter adapter;
-  WGPUDevice device;
-  WGPUQueue queue;
+  WGPUInstance instance = nullptr;
+  WGPUAdapter adapter = nullptr;
+  WGPUDevice device = nullptr;
+  WGPUQueue queue = nullptr;
+  // Declared before the pools, which update it while releasing their buffers
+  Telemetry telemetry;
   TensorPool pool = TensorPool(this);
   KernelPool kernelPool = KernelPool(this);
+  PipelineCache pipelineCache;
+  ReadbackPool readbackPool;
+  std::shared_ptr<PersistentCache> diskCache; // nullptr unless enabled in
+                                              // createContext()
+  std::shared_ptr<Profiler> profiler; // nullptr unless enableProfiling()
+  WaitMode waitMode = kSpin;          // see wait()
+  // Serializes the gpu.h functions taking a Context, so that one Context can
+  // be shared by several threads. Recursive since callbacks run inside
+  // wgpuInstanceProcessEvents() and composite functions nest.
+  std::shared_ptr<std::recursive_mutex> mutex =
+      std::make_shared<std::recursive_mutex>();
+  inline Context() = default;
+  /**
+   * @brief Contexts own their WebGPU handles and pooled resources, so they can
+   * be moved (eg. into the std::vector returned by createContexts()) but not
+   * copied. A context must not be moved while it has work in flight, since
+   * pending callbacks refer to it by address.
+   */
+  inline Context(Context &&other) noexcept
+      : instance(other.instance), adapter(other.adapter),
+        device(other.device), queue(other.queue),
+        telemetry(std::move(other.telemetry)),
+        diskCache(std::move(other.diskCache)),
+        profiler(std::move(other.profiler)), waitMode(other.waitMode),
+        mutex(std::move(other.mutex)) {
+    other.instance = nullptr;
+    other.adapter = nullptr;
+    other.device = nullptr;
+    other.queue = nullptr;
+    // The pools keep pointing to this context, only their contents move
+    std::swap(pool.data, other.pool.data);
+    std::swap(pool.arenas, other.pool.arenas);
+    std::swap(pool.arenaUsed, other.pool.arenaUsed);
+    std::swap(pool.arenaCurrent, other.pool.arenaCurrent);
+    pool.arenaBlockSize = other.pool.arenaBlockSize;
+    pool.arenaAlignment = other.pool.arenaAlignment;
+    std::swap(kernelPool.data, other.kernelPool.data);
+    std::swap(kernelPool.params, other.kernelPool.params);
+    std::swap(pipelineCache.data, other.pipelineCache.data);
+    std::swap(pipelineCache.pending, other.pipelineCache.pending);
+    pipelineCache.hits = other.pipelineCache.hits;
+    pipelineCache.misses = other.pipelineCache.misses;
+    std::swap(readbackPool.data, other.readbackPool.data);
+  }
+  Context(const Context &) = delete;
+  Context &operator=(const Context &) = delete;
   ~Context() {
+    if (!instance && !adapter && !device && !queue) {
+      return; // moved from
+    }
     LOG(kDefLog, kTrace, "Destroying context");
     if (queue) {
       wgpuQueueRelease(queue);
@@ -423,6 +874,135 @@ struct Context {
   }
 };
 
+/**
+ * @brief Telemetry class of a buffer with the given usage flags.
+ */
+inline BufferClass bufferClass(WGPUBufferUsageFlags usage) {
+  if (usage & WGPUBufferUsage_MapRead) {
+    return kReadbackBuffer;
+  }
+  return usage & WGPUBufferUsage_Uniform ? kUniformBuffer : kStorageBuffer;
+}
+
+/**
+ * @brief Counts a buffer created for the Context in its Telemetry.
+ */
+inline void trackBuffer(Telemetry &telemetry, BufferClass cls, size_t size) {
+  telemetry.liveBuffers[cls]++;
+  telemetry.liveBytes[cls] += size;
+  telemetry.peakBytes[cls] =
+      std::max(telemetry.peakBytes[cls], telemetry.liveBytes[cls]);
+}
+
+/**
+ * @brief Removes a released buffer from the Context's Telemetry.
+ */
+inline void untrackBuffer(Telemetry &telemetry, BufferClass cls,
+                          size_t size) {
+  telemetry.liveBuffers[cls]--;
+  telemetry.liveBytes[cls] -= size;
+}
+
+/**
+ * @brief Telemetry slot counting the dispatches of kernels with the label,
+ * claimed by createKernel().
+ */
+inline size_t kernelTelemetrySlot(Telemetry &telemetry,
+                                  const std::string &label) {
+  auto [it, inserted] =
+      telemetry.kernelSlots.emplace(label, telemetry.kernels.size());
+  if (inserted) {
+    telemetry.kernels.push_back({label, 0});
+  }
+  return it->second;
+}
+
+/**
+ * @brief Counts a kernel dispatch in the Context's Telemetry.
+ */
+inline void countDispatch(Telemetry &telemetry, const Kernel &kernel,
+                          size_t count = 1) {
+  telemetry.dispatches += count;
+  if (kernel.telemetrySlot < telemetry.kernels.size()) {
+    telemetry.kernels[kernel.telemetrySlot].dispatches += count;
+  }
+}
+
+/**
+ * @brief Counts a write of bytes to the GPU in the Context's Telemetry.
+ */
+inline void countWrite(Telemetry &telemetry, size_t bytes) {
+  telemetry.writes++;
+  telemetry.bytesWritten += bytes;
+}
+
+/**
+ * @brief Returns a copy of the Context's Telemetry. Safe to call while other
+ * threads use the Context.
+ * @param[in] ctx Context instance to read the counters of
+ * @return Telemetry counters at the time of the call
+ *
+ * @code
+ * Telemetry stats = snapshotTelemetry(ctx);
+ * LOG(kDefLog, kInfo, "%s", toString(stats).c_str());
+ * @endcode
+ */
+inline Telemetry snapshotTelemetry(Context &ctx) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  return ctx.telemetry;
+}
+
+/**
+ * @brief Zeroes the submit, dispatch and transfer counters of the Context, for
+ * example to measure the steady state of a loop after warmup. Live buffers
+ * are still held so they are kept, peak bytes restart from the live bytes.
+ * @param[in] ctx Context instance to reset the counters of
+ *
+ * @code
+ * resetTelemetry(ctx);
+ * @endcode
+ */
+inline void resetTelemetry(Context &ctx) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  Telemetry &telemetry = ctx.telemetry;
+  telemetry.peakBytes = telemetry.liveBytes;
+  telemetry.submits = 0;
+  telemetry.dispatches = 0;
+  telemetry.writes = 0;
+  telemetry.bytesWritten = 0;
+  telemetry.reads = 0;
+  telemetry.bytesRead = 0;
+  for (KernelCounter &counter : telemetry.kernels) {
+    counter.dispatches = 0;
+  }
+}
+
+/**
+ * @brief Converts Telemetry to a human readable multi-line summary.
+ */
+inline std::string toString(const Telemetry &telemetry) {
+  char line[256];
+  std::string str;
+  for (size_t cls = 0; cls < kNumBufferClasses; ++cls) {
+    snprintf(line, sizeof(line), "%-8s buffers: %zu, bytes: %zu, peak: %zu\n",
+             kBufferClassStr[cls], telemetry.liveBuffers[cls],
+             telemetry.liveBytes[cls], telemetry.peakBytes[cls]);
+    str += line;
+  }
+  snprintf(line, sizeof(line),
+           "submits: %zu, dispatches: %zu\n"
+           "writes: %zu (%zu bytes), reads: %zu (%zu bytes)\n",
+           telemetry.submits, telemetry.dispatches, telemetry.writes,
+           telemetry.bytesWritten, telemetry.reads, telemetry.bytesRead);
+  str += line;
+  for (const KernelCounter &counter : telemetry.kernels) {
+    snprintf(line, sizeof(line), "  %-24s %zu dispatches\n",
+             counter.label.c_str(), counter.dispatches);
+    str += line;
+  }
+  return str;
+}
+
 /**
  * @brief Tensor factory function to create a tensor (a Tensor type is simply
  * an Array with an N-dimensional  Shape specification) on the GPU. The tensor
@@ -451,19 +1031,17 @@ createTensor(TensorPool &pool, WGPUDevice &device, const Shape &shape,
                                           WGPUBufferUsage_CopyDst |
                                           WGPUBufferUsage_CopySrc) {
   LOG(kDefLog, kTrace, "Creating tensor");
-  size_t numElements = 1;
-  for (size_t dim = 0; dim < shape.rank; dim++) {
-    numElements *= shape.data[dim];
-  }
-  size_t size = dtype == kf32 ? sizeof(float) * numElements : 0;
+  size_t size = sizeBytes(shape, dtype);
   WGPUBufferDescriptor bufferDesc = {
       .usage = usage,
       .size = size,
   };
   WGPUBuffer buffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+  trackBuffer(pool.ctx->telemetry, bufferClass(usage), size);
   pool.data[buffer] = Tensor{
       .data = Array{.buffer = buffer, .usage = usage, .size = size},
       .shape = shape,
+      .dtype = dtype,
   };
   return pool.data[buffer];
 }
@@ -488,16 +1066,76 @@ createTensor(TensorPool &pool, WGPUDevice &device, const Shape &shape,
  * @endcode
  */
 inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
   return createTensor(ctx.pool, ctx.device, shape, dtype);
 }
 
+/**
+ * @brief Checks a condition and logs an error message if the condition is false.
+ * In debug mode, it will also exit the program with an error code.
+ * @param[in] condition The condition to check.
+ * @param[in] message The error message to log if the condition is false.
+ * @param[in] file The source file where the check is performed.
+ * @param[in] line The line number in the source file where the check is performed.
+ */
+inline void check(bool condition, const char *message,
+                  const char *file = "unkown", int line = -1) {
+  if constexpr (kDebug) {
+    if (!condition) {
+      LOG(kDefLog, kError, "Error in file %s line %d:\n%s", file, line,
+          message);
+      exit(1);
+    } else {
+      LOG(kDefLog, kTrace, "Success in file %s line %d:\n%s", file, line,
+          message);
+    }
+  }
+}
+
+/**
+ * @brief Writes float data to a range of a tensor buffer, converting it to the
+ * element type of the tensor. Only kf32 and kf16 tensors can be written from
+ * float data, packed integer types require an explicit quantization step.
+ * @param[in] queue WGPUQueue instance to write with
+ * @param[in] data Pointer to the float data, size(tensor.shape) elements
+ * @param[in] tensor Tensor instance to write to
+ * @param[in] offset Offset in bytes into the tensor buffer
+ * @param[in] size Size in bytes of the written range, defaults to the buffer
+ * size
+ *
+ * @code
+ * writeFloats(queue, data, tensor);
+ * @endcode
+ */
+inline void writeFloats(WGPUQueue queue, const float *data,
+                        const Tensor &tensor, size_t offset = 0,
+                        size_t size = 0) {
+  size = size > 0 ? size : tensor.data.size;
+  if (tensor.dtype == kf32) {
+    wgpuQueueWriteBuffer(queue, tensor.data.buffer, offset, data, size);
+  } else if (tensor.dtype == kf16) {
+    // Buffer sizes are padded to 4 bytes, pad the converted data to match
+    std::vector<half> halfData(size / sizeof(half));
+    std::copy(data, data + std::min(gpu::size(tensor.shape), halfData.size()),
+              halfData.begin());
+    wgpuQueueWriteBuffer(queue, tensor.data.buffer, offset, halfData.data(),
+                         size);
+  } else {
+    // Not a check(), which is compiled out without kDebug
+    LOG(kDefLog, kError,
+        "Float data can only be written to a kf32 or kf16 tensor, not %s",
+        toString(tensor.dtype).c_str());
+  }
+}
+
 /**
  * @brief Overload of the tensor factory function to instantiate a tensor on
  * the GPU with a given shape, data type. Unlike the other overloads, this
  * overload also takes initial data to populate the tensor with.
  *
  * The data is assumed to be of size equal to the product of the dimensions in
- * the shape, and is copied to the GPU buffer.
+ * the shape, and is copied to the GPU buffer. For kf16 tensors, the data is
+ * converted to half precision.
  *
  * @param[in] ctx Context instance to manage the tensor
  * @param[in] shape Shape of the tensor
@@ -511,15 +1149,71 @@ inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype) {
  */
 inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype,
                            float *data) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  Tensor tensor =
+      createTensor(ctx.pool, ctx.device, shape, dtype,
+                   WGPUBufferUsage_Storage | WGPUBufferUsage_CopyDst |
+                       WGPUBufferUsage_CopySrc);
+  writeFloats(ctx.queue, data, tensor);
+  countWrite(ctx.telemetry, tensor.data.size);
+  return tensor;
+}
+
+/**
+ * @brief Overload of the tensor factory function to instantiate a tensor with
+ * initial data that is already in the tensor's storage format, e.g. half
+ * values for kf16, int32_t for ki32 or packed uint32_t words for ki8 and kq4.
+ * The data is copied to the GPU buffer as is.
+ *
+ * @param[in] ctx Context instance to manage the tensor
+ * @param[in] shape Shape of the tensor
+ * @param[in] dtype Data type of the tensor (e.g. kf16)
+ * @param[in] data Initial data of sizeBytes(shape, dtype) bytes
+ * @return Tensor instance representing the created tensor
+ *
+ * @code
+ * Tensor tensor = createTensor(ctx, {256, 256}, kf16, halfData);
+ * @endcode
+ */
+template <typename T,
+          typename = std::enable_if_t<std::is_same_v<T, half> ||
+                                      std::is_same_v<T, int32_t> ||
+                                      std::is_same_v<T, uint32_t>>>
+inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype,
+                           const T *data) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
   Tensor tensor =
       createTensor(ctx.pool, ctx.device, shape, dtype,
                    WGPUBufferUsage_Storage | WGPUBufferUsage_CopyDst |
                        WGPUBufferUsage_CopySrc);
   wgpuQueueWriteBuffer(ctx.queue, tensor.data.buffer, 0, data,
                        tensor.data.size);
+  countWrite(ctx.telemetry, tensor.data.size);
   return tensor;
 }
 
+/**
+ * @brief Creates a tensor holding count sets of indirect dispatch arguments,
+ * (x, y, z) workgroup counts as u32 for each dispatch. The tensor can be
+ * bound to a kernel which computes the workgroup counts of later dispatches
+ * on the GPU, see setIndirectDispatch(). The counts are initially zero, so
+ * dispatches are no-ops until the arguments are written.
+ *
+ * @param[in] ctx Context instance to manage the tensor
+ * @param[in] count Number of sets of dispatch arguments
+ * @return Tensor instance of shape {3 * count} and type ku32
+ *
+ * @code
+ * Tensor args = createIndirectArgs(ctx);
+ * @endcode
+ */
+inline Tensor createIndirectArgs(Context &ctx, size_t count = 1) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  return createTensor(ctx.pool, ctx.device, Shape{3 * count}, ku32,
+                      WGPUBufferUsage_Storage | WGPUBufferUsage_Indirect |
+                          WGPUBufferUsage_CopyDst | WGPUBufferUsage_CopySrc);
+}
+
 /**
  * @brief Frees a tensor resource and updates the tensor pool.
  *
@@ -537,6 +1231,8 @@ inline Tensor createTensor(Context &ctx, const Shape &shape, NumType dtype,
 inline void FreeTensor(TensorPool &pool, Tensor tensor) {
   if (tensor.data.buffer) {
     wgpuBufferRelease(tensor.data.buffer);
+    untrackBuffer(pool.ctx->telemetry, bufferClass(tensor.data.usage),
+                  tensor.data.size);
   } else {
     LOG(kDefLog, kWarn, "Tried to free tensor with null buffer");
   }
@@ -561,80 +1257,171 @@ inline TensorPool::~TensorPool() {
     FreeTensor(*this, data[key]);
     LOG(kDefLog, kTrace, "Freed tensor");
   }
+  for (Array &arena : arenas) {
+    wgpuBufferRelease(arena.buffer);
+    untrackBuffer(ctx->telemetry, kStorageBuffer, arena.size);
+  }
+  arenas.clear();
+  arenaUsed.clear();
 }
 
 /**
- * @brief Checks a condition and logs an error message if the condition is false.
- * In debug mode, it will also exit the program with an error code.
- * @param[in] condition The condition to check.
- * @param[in] message The error message to log if the condition is false.
- * @param[in] file The source file where the check is performed.
- * @param[in] line The line number in the source file where the check is performed.
+ * @brief Destructor for KernelPool which releases the bind groups and params
+ * buffers of all kernels that have not been freed with FreeKernel().
  */
-inline void check(bool condition, const char *message,
-                  const char *file = "unkown", int line = -1) {
-  if constexpr (kDebug) {
-    if (!condition) {
-      LOG(kDefLog, kError, "Error in file %s line %d:\n%s", file, line,
-          message);
-      exit(1);
-    } else {
-      LOG(kDefLog, kTrace, "Success in file %s line %d:\n%s", file, line,
-          message);
-    }
+inline KernelPool::~KernelPool() {
+  // Note : Some kernel resources such as commandBuffer are harvested by
+  // queue submission, explicitly destroying readback and callback buffers
+  // produces runtime errors. Bind groups are only referenced by kernels.
+  for (WGPUBindGroup bindGroup : data) {
+    wgpuBindGroupRelease(bindGroup);
+  }
+  data.clear();
+  for (auto &pair : params) {
+    wgpuBufferRelease(pair.first);
+    untrackBuffer(ctx->telemetry, kUniformBuffer, pair.second);
   }
+  params.clear();
 }
 
 /**
- * @brief Factory function to create a GPU context, which aggregates WebGPU API
- * handles to interact with the GPU including the instance, adapter, device, and
- * queue.
+ * @brief Returns a string identifying the adapter and driver, used to keep
+ * persistent caches from different GPUs or driver versions apart. The string
+ * only contains characters that are safe to use in a file name.
  *
- * The function takes optional descriptor parameters for the instance
- * descriptor, adapter request options, and device descriptor, which are passed
- * through to the WebGPU API calls to create the instance, adapter, and device.
+ * @param[in] adapter WGPUAdapter to identify
+ * @return Identity string of the form <vendor>-<device>-<backend>-<driver hash>
  *
- * If dawn is used, it also sets up an error callback for device loss.
+ * @code
+ * std::string id = adapterIdentity(ctx.adapter);
+ * @endcode
+ */
+inline std::string adapterIdentity(WGPUAdapter adapter) {
+  WGPUAdapterProperties properties = {};
+  wgpuAdapterGetProperties(adapter, &properties);
+  std::string driver;
+  driver += properties.name ? properties.name : "";
+  driver += properties.driverDescription ? properties.driverDescription : "";
+  driver += properties.architecture ? properties.architecture : "";
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%04x-%04x-%d-%016llx",
+           properties.vendorID, properties.deviceID,
+           static_cast<int>(properties.backendType),
+           static_cast<unsigned long long>(
+               hashBytes(driver.data(), driver.size())));
+  wgpuAdapterPropertiesFreeMembers(properties);
+  return buffer;
+}
+
+/**
+ * @brief Returns the path of the file storing the blob for a Dawn cache key.
+ */
+inline std::string cacheBlobPath(const PersistentCache &cache, const void *key,
+                                 size_t keySize) {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.bin",
+           static_cast<unsigned long long>(hashBytes(key, keySize)));
+  return cache.dir + "/" + name;
+}
+
+#ifdef WEBGPU_BACKEND_DAWN
+/**
+ * @brief WGPUDawnLoadCacheDataFunction implementation for PersistentCache.
+ * Dawn calls this with value == nullptr to query the size of a blob, and then
+ * again with a buffer of that size to read it. Files whose stored key differs
+ * from the requested one are treated as missing.
+ */
+inline size_t loadCacheData(const void *key, size_t keySize, void *value,
+                            size_t valueSize, void *userdata) {
+  PersistentCache &cache = *static_cast<PersistentCache *>(userdata);
+  std::string path = cacheBlobPath(cache, key, keySize);
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) {
+    cache.misses++;
+    return 0;
+  }
+  uint64_t storedKeySize = 0;
+  std::vector<char> storedKey;
+  bool match = fread(&storedKeySize, sizeof(storedKeySize), 1, file) == 1 &&
+               storedKeySize == keySize;
+  if (match) {
+    storedKey.resize(keySize);
+    match = fread(storedKey.data(), 1, keySize, file) == keySize &&
+            std::memcmp(storedKey.data(), key, keySize) == 0;
+  }
+  if (!match) {
+    LOG(kDefLog, kWarn, "Cache blob %s has a different key, ignoring",
+        path.c_str());
+    fclose(file);
+    cache.misses++;
+    return 0;
+  }
+  long header = ftell(file);
+  fseek(file, 0, SEEK_END);
+  size_t size = static_cast<size_t>(ftell(file) - header);
+  if (value != nullptr && valueSize >= size) {
+    fseek(file, header, SEEK_SET);
+    size = fread(value, 1, size, file);
+    cache.hits++;
+    LOG(kDefLog, kTrace, "Loaded cache blob %s", path.c_str());
+  }
+  fclose(file);
+  return size;
+}
+
+/**
+ * @brief WGPUDawnStoreCacheDataFunction implementation for PersistentCache.
+ * Blobs are written to a temporary file first and then renamed, so that
+ * concurrently starting processes never read a partially written blob.
+ */
+inline void storeCacheData(const void *key, size_t keySize, const void *value,
+                           size_t valueSize, void *userdata) {
+  PersistentCache &cache = *static_cast<PersistentCache *>(userdata);
+  std::string path = cacheBlobPath(cache, key, keySize);
+  std::string tmpPath = path + ".tmp";
+  FILE *file = fopen(tmpPath.c_str(), "wb");
+  if (!file) {
+    LOG(kDefLog, kWarn, "Could not write cache blob %s", tmpPath.c_str());
+    return;
+  }
+  uint64_t storedKeySize = keySize;
+  bool ok = fwrite(&storedKeySize, sizeof(storedKeySize), 1, file) == 1 &&
+            fwrite(key, 1, keySize, file) == keySize &&
+            fwrite(value, 1, valueSize, file) == valueSize;
+  fclose(file);
+  if (!ok || std::rename(tmpPath.c_str(), path.c_str())) {
+    LOG(kDefLog, kWarn, "Could not write cache blob %s", path.c_str());
+    std::remove(tmpPath.c_str());
+    return;
+  }
+  cache.stores++;
+  LOG(kDefLog, kTrace, "Stored cache blob %s", path.c_str());
+}
+#endif
+
+/**
+ * @brief Variant of createContext() for an adapter that has already been
+ * obtained, eg. from enumerateAdapters(). The context takes ownership of the
+ * instance and adapter references and releases them when it is destroyed.
  *
- * @param[in] desc Instance descriptor for the WebGPU instance (optional)
- * @param[in] adapterOpts Adapter request options for the WebGPU adapter
- * (optional)
+ * @param[in] instance WebGPU instance the adapter belongs to
+ * @param[in] adapter Adapter to create the device on
  * @param[in] devDescriptor Device descriptor for the WebGPU device (optional)
+ * @param[in] cacheDir Directory for the persistent pipeline cache, disabled
+ * if empty (optional)
  * @return Context instance representing the created GPU context
- * 
+ *
  * @code
- * Context ctx = createContext();
+ * Context ctx = createContextFromAdapter(instance, adapter);
  * @endcode
  */
-inline Context createContext(const WGPUInstanceDescriptor &desc = {},
-                             const WGPURequestAdapterOptions &adapterOpts = {},
-                             WGPUDeviceDescriptor devDescriptor = {}) {
+inline Context createContextFromAdapter(WGPUInstance instance,
+                                        WGPUAdapter adapter,
+                                        WGPUDeviceDescriptor devDescriptor = {},
+                                        const std::string &cacheDir = "") {
   Context context;
-  {
-    context.instance = wgpuCreateInstance(&desc);
-    check(context.instance, "Initialize WebGPU", __FILE__, __LINE__);
-  }
-  LOG(kDefLog, kInfo, "Requesting adapter");
-  {
-    struct AdapterData {
-      WGPUAdapter adapter = nullptr;
-      bool requestEnded = false;
-    };
-    AdapterData adapterData;
-    auto onAdapterRequestEnded = [](WGPURequestAdapterStatus status,
-                                    WGPUAdapter adapter, char const *message,
-                                    void *pUserData) {
-      AdapterData &adapterData = *reinterpret_cast<AdapterData *>(pUserData);
-      check(status == WGPURequestAdapterStatus_Success,
-            "Request WebGPU adapter", __FILE__, __LINE__);
-      adapterData.adapter = adapter;
-      adapterData.requestEnded = true;
-    };
-    wgpuInstanceRequestAdapter(context.instance, &adapterOpts,
-                               onAdapterRequestEnded, (void *)&adapterData);
-    assert(adapterData.requestEnded);
-    context.adapter = adapterData.adapter;
-  }
+  context.instance = instance;
+  context.adapter = adapter;
   LOG(kDefLog, kInfo, "Requesting device");
   {
     struct DeviceData {
@@ -669,6 +1456,51 @@ inline Context createContext(const WGPUInstanceDescriptor &desc = {},
     };
 #endif
 
+#ifdef WEBGPU_BACKEND_DAWN
+    WGPUDawnCacheDeviceDescriptor cacheDesc = {};
+    if (!cacheDir.empty()) {
+      context.diskCache = std::make_shared<PersistentCache>();
+      context.diskCache->isolationKey = adapterIdentity(context.adapter);
+      context.diskCache->dir = cacheDir + "/" + context.diskCache->isolationKey;
+      std::error_code error;
+      std::filesystem::create_directories(context.diskCache->dir, error);
+      check(!error, "Create persistent cache directory", __FILE__, __LINE__);
+      cacheDesc.chain.next = devDescriptor.nextInChain;
+      cacheDesc.chain.sType = WGPUSType_DawnCacheDeviceDescriptor;
+      cacheDesc.isolationKey = context.diskCache->isolationKey.c_str();
+      cacheDesc.loadDataFunction = loadCacheData;
+      cacheDesc.storeDataFunction = storeCacheData;
+      cacheDesc.functionUserdata = context.diskCache.get();
+      devDescriptor.nextInChain = &cacheDesc.chain;
+      LOG(kDefLog, kInfo, "Using persistent pipeline cache in %s",
+          context.diskCache->dir.c_str());
+    }
+#else
+    if (!cacheDir.empty()) {
+      LOG(kDefLog, kWarn,
+          "Persistent pipeline cache requires the dawn backend, ignoring");
+    }
+#endif
+
+    // Request the optional features used by gpu.h (shader-f16 for kf16
+    // kernels, timestamp-query for timeKernel, implicit device
+    // synchronization for WebGPU calls made outside of gpu.h from several
+    // threads, subgroups for the kernels checking supportsSubgroups()) that
+    // the adapter supports, unless the caller chose features
+    std::vector<WGPUFeatureName> features;
+    if (devDescriptor.requiredFeatureCount == 0) {
+      for (WGPUFeatureName feature :
+           {WGPUFeatureName_ShaderF16, WGPUFeatureName_TimestampQuery,
+            WGPUFeatureName_ImplicitDeviceSynchronization,
+            WGPUFeatureName_ChromiumExperimentalSubgroups}) {
+        if (wgpuAdapterHasFeature(context.adapter, feature)) {
+          LOG(kDefLog, kInfo, "Requesting feature %x", feature);
+          features.push_back(feature);
+        }
+      }
+      devDescriptor.requiredFeatureCount = features.size();
+      devDescriptor.requiredFeatures = features.data();
+    }
     wgpuAdapterRequestDevice(context.adapter, &devDescriptor,
                              onDeviceRequestEnded, (void *)&devData);
     assert(devData.requestEnded);
@@ -685,189 +1517,1226 @@ inline Context createContext(const WGPUInstanceDescriptor &desc = {},
   return context;
 }
 
-inline void wait(Context &ctx, std::future<void> &future) {
-  while (future.wait_for(std::chrono::seconds(0)) !=
-         std::future_status::ready) {
-    wgpuInstanceProcessEvents(ctx.instance);
-  }
-}
-
 /**
- * @brief Copies data from a GPU buffer to CPU memory.
- * @param[in] ctx Context instance to manage the operation
- * @param[in] tensor Tensor instance representing the GPU buffer to copy from
- * @param[out] data Pointer to the CPU memory to copy the data to
- * @param[in] bufferSize Size of the data buffer in bytes
+ * @brief Factory function to create a GPU context, which aggregates WebGPU API
+ * handles to interact with the GPU including the instance, adapter, device, and
+ * queue.
+ *
+ * The function takes optional descriptor parameters for the instance
+ * descriptor, adapter request options, and device descriptor, which are passed
+ * through to the WebGPU API calls to create the instance, adapter, and device.
+ *
+ * If dawn is used, it also sets up an error callback for device loss.
+ *
+ * If a cacheDir is given and dawn is used, backend-compiled pipelines are
+ * persisted to (and loaded from) a per-adapter subdirectory of cacheDir, see
+ * PersistentCache.
+ *
+ * @param[in] desc Instance descriptor for the WebGPU instance (optional)
+ * @param[in] adapterOpts Adapter request options for the WebGPU adapter
+ * (optional)
+ * @param[in] devDescriptor Device descriptor for the WebGPU device (optional)
+ * @param[in] cacheDir Directory for the persistent pipeline cache, disabled
+ * if empty (optional)
+ * @return Context instance representing the created GPU context
  * 
  * @code
- * toCPU(ctx, tensor, data, bufferSize);
+ * Context ctx = createContext();
+ * Context cachedCtx = createContext({}, {}, {}, "/tmp/gpu_cache");
  * @endcode
  */
-inline void toCPU(Context &ctx, Tensor &tensor, float *data,
-                  size_t bufferSize) {
-  WGPUDevice device = ctx.device;
-  struct CopyOp {
-    WGPUCommandBuffer commandBuffer;
-    WGPUBuffer readbackBuffer;
-    std::promise<void> promise;
-    std::future<void> future;
-    CallbackDataDyn callbackData;
-  };
-  CopyOp op;
-  op.future = op.promise.get_future();
+inline Context createContext(const WGPUInstanceDescriptor &desc = {},
+                             const WGPURequestAdapterOptions &adapterOpts = {},
+                             WGPUDeviceDescriptor devDescriptor = {},
+                             const std::string &cacheDir = "") {
+  WGPUInstance instance = wgpuCreateInstance(&desc);
+  check(instance, "Initialize WebGPU", __FILE__, __LINE__);
+  WGPUAdapter adapter = nullptr;
+  LOG(kDefLog, kInfo, "Requesting adapter");
   {
-    WGPUBufferDescriptor readbackBufferDescriptor = {
-        .usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_MapRead,
-        .size = bufferSize,
+    struct AdapterData {
+      WGPUAdapter adapter = nullptr;
+      bool requestEnded = false;
     };
-    op.readbackBuffer =
-        wgpuDeviceCreateBuffer(device, &readbackBufferDescriptor);
-  }
-  {
-    WGPUCommandEncoder commandEncoder;
-    WGPUComputePassEncoder computePassEncoder;
-    commandEncoder = wgpuDeviceCreateCommandEncoder(device, nullptr);
-    wgpuCommandEncoderCopyBufferToBuffer(commandEncoder, tensor.data.buffer, 0,
-                                         op.readbackBuffer, 0, bufferSize);
-    op.commandBuffer = wgpuCommandEncoderFinish(commandEncoder, nullptr);
-    check(op.commandBuffer, "Create command buffer", __FILE__, __LINE__);
+    AdapterData adapterData;
+    auto onAdapterRequestEnded = [](WGPURequestAdapterStatus status,
+                                    WGPUAdapter adapter, char const *message,
+                                    void *pUserData) {
+      AdapterData &adapterData = *reinterpret_cast<AdapterData *>(pUserData);
+      check(status == WGPURequestAdapterStatus_Success,
+            "Request WebGPU adapter", __FILE__, __LINE__);
+      adapterData.adapter = adapter;
+      adapterData.requestEnded = true;
+    };
+    wgpuInstanceRequestAdapter(instance, &adapterOpts, onAdapterRequestEnded,
+                               (void *)&adapterData);
+    assert(adapterData.requestEnded);
+    adapter = adapterData.adapter;
   }
-  wgpuQueueSubmit(ctx.queue, 1, &op.commandBuffer);
-  CallbackDataDyn callbackData = {op.readbackBuffer, bufferSize, data,
-                                  &op.promise, &op.future};
-  wgpuQueueOnSubmittedWorkDone(
-      ctx.queue,
-      [](WGPUQueueWorkDoneStatus status, void *callbackData) {
-        check(status == WGPUQueueWorkDoneStatus_Success, "Queue work done",
-              __FILE__, __LINE__);
-        const auto *data = static_cast<CallbackDataDyn *>(callbackData);
-        wgpuBufferMapAsync(
-            data->buffer, WGPUMapMode_Read, 0, data->bufferSize,
-            [](WGPUBufferMapAsyncStatus status, void *captureData) {
-              const auto *data = static_cast<CallbackDataDyn *>(captureData);
-              check(status == WGPUBufferMapAsyncStatus_Success,
-                    "Map readbackBuffer", __FILE__, __LINE__);
-              const void *mappedData = wgpuBufferGetConstMappedRange(
-                  data->buffer, /*offset=*/0, data->bufferSize);
-              check(mappedData, "Get mapped range", __FILE__, __LINE__);
-              memcpy(data->output, mappedData, data->bufferSize);
-              wgpuBufferUnmap(data->buffer);
-              data->promise->set_value();
-            },
-            callbackData);
-      },
-      &callbackData);
-  wait(ctx, op.future);
+  return createContextFromAdapter(instance, adapter, devDescriptor, cacheDir);
 }
 
 /**
- * @brief Overload of the toCPU function to copy data from a GPU buffer to CPU
- * memory for an array of floats instead of a pointer to a float buffer.
- * @param[in] ctx Context instance to manage the operation
- * @param[in] tensor Tensor instance representing the GPU buffer to copy from
- * @param[out] data Array of floats to copy the data to
- * 
+ * @brief Whether the device of a context supports subgroup operations
+ * (the WGSL extension chromium_experimental_subgroups). createContext()
+ * requests the feature whenever the adapter exposes it, Dawn only exposes
+ * it with the allow_unsafe_apis toggle. Kernels using subgroups should
+ * check this and fall back to workgroup memory otherwise.
+ *
  * @code
- * toCPU(ctx, tensor, data);
+ * bool subgroups = supportsSubgroups(ctx);
  * @endcode
  */
-template <size_t N>
-void toCPU(Context &ctx, Tensor &tensor, std::array<float, N>& data) {
-  toCPU(ctx, tensor, data.data(), sizeof(data));
+inline bool supportsSubgroups(Context &ctx) {
+  return wgpuDeviceHasFeature(ctx.device,
+                              WGPUFeatureName_ChromiumExperimentalSubgroups);
 }
 
 /**
- * @brief Copies data from CPU memory to a GPU buffer. The toGPU overloads are
- * effectively a convenience wrapper around the WebGPU API call
- * wgpuQueueWriteBuffer.
+ * @brief Queries the range of subgroup sizes of the device, e.g. to choose
+ * tile sizes of subgroup kernels.
+ * @param[in] ctx Context instance of the device
+ * @param[out] minSize Smallest subgroup size, 0 if unknown
+ * @param[out] maxSize Largest subgroup size, 0 if unknown
+ * @return false if the device does not support subgroups
  *
- * @param[in] ctx Context instance to manage the operation
- * @param[in] data Pointer to the CPU memory to copy from
- * @param[in] buffer WGPUBuffer instance representing the GPU buffer to copy to
- * @param[in] size Size of the data buffer in bytes
- * 
  * @code
- * toGPU(ctx, data, buffer, size);
+ * uint32_t minSize, maxSize;
+ * subgroupSizeRange(ctx, minSize, maxSize);
  * @endcode
  */
-inline void toGPU(Context &ctx, const void *data, WGPUBuffer buffer,
-                  size_t size) {
-  wgpuQueueWriteBuffer(ctx.queue, buffer, 0, data, size);
+inline bool subgroupSizeRange(Context &ctx, uint32_t &minSize,
+                              uint32_t &maxSize) {
+  minSize = maxSize = 0;
+  if (!supportsSubgroups(ctx)) {
+    return false;
+  }
+#ifdef WEBGPU_BACKEND_DAWN
+  WGPUDawnExperimentalSubgroupLimits subgroupLimits = {};
+  subgroupLimits.chain.sType = WGPUSType_DawnExperimentalSubgroupLimits;
+  WGPUSupportedLimits limits = {};
+  limits.nextInChain = &subgroupLimits.chain;
+  if (wgpuDeviceGetLimits(ctx.device, &limits) == WGPUStatus_Success &&
+      subgroupLimits.minSubgroupSize != WGPU_LIMIT_U32_UNDEFINED) {
+    minSize = subgroupLimits.minSubgroupSize;
+    maxSize = subgroupLimits.maxSubgroupSize;
+  }
+#endif
+  return true;
 }
 
 /**
- * @brief Overload of the toGPU function to copy data from CPU memory to a GPU
- * taking a Tensor instance instead of a WGPUBuffer instance.
- * @param[in] ctx Context instance to manage the operation
- * @param[in] data Pointer to the CPU memory to copy from
- * @param[in] tensor Tensor instance representing the GPU buffer to copy to
- * 
+ * @brief Lists the distinct adapters of an instance, in order of preference
+ * (high performance adapters first).
+ *
+ * webgpu.h has no adapter enumeration, so adapters are discovered by
+ * requesting one for each combination of backend and power preference and
+ * de-duplicating the results by adapterIdentity(), which covers the backend
+ * as well as the vendor, device and driver. Requests which only differ in
+ * their power preference and return the same adapter are reported once,
+ * adapters of different backends are kept apart. CPU (software) adapters are
+ * only returned when no GPU was found.
+ *
+ * De-duplicating by identity is only correct because of how the adapters are
+ * found: each request returns a new handle even for the same GPU, and webgpu.h
+ * has no per-device key (LUID or PCI bus ID) to compare instead. Requests
+ * also only ever return the first of several GPUs of the same model on one
+ * backend, so eg. two identical GPUs show up as one adapter here, there is
+ * never a second one that the identity would wrongly merge. Use
+ * enumerateNativeAdapters() to get each of them, which createContexts() does
+ * when Dawn's native headers are available.
+ *
+ * The caller owns the returned adapters and releases them with
+ * wgpuAdapterRelease() or passes them to createContextFromAdapter().
+ *
+ * @param[in] instance WebGPU instance to request adapters from
+ * @return Distinct adapters of the instance
+ *
  * @code
- * toGPU(ctx, data, tensor);
+ * std::vector<WGPUAdapter> adapters = enumerateAdapters(instance);
  * @endcode
  */
-inline void toGPU(Context &ctx, const float *data, Tensor &tensor) {
-  wgpuQueueWriteBuffer(ctx.queue, tensor.data.buffer, 0, data,
-                       tensor.data.size);
+inline std::vector<WGPUAdapter> enumerateAdapters(WGPUInstance instance) {
+  std::vector<WGPUAdapter> adapters;
+  std::vector<WGPUAdapter> cpuAdapters;
+  std::set<std::string> seen;
+  for (WGPUBackendType backend :
+       {WGPUBackendType_Undefined, WGPUBackendType_D3D12,
+        WGPUBackendType_Metal, WGPUBackendType_Vulkan, WGPUBackendType_D3D11,
+        WGPUBackendType_OpenGL, WGPUBackendType_OpenGLES}) {
+    for (WGPUPowerPreference power :
+         {WGPUPowerPreference_HighPerformance, WGPUPowerPreference_LowPower}) {
+      WGPURequestAdapterOptions adapterOpts = {
+          .powerPreference = power,
+          .backendType = backend,
+      };
+      WGPUAdapter adapter = nullptr;
+      // Unlike in createContext(), a failed request only means the backend
+      // is not available
+      wgpuInstanceRequestAdapter(
+          instance, &adapterOpts,
+          [](WGPURequestAdapterStatus status, WGPUAdapter adapter,
+             char const *message, void *pUserData) {
+            if (status == WGPURequestAdapterStatus_Success) {
+              *static_cast<WGPUAdapter *>(pUserData) = adapter;
+            }
+          },
+          &adapter);
+      if (!adapter) {
+        continue;
+      }
+      if (!seen.insert(adapterIdentity(adapter)).second) {
+        wgpuAdapterRelease(adapter);
+        continue;
+      }
+      WGPUAdapterProperties properties = {};
+      wgpuAdapterGetProperties(adapter, &properties);
+      LOG(kDefLog, kInfo, "Found adapter %s (backend %d)",
+          properties.name ? properties.name : "", properties.backendType);
+      if (properties.adapterType == WGPUAdapterType_CPU) {
+        cpuAdapters.push_back(adapter);
+      } else {
+        adapters.push_back(adapter);
+      }
+      wgpuAdapterPropertiesFreeMembers(properties);
+    }
+  }
+  if (adapters.empty()) {
+    return cpuAdapters;
+  }
+  for (WGPUAdapter adapter : cpuAdapters) {
+    wgpuAdapterRelease(adapter);
+  }
+  return adapters;
 }
 
-
-template <typename Params>
-inline void toGPU(Context &ctx, Params &params, Kernel &op) {
-  // TODO(avh): Maintain params metadata in Kernel and check for consistency.
-  // If a kernel does not have parameters this will quietly overwrite
-  // the last buffer in the bind group with the parameters buffer.
-  if (op.numBindings > 0) {
-    wgpuQueueWriteBuffer(ctx.queue,
-                         op.buffers[op.numBindings - 1], 0,
-                         static_cast<void *>(&params), sizeof(params));
+#ifdef GPU_DAWN_NATIVE_ADAPTERS
+/**
+ * @brief Lists the physical adapters of a Dawn native instance in order of
+ * preference, with CPU (software) adapters only when no GPU was found, as
+ * enumerateAdapters() does.
+ *
+ * Dawn enumerates each physical device once per backend, so the adapters are
+ * de-duplicated by backend and handle rather than by adapterIdentity(): two
+ * identical GPUs have the same identity but are different handles, and get one
+ * entry (and one Context in createContexts()) each. The same GPU exposed
+ * through two backends, eg. Vulkan and OpenGL, is listed under both.
+ *
+ * The caller owns the returned adapters and releases them with
+ * wgpuAdapterRelease() or passes them to createContextFromAdapter().
+ *
+ * @param[in] native Dawn native instance to enumerate the adapters of
+ * @return Distinct adapters of the instance
+ *
+ * @code
+ * dawn::native::Instance native(&desc);
+ * std::vector<WGPUAdapter> adapters = enumerateNativeAdapters(native);
+ * @endcode
+ */
+inline std::vector<WGPUAdapter>
+enumerateNativeAdapters(const dawn::native::Instance &native) {
+  std::vector<WGPUAdapter> adapters;
+  std::vector<WGPUAdapter> cpuAdapters;
+  std::set<std::pair<WGPUBackendType, WGPUAdapter>> seen;
+  WGPURequestAdapterOptions adapterOpts = {
+      .powerPreference = WGPUPowerPreference_HighPerformance,
+      .backendType = WGPUBackendType_Undefined, // all backends
+  };
+  for (const dawn::native::Adapter &found :
+       native.EnumerateAdapters(&adapterOpts)) {
+    WGPUAdapter adapter = found.Get();
+    WGPUAdapterProperties properties = {};
+    wgpuAdapterGetProperties(adapter, &properties);
+    if (seen.insert({properties.backendType, adapter}).second) {
+      wgpuAdapterAddRef(adapter); // found only holds its reference until here
+      LOG(kDefLog, kInfo, "Found adapter %s (backend %d)",
+          properties.name ? properties.name : "", properties.backendType);
+      if (properties.adapterType == WGPUAdapterType_CPU) {
+        cpuAdapters.push_back(adapter);
+      } else {
+        adapters.push_back(adapter);
+      }
+    }
+    wgpuAdapterPropertiesFreeMembers(properties);
+  }
+  if (adapters.empty()) {
+    return cpuAdapters;
+  }
+  for (WGPUAdapter adapter : cpuAdapters) {
+    wgpuAdapterRelease(adapter);
   }
+  return adapters;
 }
+#endif
 
 /**
- * @brief Resets the command buffer in preparation for a kernel dispatch.
- * Since command buffers are consumed upon submission, this function is used
- * both in the initial kernel creation and every time the kernel is to be
- * reused for a dispatch.
- * @param[in] device WGPUDevice instance to manage the operation
- * @param[in] op Kernel instance representing the kernel to reset
- * 
+ * @brief Creates one Context for each adapter reported by
+ * enumerateAdapters(), eg. to shard work across the GPUs of a machine with
+ * shardRange(). With Dawn's native headers the adapters come from
+ * enumerateNativeAdapters() instead, so that each of several identical GPUs
+ * gets its own context.
+ *
+ * Each context gets its own instance, so that waiting on one context only
+ * processes the events of its own device and contexts can be driven from
+ * separate threads without contending for each other's locks.
+ *
+ * @param[in] desc Instance descriptor for the WebGPU instances (optional)
+ * @param[in] devDescriptor Device descriptor for the WebGPU devices (optional)
+ * @param[in] maxContexts Maximum number of contexts to create (optional)
+ * @return One context per adapter, in order of preference
+ *
  * @code
- * resetCommandBuffer(device, op);
+ * std::vector<Context> contexts = createContexts();
  * @endcode
  */
-inline void resetCommandBuffer(WGPUDevice &device, Kernel &op) {
+inline std::vector<Context>
+createContexts(const WGPUInstanceDescriptor &desc = {},
+               const WGPUDeviceDescriptor &devDescriptor = {},
+               size_t maxContexts = static_cast<size_t>(-1)) {
+  // Creates an instance owned by the caller and lists its adapters
+  auto discover = [&desc](WGPUInstance &instance) {
+#ifdef GPU_DAWN_NATIVE_ADAPTERS
+    dawn::native::Instance native(&desc);
+    instance = native.Get();
+    check(instance, "Initialize WebGPU", __FILE__, __LINE__);
+    wgpuInstanceAddRef(instance); // outlives native
+    return enumerateNativeAdapters(native);
+#else
+    instance = wgpuCreateInstance(&desc);
+    check(instance, "Initialize WebGPU", __FILE__, __LINE__);
+    return enumerateAdapters(instance);
+#endif
+  };
+  size_t count;
   {
-    WGPUCommandEncoder commandEncoder =
-        wgpuDeviceCreateCommandEncoder(device, nullptr);
-    WGPUComputePassEncoder computePassEncoder =
-        wgpuCommandEncoderBeginComputePass(commandEncoder, nullptr);
-    wgpuComputePassEncoderSetPipeline(computePassEncoder, op.computePipeline);
-    wgpuComputePassEncoderSetBindGroup(computePassEncoder, 0, op.bindGroup, 0,
-                                       nullptr);
-    wgpuComputePassEncoderDispatchWorkgroups(
-        computePassEncoder, op.nWorkgroups[0], op.nWorkgroups[1],
-        op.nWorkgroups[2]);
-    wgpuComputePassEncoderEnd(computePassEncoder);
-    op.commandBuffer = wgpuCommandEncoderFinish(commandEncoder, nullptr);
+    WGPUInstance instance = nullptr;
+    std::vector<WGPUAdapter> adapters = discover(instance);
+    count = std::min(adapters.size(), maxContexts);
+    for (WGPUAdapter adapter : adapters) {
+      wgpuAdapterRelease(adapter);
+    }
+    wgpuInstanceRelease(instance);
+  }
+  check(count > 0, "No WebGPU adapter found", __FILE__, __LINE__);
+  std::vector<Context> contexts;
+  contexts.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    WGPUInstance instance = nullptr;
+    // Adapter order is deterministic, so the i-th adapter of a new instance
+    // is the same GPU as the i-th adapter of the probe instance
+    std::vector<WGPUAdapter> adapters = discover(instance);
+    check(i < adapters.size(), "Adapter enumeration changed", __FILE__,
+          __LINE__);
+    for (size_t j = 0; j < adapters.size(); ++j) {
+      if (j != i) {
+        wgpuAdapterRelease(adapters[j]);
+      }
+    }
+    contexts.push_back(
+        createContextFromAdapter(instance, adapters[i], devDescriptor));
   }
+  return contexts;
 }
 
 /**
- * @brief NoParam is a no-op type used to indicate that a kernel does not have
- * any parameters.
+ * @brief A contiguous range [offset, offset + size) of a sharded dimension.
  */
-struct NoParam {};
-template <typename T> constexpr bool IsNoParam = std::is_same_v<T, NoParam>;
+struct ShardRange {
+  size_t offset;
+  size_t size;
+};
 
 /**
- * @brief Ceiling division.
+ * @brief Splits a dimension of size n (eg. the rows M of a matmul or the batch
+ * dimension) into numShards contiguous ranges of near-equal size. Each range
+ * except the last is a multiple of granularity, so that shards can be aligned
+ * to kernel tile sizes. Trailing shards may be empty if n is small.
+ *
+ * @param[in] n Size of the dimension to split
+ * @param[in] numShards Number of shards, usually the number of contexts
+ * @param[in] granularity Size that shard boundaries are rounded to (optional)
+ * @return numShards ranges covering [0, n)
+ *
+ * @code
+ * std::vector<ShardRange> shards = shardRange(M, contexts.size(), 64);
+ * @endcode
  */
-inline size_t cdiv(size_t n, size_t d) { return (n + d - 1) / d; }
+inline std::vector<ShardRange> shardRange(size_t n, size_t numShards,
+                                          size_t granularity = 1) {
+  assert(numShards > 0 && granularity > 0);
+  size_t blocks = cdiv(n, granularity);
+  std::vector<ShardRange> shards(numShards);
+  size_t offset = 0;
+  for (size_t i = 0; i < numShards; ++i) {
+    // Distribute the remainder of blocks over the first shards
+    size_t shardBlocks = blocks / numShards + (i < blocks % numShards ? 1 : 0);
+    size_t size = std::min(shardBlocks * granularity, n - offset);
+    shards[i] = ShardRange{offset, size};
+    offset += size;
+  }
+  return shards;
+}
 
 /**
- * @brief cdiv for shape specification. Mostly useful for evenly dividing total
- * # threads by workgroup size dimensions.
+ * @brief Waits until a future is ready or a timeout expires, processing
+ * WebGPU events so that the callbacks fulfilling the future can run. How the
+ * calling thread behaves between polls is determined by the mode, see
+ * WaitMode.
+ *
+ * @param[in] ctx Context instance whose events are processed
+ * @param[in] future Future to wait for
+ * @param[in] timeout Maximum time to wait
+ * @param[in] mode Polling behavior, defaults to ctx.waitMode
+ * @return true if the future is ready, false if the timeout expired first
+ *
+ * @code
+ * if (!waitFor(ctx, future, std::chrono::milliseconds(100), kBlock)) {
+ *   // still running, do other work and try again later
+ * }
+ * @endcode
+ */
+template <typename T>
+inline bool waitFor(Context &ctx, std::future<T> &future,
+                    std::chrono::nanoseconds timeout, WaitMode mode) {
+  auto now = std::chrono::steady_clock::now();
+  auto deadline = timeout < std::chrono::steady_clock::time_point::max() - now
+                      ? now + timeout
+                      : std::chrono::steady_clock::time_point::max();
+  std::chrono::microseconds backoff = kMinWaitBackoff;
+  while (true) {
+    {
+      std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+      wgpuInstanceProcessEvents(ctx.instance);
+    }
+    if (future.wait_for(std::chrono::seconds(0)) ==
+        std::future_status::ready) {
+      return true;
+    }
+    now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      return false;
+    }
+    if (mode == kYield) {
+      std::this_thread::yield();
+    } else if (mode == kBlock) {
+      // Sleep no further than the deadline
+      auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+          deadline - now);
+      std::this_thread::sleep_for(std::min(backoff, remaining));
+      backoff = std::min(backoff * 2, kMaxWaitBackoff);
+    }
+  }
+}
+
+/**
+ * @brief Overload of waitFor() using the Context's wait mode.
+ */
+template <typename T>
+inline bool waitFor(Context &ctx, std::future<T> &future,
+                    std::chrono::nanoseconds timeout) {
+  return waitFor(ctx, future, timeout, ctx.waitMode);
+}
+
+/**
+ * @brief Blocks until a future is ready, processing WebGPU events according
+ * to ctx.waitMode (kSpin by default). Set ctx.waitMode = kBlock to avoid
+ * occupying a CPU core while waiting on long running GPU work.
+ *
+ * @param[in] ctx Context instance whose events are processed
+ * @param[in] future Future to wait for
+ *
+ * @code
+ * ctx.waitMode = kBlock;
+ * dispatchKernel(ctx, op, promise);
+ * wait(ctx, future);
+ * @endcode
+ */
+template <typename T> inline void wait(Context &ctx, std::future<T> &future) {
+  waitFor(ctx, future, std::chrono::nanoseconds::max(), ctx.waitMode);
+}
+
+/**
+ * @brief Returns the size bucket of the ReadbackPool for a readback of the
+ * given size, which is the next power of two (with a minimum of 256 bytes).
+ */
+inline size_t readbackBucket(size_t size) {
+  size_t bucket = 256;
+  while (bucket < size) {
+    bucket <<= 1;
+  }
+  return bucket;
+}
+
+/**
+ * @brief Takes a MapRead staging buffer of at least the given size from the
+ * Context's ReadbackPool, creating one if no buffer of the size bucket is
+ * available. The buffer should be handed back with releaseReadbackBuffer()
+ * after it has been unmapped.
+ * @param[in] ctx Context instance owning the pool
+ * @param[in] size Size of the readback in bytes
+ * @return Staging buffer of size readbackBucket(size)
+ *
+ * @code
+ * WGPUBuffer buffer = acquireReadbackBuffer(ctx, size);
+ * @endcode
+ */
+inline WGPUBuffer acquireReadbackBuffer(Context &ctx, size_t size) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  size_t bucket = readbackBucket(size);
+  std::vector<WGPUBuffer> &buffers = ctx.readbackPool.data[bucket];
+  if (!buffers.empty()) {
+    WGPUBuffer buffer = buffers.back();
+    buffers.pop_back();
+    return buffer;
+  }
+  LOG(kDefLog, kTrace, "Creating readback buffer of size %d", bucket);
+  WGPUBufferDescriptor readbackBufferDescriptor = {
+      .usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_MapRead,
+      .size = bucket,
+  };
+  trackBuffer(ctx.telemetry, kReadbackBuffer, bucket);
+  return wgpuDeviceCreateBuffer(ctx.device, &readbackBufferDescriptor);
+}
+
+/**
+ * @brief Returns a staging buffer obtained with acquireReadbackBuffer() to the
+ * Context's ReadbackPool so it can be reused by subsequent readbacks.
+ * @param[in] ctx Context instance owning the pool
+ * @param[in] buffer Unmapped staging buffer
+ * @param[in] size Size of the readback the buffer was acquired for in bytes
+ *
+ * @code
+ * releaseReadbackBuffer(ctx, buffer, size);
+ * @endcode
+ */
+inline void releaseReadbackBuffer(Context &ctx, WGPUBuffer buffer,
+                                  size_t size) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  ctx.readbackPool.data[readbackBucket(size)].push_back(buffer);
+}
+
+/**
+ * @brief Asynchronously copies data from a GPU buffer to CPU memory. The copy
+ * goes through a staging buffer from the Context's ReadbackPool which is
+ * returned to the pool once the data has been copied to the output.
+ *
+ * toCPUAsync does *not* wait for the copy to finish and returns
+ * immediately, so that the readback can overlap with other work such as the
+ * dispatch of the next kernel. The output memory must remain valid until the
+ * returned future is ready, use wait() to process events until then.
+ *
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] tensor Tensor instance representing the GPU buffer to copy from
+ * @param[out] data Pointer to the CPU memory to copy the data to
+ * @param[in] bufferSize Size of the data buffer in bytes
+ * @param[in] sourceOffset Offset in bytes into the GPU buffer to copy from
+ * @return Future which is ready once the data has been copied to data
+ *
+ * @code
+ * std::future<void> future = toCPUAsync(ctx, tensor, data, bufferSize);
+ * wait(ctx, future);
+ * @endcode
+ */
+inline std::future<void> toCPUAsync(Context &ctx, Tensor &tensor, void *data,
+                                    size_t bufferSize,
+                                    size_t sourceOffset = 0) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  struct CopyOp {
+    Context *ctx;
+    WGPUBuffer readbackBuffer;
+    size_t bufferSize;
+    void *output; // non-owning
+    std::promise<void> promise;
+  };
+  // Owned by the map callback, which deletes it after completion
+  CopyOp *op = new CopyOp{&ctx, acquireReadbackBuffer(ctx, bufferSize),
+                          bufferSize, data};
+  ctx.telemetry.reads++;
+  ctx.telemetry.bytesRead += bufferSize;
+  ctx.telemetry.submits++;
+  std::future<void> future = op->promise.get_future();
+  {
+    WGPUCommandEncoder commandEncoder =
+        wgpuDeviceCreateCommandEncoder(ctx.device, nullptr);
+    wgpuCommandEncoderCopyBufferToBuffer(commandEncoder, tensor.data.buffer,
+                                         sourceOffset, op->readbackBuffer, 0,
+                                         bufferSize);
+    WGPUCommandBuffer commandBuffer =
+        wgpuCommandEncoderFinish(commandEncoder, nullptr);
+    check(commandBuffer, "Create command buffer", __FILE__, __LINE__);
+    wgpuQueueSubmit(ctx.queue, 1, &commandBuffer);
+    wgpuCommandBufferRelease(commandBuffer);
+    wgpuCommandEncoderRelease(commandEncoder);
+  }
+  // Mapping waits for the submitted copy, no need for a separate
+  // wgpuQueueOnSubmittedWorkDone callback
+  wgpuBufferMapAsync(
+      op->readbackBuffer, WGPUMapMode_Read, 0, bufferSize,
+      [](WGPUBufferMapAsyncStatus status, void *captureData) {
+        CopyOp *op = static_cast<CopyOp *>(captureData);
+        check(status == WGPUBufferMapAsyncStatus_Success,
+              "Map readbackBuffer", __FILE__, __LINE__);
+        const void *mappedData = wgpuBufferGetConstMappedRange(
+            op->readbackBuffer, /*offset=*/0, op->bufferSize);
+        check(mappedData, "Get mapped range", __FILE__, __LINE__);
+        memcpy(op->output, mappedData, op->bufferSize);
+        wgpuBufferUnmap(op->readbackBuffer);
+        releaseReadbackBuffer(*op->ctx, op->readbackBuffer, op->bufferSize);
+        op->promise.set_value();
+        delete op;
+      },
+      op);
+  return future;
+}
+
+/**
+ * @brief Copies data from a GPU buffer to CPU memory, blocking until the copy
+ * is complete. See toCPUAsync() for the non-blocking version.
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] tensor Tensor instance representing the GPU buffer to copy from
+ * For kf16 tensors, the data is converted to float.
+ *
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] tensor Tensor instance representing the GPU buffer to copy from
+ * @param[out] data Pointer to the CPU memory to copy the data to
+ * @param[in] bufferSize Size of the data buffer in bytes
+ * @param[in] sourceOffset Offset in bytes into the GPU buffer to copy from
+ * 
+ * @code
+ * toCPU(ctx, tensor, data, bufferSize);
+ * @endcode
+ */
+inline void toCPU(Context &ctx, Tensor &tensor, float *data,
+                  size_t bufferSize, size_t sourceOffset = 0) {
+  if (tensor.dtype == kf16) {
+    size_t numElements = bufferSize / sizeof(float);
+    std::vector<half> halfData(cdiv(numElements, 2) * 2);
+    std::future<void> future =
+        toCPUAsync(ctx, tensor, halfData.data(),
+                   halfData.size() * sizeof(half), sourceOffset);
+    wait(ctx, future);
+    std::copy(halfData.begin(), halfData.begin() + numElements, data);
+    return;
+  }
+  if (tensor.dtype != kf32) {
+    LOG(kDefLog, kError,
+        "Float data can only be read from a kf32 or kf16 tensor, not %s",
+        toString(tensor.dtype).c_str());
+    return;
+  }
+  std::future<void> future =
+      toCPUAsync(ctx, tensor, data, bufferSize, sourceOffset);
+  wait(ctx, future);
+}
+
+/**
+ * @brief Overload of the toCPU function to copy data from a GPU buffer to CPU
+ * memory in the tensor's storage format without conversion, e.g. half values
+ * for kf16, int32_t for ki32 or packed uint32_t words for ki8 and kq4.
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] tensor Tensor instance representing the GPU buffer to copy from
+ * @param[out] data Pointer to the CPU memory to copy the data to
+ * @param[in] bufferSize Size of the data buffer in bytes
+ *
+ * @code
+ * toCPU(ctx, tensor, halfData, bufferSize);
+ * @endcode
+ */
+template <typename T,
+          typename = std::enable_if_t<std::is_same_v<T, half> ||
+                                      std::is_same_v<T, int32_t> ||
+                                      std::is_same_v<T, uint32_t>>>
+inline void toCPU(Context &ctx, Tensor &tensor, T *data, size_t bufferSize) {
+  std::future<void> future = toCPUAsync(ctx, tensor, data, bufferSize);
+  wait(ctx, future);
+}
+
+/**
+ * @brief Overload of the toCPU function to copy data from a GPU buffer to CPU
+ * memory for an array of floats instead of a pointer to a float buffer.
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] tensor Tensor instance representing the GPU buffer to copy from
+ * @param[out] data Array of floats to copy the data to
+ * 
+ * @code
+ * toCPU(ctx, tensor, data);
+ * @endcode
+ */
+template <size_t N>
+void toCPU(Context &ctx, Tensor &tensor, std::array<float, N>& data) {
+  toCPU(ctx, tensor, data.data(), sizeof(data));
+}
+
+/**
+ * @brief Overload of the toCPU function to copy the span of a TensorView, such
+ * as a tensor allocated with createArenaTensor(), to CPU memory.
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] view TensorView instance representing the GPU range to copy from
+ * @param[out] data Pointer to the CPU memory to copy the data to, must hold
+ * size(view.data.shape) floats
+ *
+ * @code
+ * toCPU(ctx, view, data);
+ * @endcode
+ */
+inline void toCPU(Context &ctx, TensorView &view, float *data) {
+  toCPU(ctx, view.data, data, size(view.data.shape) * sizeof(float),
+        view.offset);
+}
+
+/**
+ * @brief Copies data from CPU memory to a GPU buffer. The toGPU overloads are
+ * effectively a convenience wrapper around the WebGPU API call
+ * wgpuQueueWriteBuffer.
+ *
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] data Pointer to the CPU memory to copy from
+ * @param[in] buffer WGPUBuffer instance representing the GPU buffer to copy to
+ * @param[in] size Size of the data buffer in bytes
+ * 
+ * @code
+ * toGPU(ctx, data, buffer, size);
+ * @endcode
+ */
+inline void toGPU(Context &ctx, const void *data, WGPUBuffer buffer,
+                  size_t size) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  wgpuQueueWriteBuffer(ctx.queue, buffer, 0, data, size);
+  countWrite(ctx.telemetry, size);
+}
+
+/**
+ * @brief Overload of the toGPU function to copy data from CPU memory to a GPU
+ * taking a Tensor instance instead of a WGPUBuffer instance.
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] data Pointer to the CPU memory to copy from
+ * @param[in] tensor Tensor instance representing the GPU buffer to copy to
+ * 
+ * @code
+ * toGPU(ctx, data, tensor);
+ * @endcode
+ */
+inline void toGPU(Context &ctx, const float *data, Tensor &tensor) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  writeFloats(ctx.queue, data, tensor);
+  countWrite(ctx.telemetry, tensor.data.size);
+}
+
+/**
+ * @brief Overload of the toGPU function to copy data that is already in the
+ * tensor's storage format, e.g. half values for kf16, int32_t for ki32 or
+ * packed uint32_t words for ki8 and kq4, without conversion.
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] data Pointer to the CPU memory to copy from
+ * @param[in] tensor Tensor instance representing the GPU buffer to copy to
+ *
+ * @code
+ * toGPU(ctx, halfData, tensor);
+ * @endcode
+ */
+template <typename T,
+          typename = std::enable_if_t<std::is_same_v<T, half> ||
+                                      std::is_same_v<T, int32_t> ||
+                                      std::is_same_v<T, uint32_t>>>
+inline void toGPU(Context &ctx, const T *data, Tensor &tensor) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  wgpuQueueWriteBuffer(ctx.queue, tensor.data.buffer, 0, data,
+                       tensor.data.size);
+  countWrite(ctx.telemetry, tensor.data.size);
+}
+
+/**
+ * @brief Overload of the toGPU function to copy data from CPU memory to the
+ * span of a TensorView, such as a tensor allocated with createArenaTensor().
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] data Pointer to the CPU memory to copy from
+ * @param[in] view TensorView instance representing the GPU range to copy to
+ *
+ * @code
+ * toGPU(ctx, data, view);
+ * @endcode
+ */
+inline void toGPU(Context &ctx, const float *data, TensorView &view) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  writeFloats(ctx.queue, data, view.data, view.offset, view.span);
+  countWrite(ctx.telemetry, view.span);
+}
+
+
+template <typename Params>
+inline void toGPU(Context &ctx, Params &params, Kernel &op) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  // TODO(avh): Maintain params metadata in Kernel and check for consistency.
+  // If a kernel does not have parameters this will quietly overwrite
+  // the last buffer in the bind group with the parameters buffer.
+  if (op.numBindings > 0) {
+    wgpuQueueWriteBuffer(ctx.queue,
+                         op.buffers[op.numBindings - 1], 0,
+                         static_cast<void *>(&params), sizeof(params));
+    countWrite(ctx.telemetry, sizeof(params));
+  }
+}
+
+/**
+ * @brief Overload of toGPU() for kernels created with several params slots,
+ * which writes params to one slot. Dispatches of the slot recorded in the
+ * same command buffer see the new values.
+ * @param[in] ctx Context instance to manage the operation
+ * @param[in] params Parameters struct of the kernel's ParamsType
+ * @param[in] op Kernel instance created with numParamSlots > slot
+ * @param[in] slot Params slot to write
+ *
+ * @code
+ * toGPU(ctx, MatmulParams{M, K, N}, kernel, 1);
+ * @endcode
+ */
+template <typename Params>
+inline void toGPU(Context &ctx, const Params &params, Kernel &op,
+                  size_t slot) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  assert(slot < op.numParamSlots && sizeof(params) <= op.paramsStride);
+  wgpuQueueWriteBuffer(ctx.queue, op.buffers[op.numBindings - 1],
+                       slot * op.paramsStride,
+                       static_cast<const void *>(&params), sizeof(params));
+  countWrite(ctx.telemetry, sizeof(params));
+}
+
+/**
+ * @brief Sets the bind group of a kernel in a compute pass. For kernels with
+ * numParamSlots > 0, the params binding is offset to the given slot.
+ * @param[in] pass Compute pass encoder to record into
+ * @param[in] op Kernel instance whose bind group is set
+ * @param[in] paramsSlot Params slot of the dispatch
+ */
+inline void setKernelBindGroup(WGPUComputePassEncoder pass, const Kernel &op,
+                               size_t paramsSlot) {
+  if (op.numParamSlots > 0) {
+    assert(paramsSlot < op.numParamSlots);
+    uint32_t offset = static_cast<uint32_t>(paramsSlot * op.paramsStride);
+    wgpuComputePassEncoderSetBindGroup(pass, 0, op.bindGroup, 1, &offset);
+  } else {
+    wgpuComputePassEncoderSetBindGroup(pass, 0, op.bindGroup, 0, nullptr);
+  }
+}
+
+/**
+ * @brief Records the dispatch of a kernel in a compute pass, with the
+ * workgroup counts read from Kernel::indirectBuffer if it is set and
+ * Kernel::nWorkgroups otherwise.
+ * @param[in] pass Compute pass encoder to record into
+ * @param[in] op Kernel instance to dispatch
+ */
+inline void recordDispatch(WGPUComputePassEncoder pass, const Kernel &op) {
+  if (op.indirectBuffer) {
+    wgpuComputePassEncoderDispatchWorkgroupsIndirect(pass, op.indirectBuffer,
+                                                     op.indirectOffset);
+  } else {
+    wgpuComputePassEncoderDispatchWorkgroups(pass, op.nWorkgroups[0],
+                                             op.nWorkgroups[1],
+                                             op.nWorkgroups[2]);
+  }
+}
+
+/**
+ * @brief Releases a kernel's command buffer if it has been recorded but not
+ * submitted, together with its profiler slot.
+ * @param[in] op Kernel instance whose command buffer is released
+ */
+inline void releaseCommandBuffer(Kernel &op) {
+  if (op.commandBuffer) {
+    wgpuCommandBufferRelease(op.commandBuffer);
+    op.commandBuffer = nullptr;
+  }
+  releaseProfileSlot(op.profiler, op.profileSlot);
+}
+
+/**
+ * @brief Resets the command buffer in preparation for a kernel dispatch.
+ * Since command buffers are consumed upon submission, dispatchKernel() calls
+ * this when the kernel has no recorded command buffer. Calling it right after
+ * a dispatch instead moves the recording out of the next dispatch. A command
+ * buffer which was recorded but not submitted is released first.
+ * @param[in] device WGPUDevice instance to manage the operation
+ * @param[in] op Kernel instance representing the kernel to reset
+ * 
+ * @code
+ * resetCommandBuffer(device, op);
+ * @endcode
+ */
+inline void resetCommandBuffer(WGPUDevice &device, Kernel &op) {
+  releaseCommandBuffer(op);
+  {
+    WGPUCommandEncoder commandEncoder =
+        wgpuDeviceCreateCommandEncoder(device, nullptr);
+    WGPUComputePassTimestampWrites timestampWrites = {};
+    WGPUComputePassDescriptor passDesc = {};
+    op.profileSlot = claimProfileSlot(op.profiler, op.label, timestampWrites);
+    if (op.profileSlot.index != Profiler::kNoSlot) {
+      passDesc.timestampWrites = &timestampWrites;
+    }
+    WGPUComputePassEncoder computePassEncoder =
+        wgpuCommandEncoderBeginComputePass(commandEncoder, &passDesc);
+    wgpuComputePassEncoderSetPipeline(computePassEncoder, op.computePipeline);
+    setKernelBindGroup(computePassEncoder, op, op.paramsSlot);
+    recordDispatch(computePassEncoder, op);
+    wgpuComputePassEncoderEnd(computePassEncoder);
+    wgpuComputePassEncoderRelease(computePassEncoder);
+    op.commandBuffer = wgpuCommandEncoderFinish(commandEncoder, nullptr);
+    check(op.commandBuffer, "Create command buffer", __FILE__, __LINE__);
+    wgpuCommandEncoderRelease(commandEncoder);
+  }
+}
+
+/**
+ * @brief Makes a kernel read its workgroup counts from a tensor of indirect
+ * dispatch arguments (see createIndirectArgs()) when it executes, instead of
+ * using Kernel::nWorkgroups. The arguments are typically written by a
+ * previous kernel in the same CommandBatch or command buffer, e.g. from the
+ * number of elements left after a compaction, so the grid size never has to
+ * be read back to the CPU.
+ *
+ * The kernel's command buffer is re-recorded if it has one. CommandBatches
+ * record the kernel when they are created, so call this before
+ * createCommandBatch().
+ *
+ * The arguments tensor can not be bound to the kernel itself, as a buffer
+ * can not be both written and used for indirect arguments by one dispatch.
+ *
+ * @param[in] ctx Context instance to manage the kernel
+ * @param[in] op Kernel instance to dispatch indirectly
+ * @param[in] args Tensor from createIndirectArgs()
+ * @param[in] index Index of the set of arguments within args
+ *
+ * @code
+ * Tensor args = createIndirectArgs(ctx);
+ * Kernel count = createKernel(ctx, countCode, Bindings{input, args}, {1, 1, 1});
+ * Kernel process = createKernel(ctx, processCode, Bindings{input, output},
+ *                               {1, 1, 1});
+ * setIndirectDispatch(ctx, process, args);
+ * CommandBatch batch = createCommandBatch(ctx, {count, process});
+ * @endcode
+ */
+inline void setIndirectDispatch(Context &ctx, Kernel &op, const Tensor &args,
+                                size_t index = 0) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  check(args.data.usage & WGPUBufferUsage_Indirect,
+        "Indirect arguments are created with createIndirectArgs()", __FILE__,
+        __LINE__);
+  assert((index + 1) * 3 * sizeof(uint32_t) <= args.data.size);
+  op.indirectBuffer = args.data.buffer;
+  op.indirectOffset = index * 3 * sizeof(uint32_t);
+  if (op.commandBuffer) {
+    resetCommandBuffer(ctx.device, op);
+  }
+}
+
+/**
+ * @brief NoParam is a no-op type used to indicate that a kernel does not have
+ * any parameters.
+ */
+struct NoParam {};
+template <typename T> constexpr bool IsNoParam = std::is_same_v<T, NoParam>;
+
+
+/**
+ * @brief Tensor factory function which sub-allocates a tensor from the large
+ * backing buffers (arenas) of the Context's TensorPool instead of creating a
+ * WGPUBuffer per tensor. This avoids a driver allocation for each of many
+ * small tensors.
+ *
+ * Allocations are aligned to the device's minStorageBufferOffsetAlignment and
+ * returned as a TensorView, which can be passed directly to the Bindings
+ * constructor. The data member of the view refers to the backing buffer and
+ * carries the requested shape.
+ *
+ * Arena tensors are released all at once with resetArena(), or when the
+ * Context is destroyed, they cannot be freed individually with FreeTensor().
+ *
+ * @param[in] ctx Context instance to manage the tensor
+ * @param[in] shape Shape of the tensor
+ * @param[in] dtype Data type of the tensor (e.g. kf32)
+ * @param[in] data Optional initial data to populate the tensor with
+ * @return TensorView into an arena buffer
+ *
+ * @code
+ * TensorView a = createArenaTensor(ctx, {256, 256}, kf32);
+ * Kernel op = createKernel(ctx, code, Bindings{a, b, c}, nWorkgroups);
+ * @endcode
+ */
+inline TensorView createArenaTensor(Context &ctx, const Shape &shape,
+                                    NumType dtype,
+                                    const float *data = nullptr) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  TensorPool &pool = ctx.pool;
+  if (pool.arenaAlignment == 0) {
+    WGPUSupportedLimits limits = {};
+    wgpuDeviceGetLimits(ctx.device, &limits);
+    pool.arenaAlignment =
+        std::max<size_t>(limits.limits.minStorageBufferOffsetAlignment, 4);
+  }
+  size_t alignment = pool.arenaAlignment;
+  size_t bytes = sizeBytes(shape, dtype);
+  while (pool.arenaCurrent < pool.arenas.size()) {
+    size_t offset =
+        cdiv(pool.arenaUsed[pool.arenaCurrent], alignment) * alignment;
+    if (offset + bytes <= pool.arenas[pool.arenaCurrent].size) {
+      break;
+    }
+    ++pool.arenaCurrent;
+  }
+  if (pool.arenaCurrent == pool.arenas.size()) {
+    WGPUBufferUsageFlags usage = WGPUBufferUsage_Storage |
+                                 WGPUBufferUsage_CopyDst |
+                                 WGPUBufferUsage_CopySrc;
+    size_t arenaSize = std::max(pool.arenaBlockSize, bytes);
+    WGPUBufferDescriptor bufferDesc = {
+        .usage = usage,
+        .size = arenaSize,
+    };
+    WGPUBuffer buffer = wgpuDeviceCreateBuffer(ctx.device, &bufferDesc);
+    check(buffer, "Create arena buffer", __FILE__, __LINE__);
+    trackBuffer(ctx.telemetry, kStorageBuffer, arenaSize);
+    LOG(kDefLog, kTrace, "Created arena %d of %d bytes", pool.arenas.size(),
+        arenaSize);
+    pool.arenas.push_back(Array{.buffer = buffer, .usage = usage,
+                                .size = arenaSize});
+    pool.arenaUsed.push_back(0);
+  }
+  size_t offset = cdiv(pool.arenaUsed[pool.arenaCurrent], alignment) * alignment;
+  pool.arenaUsed[pool.arenaCurrent] = offset + bytes;
+  TensorView view = {
+      .data = Tensor{.data = pool.arenas[pool.arenaCurrent],
+                     .shape = shape,
+                     .dtype = dtype},
+      .offset = offset,
+      .span = bytes,
+  };
+  if (data) {
+    writeFloats(ctx.queue, data, view.data, offset, bytes);
+    countWrite(ctx.telemetry, bytes);
+  }
+  return view;
+}
+
+/**
+ * @brief Returns the current position of the arena bump allocator, to be
+ * passed to resetArena() to release everything allocated after this point.
+ *
+ * @code
+ * ArenaMark scratch = arenaMark(ctx);
+ * // per-request activations with createArenaTensor() ...
+ * resetArena(ctx, scratch);
+ * @endcode
+ */
+inline ArenaMark arenaMark(Context &ctx) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  TensorPool &pool = ctx.pool;
+  if (pool.arenaCurrent == pool.arenas.size()) {
+    return ArenaMark{pool.arenaCurrent, 0};
+  }
+  return ArenaMark{pool.arenaCurrent, pool.arenaUsed[pool.arenaCurrent]};
+}
+
+/**
+ * @brief Releases all arena tensors allocated after the mark (by default all
+ * arena tensors) so that their memory is reused by subsequent
+ * createArenaTensor() calls. The backing buffers themselves are kept.
+ *
+ * The caller is responsible for ensuring that no pending GPU work or kernel
+ * bindings still refer to the released tensors.
+ *
+ * @param[in] ctx Context instance which owns the arenas
+ * @param[in] mark Position returned by arenaMark()
+ *
+ * @code
+ * resetArena(ctx);
+ * @endcode
+ */
+inline void resetArena(Context &ctx, const ArenaMark &mark = {}) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  TensorPool &pool = ctx.pool;
+  for (size_t i = mark.arena; i < pool.arenas.size(); ++i) {
+    pool.arenaUsed[i] = i == mark.arena ? mark.offset : 0;
+  }
+  pool.arenaCurrent = mark.arena;
+}
+
+/**
+ * @brief Plans the placement of intermediate tensors of a kernel sequence in a
+ * single scratch buffer, based on the liveness of each tensor.
+ *
+ * Tensors are declared with planTensor() and the kernel sequence is described
+ * with planStep(), which takes the planned tensors of one kernel in binding
+ * order, as they would be passed to Bindings. A tensor is live from the first
+ * to the last step that binds it. planMemory() then assigns offsets such that
+ * tensors with overlapping lifetimes never share memory, and allocates the
+ * scratch buffer. Tensors that are read after the sequence (e.g. the final
+ * output) should be allocated with createTensor() instead, or bound in a final
+ * step to keep them live.
+ *
+ * @code
+ * MemoryPlan plan;
+ * size_t h = planTensor(plan, {batch, hidden}, kf32);
+ * size_t g = planTensor(plan, {batch, hidden}, kf32);
+ * planStep(plan, {h});    // up projection writes h
+ * planStep(plan, {h, g}); // gelu reads h, writes g
+ * planMemory(ctx, plan);
+ * Kernel gelu = createKernel(ctx, code,
+ *                            Bindings{planned(plan, h), planned(plan, g)},
+ *                            nWorkgroups);
+ * @endcode
+ */
+struct MemoryPlan {
+  static constexpr size_t kUnused = static_cast<size_t>(-1);
+  std::vector<Shape> shapes;
+  std::vector<NumType> dtypes;
+  std::vector<size_t> sizes;    // in bytes
+  std::vector<size_t> firstUse; // index of the first step binding the tensor
+  std::vector<size_t> lastUse;  // index of the last step binding the tensor
+  std::vector<size_t> offsets;  // in bytes into scratch, set by planMemory()
+  size_t numSteps = 0;
+  size_t naivePeak = 0;   // bytes with one buffer per tensor
+  size_t plannedPeak = 0; // bytes of the scratch buffer
+  Tensor scratch = {};
+};
+
+/**
+ * @brief Declares an intermediate tensor in a MemoryPlan.
+ * @param[in] plan MemoryPlan instance to add the tensor to
+ * @param[in] shape Shape of the tensor
+ * @param[in] dtype Data type of the tensor (e.g. kf32)
+ * @return Index of the tensor in the plan, used with planStep() and planned()
+ *
+ * @code
+ * size_t h = planTensor(plan, {batch, hidden}, kf32);
+ * @endcode
+ */
+inline size_t planTensor(MemoryPlan &plan, const Shape &shape, NumType dtype) {
+  plan.shapes.push_back(shape);
+  plan.dtypes.push_back(dtype);
+  plan.sizes.push_back(sizeBytes(shape, dtype));
+  plan.firstUse.push_back(MemoryPlan::kUnused);
+  plan.lastUse.push_back(MemoryPlan::kUnused);
+  return plan.shapes.size() - 1;
+}
+
+/**
+ * @brief Appends a kernel to the sequence described by a MemoryPlan.
+ * @param[in] plan MemoryPlan instance describing the sequence
+ * @param[in] tensors Indices of the planned tensors bound by the kernel
+ *
+ * @code
+ * planStep(plan, {h, g});
+ * @endcode
+ */
+inline void planStep(MemoryPlan &plan, std::initializer_list<size_t> tensors) {
+  for (size_t id : tensors) {
+    check(id < plan.shapes.size(), "Planned tensor exists", __FILE__,
+          __LINE__);
+    if (plan.firstUse[id] == MemoryPlan::kUnused) {
+      plan.firstUse[id] = plan.numSteps;
+    }
+    plan.lastUse[id] = plan.numSteps;
+  }
+  ++plan.numSteps;
+}
+
+/**
+ * @brief Assigns scratch buffer offsets to the tensors of a MemoryPlan and
+ * allocates the scratch buffer in the Context's TensorPool.
+ *
+ * Tensors are placed greedily in order of decreasing size at the lowest offset,
+ * aligned to minStorageBufferOffsetAlignment, which does not overlap any
+ * already placed tensor with an overlapping lifetime. The planned peak memory
+ * is logged together with the naive peak of one buffer per tensor.
+ *
+ * @param[in] ctx Context instance to allocate the scratch buffer in
+ * @param[in] plan MemoryPlan instance to finalize
+ *
+ * @code
+ * planMemory(ctx, plan);
+ * @endcode
+ */
+inline void planMemory(Context &ctx, MemoryPlan &plan) {
+  WGPUSupportedLimits limits = {};
+  wgpuDeviceGetLimits(ctx.device, &limits);
+  size_t alignment =
+      std::max<size_t>(limits.limits.minStorageBufferOffsetAlignment, 4);
+  size_t n = plan.shapes.size();
+  std::vector<size_t> order(n);
+  for (size_t i = 0; i < n; ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return plan.sizes[a] > plan.sizes[b];
+  });
+  plan.offsets.assign(n, 0);
+  plan.naivePeak = 0;
+  plan.plannedPeak = 0;
+  std::vector<size_t> placed;
+  for (size_t id : order) {
+    plan.naivePeak += plan.sizes[id];
+    if (plan.firstUse[id] == MemoryPlan::kUnused) {
+      LOG(kDefLog, kWarn, "Planned tensor %d is not bound by any step", id);
+      continue;
+    }
+    // Live ranges of placed tensors that overlap this tensor in time, sorted
+    // by offset, so that the first gap large enough can be found in one pass
+    std::vector<std::pair<size_t, size_t>> conflicts;
+    for (size_t other : placed) {
+      if (plan.firstUse[other] <= plan.lastUse[id] &&
+          plan.firstUse[id] <= plan.lastUse[other]) {
+        conflicts.push_back(
+            {plan.offsets[other], plan.offsets[other] + plan.sizes[other]});
+      }
+    }
+    std::sort(conflicts.begin(), conflicts.end());
+    size_t offset = 0;
+    for (const auto &[begin, end] : conflicts) {
+      if (offset + plan.sizes[id] <= begin) {
+        break;
+      }
+      offset = std::max(offset, cdiv(end, alignment) * alignment);
+    }
+    plan.offsets[id] = offset;
+    plan.plannedPeak = std::max(plan.plannedPeak, offset + plan.sizes[id]);
+    placed.push_back(id);
+  }
+  LOG(kDefLog, kInfo,
+      "Memory plan: %d tensors over %d steps, planned peak %d bytes vs naive "
+      "peak %d bytes",
+      n, plan.numSteps, plan.plannedPeak, plan.naivePeak);
+  if (plan.plannedPeak > 0) {
+    plan.scratch = createTensor(ctx, Shape{cdiv(plan.plannedPeak, 4)}, kf32);
+  }
+}
+
+/**
+ * @brief Returns the TensorView of a planned tensor in the scratch buffer,
+ * which can be passed to the Bindings constructor.
+ * @param[in] plan MemoryPlan instance finalized with planMemory()
+ * @param[in] id Index of the tensor returned by planTensor()
+ * @return TensorView of the tensor in the scratch buffer
+ *
+ * @code
+ * TensorView h = planned(plan, hId);
+ * @endcode
+ */
+inline TensorView planned(const MemoryPlan &plan, size_t id) {
+  check(id < plan.offsets.size(), "Memory plan is finalized", __FILE__,
+        __LINE__);
+  return TensorView{
+      .data = Tensor{.data = plan.scratch.data,
+                     .shape = plan.shapes[id],
+                     .dtype = plan.dtypes[id]},
+      .offset = plan.offsets[id],
+      .span = plan.sizes[id],
+  };
+}
+
+/**
+ * @brief cdiv for shape specification. Mostly useful for evenly dividing total
+ * # threads by workgroup size dimensions.
  */
 inline Shape cdiv(Shape total, Shape group) {
   assert(total.rank == group.rank);
@@ -879,6 +2748,358 @@ inline Shape cdiv(Shape total, Shape group) {
   return result;
 }
 
+/**
+ * @brief Rounds a problem size up to its bucket, the next power of two of at
+ * least minBucket. Kernels sized for the bucket serve every size within it,
+ * which bounds the number of distinct kernels for dynamic shapes.
+ *
+ * @code
+ * bucketSize(100); // 128
+ * bucketSize(3, 16); // 16
+ * @endcode
+ */
+inline size_t bucketSize(size_t n, size_t minBucket = 1) {
+  size_t bucket = std::max<size_t>(minBucket, 1);
+  while (bucket < n) {
+    bucket *= 2;
+  }
+  return bucket;
+}
+
+/**
+ * @brief Rounds a problem size up to the smallest of a sorted list of
+ * buckets which fits it, or returns n if none does.
+ *
+ * @code
+ * bucketSize(5, {1, 2, 4, 8}); // 8
+ * @endcode
+ */
+inline size_t bucketSize(size_t n, const std::vector<size_t> &buckets) {
+  auto it = std::lower_bound(buckets.begin(), buckets.end(), n);
+  return it == buckets.end() ? n : *it;
+}
+
+/**
+ * @brief Rounds each dimension of a shape up to its bucket with bucketSize().
+ */
+inline Shape bucketShape(const Shape &shape, size_t minBucket = 1) {
+  Shape result = shape;
+  for (size_t dim = 0; dim < shape.rank; ++dim) {
+    result[dim] = bucketSize(shape[dim], minBucket);
+  }
+  return result;
+}
+
+/**
+ * @brief Computes the key used to look up compiled pipelines in the
+ * PipelineCache. The key is a hash of the WGSL code, the entry point, the
+ * override constants and the binding layout (number of storage bindings and
+ * the size of the params buffer, if any).
+ *
+ * The label and the sizes of the bound buffers are intentionally not part of
+ * the key, they do not affect the compiled pipeline. Kernels over tensors of
+ * different sizes share their pipeline, with the bounds checked in WGSL
+ * against arrayLength() or uniform params.
+ *
+ * @param[in] code WGSL code for the kernel
+ * @param[in] numTensors Number of storage buffer bindings
+ * @param[in] paramsSize Size of the params buffer in bytes, 0 if none
+ * @param[in] dynamicParams Whether the params are bound with a dynamic offset
+ * @return Key for the PipelineCache
+ *
+ * @code
+ * uint64_t key = pipelineKey(code, numTensors, paramsSize);
+ * @endcode
+ */
+inline uint64_t pipelineKey(const KernelCode &code, size_t numTensors,
+                            size_t paramsSize,
+                            bool dynamicParams = false) {
+  uint64_t key = hashBytes(code.data.data(), code.data.size());
+  key = hashBytes(code.entryPoint.data(), code.entryPoint.size(), key);
+  key = hashBytes(&numTensors, sizeof(numTensors), key);
+  key = hashBytes(&paramsSize, sizeof(paramsSize), key);
+  key = hashBytes(&dynamicParams, sizeof(dynamicParams), key);
+  for (const auto &constant : code.constants) {
+    key = hashBytes(constant.first.data(), constant.first.size(), key);
+    key = hashBytes(&constant.second, sizeof(constant.second), key);
+  }
+  return key;
+}
+
+/**
+ * @brief Creates the bind group layout and pipeline layout of a pipeline with
+ * numTensors storage buffer bindings, followed by a uniform params buffer
+ * binding if paramsSize > 0, with a dynamic offset if dynamicParams is set.
+ * The compute pipeline of the returned CompiledPipeline is left unset.
+ *
+ * Storage bindings have no minimum size so that the layout fits buffers of
+ * any size, the bind group validates the bound ranges instead.
+ */
+inline CompiledPipeline createPipelineLayout(WGPUDevice device,
+                                             size_t numTensors,
+                                             size_t paramsSize,
+                                             bool dynamicParams = false) {
+  size_t numBindings = paramsSize > 0 ? numTensors + 1 : numTensors;
+  std::vector<WGPUBindGroupLayoutEntry> bgLayoutEntries(numBindings);
+  // Create layout entries for input buffers
+  for (size_t i = 0; i < numTensors; ++i) {
+    bgLayoutEntries[i] = WGPUBindGroupLayoutEntry{
+        .binding = static_cast<uint32_t>(i),
+        .visibility = WGPUShaderStage_Compute,
+        .buffer =
+            WGPUBufferBindingLayout{
+                .type = WGPUBufferBindingType_Storage,
+                .minBindingSize = 0,
+            },
+    };
+  }
+  if (paramsSize > 0) {
+    LOG(kDefLog, kInfo, "Create layout entry for the params buffer");
+    // Create layout entry for the params buffer, which is always the last
+    // binding
+    bgLayoutEntries[numTensors] = WGPUBindGroupLayoutEntry{
+        .binding = static_cast<uint32_t>(numTensors),
+        .visibility = WGPUShaderStage_Compute,
+        .buffer =
+            WGPUBufferBindingLayout{
+                .type = WGPUBufferBindingType_Uniform,
+                .hasDynamicOffset = dynamicParams,
+                .minBindingSize = paramsSize,
+            },
+    };
+  }
+  CompiledPipeline pipeline = {};
+  WGPUBindGroupLayoutDescriptor bgLayoutDesc = {
+      .entryCount = static_cast<uint32_t>(bgLayoutEntries.size()),
+      .entries = bgLayoutEntries.data(),
+  };
+  pipeline.bgLayout = wgpuDeviceCreateBindGroupLayout(device, &bgLayoutDesc);
+  WGPUPipelineLayoutDescriptor pipelineLayoutDesc = {
+      .bindGroupLayoutCount = 1,
+      .bindGroupLayouts = &pipeline.bgLayout,
+  };
+  pipeline.pipelineLayout =
+      wgpuDeviceCreatePipelineLayout(device, &pipelineLayoutDesc);
+  return pipeline;
+}
+
+/**
+ * @brief Creates the WGSL shader module of a kernel. The caller releases the
+ * module once the pipeline using it has been created.
+ */
+inline WGPUShaderModule createShaderModule(WGPUDevice device,
+                                           const KernelCode &code) {
+  WGPUShaderModuleWGSLDescriptor wgslDesc = {
+      .code = code.data.c_str(),
+  };
+  wgslDesc.chain.sType = WGPUSType_ShaderModuleWGSLDescriptor;
+  WGPUShaderModuleDescriptor shaderModuleDesc = {};
+  shaderModuleDesc.nextInChain = &wgslDesc.chain;
+  shaderModuleDesc.label = code.label.c_str();
+  return wgpuDeviceCreateShaderModule(device, &shaderModuleDesc);
+}
+
+/**
+ * @brief Converts the override constants of a kernel to the entries of its
+ * compute pipeline descriptor. The entries point into code, which must
+ * outlive them.
+ */
+inline std::vector<WGPUConstantEntry> constantEntries(const KernelCode &code) {
+  std::vector<WGPUConstantEntry> entries;
+  for (const auto &constant : code.constants) {
+    entries.push_back(WGPUConstantEntry{
+        .key = constant.first.c_str(),
+        .value = constant.second,
+    });
+  }
+  return entries;
+}
+
+/**
+ * @brief Returns the compiled pipeline for the given code and binding layout,
+ * creating the bind group layout, pipeline layout, shader module and compute
+ * pipeline on a cache miss. Subsequent calls with the same code and layout
+ * return the cached pipeline without recompiling.
+ *
+ * The compilation blocks the calling thread, see compilePipelineAsync() for
+ * the non-blocking version.
+ *
+ * @param[in] ctx Context instance which owns the PipelineCache
+ * @param[in] code WGSL code for the kernel
+ * @param[in] numTensors Number of storage buffer bindings
+ * @param[in] paramsSize Size of the params buffer in bytes, 0 if none
+ * @param[in] dynamicParams Whether the params are bound with a dynamic offset
+ * @return Reference to the cached CompiledPipeline
+ *
+ * @code
+ * CompiledPipeline &pipeline = getPipeline(ctx, code, n, paramsSize);
+ * @endcode
+ */
+inline const CompiledPipeline &getPipeline(Context &ctx, const KernelCode &code,
+                                           size_t numTensors,
+                                           size_t paramsSize,
+                                           bool dynamicParams = false) {
+  uint64_t key =
+      pipelineKey(code, numTensors, paramsSize, dynamicParams);
+  auto it = ctx.pipelineCache.data.find(key);
+  if (it != ctx.pipelineCache.data.end()) {
+    ctx.pipelineCache.hits++;
+    LOG(kDefLog, kTrace, "Pipeline cache hit for %s", code.label.c_str());
+    return it->second;
+  }
+  ctx.pipelineCache.misses++;
+  LOG(kDefLog, kTrace, "Pipeline cache miss for %s", code.label.c_str());
+  WGPUDevice device = ctx.device;
+  CompiledPipeline pipeline =
+      createPipelineLayout(device, numTensors, paramsSize, dynamicParams);
+  WGPUShaderModule shaderModule = createShaderModule(device, code);
+  std::vector<WGPUConstantEntry> constants = constantEntries(code);
+  WGPUComputePipelineDescriptor computePipelineDesc = {};
+  computePipelineDesc.layout = pipeline.pipelineLayout;
+  computePipelineDesc.compute.module = shaderModule;
+  computePipelineDesc.compute.entryPoint = code.entryPoint.c_str();
+  computePipelineDesc.compute.constantCount = constants.size();
+  computePipelineDesc.compute.constants = constants.data();
+  computePipelineDesc.label = code.label.c_str();
+  pipeline.computePipeline =
+      wgpuDeviceCreateComputePipeline(device, &computePipelineDesc);
+  // The pipeline holds its own reference to the shader module
+  wgpuShaderModuleRelease(shaderModule);
+  return ctx.pipelineCache.data[key] = pipeline;
+}
+
+/**
+ * @brief Removes a compiled pipeline from the Context's PipelineCache and
+ * releases it, for pipelines which will not be used again, such as the losing
+ * candidates of an autotuning run. Kernels created with the pipeline must be
+ * freed (see FreeKernel()) before it is evicted, a later createKernel() with
+ * the same code compiles it again.
+ * @param[in] ctx Context instance which owns the PipelineCache
+ * @param[in] computePipeline Kernel::computePipeline of the pipeline to evict
+ *
+ * @code
+ * WGPUComputePipeline pipeline = op.computePipeline;
+ * FreeKernel(ctx.kernelPool, op);
+ * evictPipeline(ctx, pipeline);
+ * @endcode
+ */
+inline void evictPipeline(Context &ctx, WGPUComputePipeline computePipeline) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  for (auto it = ctx.pipelineCache.data.begin();
+       it != ctx.pipelineCache.data.end(); ++it) {
+    if (it->second.computePipeline == computePipeline) {
+      wgpuComputePipelineRelease(it->second.computePipeline);
+      wgpuPipelineLayoutRelease(it->second.pipelineLayout);
+      wgpuBindGroupLayoutRelease(it->second.bgLayout);
+      ctx.pipelineCache.data.erase(it);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Compiles the pipeline for the given code and binding layout without
+ * blocking, using wgpuDeviceCreateComputePipelineAsync. onReady is called
+ * with true once the pipeline is in the Context's PipelineCache, from which
+ * createKernel() then picks it up without compiling, or with false if the
+ * compilation failed.
+ *
+ * Pipelines which are already cached call onReady immediately, concurrent
+ * requests for a pipeline that is still compiling share the compilation. As
+ * with other WebGPU callbacks, onReady runs while events are processed, eg.
+ * in wait() or waitFor(). The Context must not be moved while compilations
+ * are in flight.
+ *
+ * @param[in] ctx Context instance which owns the PipelineCache
+ * @param[in] code WGSL code for the kernel
+ * @param[in] numTensors Number of storage buffer bindings
+ * @param[in] paramsSize Size of the params buffer in bytes, 0 if none
+ * @param[in] onReady Called with the success of the compilation
+ * @param[in] dynamicParams Whether the params are bound with a dynamic offset
+ *
+ * @code
+ * compilePipelineAsync(ctx, code, n, 0, [](bool ok) { ... });
+ * @endcode
+ */
+inline void compilePipelineAsync(Context &ctx, const KernelCode &code,
+                                 size_t numTensors,
+                                 size_t paramsSize,
+                                 std::function<void(bool)> onReady,
+                                 bool dynamicParams = false) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  uint64_t key =
+      pipelineKey(code, numTensors, paramsSize, dynamicParams);
+  if (ctx.pipelineCache.data.count(key) > 0) {
+    ctx.pipelineCache.hits++;
+    onReady(true);
+    return;
+  }
+  auto pending = ctx.pipelineCache.pending.find(key);
+  if (pending != ctx.pipelineCache.pending.end()) {
+    pending->second.push_back(std::move(onReady));
+    return;
+  }
+  ctx.pipelineCache.misses++;
+  ctx.pipelineCache.pending[key].push_back(std::move(onReady));
+  LOG(kDefLog, kTrace, "Compiling pipeline for %s asynchronously",
+      code.label.c_str());
+  struct CompileOp {
+    Context *ctx; // non-owning
+    uint64_t key;
+    CompiledPipeline pipeline;
+    std::string label;
+  };
+  // Owned by the callback, which deletes it after completion
+  CompileOp *op = new CompileOp{
+      &ctx, key,
+      createPipelineLayout(ctx.device, numTensors, paramsSize, dynamicParams),
+      code.label};
+  WGPUShaderModule shaderModule = createShaderModule(ctx.device, code);
+  std::vector<WGPUConstantEntry> constants = constantEntries(code);
+  WGPUComputePipelineDescriptor computePipelineDesc = {};
+  computePipelineDesc.layout = op->pipeline.pipelineLayout;
+  computePipelineDesc.compute.module = shaderModule;
+  computePipelineDesc.compute.entryPoint = code.entryPoint.c_str();
+  computePipelineDesc.compute.constantCount = constants.size();
+  computePipelineDesc.compute.constants = constants.data();
+  computePipelineDesc.label = code.label.c_str();
+  wgpuDeviceCreateComputePipelineAsync(
+      ctx.device, &computePipelineDesc,
+      [](WGPUCreatePipelineAsyncStatus status, WGPUComputePipeline pipeline,
+         const char *message, void *data) {
+        CompileOp *op = static_cast<CompileOp *>(data);
+        Context &ctx = *op->ctx;
+        std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+        bool success = status == WGPUCreatePipelineAsyncStatus_Success;
+        PipelineCache &cache = ctx.pipelineCache;
+        if (success && cache.data.count(op->key) == 0) {
+          op->pipeline.computePipeline = pipeline;
+          cache.data[op->key] = op->pipeline;
+        } else {
+          // Failed, or compiled synchronously by getPipeline() meanwhile
+          if (!success) {
+            LOG(kDefLog, kError, "Pipeline compilation for %s failed: %s",
+                op->label.c_str(), message ? message : "");
+          }
+          if (pipeline) {
+            wgpuComputePipelineRelease(pipeline);
+          }
+          wgpuPipelineLayoutRelease(op->pipeline.pipelineLayout);
+          wgpuBindGroupLayoutRelease(op->pipeline.bgLayout);
+        }
+        std::vector<std::function<void(bool)>> waiters =
+            std::move(cache.pending[op->key]);
+        cache.pending.erase(op->key);
+        delete op;
+        for (std::function<void(bool)> &onReady : waiters) {
+          onReady(success);
+        }
+      },
+      op);
+  // The pipeline holds its own reference to the shader module
+  wgpuShaderModuleRelease(shaderModule);
+}
+
 /**
  * @brief A factory function to create a kernel on the GPU. The kernel is
  * created with the given WGSL code, input tensors, output tensor, and
@@ -888,6 +3109,10 @@ inline Shape cdiv(Shape total, Shape group) {
  * reference handles to the underlying buffers as well as the size of the
  * buffers.
  *
+ * Compiled pipelines are cached in the Context's PipelineCache, so creating a
+ * kernel with the same code and binding layout as an existing kernel only
+ * creates a new bind group (and params buffer).
+ *
  * @param[in] ctx Context instance to manage the kernel
  * @param[in] code WGSL code for the kernel
  * @param[in] dataBindings Pointer to a span of tensors bound to the kernel
@@ -898,6 +3123,15 @@ inline Shape cdiv(Shape total, Shape group) {
  * have any parameters, use NoParam. This is cast as void* to allow for
  * arbitrary types to be passed as parameters.
  * @param[in] paramsSize Size of the parameters buffer in bytes.
+ * @param[in] viewSpans Optional sizes in bytes of the bound ranges starting at
+ * viewOffsets, e.g. for tensors allocated with createArenaTensor(). If nullptr,
+ * the bindings extend to the end of their buffers.
+ * @param[in] numParamSlots If > 0, params points to numParamSlots consecutive
+ * parameter structs of paramsSize bytes, which are stored in one uniform
+ * buffer and bound with a dynamic offset. Kernel::paramsSlot (or
+ * BatchOp::paramsSlot) selects the slot used by a dispatch, so that one
+ * kernel can be dispatched with different parameters (e.g. problem sizes)
+ * within one command buffer.
  * @return Kernel instance representing the created kernel
  * 
  * @code
@@ -909,8 +3143,15 @@ inline Kernel createKernel(Context &ctx, const KernelCode &code,
                            const Tensor *dataBindings, size_t numTensors,
                            const size_t *viewOffsets, const Shape &nWorkgroups,
                            const void *params = nullptr,
-                           size_t paramsSize = 0) {
+                           size_t paramsSize = 0,
+                           const size_t *viewSpans = nullptr,
+                           size_t numParamSlots = 0) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
   assert(nWorkgroups.rank == 3);
+  if (code.precision == kf16) {
+    check(wgpuDeviceHasFeature(ctx.device, WGPUFeatureName_ShaderF16),
+          "Device supports shader-f16 for kf16 kernels", __FILE__, __LINE__);
+  }
   WGPUDevice device = ctx.device;
   WGPUQueue queue = ctx.queue;
   Kernel op;
@@ -929,52 +3170,46 @@ inline Kernel createKernel(Context &ctx, const KernelCode &code,
   op.buffers = std::make_unique<WGPUBuffer[]>(numBindings);
   op.bufferSizes = std::make_unique<size_t[]>(numBindings);
   op.numBindings = numBindings;
-  std::vector<WGPUBindGroupLayoutEntry> bgLayoutEntries(numBindings);
-  // Create layout entries for input buffers
-  for (size_t i = 0; i < numTensors; ++i) {
-    bgLayoutEntries[i] = WGPUBindGroupLayoutEntry{
-        .binding = static_cast<uint32_t>(i),
-        .visibility = WGPUShaderStage_Compute,
-        .buffer =
-            WGPUBufferBindingLayout{
-                .type = WGPUBufferBindingType_Storage,
-                .minBindingSize = dataBindings[i].data.size,
-            },
-    };
-  }
-  if (paramsSize > 0) {
-    LOG(kDefLog, kInfo, "Create layout entry for the params buffer");
-    // Create layout entry for the params buffer
-    bgLayoutEntries[paramIndex] = WGPUBindGroupLayoutEntry{
-        .binding = static_cast<uint32_t>(paramIndex),
-        .visibility = WGPUShaderStage_Compute,
-        .buffer =
-            WGPUBufferBindingLayout{
-                .type = WGPUBufferBindingType_Uniform,
-                .minBindingSize = paramsSize,
-            },
-    };
-  }
-  WGPUBindGroupLayoutDescriptor bgLayoutDesc = {
-      .entryCount = static_cast<uint32_t>(bgLayoutEntries.size()),
-      .entries = bgLayoutEntries.data(),
-  };
-  WGPUBindGroupLayout bgLayout =
-      wgpuDeviceCreateBindGroupLayout(device, &bgLayoutDesc);
   for (size_t i = 0; i < numTensors; ++i) {
     op.buffers[i] = dataBindings[i].data.buffer;
-    op.bufferSizes[i] = dataBindings[i].data.size;
+    // Views are bound to their span, otherwise the remainder of the buffer
+    op.bufferSizes[i] = viewSpans && viewSpans[i] > 0
+                            ? viewSpans[i]
+                            : dataBindings[i].data.size - viewOffsets[i];
   }
+  const CompiledPipeline &pipeline =
+      getPipeline(ctx, code, numTensors, paramsSize,
+                  /* dynamicParams */ numParamSlots > 0);
   // Create a buffer for the Params struct
   if (paramsSize > 0) {
+    size_t numSlots = std::max<size_t>(numParamSlots, 1);
+    op.paramsStride = paramsSize;
+    if (numParamSlots > 0) {
+      // Dynamic offsets are multiples of the uniform offset alignment
+      WGPUSupportedLimits limits = {};
+      wgpuDeviceGetLimits(device, &limits);
+      size_t alignment = limits.limits.minUniformBufferOffsetAlignment > 0
+                             ? limits.limits.minUniformBufferOffsetAlignment
+                             : 256;
+      op.paramsStride = cdiv(paramsSize, alignment) * alignment;
+      op.numParamSlots = numParamSlots;
+    }
     WGPUBufferDescriptor paramsBufferDesc = {
         .usage = WGPUBufferUsage_Uniform | WGPUBufferUsage_CopyDst,
-        .size = paramsSize,
+        .size = op.paramsStride * (numSlots - 1) + paramsSize,
         .mappedAtCreation = false,
     };
     op.buffers[paramIndex] = wgpuDeviceCreateBuffer(device, &paramsBufferDesc);
+    trackBuffer(ctx.telemetry, kUniformBuffer, paramsBufferDesc.size);
+    ctx.kernelPool.params[op.buffers[paramIndex]] = paramsBufferDesc.size;
     op.bufferSizes[paramIndex] = paramsSize;
-    wgpuQueueWriteBuffer(queue, op.buffers[paramIndex], 0, params, paramsSize);
+    for (size_t slot = 0; slot < numSlots; ++slot) {
+      wgpuQueueWriteBuffer(queue, op.buffers[paramIndex],
+                           slot * op.paramsStride,
+                           static_cast<const uint8_t *>(params) +
+                               slot * paramsSize,
+                           paramsSize);
+    }
     LOG(kDefLog, kTrace, "Params buffer written");
   } else {
     LOG(kDefLog, kTrace, "No params buffer needed");
@@ -1000,43 +3235,65 @@ inline Kernel createKernel(Context &ctx, const KernelCode &code,
   }
   LOG(kDefLog, kTrace, "BG Entries Size: %d", numBindings);
   WGPUBindGroupDescriptor bindGroupDesc = {
-      .layout = bgLayout,
+      .layout = pipeline.bgLayout,
       .entryCount = static_cast<uint32_t>(numBindings),
       .entries = bindGroupEntries.data(),
   };
   op.bindGroup = wgpuDeviceCreateBindGroup(device, &bindGroupDesc);
-  {
-    WGPUPipelineLayoutDescriptor pipelineLayoutDesc = {
-        .bindGroupLayoutCount = 1,
-        .bindGroupLayouts = &bgLayout,
-    };
-    WGPUPipelineLayout pipelineLayout =
-        wgpuDeviceCreatePipelineLayout(device, &pipelineLayoutDesc);
-    WGPUShaderModuleWGSLDescriptor wgslDesc = {
-        .code = code.data.c_str(),
-    };
-    wgslDesc.chain.sType = WGPUSType_ShaderModuleWGSLDescriptor;
-    WGPUShaderModuleDescriptor shaderModuleDesc = {};
-    shaderModuleDesc.nextInChain = &wgslDesc.chain;
-    shaderModuleDesc.label = code.label.c_str();
-    WGPUComputePipelineDescriptor computePipelineDesc = {};
-    computePipelineDesc.layout = pipelineLayout;
-    computePipelineDesc.compute.module =
-        wgpuDeviceCreateShaderModule(device, &shaderModuleDesc);
-    computePipelineDesc.compute.entryPoint = code.entryPoint.c_str();
-    computePipelineDesc.label = code.label.c_str();
-    op.computePipeline =
-        wgpuDeviceCreateComputePipeline(device, &computePipelineDesc);
+  op.computePipeline = pipeline.computePipeline;
+  /*
+  op.nWorkgroups = {cdiv(nThreads[0], code.workgroupSize[0]),
+                    cdiv(nThreads[1], code.workgroupSize[1]),
+                    cdiv(nThreads[2], code.workgroupSize[2])};
+  */
+  op.nWorkgroups = {nWorkgroups[0], nWorkgroups[1], nWorkgroups[2]};
+  op.label = code.label;
+  op.profiler = ctx.profiler.get();
+  op.telemetrySlot = kernelTelemetrySlot(ctx.telemetry, code.label);
+  // The command buffer is recorded by the first dispatchKernel(), kernels
+  // which only run through a CommandBatch or KernelGraph never record one and
+  // never claim a profiler slot for it
+  ctx.kernelPool.data.insert(op.bindGroup);
+  return op;
+}
+
+/**
+ * @brief Frees the resources owned by a kernel, its bind group, params buffer
+ * and any recorded but unsubmitted command buffer, and updates the kernel
+ * pool. The compiled pipeline stays in the Context's PipelineCache for other
+ * kernels with the same code.
+ *
+ * Only needed if the use case requires manually managing resource lifetimes of
+ * kernels, e.g. when many short-lived kernels are created in a loop. For
+ * simple use cases, the KernelPool destructor frees all kernels. The kernel
+ * must not be in flight or referenced by a CommandBatch that is dispatched
+ * afterwards.
+ *
+ * @param[in] pool KernelPool instance which manages the kernel
+ * @param[in] op Kernel instance to free
+ *
+ * @code
+ * FreeKernel(ctx.kernelPool, op);
+ * @endcode
+ */
+inline void FreeKernel(KernelPool &pool, Kernel &op) {
+  releaseCommandBuffer(op);
+  if (pool.data.erase(op.bindGroup) > 0) {
+    wgpuBindGroupRelease(op.bindGroup);
+  } else {
+    LOG(kDefLog, kWarn, "Tried to free kernel that was not in pool");
+  }
+  op.bindGroup = nullptr;
+  // The params buffer, if any, is the last binding
+  if (op.numBindings > 0) {
+    auto params = pool.params.find(op.buffers[op.numBindings - 1]);
+    if (params != pool.params.end()) {
+      wgpuBufferRelease(params->first);
+      untrackBuffer(pool.ctx->telemetry, kUniformBuffer, params->second);
+      pool.params.erase(params);
+      op.buffers[op.numBindings - 1] = nullptr;
+    }
   }
-  /*
-  op.nWorkgroups = {cdiv(nThreads[0], code.workgroupSize[0]),
-                    cdiv(nThreads[1], code.workgroupSize[1]),
-                    cdiv(nThreads[2], code.workgroupSize[2])};
-  */
-  op.nWorkgroups = {nWorkgroups[0], nWorkgroups[1], nWorkgroups[2]};
-  resetCommandBuffer(device, op);
-  ctx.kernelPool.data.insert(&op);
-  return op;
 }
 
 /**
@@ -1071,13 +3328,170 @@ Kernel createKernel(Context &ctx, const KernelCode &code,
     return createKernel(ctx, code, dataBindings.data.data(), numInputs,
                         dataBindings.viewOffsets.data(), nWorkgroups,
                         reinterpret_cast<const void *>(&params),
-                        sizeof(ParamsType));
+                        sizeof(ParamsType), dataBindings.viewSpans.data());
   } else {
     // LOG(kDefLog, kTrace , "No params");
     return createKernel(ctx, code, dataBindings.data.data(), numInputs,
                         dataBindings.viewOffsets.data(), nWorkgroups, nullptr,
-                        0);
+                        0, dataBindings.viewSpans.data());
+  }
+}
+
+/**
+ * @brief Overload of createKernel() for shape-polymorphic kernels, which
+ * stores one params struct per slot and binds them with a dynamic offset.
+ *
+ * The kernel is dispatched with the params of Kernel::paramsSlot, or of
+ * BatchOp::paramsSlot within a CommandBatch, so one kernel and bind group
+ * serve several problem sizes. Size the bindings for the largest problem
+ * (see bucketSize()) and mask out-of-range invocations in the shader.
+ *
+ * @param[in] ctx Context instance to manage the kernel
+ * @param[in] code WGSL code for the kernel
+ * @param[in] dataBindings A Bindings of tensors whose GPU buffers are bound
+ * to the kernel as inputs and outputs.
+ * @param[in] nWorkgroups Number of workgroups in the x, y, z grid, must be a
+ * Shape of rank == 3.
+ * @param[in] params Parameters of each slot, must not be empty
+ * @return Kernel instance representing the created kernel
+ *
+ * @code
+ * Kernel kernel = createKernel(ctx, code, Bindings{a, b, c}, nWorkgroups,
+ *                              std::vector<Params>{{64, 64}, {128, 64}});
+ * CommandBatch batch = createCommandBatch(ctx, {BatchOp{kernel, 0},
+ *                                              BatchOp{kernel, 1}});
+ * @endcode
+ */
+template <typename ParamsType, size_t numInputs>
+Kernel createKernel(Context &ctx, const KernelCode &code,
+                    const Bindings<numInputs> &dataBindings,
+                    const Shape &nWorkgroups,
+                    const std::vector<ParamsType> &params) {
+  static_assert(!IsNoParam<ParamsType>, "Params slots need a params type");
+  assert(!params.empty());
+  return createKernel(ctx, code, dataBindings.data.data(), numInputs,
+                      dataBindings.viewOffsets.data(), nWorkgroups,
+                      reinterpret_cast<const void *>(params.data()),
+                      sizeof(ParamsType), dataBindings.viewSpans.data(),
+                      params.size());
+}
+
+/**
+ * @brief Non-blocking version of createKernel(). The pipeline is compiled in
+ * the background with compilePipelineAsync() and the kernel is created once
+ * it is ready, so the calling thread can keep dispatching other kernels (eg.
+ * the previous version of a hot reloaded kernel) in the meantime.
+ *
+ * The future becomes ready while events are processed, poll it with
+ * waitFor(ctx, future, std::chrono::nanoseconds(0)) or block with wait(). If
+ * the compilation fails, the kernel's computePipeline is nullptr.
+ *
+ * @param[in] ctx Context instance to manage the kernel
+ * @param[in] code WGSL code for the kernel
+ * @param[in] dataBindings A Bindings of tensors whose GPU buffers are bound
+ * to the kernel as inputs and outputs.
+ * @param[in] nWorkgroups Number of workgroups in the x, y, z grid, must be a
+ * Shape of rank == 3.
+ * @param[in] params Optional parameters for the kernel. If the kernel does not
+ * have any parameters, use NoParam.
+ * @return Future of the created Kernel
+ *
+ * @code
+ * std::future<Kernel> next = createKernelAsync(ctx, code, Bindings{screen},
+ *                                              nWorkgroups, params);
+ * if (waitFor(ctx, next, std::chrono::nanoseconds(0))) {
+ *   kernel = next.get();
+ * }
+ * @endcode
+ */
+template <typename ParamsType = NoParam, size_t numInputs>
+std::future<Kernel> createKernelAsync(Context &ctx, const KernelCode &code,
+                                      const Bindings<numInputs> &dataBindings,
+                                      const Shape &nWorkgroups,
+                                      const ParamsType &params = ParamsType{}) {
+  auto promise = std::make_shared<std::promise<Kernel>>();
+  std::future<Kernel> future = promise->get_future();
+  size_t paramsSize = IsNoParam<ParamsType> ? 0 : sizeof(ParamsType);
+  // Captured by value, the arguments may be gone by the time the callback
+  // runs
+  compilePipelineAsync(
+      ctx, code, numInputs, paramsSize,
+      [&ctx, promise, code, dataBindings, nWorkgroups, params](bool success) {
+        if (success) {
+          promise->set_value(
+              createKernel(ctx, code, dataBindings, nWorkgroups, params));
+        } else {
+          promise->set_value(Kernel{});
+        }
+      });
+  return future;
+}
+
+/**
+ * @brief Pipeline to compile ahead of time with warmupKernels(), identified
+ * by its code and binding layout like the pipelines in the PipelineCache.
+ */
+struct KernelWarmup {
+  KernelCode code;
+  size_t numTensors = 0; // number of storage bindings
+  size_t paramsSize = 0; // sizeof the params struct, 0 if none
+};
+
+/**
+ * @brief Convenience factory for a KernelWarmup matching the kernel that
+ * createKernel() would create for the same code, bindings and params type.
+ *
+ * @code
+ * KernelWarmup warmup = kernelWarmup<Params>(code, Bindings{input, output});
+ * @endcode
+ */
+template <typename ParamsType = NoParam, size_t numInputs>
+KernelWarmup kernelWarmup(const KernelCode &code,
+                          const Bindings<numInputs> &dataBindings) {
+  return KernelWarmup{code, numInputs,
+                      IsNoParam<ParamsType> ? 0 : sizeof(ParamsType)};
+}
+
+/**
+ * @brief Compiles the pipelines of a list of kernels in the background, eg.
+ * at startup, so that the createKernel() calls for them later hit the
+ * PipelineCache instead of compiling on the calling thread.
+ * @param[in] ctx Context instance which owns the PipelineCache
+ * @param[in] kernels Code and binding layouts of the kernels
+ * @return Future which is ready once all pipelines have been compiled (or
+ * failed to compile)
+ *
+ * @code
+ * std::future<void> warm = warmupKernels(ctx, {kernelWarmup(gelu, {a, b})});
+ * ... other startup work ...
+ * wait(ctx, warm);
+ * @endcode
+ */
+inline std::future<void>
+warmupKernels(Context &ctx, const std::vector<KernelWarmup> &kernels) {
+  struct WarmupOp {
+    std::promise<void> promise;
+    size_t remaining;
+  };
+  auto op = std::make_shared<WarmupOp>();
+  op->remaining = kernels.size();
+  std::future<void> future = op->promise.get_future();
+  if (kernels.empty()) {
+    op->promise.set_value();
+    return future;
+  }
+  for (const KernelWarmup &kernel : kernels) {
+    compilePipelineAsync(ctx, kernel.code, kernel.numTensors,
+                         kernel.paramsSize,
+                         [op](bool) {
+                           // Callbacks run with the Context mutex held
+                           if (--op->remaining == 0) {
+                             op->promise.set_value();
+                           }
+                         });
   }
+  LOG(kDefLog, kInfo, "Warming up %zu kernels", kernels.size());
+  return future;
 }
 
 /**
@@ -1085,6 +3499,10 @@ Kernel createKernel(Context &ctx, const KernelCode &code,
  * It also sets up a callback to notify when the kernel has finished executing
  * by setting the value of the promise in the kernel instance argument.
  *
+ * The kernel's command buffer is released after submission. If it has not
+ * been re-recorded with resetCommandBuffer() since the last dispatch, it is
+ * recorded here.
+ *
  * dispatchKernel does *not* wait for the kernel to finish executing and returns
  * immediately. The caller can wait for the kernel to finish executing by
  * calling wait() on the future in the kernel instance.
@@ -1099,8 +3517,222 @@ Kernel createKernel(Context &ctx, const KernelCode &code,
  */
 inline void dispatchKernel(Context &ctx, Kernel &kernel,
                            std::promise<void> &promise) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  if (!kernel.commandBuffer) {
+    resetCommandBuffer(ctx.device, kernel);
+  }
   // Submit the command buffer
   wgpuQueueSubmit(ctx.queue, 1, &kernel.commandBuffer);
+  wgpuCommandBufferRelease(kernel.commandBuffer);
+  kernel.commandBuffer = nullptr;
+  submitProfileSlot(kernel.profiler, kernel.profileSlot);
+  ctx.telemetry.submits++;
+  countDispatch(ctx.telemetry, kernel);
+  wgpuQueueOnSubmittedWorkDone(
+      ctx.queue,
+      [](WGPUQueueWorkDoneStatus status, void *data) {
+        check(status == WGPUQueueWorkDoneStatus_Success, "Queue work done",
+              __FILE__, __LINE__);
+        auto *promise = static_cast<std::promise<void> *>(data);
+        promise->set_value();
+      },
+      &promise);
+}
+
+/**
+ * @brief A single operation recorded into a CommandBatch, either a kernel
+ * dispatch or a buffer to buffer copy.
+ *
+ * BatchOp is implicitly constructible from a Kernel so that batches can be
+ * written as a list of kernels, with copies interleaved as needed.
+ *
+ * @code
+ * BatchOp dispatch = kernel;
+ * BatchOp copy = {src, dst};
+ * @endcode
+ */
+struct BatchOp {
+  inline BatchOp(const Kernel &kernel)
+      : kernel(&kernel), paramsSlot(kernel.paramsSlot) {}
+  inline BatchOp(const Kernel &kernel, size_t paramsSlot)
+      : kernel(&kernel), paramsSlot(paramsSlot) {}
+  inline BatchOp(const Tensor &src, const Tensor &dst, size_t size = 0,
+                 size_t srcOffset = 0, size_t dstOffset = 0)
+      : src(src.data.buffer), srcOffset(srcOffset), dst(dst.data.buffer),
+        dstOffset(dstOffset), size(size > 0 ? size : src.data.size) {}
+  const Kernel *kernel = nullptr; // non-owning, nullptr for copies
+  size_t paramsSlot = 0; // params slot of the dispatch, see numParamSlots
+  WGPUBuffer src = nullptr;       // copy source, non-owning
+  size_t srcOffset = 0;
+  WGPUBuffer dst = nullptr; // copy destination, non-owning
+  size_t dstOffset = 0;
+  size_t size = 0; // copy size in bytes
+};
+
+/**
+ * @brief Represents an ordered sequence of kernel dispatches and buffer copies
+ * which is recorded into a single command buffer and submitted to the queue
+ * with one wgpuQueueSubmit call, instead of one submission per kernel.
+ *
+ * Consecutive dispatches are recorded into the same compute pass. When the
+ * kernels are profiled (see enableProfiling()), each dispatch gets its own pass
+ * instead so that it can be timed individually. As with Kernel, the
+ * commandBuffer is released upon submission and re-recorded by the next
+ * dispatchBatch(), unless resetCommandBuffer() has been called in between.
+ *
+ * The kernels referenced by the batch are non-owning and must outlive it.
+ */
+struct CommandBatch {
+  std::vector<BatchOp> ops;
+  WGPUCommandBuffer commandBuffer = nullptr; // destroyed upon submission
+  std::vector<ProfileSlot> profileSlots; // slots of commandBuffer's passes
+  Profiler *profiler = nullptr; // non-owning, profiler of the kernels
+};
+
+/**
+ * @brief Releases a batch's command buffer if it has been recorded but not
+ * submitted, together with its profiler slots.
+ * @param[in] batch CommandBatch instance whose command buffer is released
+ */
+inline void releaseCommandBuffer(CommandBatch &batch) {
+  if (batch.commandBuffer) {
+    wgpuCommandBufferRelease(batch.commandBuffer);
+    batch.commandBuffer = nullptr;
+  }
+  for (ProfileSlot &slot : batch.profileSlots) {
+    releaseProfileSlot(batch.profiler, slot);
+  }
+  batch.profileSlots.clear();
+}
+
+/**
+ * @brief Records the operations of a CommandBatch into a new command buffer.
+ * Consecutive kernel dispatches share one compute pass, copies are recorded
+ * between passes. A command buffer which was recorded but not submitted is
+ * released first.
+ * @param[in] device WGPUDevice instance to manage the operation
+ * @param[in] batch CommandBatch instance to record
+ *
+ * @code
+ * resetCommandBuffer(device, batch);
+ * @endcode
+ */
+inline void resetCommandBuffer(WGPUDevice &device, CommandBatch &batch) {
+  releaseCommandBuffer(batch);
+  WGPUCommandEncoder commandEncoder =
+      wgpuDeviceCreateCommandEncoder(device, nullptr);
+  WGPUComputePassEncoder computePassEncoder = nullptr;
+  WGPUComputePipeline currentPipeline = nullptr;
+  for (const BatchOp &op : batch.ops) {
+    if (op.kernel) {
+      WGPUComputePassTimestampWrites timestampWrites = {};
+      ProfileSlot slot;
+      if (op.kernel->profiler) {
+        if (computePassEncoder) {
+          wgpuComputePassEncoderEnd(computePassEncoder);
+          wgpuComputePassEncoderRelease(computePassEncoder);
+          computePassEncoder = nullptr;
+        }
+        batch.profiler = op.kernel->profiler;
+        slot = claimProfileSlot(batch.profiler, op.kernel->label,
+                                timestampWrites);
+      }
+      if (!computePassEncoder) {
+        WGPUComputePassDescriptor passDesc = {};
+        if (slot.index != Profiler::kNoSlot) {
+          passDesc.timestampWrites = &timestampWrites;
+          batch.profileSlots.push_back(slot);
+        }
+        computePassEncoder =
+            wgpuCommandEncoderBeginComputePass(commandEncoder, &passDesc);
+        currentPipeline = nullptr;
+      }
+      // Kernels sharing a cached pipeline only need to rebind their buffers
+      if (op.kernel->computePipeline != currentPipeline) {
+        wgpuComputePassEncoderSetPipeline(computePassEncoder,
+                                          op.kernel->computePipeline);
+        currentPipeline = op.kernel->computePipeline;
+      }
+      setKernelBindGroup(computePassEncoder, *op.kernel, op.paramsSlot);
+      recordDispatch(computePassEncoder, *op.kernel);
+    } else {
+      if (computePassEncoder) {
+        wgpuComputePassEncoderEnd(computePassEncoder);
+        wgpuComputePassEncoderRelease(computePassEncoder);
+        computePassEncoder = nullptr;
+      }
+      wgpuCommandEncoderCopyBufferToBuffer(commandEncoder, op.src,
+                                           op.srcOffset, op.dst, op.dstOffset,
+                                           op.size);
+    }
+  }
+  if (computePassEncoder) {
+    wgpuComputePassEncoderEnd(computePassEncoder);
+    wgpuComputePassEncoderRelease(computePassEncoder);
+  }
+  batch.commandBuffer = wgpuCommandEncoderFinish(commandEncoder, nullptr);
+  check(batch.commandBuffer, "Create command buffer", __FILE__, __LINE__);
+  wgpuCommandEncoderRelease(commandEncoder);
+}
+
+/**
+ * @brief Factory function to create a CommandBatch from an ordered list of
+ * kernels and copies, and record its command buffer.
+ * @param[in] ctx Context instance to manage the batch
+ * @param[in] ops Ordered kernel dispatches and buffer copies
+ * @return CommandBatch instance ready to be dispatched
+ *
+ * @code
+ * CommandBatch batch = createCommandBatch(ctx, {qkv, qk, softmax,
+ *                                               BatchOp{out, staging}});
+ * @endcode
+ */
+inline CommandBatch createCommandBatch(Context &ctx,
+                                       const std::vector<BatchOp> &ops) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  CommandBatch batch;
+  batch.ops = ops;
+  resetCommandBuffer(ctx.device, batch);
+  return batch;
+}
+
+/**
+ * @brief Asynchronously submits a CommandBatch to the GPU queue with a single
+ * wgpuQueueSubmit call. The promise is fulfilled once all of the operations in
+ * the batch have finished executing.
+ *
+ * As with dispatchKernel(), the command buffer is released after submission
+ * and recorded here if it has not been re-recorded since the last dispatch.
+ * This does *not* wait for the batch to finish, use wait() on the future of
+ * the promise.
+ *
+ * @param[in] ctx Context instance to manage the batch
+ * @param[in] batch CommandBatch instance to dispatch
+ * @param[in] promise Promise which is fulfilled upon completion
+ *
+ * @code
+ * dispatchBatch(ctx, batch, promise);
+ * @endcode
+ */
+inline void dispatchBatch(Context &ctx, CommandBatch &batch,
+                          std::promise<void> &promise) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  if (!batch.commandBuffer) {
+    resetCommandBuffer(ctx.device, batch);
+  }
+  wgpuQueueSubmit(ctx.queue, 1, &batch.commandBuffer);
+  wgpuCommandBufferRelease(batch.commandBuffer);
+  batch.commandBuffer = nullptr;
+  ctx.telemetry.submits++;
+  for (const BatchOp &op : batch.ops) {
+    if (op.kernel) {
+      countDispatch(ctx.telemetry, *op.kernel);
+    }
+  }
+  for (ProfileSlot &slot : batch.profileSlots) {
+    submitProfileSlot(batch.profiler, slot);
+  }
+  batch.profileSlots.clear();
   wgpuQueueOnSubmittedWorkDone(
       ctx.queue,
       [](WGPUQueueWorkDoneStatus status, void *data) {
@@ -1112,6 +3744,485 @@ inline void dispatchKernel(Context &ctx, Kernel &kernel,
       &promise);
 }
 
+/**
+ * @brief Measures the mean GPU execution time of a kernel dispatch by
+ * recording nIter dispatches into one compute pass. The pass is bracketed by
+ * timestamp queries when the device has the timestamp-query feature, otherwise
+ * the wall clock time until the queue reports completion is used, which also
+ * includes submission overhead.
+ *
+ * This is a blocking call intended for benchmarking and autotuning, it does
+ * not consume the kernel's command buffer.
+ *
+ * @param[in] ctx Context instance to manage the kernel
+ * @param[in] kernel Kernel instance to time
+ * @param[in] nIter Number of dispatches to average over
+ * @return Mean time per dispatch in milliseconds
+ *
+ * @code
+ * double ms = timeKernel(ctx, kernel, 10);
+ * @endcode
+ */
+inline double timeKernel(Context &ctx, Kernel &kernel, size_t nIter = 10) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  bool timestamps =
+      wgpuDeviceHasFeature(ctx.device, WGPUFeatureName_TimestampQuery);
+  WGPUQuerySet querySet = nullptr;
+  WGPUComputePassTimestampWrites timestampWrites = {};
+  WGPUComputePassDescriptor passDesc = {};
+  if (timestamps) {
+    WGPUQuerySetDescriptor querySetDesc = {
+        .type = WGPUQueryType_Timestamp,
+        .count = 2,
+    };
+    querySet = wgpuDeviceCreateQuerySet(ctx.device, &querySetDesc);
+    timestampWrites = {
+        .querySet = querySet,
+        .beginningOfPassWriteIndex = 0,
+        .endOfPassWriteIndex = 1,
+    };
+    passDesc.timestampWrites = &timestampWrites;
+  }
+  WGPUCommandEncoder commandEncoder =
+      wgpuDeviceCreateCommandEncoder(ctx.device, nullptr);
+  WGPUComputePassEncoder computePassEncoder =
+      wgpuCommandEncoderBeginComputePass(commandEncoder, &passDesc);
+  wgpuComputePassEncoderSetPipeline(computePassEncoder, kernel.computePipeline);
+  setKernelBindGroup(computePassEncoder, kernel, kernel.paramsSlot);
+  for (size_t i = 0; i < nIter; ++i) {
+    recordDispatch(computePassEncoder, kernel);
+  }
+  wgpuComputePassEncoderEnd(computePassEncoder);
+  wgpuComputePassEncoderRelease(computePassEncoder);
+  Tensor resolve = {};
+  if (timestamps) {
+    WGPUBufferDescriptor resolveDesc = {
+        .usage = WGPUBufferUsage_QueryResolve | WGPUBufferUsage_CopySrc,
+        .size = 2 * sizeof(uint64_t),
+    };
+    resolve.data.buffer = wgpuDeviceCreateBuffer(ctx.device, &resolveDesc);
+    resolve.data.size = resolveDesc.size;
+    wgpuCommandEncoderResolveQuerySet(commandEncoder, querySet, 0, 2,
+                                      resolve.data.buffer, 0);
+  }
+  WGPUCommandBuffer commandBuffer =
+      wgpuCommandEncoderFinish(commandEncoder, nullptr);
+  check(commandBuffer, "Create command buffer", __FILE__, __LINE__);
+  wgpuCommandEncoderRelease(commandEncoder);
+  auto start = std::chrono::high_resolution_clock::now();
+  wgpuQueueSubmit(ctx.queue, 1, &commandBuffer);
+  wgpuCommandBufferRelease(commandBuffer);
+  ctx.telemetry.submits++;
+  countDispatch(ctx.telemetry, kernel, nIter);
+  double totalMs;
+  if (timestamps) {
+    uint64_t ticks[2];
+    std::future<void> future =
+        toCPUAsync(ctx, resolve, ticks, sizeof(ticks));
+    wait(ctx, future);
+    totalMs = static_cast<double>(ticks[1] - ticks[0]) / 1e6; // ns -> ms
+    wgpuBufferRelease(resolve.data.buffer);
+    wgpuQuerySetRelease(querySet);
+  } else {
+    std::promise<void> promise;
+    std::future<void> future = promise.get_future();
+    wgpuQueueOnSubmittedWorkDone(
+        ctx.queue,
+        [](WGPUQueueWorkDoneStatus status, void *data) {
+          check(status == WGPUQueueWorkDoneStatus_Success, "Queue work done",
+                __FILE__, __LINE__);
+          static_cast<std::promise<void> *>(data)->set_value();
+        },
+        &promise);
+    wait(ctx, future);
+    totalMs = std::chrono::duration<double, std::milli>(
+                  std::chrono::high_resolution_clock::now() - start)
+                  .count();
+  }
+  return totalMs / static_cast<double>(nIter);
+}
+
+/**
+ * @brief Enables the GPU profiler on a Context. Kernels created afterwards
+ * record the device time of their dispatches with timestamp queries, labeled
+ * with KernelCode::label. Requires the timestamp-query feature, which
+ * createContext() requests when the adapter supports it.
+ *
+ * Each recorded but not yet collected dispatch takes one of the capacity
+ * slots, so collectProfile() should be called periodically in long running
+ * loops. Calling this again while profiling is enabled keeps the existing
+ * profiler and its capacity.
+ *
+ * @param[in] ctx Context instance to profile
+ * @param[in] capacity Maximum number of dispatches between collections
+ * @return true if profiling is enabled, false if timestamps are unsupported
+ *
+ * @code
+ * enableProfiling(ctx);
+ * Kernel op = createKernel(ctx, code, bindings, nWorkgroups);
+ * @endcode
+ */
+inline bool enableProfiling(Context &ctx, size_t capacity = 1024) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  if (ctx.profiler) {
+    // Existing kernels and batches point to the current profiler
+    return true;
+  }
+  if (!wgpuDeviceHasFeature(ctx.device, WGPUFeatureName_TimestampQuery)) {
+    LOG(kDefLog, kWarn,
+        "Profiling requires the timestamp-query feature, not enabled");
+    return false;
+  }
+  auto profiler = std::make_shared<Profiler>();
+  WGPUQuerySetDescriptor querySetDesc = {
+      .type = WGPUQueryType_Timestamp,
+      .count = static_cast<uint32_t>(2 * capacity),
+  };
+  profiler->querySet = wgpuDeviceCreateQuerySet(ctx.device, &querySetDesc);
+  check(profiler->querySet, "Create profiler query set", __FILE__, __LINE__);
+  WGPUBufferDescriptor resolveDesc = {
+      .usage = WGPUBufferUsage_QueryResolve | WGPUBufferUsage_CopySrc,
+      .size = 2 * capacity * sizeof(uint64_t),
+  };
+  profiler->resolveBuffer = wgpuDeviceCreateBuffer(ctx.device, &resolveDesc);
+  profiler->slots.assign(capacity, Profiler::kFree);
+  profiler->labels.resize(capacity);
+  profiler->tickets.assign(capacity, 0);
+  ctx.profiler = profiler;
+  return true;
+}
+
+/**
+ * @brief Reads back the timestamps of all submitted dispatches and appends
+ * them to the profiler's events, freeing their slots. The readback is queued
+ * after previously submitted work, so this blocks until that work is done.
+ * @param[in] ctx Context instance with profiling enabled
+ * @return Number of collected events
+ *
+ * @code
+ * collectProfile(ctx);
+ * @endcode
+ */
+inline size_t collectProfile(Context &ctx) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  Profiler *profiler = ctx.profiler.get();
+  if (!profiler) {
+    return 0;
+  }
+  size_t numSlots = profiler->slots.size();
+  WGPUCommandEncoder commandEncoder =
+      wgpuDeviceCreateCommandEncoder(ctx.device, nullptr);
+  wgpuCommandEncoderResolveQuerySet(commandEncoder, profiler->querySet, 0,
+                                    static_cast<uint32_t>(2 * numSlots),
+                                    profiler->resolveBuffer, 0);
+  WGPUCommandBuffer commandBuffer =
+      wgpuCommandEncoderFinish(commandEncoder, nullptr);
+  check(commandBuffer, "Create command buffer", __FILE__, __LINE__);
+  wgpuQueueSubmit(ctx.queue, 1, &commandBuffer);
+  wgpuCommandBufferRelease(commandBuffer);
+  wgpuCommandEncoderRelease(commandEncoder);
+  ctx.telemetry.submits++;
+  // Slots submitted from here on are collected by the next call
+  std::vector<size_t> submitted;
+  {
+    std::lock_guard<std::mutex> slotLock(profiler->mutex);
+    for (size_t slot = 0; slot < numSlots; ++slot) {
+      if (profiler->slots[slot] == Profiler::kSubmitted) {
+        submitted.push_back(slot);
+      }
+    }
+  }
+  std::vector<uint64_t> timestamps(2 * numSlots);
+  Tensor resolve = {.data = Array{.buffer = profiler->resolveBuffer,
+                                  .size = 2 * numSlots * sizeof(uint64_t)}};
+  std::future<void> future =
+      toCPUAsync(ctx, resolve, timestamps.data(),
+                 timestamps.size() * sizeof(uint64_t));
+  wait(ctx, future);
+  std::lock_guard<std::mutex> slotLock(profiler->mutex);
+  for (size_t slot : submitted) {
+    profiler->events.push_back(ProfileEvent{
+        .label = profiler->labels[slot],
+        .begin = timestamps[2 * slot],
+        .end = timestamps[2 * slot + 1],
+    });
+    profiler->slots[slot] = Profiler::kFree;
+  }
+  return submitted.size();
+}
+
+/**
+ * @brief Aggregate device time statistics of the dispatches with one label.
+ */
+struct ProfileStats {
+  std::string label;
+  size_t count;
+  double totalMs;
+  double meanMs;
+  double p50Ms;
+  double p99Ms;
+};
+
+/**
+ * @brief Collects pending events and returns per-label statistics of all
+ * events recorded so far, sorted by decreasing total time so that the
+ * bottleneck of a kernel chain comes first.
+ * @param[in] ctx Context instance with profiling enabled
+ * @return Statistics for each kernel label
+ *
+ * @code
+ * for (const ProfileStats &stats : profileStats(ctx)) {
+ *   LOG(kDefLog, kInfo, "%s: %.3f ms", stats.label.c_str(), stats.meanMs);
+ * }
+ * @endcode
+ */
+inline std::vector<ProfileStats> profileStats(Context &ctx) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  collectProfile(ctx);
+  std::vector<ProfileStats> result;
+  if (!ctx.profiler) {
+    return result;
+  }
+  std::unordered_map<std::string, std::vector<double>> durations;
+  for (const ProfileEvent &event : ctx.profiler->events) {
+    durations[event.label].push_back(
+        static_cast<double>(event.end - event.begin) / 1e6); // ns -> ms
+  }
+  for (auto &[label, ms] : durations) {
+    std::sort(ms.begin(), ms.end());
+    auto percentile = [&ms](double p) {
+      size_t rank = static_cast<size_t>(std::ceil(p * ms.size()));
+      return ms[std::max<size_t>(rank, 1) - 1];
+    };
+    double total = 0.0;
+    for (double value : ms) {
+      total += value;
+    }
+    result.push_back(ProfileStats{
+        .label = label,
+        .count = ms.size(),
+        .totalMs = total,
+        .meanMs = total / ms.size(),
+        .p50Ms = percentile(0.50),
+        .p99Ms = percentile(0.99),
+    });
+  }
+  std::sort(result.begin(), result.end(),
+            [](const ProfileStats &a, const ProfileStats &b) {
+              return a.totalMs > b.totalMs;
+            });
+  return result;
+}
+
+/**
+ * @brief Collects pending events and writes all events recorded so far in the
+ * Chrome trace event format, which can be opened in chrome://tracing or
+ * Perfetto.
+ * @param[in] ctx Context instance with profiling enabled
+ * @param[in] path Path of the JSON file to write
+ * @return true if the file was written
+ *
+ * @code
+ * writeChromeTrace(ctx, "trace.json");
+ * @endcode
+ */
+inline bool writeChromeTrace(Context &ctx, const std::string &path) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  if (!ctx.profiler) {
+    LOG(kDefLog, kWarn, "Profiling is not enabled, no trace written");
+    return false;
+  }
+  collectProfile(ctx);
+  FILE *file = fopen(path.c_str(), "w");
+  if (!file) {
+    LOG(kDefLog, kError, "Could not open %s for writing", path.c_str());
+    return false;
+  }
+  uint64_t start = UINT64_MAX;
+  const std::vector<ProfileEvent> &events = ctx.profiler->events;
+  for (const ProfileEvent &event : events) {
+    start = std::min(start, event.begin);
+  }
+  fprintf(file, "{\"traceEvents\":[");
+  for (size_t i = 0; i < events.size(); ++i) {
+    std::string label;
+    for (char c : events[i].label) {
+      if (c == '"' || c == '\\') {
+        label += '\\';
+      }
+      label += c;
+    }
+    // Trace timestamps are in microseconds
+    fprintf(file,
+            "%s\n{\"name\":\"%s\",\"cat\":\"gpu\",\"ph\":\"X\",\"pid\":0,"
+            "\"tid\":0,\"ts\":%.3f,\"dur\":%.3f}",
+            i == 0 ? "" : ",", label.c_str(),
+            static_cast<double>(events[i].begin - start) / 1e3,
+            static_cast<double>(events[i].end - events[i].begin) / 1e3);
+  }
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  LOG(kDefLog, kInfo, "Wrote %d profile events to %s", events.size(),
+      path.c_str());
+  return true;
+}
+
+/**
+ * @brief Represents a DAG of kernel dispatches and buffer copies which is
+ * captured once and replayed with a single call.
+ *
+ * Nodes are added with addNode() together with the nodes they depend on.
+ * compileGraph() orders the nodes into dependency levels and records them into
+ * a CommandBatch. Within a level, nodes have no ordering constraints between
+ * them, so dispatches sharing a pipeline are recorded back to back and copies
+ * are grouped together, which minimizes pipeline rebinds and compute pass
+ * breaks.
+ *
+ * replay() submits the recorded commands and immediately re-records them, so
+ * that the CPU-side encoding of the next iteration overlaps with the GPU
+ * executing the current one and callers never need to call
+ * resetCommandBuffer() by hand. Uniform parameters of the kernels in the graph
+ * can be updated between replays with toGPU(ctx, params, kernel).
+ *
+ * WebGPU command buffers can only be submitted once and compute passes can
+ * not be recorded into render bundles, so each replay still encodes the whole
+ * graph. What the graph saves is the ordering and the pass and pipeline
+ * changes, not the encoding itself: the CPU cost of a replay is that of one
+ * resetCommandBuffer() of the batch, hidden behind the GPU work of the
+ * previous replay.
+ *
+ * The command buffer recorded after the last replay, and its profiler slots,
+ * are held until releaseGraph() or the next compileGraph(). The kernels and
+ * tensors referenced by the graph are non-owning and must outlive it.
+ */
+struct KernelGraph {
+  std::vector<BatchOp> nodes;
+  std::vector<std::vector<size_t>> deps; // deps[i] are the nodes node i waits on
+  CommandBatch batch;                    // topologically ordered nodes
+  size_t replays = 0;
+};
+
+/**
+ * @brief Adds a kernel dispatch or buffer copy to a KernelGraph.
+ * @param[in] graph KernelGraph instance to add the node to
+ * @param[in] op Kernel dispatch or buffer copy
+ * @param[in] deps Indices of previously added nodes which have to complete
+ * before this node runs
+ * @return Index of the new node, used to express dependencies on it
+ *
+ * @code
+ * size_t qkvNode = addNode(graph, qkv);
+ * size_t qkNode = addNode(graph, qk, {qkvNode});
+ * @endcode
+ */
+inline size_t addNode(KernelGraph &graph, const BatchOp &op,
+                      std::initializer_list<size_t> deps = {}) {
+  size_t index = graph.nodes.size();
+  for (size_t dep : deps) {
+    check(dep < index, "Graph dependency refers to an existing node", __FILE__,
+          __LINE__);
+  }
+  graph.nodes.push_back(op);
+  graph.deps.push_back(std::vector<size_t>(deps));
+  return index;
+}
+
+/**
+ * @brief Orders the nodes of a KernelGraph topologically and records them into
+ * its command buffer. Needs to be called once after all nodes have been added
+ * and before the first replay().
+ * @param[in] ctx Context instance to manage the graph
+ * @param[in] graph KernelGraph instance to compile
+ *
+ * @code
+ * compileGraph(ctx, graph);
+ * @endcode
+ */
+inline void compileGraph(Context &ctx, KernelGraph &graph) {
+  // Kahn's algorithm, processed one dependency level at a time
+  size_t n = graph.nodes.size();
+  std::vector<size_t> pending(n);
+  std::vector<std::vector<size_t>> dependents(n);
+  std::vector<size_t> level;
+  for (size_t i = 0; i < n; ++i) {
+    pending[i] = graph.deps[i].size();
+    for (size_t dep : graph.deps[i]) {
+      dependents[dep].push_back(i);
+    }
+    if (pending[i] == 0) {
+      level.push_back(i);
+    }
+  }
+  std::vector<BatchOp> ordered;
+  ordered.reserve(n);
+  while (!level.empty()) {
+    // Dispatches first, grouped by pipeline, then copies
+    std::stable_sort(level.begin(), level.end(), [&](size_t a, size_t b) {
+      const Kernel *ka = graph.nodes[a].kernel;
+      const Kernel *kb = graph.nodes[b].kernel;
+      if (!ka || !kb) {
+        return ka && !kb;
+      }
+      return ka->computePipeline < kb->computePipeline;
+    });
+    std::vector<size_t> next;
+    for (size_t node : level) {
+      ordered.push_back(graph.nodes[node]);
+      for (size_t dependent : dependents[node]) {
+        if (--pending[dependent] == 0) {
+          next.push_back(dependent);
+        }
+      }
+    }
+    level = std::move(next);
+  }
+  check(ordered.size() == n, "Kernel graph is acyclic", __FILE__, __LINE__);
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  releaseCommandBuffer(graph.batch);
+  graph.batch = createCommandBatch(ctx, ordered);
+}
+
+/**
+ * @brief Submits a compiled KernelGraph to the GPU queue and re-records its
+ * command buffer for the next replay. The promise is fulfilled once all of the
+ * nodes in the graph have finished executing.
+ * @param[in] ctx Context instance to manage the graph
+ * @param[in] graph KernelGraph instance compiled with compileGraph()
+ * @param[in] promise Promise which is fulfilled upon completion
+ *
+ * @code
+ * for (int i = 0; i < nIter; i++) {
+ *   replay(ctx, graph, promises[i]);
+ *   wait(ctx, futures[i]);
+ * }
+ * @endcode
+ */
+inline void replay(Context &ctx, KernelGraph &graph,
+                   std::promise<void> &promise) {
+  check(graph.batch.commandBuffer, "Kernel graph is compiled", __FILE__,
+        __LINE__);
+  dispatchBatch(ctx, graph.batch, promise);
+  resetCommandBuffer(ctx.device, graph.batch);
+  ++graph.replays;
+}
+
+/**
+ * @brief Releases the command buffer a KernelGraph holds for its next replay,
+ * together with its profiler slots. The nodes are kept, so the graph can be
+ * compiled again with compileGraph().
+ * @param[in] ctx Context instance which compiled the graph
+ * @param[in] graph KernelGraph instance to release
+ *
+ * @code
+ * releaseGraph(ctx, graph);
+ * @endcode
+ */
+inline void releaseGraph(Context &ctx, KernelGraph &graph) {
+  std::lock_guard<std::recursive_mutex> lock(*ctx.mutex);
+  releaseCommandBuffer(graph.batch);
+  graph.batch.ops.clear();
+}
+
 } // namespace gpu
 
 #endif // GPU_H
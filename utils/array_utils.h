@@ -3,8 +3,10 @@
  *
  * This file contains utility functions for working with arrays. These are
  * mostly convenience functions for setting up and inspecting data for testing.
- * They are not optimized and are not intended for use in performance-critical
- * code.
+ * Functions which touch every element of large arrays (range, the seeded
+ * randn / randint overloads, eye, transpose, flip and the checks) run on a
+ * shared thread pool in contiguous chunks, with inner loops written so that
+ * the compiler can vectorize them.
  *
  */
 
@@ -13,11 +15,20 @@
 
 #include <algorithm> // std::max_element
 #include <array>
+#include <atomic>
+#include <cassert>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
 #include <random>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include "utils/logging.h"
 
@@ -26,6 +37,159 @@ namespace gpu {
 static constexpr int kShowMaxRows = 8;
 static constexpr int kShowMaxCols = 8;
 
+// Minimum number of elements per chunk of work handed to a thread, smaller
+// arrays are processed on the calling thread
+static constexpr size_t kParallelGrain = 1 << 16;
+
+/**
+ * @brief Fixed set of worker threads running chunks of one job at a time. The
+ * calling thread works on the job as well and returns when all chunks are
+ * done. Jobs started from within a job run serially on the calling thread.
+ */
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t numWorkers) {
+    for (size_t i = 0; i < numWorkers; i++) {
+      workers.emplace_back([this] { workerLoop(); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /**
+   * @brief Number of threads working on a job, including the caller.
+   */
+  size_t size() const { return workers.size() + 1; }
+
+  /**
+   * @brief Runs fn(chunk) for each chunk in [0, numChunks).
+   */
+  void run(size_t numChunks, const std::function<void(size_t)> &fn) {
+    if (workers.empty() || numChunks <= 1 || insideJob()) {
+      for (size_t chunk = 0; chunk < numChunks; chunk++) {
+        fn(chunk);
+      }
+      return;
+    }
+    std::lock_guard<std::mutex> runLock(runMutex);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = &fn;
+      jobChunks = numChunks;
+      nextChunk = 0;
+      finished = 0;
+      ++generation;
+    }
+    wake.notify_all();
+    work();
+    // Every worker takes part in every job, so none of them can still refer
+    // to fn once they all finished
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return finished == workers.size(); });
+    job = nullptr;
+  }
+
+private:
+  static bool &insideJob() {
+    static thread_local bool inside = false;
+    return inside;
+  }
+
+  void work() {
+    insideJob() = true;
+    for (size_t chunk = nextChunk++; chunk < jobChunks; chunk = nextChunk++) {
+      (*job)(chunk);
+    }
+    insideJob() = false;
+  }
+
+  void workerLoop() {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [&] { return stop || generation != seen; });
+      if (stop) {
+        return;
+      }
+      seen = generation;
+      lock.unlock();
+      work();
+      lock.lock();
+      if (++finished == workers.size()) {
+        done.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex runMutex; // serializes jobs from different threads
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const std::function<void(size_t)> *job = nullptr;
+  size_t jobChunks = 0;
+  std::atomic<size_t> nextChunk{0};
+  size_t finished = 0;
+  uint64_t generation = 0;
+  bool stop = false;
+};
+
+/**
+ * @brief Thread pool shared by the array utilities, with one thread per
+ * hardware thread.
+ */
+inline ThreadPool &defaultThreadPool() {
+  static ThreadPool pool(
+      std::max(1u, std::thread::hardware_concurrency()) - 1);
+  return pool;
+}
+
+/**
+ * @brief Runs fn(begin, end) over contiguous subranges covering [0, n) on the
+ * default thread pool. Ranges hold at least grain elements, so small n run on
+ * the calling thread.
+ * @param n The number of elements.
+ * @param fn The function to run on each subrange.
+ * @param grain The minimum number of elements per subrange.
+ * @code
+ * parallelFor(N, [&](size_t begin, size_t end) {
+ *   for (size_t i = begin; i < end; i++) {
+ *     a[i] *= 2.0f;
+ *   }
+ * });
+ * @endcode
+ */
+inline void parallelFor(size_t n,
+                        const std::function<void(size_t, size_t)> &fn,
+                        size_t grain = kParallelGrain) {
+  if (n == 0) {
+    return;
+  }
+  ThreadPool &pool = defaultThreadPool();
+  // A few chunks per thread to even out differences in thread speed
+  size_t numChunks = std::min((n + grain - 1) / std::max<size_t>(grain, 1),
+                              pool.size() * 4);
+  if (numChunks <= 1) {
+    fn(0, n);
+    return;
+  }
+  pool.run(numChunks, [&](size_t chunk) {
+    fn(chunk * n / numChunks, (chunk + 1) * n / numChunks);
+  });
+}
+
 /**
  * @brief Show a 2D array as a string, base implementation.
  *
@@ -137,13 +301,15 @@ std::string show(const std::array<float, rows * cols> &a,
  * @param start The starting value.
  * @param step The step size.
  */
-void range(float *input, size_t N, float start = 0.0, float step = 1.0) {
-  // TODO(avh): currently unused - check
-  float curr = start;
-  for (size_t i = 0; i < N; i++) {
-    input[i] = curr;
-    curr += step;
-  }
+inline void range(float *input, size_t N, float start = 0.0,
+                  float step = 1.0) {
+  // Computed from the index rather than accumulated, so that every chunk can
+  // start on its own (and large arrays don't accumulate rounding errors)
+  parallelFor(N, [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      input[i] = start + static_cast<float>(i) * step;
+    }
+  });
 }
 
 /**
@@ -224,21 +390,92 @@ void randn(std::array<float, size> &a, std::mt19937 &gen, float mean = 0.0,
   }
 }
 
+/**
+ * @brief Counter-based random bits: a hash (the SplitMix64 finalizer) of the
+ * seed and the element index. Unlike a sequential generator, element i does
+ * not depend on the elements before it, so arrays can be filled in parallel
+ * with the same values as a serial loop.
+ * @param seed The seed.
+ * @param index The element index.
+ * @return uint64_t 64 random bits.
+ */
+inline uint64_t randomBits(uint64_t seed, uint64_t index) {
+  uint64_t z = seed + (index + 1) * 0x9E3779B97F4A7C15ull;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+/**
+ * @brief Populate the array with random integers from a counter-based
+ * generator. The values depend only on the seed and the index, not on the
+ * number of threads.
+ * @param a The array to populate.
+ * @param N The number of elements in the array.
+ * @param seed The seed of the random numbers.
+ * @param min The minimum value for the random integers.
+ * @param max The maximum value for the random integers.
+ */
+inline void randint(float *a, size_t N, uint64_t seed, int min = -1,
+                    int max = 1) {
+  const uint64_t count = static_cast<uint64_t>(max - min + 1);
+  parallelFor(N, [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      // Multiply-shift maps the top 32 bits to [0, count)
+      uint64_t r = ((randomBits(seed, i) >> 32) * count) >> 32;
+      a[i] = static_cast<float>(min + static_cast<int64_t>(r));
+    }
+  });
+}
+
+/**
+ * @brief Populate the array with random floats from a Gaussian distribution,
+ * using a counter-based generator and the Box-Muller transform. The values
+ * depend only on the seed and the index, not on the number of threads.
+ * @param a The array to populate.
+ * @param N The number of elements in the array.
+ * @param seed The seed of the random numbers.
+ * @param mean The mean of the Gaussian distribution.
+ * @param std The standard deviation of the Gaussian distribution.
+ */
+inline void randn(float *a, size_t N, uint64_t seed, float mean = 0.0,
+                  float std = 1.0) {
+  constexpr float kTwoPi = 6.28318530717958647692f;
+  constexpr float kInv24 = 1.0f / (1 << 24);
+  parallelFor(N, [=](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      // Each pair of elements shares the two uniforms of one draw
+      uint64_t bits = randomBits(seed, i / 2);
+      float u1 = (static_cast<float>(bits >> 40) + 1.0f) * kInv24; // (0, 1]
+      float u2 = static_cast<float>((bits >> 8) & 0xFFFFFF) * kInv24;
+      float radius = std::sqrt(-2.0f * std::log(u1));
+      float angle = kTwoPi * u2;
+      a[i] = mean + std * radius *
+                        (i % 2 == 0 ? std::cos(angle) : std::sin(angle));
+    }
+  });
+}
+
 /**
  * @brief Populate a square matrix with the identity matrix.
  * @param a The array to populate.
  * @param N The number of rows and columns in the square matrix.
  */
 inline void eye(float *a, size_t N) {
-  for (size_t i = 0; i < N; i++) {
-    for (size_t j = 0; j < N; j++) {
-      a[i * N + j] = (i == j) ? 1.0 : 0.0;
-    }
-  }
+  parallelFor(
+      N,
+      [=](size_t begin, size_t end) {
+        std::memset(a + begin * N, 0, (end - begin) * N * sizeof(float));
+        for (size_t i = begin; i < end; i++) {
+          a[i * N + i] = 1.0;
+        }
+      },
+      std::max<size_t>(1, kParallelGrain / std::max<size_t>(N, 1)));
 }
 
-// Note transformation operations here are purely for testing - they are not
-// optimized to be used in hot paths.
+// Side of the square tiles transposed at a time, 32 x 32 floats of input and
+// output fit in L1
+static constexpr size_t kTransposeTile = 32;
 
 /**
  * @brief Transpose a matrix.
@@ -247,12 +484,30 @@ inline void eye(float *a, size_t N) {
  * @param M The number of rows in the input matrix.
  * @param N The number of columns in the input matrix.
  */
-inline void transpose(float *input, float *output, size_t M, size_t N) {
-  for (size_t i = 0; i < M; i++) {
-    for (size_t j = 0; j < N; j++) {
-      output[j * M + i] = input[i * N + j];
-    }
-  }
+inline void transpose(const float *input, float *output, size_t M,
+                      size_t N) {
+  // Tiles keep both the strided reads and the strided writes within a few
+  // cache lines, threads work on separate bands of tile rows
+  const size_t bands = (M + kTransposeTile - 1) / kTransposeTile;
+  parallelFor(
+      bands,
+      [=](size_t bandBegin, size_t bandEnd) {
+        for (size_t i0 = bandBegin * kTransposeTile;
+             i0 < std::min(M, bandEnd * kTransposeTile);
+             i0 += kTransposeTile) {
+          const size_t iEnd = std::min(M, i0 + kTransposeTile);
+          for (size_t j0 = 0; j0 < N; j0 += kTransposeTile) {
+            const size_t jEnd = std::min(N, j0 + kTransposeTile);
+            for (size_t j = j0; j < jEnd; j++) {
+              for (size_t i = i0; i < iEnd; i++) {
+                output[j * M + i] = input[i * N + j];
+              }
+            }
+          }
+        }
+      },
+      std::max<size_t>(1, kParallelGrain / (kTransposeTile *
+                                            std::max<size_t>(N, 1))));
 }
 
 /**
@@ -263,21 +518,190 @@ inline void transpose(float *input, float *output, size_t M, size_t N) {
  * @param horizontal Whether to flip horizontally (true) or vertically (false).
  */
 inline void flip(float *a, size_t R, size_t C, bool horizontal = true) {
+  const size_t grain =
+      std::max<size_t>(1, kParallelGrain / std::max<size_t>(C, 1));
   if (horizontal) {
-    for (size_t i = 0; i < R; i++) {
-      for (size_t j = 0; j < C / 2; j++) {
-        std::swap(a[i * C + j], a[i * C + C - j - 1]);
-      }
-    }
+    parallelFor(
+        R,
+        [=](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; i++) {
+            std::reverse(a + i * C, a + (i + 1) * C);
+          }
+        },
+        grain);
   } else {
-    for (size_t i = 0; i < R / 2; i++) {
-      for (size_t j = 0; j < C; j++) {
-        std::swap(a[i * C + j], a[(R - i - 1) * C + j]);
+    // Swapping whole rows, contiguous in memory
+    parallelFor(
+        R / 2,
+        [=](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; i++) {
+            std::swap_ranges(a + i * C, a + (i + 1) * C,
+                             a + (R - i - 1) * C);
+          }
+        },
+        grain);
+  }
+}
+
+/**
+ * @brief Quantize a row-major matrix to symmetric 8-bit or 4-bit integers in
+ * blocks along the rows, with one float scale per block. Values are packed
+ * into 32-bit words lowest bits first, 4 values per word for 8 bits and 8
+ * values per word for 4 bits, as read by the quantized matmul kernels.
+ * @param input The input matrix.
+ * @param rows The number of rows in the input matrix.
+ * @param cols The number of columns in the input matrix, must be a multiple of
+ * blockSize.
+ * @param bits The number of bits per value, 8 or 4.
+ * @param blockSize The number of consecutive values in a row sharing a scale,
+ * must be a multiple of the number of values per word.
+ * @param packed The output packed values, rows * cols * bits / 32 words.
+ * @param scales The output scales, rows * cols / blockSize floats.
+ */
+inline void quantize(const float *input, size_t rows, size_t cols, int bits,
+                     size_t blockSize, uint32_t *packed, float *scales) {
+  assert(bits == 8 || bits == 4);
+  assert(cols % blockSize == 0 && blockSize % (32 / bits) == 0);
+  const int maxValue = (1 << (bits - 1)) - 1;
+  const uint32_t mask = (1u << bits) - 1;
+  const size_t valuesPerWord = 32 / bits;
+  for (size_t block = 0; block < rows * cols / blockSize; block++) {
+    const float *values = input + block * blockSize;
+    float absMax = 0.0;
+    for (size_t i = 0; i < blockSize; i++) {
+      absMax = std::max(absMax, std::abs(values[i]));
+    }
+    float scale = absMax / maxValue;
+    scales[block] = scale;
+    for (size_t i = 0; i < blockSize; i += valuesPerWord) {
+      uint32_t word = 0;
+      for (size_t j = 0; j < valuesPerWord; j++) {
+        int q = scale == 0.0 ? 0
+                             : static_cast<int>(std::round(values[i + j] /
+                                                           scale));
+        q = std::clamp(q, -maxValue, maxValue);
+        word |= (static_cast<uint32_t>(q) & mask) << (j * bits);
       }
+      packed[(block * blockSize + i) / valuesPerWord] = word;
     }
   }
 }
 
+/**
+ * @brief Dequantize a matrix produced by `quantize()` back to floats.
+ * @param packed The packed values.
+ * @param scales The scales of each block.
+ * @param rows The number of rows in the matrix.
+ * @param cols The number of columns in the matrix.
+ * @param bits The number of bits per value, 8 or 4.
+ * @param blockSize The number of consecutive values in a row sharing a scale.
+ * @param output The output matrix, rows * cols floats.
+ */
+inline void dequantize(const uint32_t *packed, const float *scales,
+                       size_t rows, size_t cols, int bits, size_t blockSize,
+                       float *output) {
+  assert(bits == 8 || bits == 4);
+  const size_t valuesPerWord = 32 / bits;
+  for (size_t i = 0; i < rows * cols; i++) {
+    uint32_t word = packed[i / valuesPerWord];
+    // Shift the value to the top bits, then sign extend with a right shift
+    uint32_t shift = 32 - bits * (i % valuesPerWord + 1);
+    int32_t q = static_cast<int32_t>(word << shift) >> (32 - bits);
+    output[i] = scales[i / blockSize] * q;
+  }
+}
+
+/**
+ * @brief Differences between two arrays, as computed by `compare()`.
+ */
+struct ErrorStats {
+  float maxAbsError = 0.0; // max |a - b|
+  float maxRelError = 0.0; // max |a - b| / |b|, for b != 0
+  size_t maxIndex = 0;     // index of maxAbsError
+  size_t mismatches = 0;   // elements outside of the tolerance or NaN
+  size_t mismatchIndex = 0; // lowest index of a mismatch found
+  bool passed = true;
+};
+
+/**
+ * @brief Compare two arrays in parallel. Elements match when |a - b| <= atol +
+ * rtol * |b| and neither is NaN. With earlyExit, threads stop at the next
+ * block of elements once a mismatch was found, so the statistics then only
+ * cover the elements checked so far.
+ * @param a The first array.
+ * @param b The second (reference) array.
+ * @param n The number of elements in the arrays.
+ * @param atol The absolute tolerance.
+ * @param rtol The tolerance relative to the reference.
+ * @param earlyExit Whether to stop at the first mismatch.
+ * @return ErrorStats The differences between the arrays.
+ * @code
+ * ErrorStats stats = compare(output.data(), ref.data(), N, 1e-3, 1e-2);
+ * @endcode
+ */
+inline ErrorStats compare(const float *a, const float *b, size_t n,
+                          float atol = 1e-3, float rtol = 0.0,
+                          bool earlyExit = true) {
+  // Elements between checks of the early exit flag
+  constexpr size_t kBlock = 4096;
+  ErrorStats stats;
+  stats.mismatchIndex = n;
+  std::mutex mutex;
+  std::atomic<bool> failed{false};
+  parallelFor(n, [&](size_t begin, size_t end) {
+    ErrorStats local;
+    local.mismatchIndex = n;
+    for (size_t block = begin; block < end; block += kBlock) {
+      if (earlyExit && failed.load(std::memory_order_relaxed)) {
+        break;
+      }
+      const size_t blockEnd = std::min(end, block + kBlock);
+      // Branch free maxima over the block, so the loop vectorizes
+      float blockAbs = 0.0;
+      float blockRel = 0.0;
+      bool blockFailed = false;
+      for (size_t i = block; i < blockEnd; i++) {
+        float diff = std::abs(a[i] - b[i]);
+        float ref = std::abs(b[i]);
+        blockAbs = std::max(blockAbs, diff);
+        blockRel = std::max(blockRel, ref > 0.0f ? diff / ref : 0.0f);
+        // NaN compares false, so !(diff <= tol) catches NaN in a or b
+        blockFailed |= !(diff <= atol + rtol * ref);
+      }
+      if (blockAbs > local.maxAbsError) {
+        for (size_t i = block; i < blockEnd; i++) {
+          if (std::abs(a[i] - b[i]) == blockAbs) {
+            local.maxIndex = i;
+            break;
+          }
+        }
+        local.maxAbsError = blockAbs;
+      }
+      local.maxRelError = std::max(local.maxRelError, blockRel);
+      if (blockFailed) {
+        for (size_t i = block; i < blockEnd; i++) {
+          float diff = std::abs(a[i] - b[i]);
+          if (!(diff <= atol + rtol * std::abs(b[i]))) {
+            local.mismatchIndex = std::min(local.mismatchIndex, i);
+            local.mismatches++;
+          }
+        }
+        failed = true;
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (local.maxAbsError > stats.maxAbsError) {
+      stats.maxAbsError = local.maxAbsError;
+      stats.maxIndex = local.maxIndex;
+    }
+    stats.maxRelError = std::max(stats.maxRelError, local.maxRelError);
+    stats.mismatches += local.mismatches;
+    stats.mismatchIndex = std::min(stats.mismatchIndex, local.mismatchIndex);
+  });
+  stats.passed = stats.mismatches == 0;
+  return stats;
+}
+
 /**
  * @brief Determine if the values of two arrays are close to each other.
  * @param a The first array.
@@ -286,14 +710,14 @@ inline void flip(float *a, size_t R, size_t C, bool horizontal = true) {
  * @param tol The tolerance for closeness.
  * @return bool True if the arrays are close, false otherwise.
  */
-bool isclose(float *a, float *b, size_t n, float tol = 1e-3) {
-  for (size_t i = 0; i < n; i++) {
-    if (std::abs(a[i] - b[i]) > tol || std::isnan(a[i]) || std::isnan(b[i])) {
-      LOG(kDefLog, kError, "Mismatch at index %d: %f != %f", i, a[i], b[i]);
-      return false;
-    }
+inline bool isclose(const float *a, const float *b, size_t n,
+                    float tol = 1e-3) {
+  ErrorStats stats = compare(a, b, n, tol);
+  if (!stats.passed) {
+    size_t i = stats.mismatchIndex;
+    LOG(kDefLog, kError, "Mismatch at index %zu: %f != %f", i, a[i], b[i]);
   }
-  return true;
+  return stats.passed;
 }
 
 } // namespace gpu
@@ -0,0 +1,119 @@
+/*
+ * half.h
+ *
+ * This file contains a minimal IEEE 754 half precision (binary16) storage type
+ * and conversions from and to float, used to populate and read back kf16
+ * tensors from the CPU. Arithmetic is intentionally not supported, convert to
+ * float first.
+ *
+ */
+
+#ifndef HALF_H
+#define HALF_H
+
+#include <cstdint>
+#include <cstring>
+
+namespace gpu {
+
+/**
+ * @brief Converts a float to the bits of the nearest half precision value,
+ * rounding to nearest even. Values beyond the half range become infinity,
+ * NaNs remain NaNs.
+ * @param[in] value Single precision value
+ * @return Half precision bits
+ *
+ * @code
+ * uint16_t bits = floatToHalfBits(1.0f); // 0x3c00
+ * @endcode
+ */
+inline uint16_t floatToHalfBits(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  uint32_t sign = (bits >> 16) & 0x8000u;
+  uint32_t exponent = (bits >> 23) & 0xffu;
+  uint32_t mantissa = bits & 0x7fffffu;
+  if (exponent == 0xffu) { // inf or nan
+    return static_cast<uint16_t>(sign | 0x7c00u |
+                                 (mantissa ? 0x200u | (mantissa >> 13) : 0));
+  }
+  int32_t halfExponent = static_cast<int32_t>(exponent) - 127 + 15;
+  if (halfExponent >= 0x1f) { // overflow
+    return static_cast<uint16_t>(sign | 0x7c00u);
+  }
+  if (halfExponent <= 0) { // subnormal or zero
+    if (halfExponent < -10) {
+      return static_cast<uint16_t>(sign);
+    }
+    mantissa |= 0x800000u; // implicit leading bit
+    uint32_t shift = static_cast<uint32_t>(14 - halfExponent);
+    uint32_t half = mantissa >> shift;
+    uint32_t remainder = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1u))) {
+      ++half;
+    }
+    return static_cast<uint16_t>(sign | half);
+  }
+  uint32_t half = sign | (static_cast<uint32_t>(halfExponent) << 10) |
+                  (mantissa >> 13);
+  uint32_t remainder = mantissa & 0x1fffu;
+  if (remainder > 0x1000u || (remainder == 0x1000u && (half & 1u))) {
+    ++half; // may carry into the exponent, which correctly rounds up to inf
+  }
+  return static_cast<uint16_t>(half);
+}
+
+/**
+ * @brief Converts the bits of a half precision value to float, exactly.
+ * @param[in] bits Half precision bits
+ * @return Single precision value
+ *
+ * @code
+ * float value = halfBitsToFloat(0x3c00); // 1.0f
+ * @endcode
+ */
+inline float halfBitsToFloat(uint16_t bits) {
+  uint32_t sign = static_cast<uint32_t>(bits & 0x8000u) << 16;
+  uint32_t exponent = (bits >> 10) & 0x1fu;
+  uint32_t mantissa = bits & 0x3ffu;
+  uint32_t result;
+  if (exponent == 0x1fu) { // inf or nan
+    result = sign | 0x7f800000u | (mantissa << 13);
+  } else if (exponent != 0) {
+    result = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    result = sign;
+  } else { // subnormal, normalize
+    exponent = 127 - 15 + 1;
+    while ((mantissa & 0x400u) == 0) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    result = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+  }
+  float value;
+  std::memcpy(&value, &result, sizeof(value));
+  return value;
+}
+
+/**
+ * @brief Half precision storage type with the same layout as a WGSL f16.
+ *
+ * @code
+ * half h = 0.5f;
+ * float f = h;
+ * @endcode
+ */
+struct half {
+  uint16_t data = 0;
+  inline half() = default;
+  inline half(float value) : data(floatToHalfBits(value)) {}
+  inline operator float() const { return halfBitsToFloat(data); }
+};
+
+static_assert(sizeof(half) == 2, "half must be 2 bytes");
+
+} // namespace gpu
+
+#endif
@@ -22,39 +22,61 @@ struct Logger {
   int level;
 };
 
+/**
+ * @brief Most verbose level of LOG calls compiled into the program. Calls
+ * above it are removed at compile time, including the evaluation of their
+ * arguments. Defaults to kTrace (everything, filtered at runtime by
+ * Logger::level), or to kError if NDEBUG is defined so that release builds
+ * still report failures. Can be set as a compiler flag, e.g.
+ * -DGPU_LOG_LEVEL=-1 to remove all logging.
+ */
+#ifndef GPU_LOG_LEVEL
 #ifndef NDEBUG
+#define GPU_LOG_LEVEL 3
+#else
+#define GPU_LOG_LEVEL 0
+#endif
+#endif
+
 /**
- * @brief Log a message to the logger. If NDEBUG is defined in a source or as a
- * compiler flag, this is a no-op.
+ * @brief Log a message to the logger, see LOG().
  *
  * @param logger The logger to log to.
  * @param level The log level of the message.
  * @param message The message to log.
  */
-inline void LOG(Logger& logger, int level, const char *message, ...) {
+inline void logMessage(Logger &logger, int level, const char *message, ...) {
   static const char *orange = "\033[0;33m";
   static const char *red = "\033[0;31m";
   static const char *white = "\033[0;37m";
   static const char *gray = "\033[0;90m";
   static const char *reset = "\033[0m";
   static const char *logColors[] = {red, red, orange, gray};
-  if (level <= logger.level) {
-    va_list(args);
-    va_start(args, message);
-    snprintf(logger.buffer, sizeof(logger.buffer), message, args);
-    // Brackets and messages are white.
-    // Log levels are red for error and warning, orange for info, and grey for trace.
-    // Then the color is reset.
-    fprintf(logger.stream, "%s[%s%s%s] ", white, logColors[level], kLevelStr[level],
-            white);
-    vfprintf(logger.stream, message, args);
-    fprintf(logger.stream, "%s\n", reset);
-    va_end(args);
-  }
+  va_list args;
+  va_start(args, message);
+  // Brackets and messages are white.
+  // Log levels are red for error and warning, orange for info, and grey for trace.
+  // Then the color is reset.
+  fprintf(logger.stream, "%s[%s%s%s] ", white, logColors[level], kLevelStr[level],
+          white);
+  vfprintf(logger.stream, message, args);
+  fprintf(logger.stream, "%s\n", reset);
+  va_end(args);
 }
-#else
-#define LOG(logger, level, message, ...) ((void)0)
-#endif
+
+/**
+ * @brief Log a message to the logger if level is at most GPU_LOG_LEVEL and the
+ * logger's level. The arguments are only evaluated if the message is logged,
+ * and calls above GPU_LOG_LEVEL compile to nothing.
+ *
+ * @code
+ * LOG(kDefLog, kInfo, "Created %zu kernels", n);
+ * @endcode
+ */
+#define LOG(LOGGER, LEVEL, ...)                                                \
+  (((LEVEL) <= GPU_LOG_LEVEL && (LEVEL) <= (LOGGER).level)                    \
+       ? ::gpu::logMessage((LOGGER), (LEVEL), __VA_ARGS__)                    \
+       : (void)0)
 
 /**
  * @brief Default logger for logging messages to stdout at the info level.